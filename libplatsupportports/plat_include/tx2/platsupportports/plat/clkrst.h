@@ -0,0 +1,53 @@
+/*
+ * Copyright 2020, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <platsupport/clock.h>
+#include <platsupport/reset.h>
+
+/*
+ * Clock and reset operations that bring up a device, done by the BPMP in the
+ * order given. This is a convenience, not a faster path: the channel to the
+ * BPMP firmware holds one request, so each operation is a round trip of its
+ * own, just as with the individual clock and reset calls.
+ */
+
+enum tx2_clkrst_op_type {
+    TX2_RESET_ASSERT,
+    TX2_RESET_DEASSERT,
+    TX2_RESET_MODULE, // Assert and deassert
+    TX2_CLK_GATE_ON,
+    TX2_CLK_GATE_OFF,
+    TX2_CLK_SET_RATE,
+};
+
+struct tx2_clkrst_op {
+    enum tx2_clkrst_op_type type;
+    union {
+        reset_id_t reset; // TX2_RESET_*
+        enum clock_gate gate; // TX2_CLK_GATE_*
+        enum clk_id clk; // TX2_CLK_SET_RATE
+    };
+    /* TX2_CLK_SET_RATE: the rate to set, and the rate the BPMP set */
+    freq_t rate;
+    /* 0 once done, otherwise an error code */
+    int status;
+};
+
+/*
+ * Carries out a sequence of clock and reset operations. All operations are
+ * sent even if one of them fails, the BPMP does them in the order given. If an
+ * operation is invalid, none are sent: it gets -EINVAL and the others
+ * -ECANCELED. Every operation has its final status on return.
+ *
+ * @param clock_sys An initialised TX2 clock subsystem, whose BPMP interface is used.
+ * @param ops Array of operations, their status and rates are filled in.
+ * @param nops Number of operations in the array.
+ *
+ * @return 0 if all operations succeeded, otherwise an error code.
+ */
+int tx2_clkrst_run(clock_sys_t *clock_sys, struct tx2_clkrst_op *ops, int nops);
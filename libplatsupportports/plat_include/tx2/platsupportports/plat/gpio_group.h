@@ -0,0 +1,102 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <platsupport/gpio.h>
+#include <platsupportports/plat/gpio.h>
+
+/*
+ * A set of GPIO pins that are driven or sampled together, e.g. for a
+ * bit-banged bus. The register addresses of the pins are worked out once,
+ * and the group remembers the levels it drives, so that a write only
+ * touches the pins that change and never reads a register back.
+ *
+ * Every TX2 GPIO pin has a register block of its own, there is no register
+ * that covers several pins. A write to a group is one store per pin that
+ * changes, issued back to back, and a read is one load per pin, so pins
+ * do not switch or get sampled in the same bus cycle.
+ *
+ * Pin i of the group is bit i of the masks and levels below. The pins must
+ * have been set up with gpio_sys->init, and their outputs should only be
+ * driven through the group afterwards.
+ */
+
+#define TX2_GPIO_GROUP_MAX 32
+
+struct tx2_gpio_group {
+    int npins;
+    uint32_t pins_mask;
+    /* The output levels the group last set */
+    uint32_t levels;
+    volatile uint32_t *input[TX2_GPIO_GROUP_MAX];
+    volatile uint32_t *output[TX2_GPIO_GROUP_MAX];
+};
+
+/*
+ * Sets up a group of pins, reading the levels they are driven to.
+ *
+ * @param gpio_sys An initialised TX2 GPIO subsystem.
+ * @param pins Array of distinct pins, the first is bit 0.
+ * @param npins Number of pins in the array, at most TX2_GPIO_GROUP_MAX.
+ * @param group Group to fill in.
+ *
+ * @return 0 on success, otherwise an error code.
+ */
+int tx2_gpio_group_init(gpio_sys_t *gpio_sys, const gpio_id_t *pins, int npins, struct tx2_gpio_group *group);
+
+/*
+ * Sets up a group of all the pins of a port, in order, so that pin Pn is
+ * bit n.
+ *
+ * @param gpio_sys An initialised TX2 GPIO subsystem.
+ * @param port The port.
+ * @param group Group to fill in.
+ *
+ * @return 0 on success, otherwise an error code.
+ */
+int tx2_gpio_group_init_port(gpio_sys_t *gpio_sys, enum gpio_port port, struct tx2_gpio_group *group);
+
+/*
+ * Drives some of the pins of a group. Bits outside the group are ignored.
+ *
+ * @param group An initialised group.
+ * @param mask The pins to drive.
+ * @param levels The levels to drive them to, a set bit is high.
+ *
+ * @return 0 on success, otherwise an error code.
+ */
+int tx2_gpio_group_write(struct tx2_gpio_group *group, uint32_t mask, uint32_t levels);
+
+/*
+ * Samples some of the pins of a group.
+ *
+ * @param group An initialised group.
+ * @param mask The pins to sample.
+ * @param levels Filled in with the levels of the pins in the mask, a set bit is high.
+ *
+ * @return 0 on success, otherwise an error code.
+ */
+int tx2_gpio_group_read(struct tx2_gpio_group *group, uint32_t mask, uint32_t *levels);
+
+/*
+ * Inverts the level of some of the pins of a group.
+ *
+ * @param group An initialised group.
+ * @param mask The pins to invert.
+ *
+ * @return 0 on success, otherwise an error code.
+ */
+static inline int tx2_gpio_group_toggle(struct tx2_gpio_group *group, uint32_t mask)
+{
+    if (!group) {
+        return -EINVAL;
+    }
+    return tx2_gpio_group_write(group, mask, ~group->levels);
+}
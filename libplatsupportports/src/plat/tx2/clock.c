@@ -9,9 +9,12 @@
 #include <errno.h>
 #include <platsupport/clock.h>
 #include <platsupport/plat/clock.h>
+#include <platsupport/plat/reset.h>
+#include <platsupportports/plat/clkrst.h>
 
 /* NVIDIA interface */
 #include <tx2bpmp/bpmp.h> /* struct mrq_clk_request, struct mrq_clk_response */
+#include <tx2bpmp/clock_bindings.h> /* TEGRA186_CLK_CLK_MAX */
 
 #define TX2_CLKCAR_PADDR 0x5000000
 #define TX2_CLKCAR_SIZE 0x1000000
@@ -24,13 +27,84 @@
 
 extern uint32_t mrq_clk_id_map[];
 extern uint32_t mrq_gate_id_map[];
+extern uint32_t mrq_reset_id_map[];
+
+/*
+ * What we know about a BPMP clock, so that queries don't need a round trip to
+ * the BPMP. Clocks and gates both map to BPMP clock IDs, so the cache is
+ * indexed by those. It assumes that this clock_sys is the only one changing
+ * the clocks it uses.
+ */
+#define TX2_CLK_RATE_VALID BIT(0)
+#define TX2_CLK_PARENT_VALID BIT(1)
+#define TX2_CLK_GATE_VALID BIT(2)
+#define TX2_CLK_ENABLED BIT(3)
+
+/* Longer parent chains than this are taken to be loops */
+#define TX2_CLK_MAX_DEPTH 16
+
+struct tx2_clk_state {
+    freq_t rate;
+    uint32_t parent; // BPMP ID of the parent clock
+    uint32_t flags;
+};
 
 typedef struct tx2_clk {
     ps_io_ops_t *io_ops;
     void *car_vaddr;
     struct tx2_bpmp *bpmp;
+    struct tx2_clk_state *cache; // TEGRA186_CLK_CLK_MAX entries
 } tx2_clk_t;
 
+/*
+ * Whether the rate of a clock may follow that of another, i.e. the other
+ * clock is the clock itself or above it. Parents we don't know could be
+ * anything.
+ */
+static bool tx2_clk_depends_on(tx2_clk_t *clk, uint32_t bpmp_clk_id, uint32_t bpmp_other_id)
+{
+    for (int depth = 0; depth < TX2_CLK_MAX_DEPTH; depth++) {
+        if (bpmp_clk_id == bpmp_other_id) {
+            return true;
+        }
+        if (!(clk->cache[bpmp_clk_id].flags & TX2_CLK_PARENT_VALID)) {
+            return true;
+        }
+        if (clk->cache[bpmp_clk_id].parent >= TEGRA186_CLK_CLK_MAX ||
+            clk->cache[bpmp_clk_id].parent == bpmp_clk_id) {
+            /* Reached a root */
+            return false;
+        }
+        bpmp_clk_id = clk->cache[bpmp_clk_id].parent;
+    }
+    return true;
+}
+
+/* Record the outcome of enabling or disabling a gate */
+static void tx2_clk_gate_changed(tx2_clk_t *clk, uint32_t bpmp_gate_id, bool enabled, bool success)
+{
+    struct tx2_clk_state *state = &clk->cache[bpmp_gate_id];
+
+    state->flags &= ~(TX2_CLK_GATE_VALID | TX2_CLK_ENABLED);
+    if (success) {
+        /* Otherwise the gate may or may not have changed */
+        state->flags |= TX2_CLK_GATE_VALID | (enabled ? TX2_CLK_ENABLED : 0);
+    }
+}
+
+/* Forget what a rate change of a clock invalidates */
+static void tx2_clk_rate_changing(tx2_clk_t *clk, uint32_t bpmp_clk_id)
+{
+    /* The BPMP may pick a different parent to reach the new rate, and the
+     * rate carries down to the clocks below this one */
+    clk->cache[bpmp_clk_id].flags &= ~TX2_CLK_PARENT_VALID;
+    for (uint32_t i = 0; i < TEGRA186_CLK_CLK_MAX; i++) {
+        if ((clk->cache[i].flags & TX2_CLK_RATE_VALID) && tx2_clk_depends_on(clk, i, bpmp_clk_id)) {
+            clk->cache[i].flags &= ~TX2_CLK_RATE_VALID;
+        }
+    }
+}
+
 static inline bool check_valid_gate(enum clock_gate gate)
 {
     return (CLK_GATE_FUSE <= gate && gate < NCLKGATES);
@@ -56,13 +130,21 @@ static int tx2_car_gate_enable(clock_sys_t *clock_sys, enum clock_gate gate, enu
     uint32_t command = (mode == CLKGATE_ON ? CMD_CLK_ENABLE : CMD_CLK_DISABLE);
 
     uint32_t bpmp_gate_id = mrq_gate_id_map[gate];
+    tx2_clk_t *clk = clock_sys->priv;
+    struct tx2_clk_state *state = &clk->cache[bpmp_gate_id];
+    uint32_t enabled = (mode == CLKGATE_ON ? TX2_CLK_ENABLED : 0);
+
+    /* Nothing to do if we've already put the gate in this mode */
+    if ((state->flags & TX2_CLK_GATE_VALID) && (state->flags & TX2_CLK_ENABLED) == enabled) {
+        return 0;
+    }
 
     /* Setup the message and make a call to BPMP */
     struct mrq_clk_request req = { .cmd_and_id = (command << 24) | bpmp_gate_id };
     struct mrq_clk_response res = {0};
-    tx2_clk_t *clk = clock_sys->priv;
 
     int bytes_recvd = tx2_bpmp_call(clk->bpmp, MRQ_CLK, &req, sizeof(req), &res, sizeof(res));
+    tx2_clk_gate_changed(clk, bpmp_gate_id, enabled, bytes_recvd >= 0);
     if (bytes_recvd < 0) {
         return -EIO;
     }
@@ -72,31 +154,46 @@ static int tx2_car_gate_enable(clock_sys_t *clock_sys, enum clock_gate gate, enu
 
 static freq_t tx2_car_get_freq(clk_t *clk)
 {
-    struct mrq_clk_request req = { .cmd_and_id = (CMD_CLK_GET_RATE << 24) | clk->id };
-    struct mrq_clk_response res = {0};
+    uint32_t bpmp_clk_id = mrq_clk_id_map[clk->id];
     tx2_clk_t *tx2_clk = clk->clk_sys->priv;
+    struct tx2_clk_state *state = &tx2_clk->cache[bpmp_clk_id];
 
-    int bytes_recvd = tx2_bpmp_call(tx2_clk->bpmp, MRQ_CLK, &req, sizeof(req), &res, sizeof(&res));
+    if (state->flags & TX2_CLK_RATE_VALID) {
+        return state->rate;
+    }
+
+    struct mrq_clk_request req = { .cmd_and_id = (CMD_CLK_GET_RATE << 24) | bpmp_clk_id };
+    struct mrq_clk_response res = {0};
+
+    int bytes_recvd = tx2_bpmp_call(tx2_clk->bpmp, MRQ_CLK, &req, sizeof(req), &res, sizeof(res));
     if (bytes_recvd < 0) {
         return 0;
     }
 
-    return (freq_t) res.clk_get_rate.rate;
+    state->rate = (freq_t) res.clk_get_rate.rate;
+    state->flags |= TX2_CLK_RATE_VALID;
+
+    return state->rate;
 }
 
 static freq_t tx2_car_set_freq(clk_t *clk, freq_t hz)
 {
-    struct mrq_clk_request req = { .cmd_and_id = (CMD_CLK_SET_RATE << 24) | clk->id };
+    uint32_t bpmp_clk_id = mrq_clk_id_map[clk->id];
+    struct mrq_clk_request req = { .cmd_and_id = (CMD_CLK_SET_RATE << 24) | bpmp_clk_id };
     req.clk_set_rate.rate = hz;
     struct mrq_clk_response res = {0};
     tx2_clk_t *tx2_clk = clk->clk_sys->priv;
 
-    int bytes_recvd = tx2_bpmp_call(tx2_clk->bpmp, MRQ_CLK, &req, sizeof(req), &res, sizeof(&res));
+    tx2_clk_rate_changing(tx2_clk, bpmp_clk_id);
+
+    int bytes_recvd = tx2_bpmp_call(tx2_clk->bpmp, MRQ_CLK, &req, sizeof(req), &res, sizeof(res));
     if (bytes_recvd < 0) {
         return 0;
     }
 
     clk->req_freq = hz;
+    tx2_clk->cache[bpmp_clk_id].rate = (freq_t) res.clk_set_rate.rate;
+    tx2_clk->cache[bpmp_clk_id].flags |= TX2_CLK_RATE_VALID;
 
     return (freq_t) res.clk_set_rate.rate;
 }
@@ -146,6 +243,9 @@ static clk_t *tx2_car_get_clock(clock_sys_t *clock_sys, enum clk_id id)
     }
     strncpy(clock_name, (char *) res.clk_get_all_info.name, clk_name_len);
 
+    tx2_clk->cache[bpmp_clk_id].parent = res.clk_get_all_info.parent;
+    tx2_clk->cache[bpmp_clk_id].flags |= TX2_CLK_PARENT_VALID;
+
     ret_clk->name = (const char *) clock_name;
 
     /* There's no need for the init nor the recal functions as we're already
@@ -210,6 +310,13 @@ int clock_sys_init(ps_io_ops_t *io_ops, clock_sys_t *clock_sys)
 
     clk = clock_sys->priv;
 
+    error = ps_calloc(&io_ops->malloc_ops, TEGRA186_CLK_CLK_MAX, sizeof(*clk->cache), (void **) &clk->cache);
+    if (error) {
+        ZF_LOGE("Failed to allocate memory for the clock state cache");
+        error = -ENOMEM;
+        goto fail;
+    }
+
     car_vaddr = ps_io_map(&io_ops->io_mapper, TX2_CLKCAR_PADDR, TX2_CLKCAR_SIZE, 0, PS_MEM_NORMAL);
     if (car_vaddr == NULL) {
         ZF_LOGE("Failed to map tx2 CAR registers");
@@ -251,6 +358,10 @@ fail:
     }
 
     if (clock_sys->priv) {
+        if (clk->cache) {
+            ZF_LOGF_IF(ps_free(&io_ops->malloc_ops, TEGRA186_CLK_CLK_MAX * sizeof(*clk->cache), (void *) clk->cache),
+                       "Failed to free the clock state cache after failing to initialise");
+        }
         if (clk->bpmp) {
             ZF_LOGF_IF(ps_free(&io_ops->malloc_ops, sizeof(struct tx2_bpmp), (void *) clk->bpmp),
                        "Failed to free the BPMP structure after failing to initialise");
@@ -262,6 +373,172 @@ fail:
     return error;
 }
 
+/* The BPMP messages of one operation of tx2_clkrst_run() */
+struct tx2_clkrst_msg {
+    union {
+        struct mrq_clk_request clk;
+        struct mrq_reset_request reset;
+    } tx;
+    struct mrq_clk_response rx;
+};
+
+static int tx2_clkrst_prepare(struct tx2_clkrst_op *op, struct tx2_clkrst_msg *msg,
+                              struct tx2_bpmp_request *req)
+{
+    uint32_t command;
+
+    switch (op->type) {
+    case TX2_RESET_ASSERT:
+    case TX2_RESET_DEASSERT:
+    case TX2_RESET_MODULE:
+        if (!(RESET_TOP_GTE <= op->reset && op->reset < NRESETS)) {
+            ZF_LOGE("Invalid reset ID");
+            return -EINVAL;
+        }
+        command = (op->type == TX2_RESET_ASSERT ? CMD_RESET_ASSERT :
+                   op->type == TX2_RESET_DEASSERT ? CMD_RESET_DEASSERT : CMD_RESET_MODULE);
+        msg->tx.reset.cmd = command;
+        msg->tx.reset.reset_id = mrq_reset_id_map[op->reset];
+        req->mrq = MRQ_RESET;
+        req->tx_size = sizeof(msg->tx.reset);
+        req->rx_size = 0;
+        break;
+    case TX2_CLK_GATE_ON:
+    case TX2_CLK_GATE_OFF:
+        if (!check_valid_gate(op->gate)) {
+            ZF_LOGE("Invalid clock gate!");
+            return -EINVAL;
+        }
+        command = (op->type == TX2_CLK_GATE_ON ? CMD_CLK_ENABLE : CMD_CLK_DISABLE);
+        msg->tx.clk.cmd_and_id = (command << 24) | mrq_gate_id_map[op->gate];
+        req->mrq = MRQ_CLK;
+        req->tx_size = sizeof(msg->tx.clk);
+        req->rx_size = sizeof(msg->rx);
+        break;
+    case TX2_CLK_SET_RATE:
+        if (!check_valid_clk_id(op->clk)) {
+            ZF_LOGE("Invalid clock ID");
+            return -EINVAL;
+        }
+        msg->tx.clk.cmd_and_id = (CMD_CLK_SET_RATE << 24) | mrq_clk_id_map[op->clk];
+        msg->tx.clk.clk_set_rate.rate = op->rate;
+        req->mrq = MRQ_CLK;
+        req->tx_size = sizeof(msg->tx.clk);
+        req->rx_size = sizeof(msg->rx);
+        break;
+    default:
+        ZF_LOGE("Invalid clock/reset operation %d", op->type);
+        return -EINVAL;
+    }
+
+    req->tx_msg = &msg->tx;
+    req->rx_msg = req->rx_size ? &msg->rx : NULL;
+
+    return 0;
+}
+
+static void tx2_clkrst_fail(struct tx2_clkrst_op *ops, int nops, int status)
+{
+    for (int i = 0; i < nops; i++) {
+        ops[i].status = status;
+    }
+}
+
+int tx2_clkrst_run(clock_sys_t *clock_sys, struct tx2_clkrst_op *ops, int nops)
+{
+    if (!clock_sys || !clock_sys->priv || !ops || nops <= 0) {
+        ZF_LOGE("Invalid arguments");
+        return -EINVAL;
+    }
+
+    tx2_clk_t *clk = clock_sys->priv;
+    struct tx2_clkrst_msg *msgs = NULL;
+    struct tx2_bpmp_request *reqs = NULL;
+    int error = 0;
+
+    /* The requests have to be contiguous for the submission */
+    error = ps_calloc(&clk->io_ops->malloc_ops, nops, sizeof(*msgs), (void **) &msgs);
+    if (error) {
+        ZF_LOGE("Failed to allocate memory for the BPMP messages");
+        tx2_clkrst_fail(ops, nops, -ENOMEM);
+        return -ENOMEM;
+    }
+    error = ps_calloc(&clk->io_ops->malloc_ops, nops, sizeof(*reqs), (void **) &reqs);
+    if (error) {
+        ZF_LOGE("Failed to allocate memory for the BPMP requests");
+        error = -ENOMEM;
+        tx2_clkrst_fail(ops, nops, error);
+        goto out;
+    }
+
+    /* Nothing is sent unless every operation is valid */
+    for (int i = 0; i < nops; i++) {
+        error = tx2_clkrst_prepare(&ops[i], &msgs[i], &reqs[i]);
+        if (error) {
+            tx2_clkrst_fail(ops, nops, -ECANCELED);
+            ops[i].status = error;
+            goto out;
+        }
+    }
+    tx2_clkrst_fail(ops, nops, -EINPROGRESS);
+
+    /* Rates and gates we know now may not survive the operations */
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].type == TX2_CLK_SET_RATE) {
+            tx2_clk_rate_changing(clk, mrq_clk_id_map[ops[i].clk]);
+        } else if (ops[i].type == TX2_CLK_GATE_ON || ops[i].type == TX2_CLK_GATE_OFF) {
+            tx2_clk_gate_changed(clk, mrq_gate_id_map[ops[i].gate], false, false);
+        }
+    }
+
+    error = tx2_bpmp_submit(clk->bpmp, reqs, nops);
+    if (error) {
+        ZF_LOGE("Failed to submit the clock/reset operations");
+        tx2_clkrst_fail(ops, nops, error);
+        goto out;
+    }
+
+    /* The BPMP responds in order, one request at a time through the single
+     * frame, so the last response means all are done */
+    error = tx2_bpmp_wait(clk->bpmp, &reqs[nops - 1]);
+    if (error) {
+        ZF_LOGE("Clock/reset operations failed: %d", error);
+        /* The requests are freed below, the driver must not keep any of them */
+        tx2_bpmp_cancel(clk->bpmp, reqs, nops);
+    }
+
+    /* Replay the outcomes in order, so that a rate set by a later operation
+     * invalidates one set earlier that derives from it */
+    for (int i = 0; i < nops; i++) {
+        bool success = reqs[i].status >= 0;
+        ops[i].status = success ? 0 : reqs[i].status;
+
+        if (ops[i].type == TX2_CLK_GATE_ON || ops[i].type == TX2_CLK_GATE_OFF) {
+            tx2_clk_gate_changed(clk, mrq_gate_id_map[ops[i].gate], ops[i].type == TX2_CLK_GATE_ON, success);
+        } else if (ops[i].type == TX2_CLK_SET_RATE && success) {
+            uint32_t bpmp_clk_id = mrq_clk_id_map[ops[i].clk];
+            ops[i].rate = (freq_t) msgs[i].rx.clk_set_rate.rate;
+            tx2_clk_rate_changing(clk, bpmp_clk_id);
+            clk->cache[bpmp_clk_id].rate = ops[i].rate;
+            clk->cache[bpmp_clk_id].flags |= TX2_CLK_RATE_VALID;
+        }
+
+        if (!success && !error) {
+            error = ops[i].status;
+        }
+    }
+
+out:
+    if (reqs) {
+        ZF_LOGF_IF(ps_free(&clk->io_ops->malloc_ops, nops * sizeof(*reqs), (void *) reqs),
+                   "Failed to free the BPMP requests");
+    }
+    ZF_LOGF_IF(ps_free(&clk->io_ops->malloc_ops, nops * sizeof(*msgs), (void *) msgs),
+               "Failed to free the BPMP messages");
+
+    return error;
+}
+
 void clk_print_clock_tree(clock_sys_t *sys)
 {
     /* TODO Implement this function. The manual doesn't really give us a nice
@@ -16,9 +16,11 @@
 
 #include <utils/arith.h>
 #include <utils/attribute.h>
+#include <utils/util.h>
 #include <platsupport/gpio.h>
 
 #include <platsupportports/plat/gpio.h>
+#include <platsupportports/plat/gpio_group.h>
 
 #define TX2_GPIO_PIN_STRIDE 0x20
 
@@ -123,6 +125,7 @@ static int tx2_gpio_set_direction(gpio_sys_t *gpio_sys, gpio_id_t gpio, enum gpi
     case GPIO_DIR_IN:
         config_val &= ~TX2_GPIO_ENABLE_CONFIG_OUT;
         output_control_val |= TX2_GPIO_OUTPUT_CONTROL_FLOATED;
+        break;
     default:
         return -EINVAL;
     }
@@ -240,7 +243,7 @@ static int tx2_gpio_set_level(gpio_t *gpio, enum gpio_level level)
     volatile uint32_t *reg_vaddr = tx2_gpio_get_register(gpio->gpio_sys, GPIO_OUTPUT_VALUE, gpio->id);
 
     val = *reg_vaddr;
-    if (GPIO_LEVEL_HIGH) {
+    if (level == GPIO_LEVEL_HIGH) {
         val |= TX2_GPIO_OUTPUT_VALUE_HIGH;
     } else {
         val &= ~(TX2_GPIO_OUTPUT_VALUE_HIGH);
@@ -285,6 +288,99 @@ static int tx2_gpio_pending_status(gpio_t *gpio, bool clear)
     return pending;
 }
 
+int tx2_gpio_group_init(gpio_sys_t *gpio_sys, const gpio_id_t *pins, int npins, struct tx2_gpio_group *group)
+{
+    if (gpio_sys == NULL || pins == NULL || group == NULL) {
+        return -EINVAL;
+    }
+    if (npins <= 0 || npins > TX2_GPIO_GROUP_MAX) {
+        return -EINVAL;
+    }
+
+    group->npins = npins;
+    group->pins_mask = 0;
+    group->levels = 0;
+
+    for (int i = 0; i < npins; i++) {
+        if (!tx2_valid_pin(pins[i])) {
+            ZF_LOGE("Invalid GPIO pin %d", pins[i]);
+            return -EINVAL;
+        }
+        /* A pin twice would throw the remembered levels off */
+        for (int j = 0; j < i; j++) {
+            if (pins[j] == pins[i]) {
+                ZF_LOGE("GPIO pin %d is in the group twice", pins[i]);
+                return -EINVAL;
+            }
+        }
+
+        group->input[i] = tx2_gpio_get_register(gpio_sys, GPIO_INPUT, pins[i]);
+        group->output[i] = tx2_gpio_get_register(gpio_sys, GPIO_OUTPUT_VALUE, pins[i]);
+        group->pins_mask |= BIT(i);
+        if (*group->output[i] & TX2_GPIO_OUTPUT_VALUE_HIGH) {
+            group->levels |= BIT(i);
+        }
+    }
+
+    return 0;
+}
+
+int tx2_gpio_group_init_port(gpio_sys_t *gpio_sys, enum gpio_port port, struct tx2_gpio_group *group)
+{
+    gpio_id_t pins[TX2_GPIO_GROUP_MAX];
+    int npins;
+
+    if (port < 0 || port >= GPIO_NPORTS) {
+        return -EINVAL;
+    }
+
+    npins = tx2_ports[port].end - tx2_ports[port].start + 1;
+    for (int i = 0; i < npins; i++) {
+        pins[i] = tx2_ports[port].start + i;
+    }
+
+    return tx2_gpio_group_init(gpio_sys, pins, npins, group);
+}
+
+int tx2_gpio_group_write(struct tx2_gpio_group *group, uint32_t mask, uint32_t levels)
+{
+    if (group == NULL) {
+        return -EINVAL;
+    }
+
+    /* Only the value bit of the output register is implemented, so there's
+     * nothing to preserve and no need to read it first */
+    uint32_t changed = (group->levels ^ levels) & mask & group->pins_mask;
+    group->levels ^= changed;
+    while (changed) {
+        int i = CTZ(changed);
+        changed &= changed - 1;
+        *group->output[i] = (levels & BIT(i)) ? TX2_GPIO_OUTPUT_VALUE_HIGH : 0;
+    }
+
+    return 0;
+}
+
+int tx2_gpio_group_read(struct tx2_gpio_group *group, uint32_t mask, uint32_t *levels)
+{
+    if (group == NULL || levels == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t val = 0;
+    mask &= group->pins_mask;
+    while (mask) {
+        int i = CTZ(mask);
+        mask &= mask - 1;
+        if (*group->input[i]) {
+            val |= BIT(i);
+        }
+    }
+    *levels = val;
+
+    return 0;
+}
+
 int gpio_sys_init(ps_io_ops_t *io_ops, gpio_sys_t *gpio_sys)
 {
     if (io_ops == NULL) {
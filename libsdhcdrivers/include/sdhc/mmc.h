@@ -14,6 +14,12 @@ typedef struct mmc_card *mmc_card_t;
 
 typedef void (*mmc_cb)(mmc_card_t mmc_card, int status, size_t bytes_transferred, void *token);
 
+/* A physically contiguous piece of a scatter-gather transfer */
+struct mmc_sg {
+    uintptr_t pbuf;
+    size_t    len;
+};
+
 
 static inline size_t mmc_block_size(mmc_card_t mmc_card)
 {
@@ -36,6 +42,8 @@ int mmc_init(sdio_host_dev_t *sdio, ps_io_ops_t *io_ops, mmc_card_t *mmc_card);
  * The client may use either physical or virtual address for the transfer depending
  * on the DMA requirements of the underlying driver. It is recommended to provide
  * both for rebustness.
+ * Any number of requests with a callback may be outstanding. They are queued,
+ * issued back to back from mmc_handle_irq, and complete in order.
  * @param[in] mmc_card  A handle to an initialised MMC card
  * @param[in] start     the starting block number of the operation
  * @param[in] nblocks   The number of blocks to read
@@ -67,6 +75,101 @@ long mmc_block_read(mmc_card_t mmc_card, unsigned long start_block, int nblocks,
 long mmc_block_write(mmc_card_t mmc_card, unsigned long start_block, int nblocks,
                      const void *vbuf, uintptr_t pbuf, mmc_cb cb, void *token);
 
+/** Read blocks from the MMC into a scattered buffer
+ * The transfer is described to the host controller as one ADMA2 descriptor
+ * table, so it is a single command however the buffer is split. Segments
+ * must be word aligned and their lengths must add up to the transfer size.
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @param[in] start     The starting block number of the operation
+ * @param[in] nblocks   The number of blocks to read
+ * @param[in] sg        The physical segments of the buffer
+ * @param[in] nsg       The number of segments in sg
+ * @param[in] cb        A callback function to call when the transaction completes.
+ *                      If NULL is passed as this argument, the call will be blocking.
+ * @param[in] token     A token to pass, unmodified, to the provided callback function.
+ * @return              The number of bytes read, negative on failure. Fails if
+ *                      the host controller does not support ADMA2.
+ */
+long mmc_block_read_sg(mmc_card_t mmc_card, unsigned long start_block, int nblocks,
+                       const struct mmc_sg *sg, int nsg, mmc_cb cb, void *token);
+
+/** Write blocks to the MMC from a scattered buffer
+ * See mmc_block_read_sg.
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @param[in] start     The starting block number of the operation
+ * @param[in] nblocks   The number of blocks to write
+ * @param[in] sg        The physical segments of the buffer
+ * @param[in] nsg       The number of segments in sg
+ * @param[in] cb        A callback function to call when the transaction completes.
+ *                      If NULL is passed as this argument, the call will be blocking.
+ * @param[in] token     A token to pass, unmodified, to the provided callback function.
+ * @return              The number of bytes written, negative on failure.
+ */
+long mmc_block_write_sg(mmc_card_t mmc_card, unsigned long start_block, int nblocks,
+                        const struct mmc_sg *sg, int nsg, mmc_cb cb, void *token);
+
+/** Tell the card that blocks no longer hold data
+ * eMMC cards that support it are sent DISCARD, or TRIM before eMMC 4.5,
+ * which work on single blocks. Otherwise the blocks are erased, and the
+ * range shrinks to the whole erase groups that lie within it. Blocking.
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @param[in] start     The starting block number of the operation
+ * @param[in] nblocks   The number of blocks to discard
+ * @return              The number of bytes discarded, which may be less
+ *                      than requested after alignment, negative on failure.
+ */
+long mmc_block_discard(mmc_card_t mmc_card, unsigned long start_block, int nblocks);
+
+/** Enable the eMMC command queue
+ * While the queue is enabled, the card only accepts tagged requests; the
+ * mmc_block_* calls fail until it is disabled again.
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @return              The queue depth negotiated with the card, negative
+ *                      if the card does not support command queueing.
+ */
+int mmc_cmdq_enable(mmc_card_t mmc_card);
+
+/** Disable the eMMC command queue
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @return              0 on success, negative if requests are outstanding.
+ */
+int mmc_cmdq_disable(mmc_card_t mmc_card);
+
+/** Ask the card which queued requests are ready to run
+ * The driver asks on its own whenever a request is queued or completes.
+ * If the card had nothing ready then, nothing more happens until this is
+ * called, e.g. from a timer or when the host controller goes idle.
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @return              The number of requests outstanding, negative if the
+ *                      command queue is not enabled.
+ */
+int mmc_cmdq_poll(mmc_card_t mmc_card);
+
+/** Queue a tagged read
+ * The card may execute queued requests in any order. Requests are driven
+ * from mmc_handle_irq and mmc_cmdq_poll.
+ * @param[in] mmc_card  A handle to an initialised MMC card
+ * @param[in] start     The starting block number of the operation
+ * @param[in] nblocks   The number of blocks to read
+ * @param[in] vbuf      The virtual address of a buffer to read the data into
+ * @param[in] pbuf      The physical address of a buffer to read the data into
+ * @param[in] cb        A callback function to call when the request completes.
+ *                      Must not be NULL.
+ * @param[in] token     A token to pass, unmodified, to the provided callback function.
+ * @return              The tag of the request, negative if the queue is full
+ *                      or on failure.
+ */
+int mmc_cmdq_read(mmc_card_t mmc_card, unsigned long start_block, int nblocks,
+                  void *vbuf, uintptr_t pbuf, mmc_cb cb, void *token);
+
+/** Queue a tagged write
+ * See mmc_cmdq_read.
+ * @return              The tag of the request, negative if the queue is full
+ *                      or on failure.
+ */
+int mmc_cmdq_write(mmc_card_t mmc_card, unsigned long start_block, int nblocks,
+                   const void *vbuf, uintptr_t pbuf, mmc_cb cb, void *token);
+
 /**
  * Returns the nth IRQ that this underlying device generates
  * @param[in] mmc  A handle to an initialised MMC card
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sdhc/mmc.h>
+
+/*
+ * An optional write-back block cache over an MMC card. Blocks are kept in
+ * DMA memory and replaced least recently used first. Sequential reads grow
+ * a read-ahead window and dirty blocks are written back in runs of
+ * consecutive blocks with multi-block writes.
+ *
+ * All calls are blocking. The cache assumes it is the only user of the
+ * card; mixing cached and uncached accesses to the same blocks requires a
+ * flush first.
+ */
+typedef struct mmc_cache *mmc_cache_t;
+
+struct mmc_cache_stats {
+    unsigned long hits;        //Blocks read from the cache
+    unsigned long misses;      //Blocks read from the card
+    unsigned long readahead;   //Blocks read ahead of a request
+    unsigned long evictions;   //Blocks replaced
+    unsigned long writebacks;  //Write commands sent to the card
+    unsigned long written;     //Blocks written to the card
+};
+
+/** Create a block cache
+ * @param[in]  mmc_card  A handle to an initialised MMC card
+ * @param[in]  nblocks   The number of blocks to cache
+ * @param[out] cache     On success, a handle to the cache
+ * @return               0 on success.
+ */
+int mmc_cache_init(mmc_card_t mmc_card, int nblocks, mmc_cache_t *cache);
+
+/** Write back all dirty blocks and free the cache
+ * @param[in] cache  A handle to the cache
+ * @return           0 on success. The cache is freed even if the write back fails.
+ */
+int mmc_cache_destroy(mmc_cache_t cache);
+
+/** Read blocks through the cache
+ * @param[in] cache    A handle to the cache
+ * @param[in] start    The starting block number of the operation
+ * @param[in] nblocks  The number of blocks to read
+ * @param[in] buf      The buffer to read the data into
+ * @return             The number of bytes read, negative on failure.
+ */
+long mmc_cache_read(mmc_cache_t cache, unsigned long start, int nblocks, void *buf);
+
+/** Write blocks through the cache
+ * The data reaches the card when the blocks are evicted or flushed.
+ * @param[in] cache    A handle to the cache
+ * @param[in] start    The starting block number of the operation
+ * @param[in] nblocks  The number of blocks to write
+ * @param[in] buf      The buffer that contains the data to be written
+ * @return             The number of bytes written, negative on failure.
+ */
+long mmc_cache_write(mmc_cache_t cache, unsigned long start, int nblocks, const void *buf);
+
+/** Write back all dirty blocks
+ * Blocks stay cached.
+ * @param[in] cache  A handle to the cache
+ * @return           0 on success.
+ */
+int mmc_cache_flush(mmc_cache_t cache);
+
+/** Write barrier
+ * Writes made before the barrier are on the card, and the card has
+ * finished programming them, before any write made after it.
+ * @param[in] cache  A handle to the cache
+ * @return           0 on success.
+ */
+int mmc_cache_barrier(mmc_cache_t cache);
+
+/** Get the cache counters
+ * @param[in]  cache  A handle to the cache
+ * @param[out] stats  Filled with the counters since the cache was created
+ */
+void mmc_cache_get_stats(mmc_cache_t cache, struct mmc_cache_stats *stats);
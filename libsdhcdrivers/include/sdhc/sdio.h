@@ -26,6 +26,13 @@
 #define SDHC_PRES_STATE_CDIHB        (1 << 1)  //Command Inhibit(DATA)
 #define SDHC_PRES_STATE_CIHB         (1 << 0)  //Command Inhibit(CMD)
 
+/* Bus timings, in increasing order of clock rate */
+enum sdio_timing {
+    SDIO_TIMING_LEGACY = 0, //25MHz (SD default speed, MMC backwards compatible)
+    SDIO_TIMING_HS,         //50MHz (SD high speed, MMC high speed 52MHz)
+    SDIO_TIMING_HS200,      //200MHz SDR, eMMC only, needs tuning
+};
+
 /* TODO turn this into sdio_cmd */
 struct mmc_cmd;
 struct sdio_host_dev;
@@ -37,8 +44,12 @@ struct sdio_host_dev {
     int (*send_command)(struct sdio_host_dev *sdio, struct mmc_cmd *cmd, sdio_cb cb, void *token);
     int (*handle_irq)(struct sdio_host_dev *sdio, int irq);
     int (*is_voltage_compatible)(struct sdio_host_dev *sdio, int mv);
+    int (*get_signal_voltage)(struct sdio_host_dev *sdio);
     int (*nth_irq)(struct sdio_host_dev *sdio, int n);
     uint32_t (*get_present_state)(struct sdio_host_dev *sdio);
+    int (*set_bus_width)(struct sdio_host_dev *sdio, int width);
+    int (*set_timing)(struct sdio_host_dev *sdio, enum sdio_timing timing);
+    int (*execute_tuning)(struct sdio_host_dev *sdio, uint32_t opcode, int width);
 
     void *priv;
 };
@@ -71,6 +82,16 @@ static inline int sdio_is_voltage_compatible(sdio_host_dev_t *sdio, int mv)
     return sdio->is_voltage_compatible(sdio, mv);
 }
 
+/**
+ * Returns the voltage the host currently drives the CMD and DAT lines at
+ * @param[in] sdio A handle to an initialised SDIO driver
+ * @return         The signalling voltage, in millivolts
+ */
+static inline int sdio_get_signal_voltage(sdio_host_dev_t *sdio)
+{
+    return sdio->get_signal_voltage(sdio);
+}
+
 /**
  * Resets the provided SDIO device
  * @param[in] sdio A handle to an initialised SDIO driver
@@ -91,6 +112,41 @@ static inline int sdio_set_operational(sdio_host_dev_t *sdio)
     return sdio->set_operational(sdio);
 }
 
+/**
+ * Set the data bus width of the host
+ * @param[in] sdio  A handle to an initialised SDIO driver
+ * @param[in] width The bus width in bits; 1, 4 or 8
+ * @return          0 on success, negative if the width is not supported
+ */
+static inline int sdio_set_bus_width(sdio_host_dev_t *sdio, int width)
+{
+    return sdio->set_bus_width(sdio, width);
+}
+
+/**
+ * Set the bus timing, and with it the card clock, of the host
+ * @param[in] sdio   A handle to an initialised SDIO driver
+ * @param[in] timing The timing the card has been switched to
+ * @return           0 on success, negative if the timing is not supported
+ */
+static inline int sdio_set_timing(sdio_host_dev_t *sdio, enum sdio_timing timing)
+{
+    return sdio->set_timing(sdio, timing);
+}
+
+/**
+ * Find the best sampling point for the current timing
+ * @param[in] sdio   A handle to an initialised SDIO driver
+ * @param[in] opcode The tuning command of the card (CMD19 or CMD21)
+ * @param[in] width  The current bus width in bits
+ * @return           0 on success, negative if the host can not tune or no
+ *                   working sampling point was found
+ */
+static inline int sdio_execute_tuning(sdio_host_dev_t *sdio, uint32_t opcode, int width)
+{
+    return sdio->execute_tuning(sdio, opcode, width);
+}
+
 /**
  * Returns the nth IRQ that this device generates
  * @param[in] sdio A handle to an initialised SDIO driver
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <utils/util.h>
 
 #define CSD_VERSION_1       0
 #define CSD_VERSION_2_AND_3 1
@@ -143,6 +144,8 @@ static int mmc_cmd_add_data(struct mmc_cmd *cmd, void *vbuf, uintptr_t pbuf, uin
     if (d) {
         d->pbuf = pbuf;
         d->vbuf = vbuf;
+        d->sg = NULL;
+        d->nsg = 0;
         d->data_addr = addr;
         d->block_size = block_size;
         d->blocks = blocks;
@@ -207,12 +210,19 @@ static int mmc_card_registry(mmc_card_t card)
     memcpy(card->raw_cid, cmd.response, sizeof(card->raw_cid));
 
 
-    /* Retrieve RCA number. */
+    /* Retrieve RCA number. An SD card publishes one, an MMC is given one. */
     cmd.index = MMC_SEND_RELATIVE_ADDR;
-    cmd.arg = 0;
-    cmd.rsp_type = MMC_RSP_TYPE_R6;
-    host_send_command(card, &cmd, NULL, NULL);
-    card->raw_rca = (cmd.response[0] >> 16);
+    if (card->type == CARD_TYPE_SD) {
+        cmd.arg = 0;
+        cmd.rsp_type = MMC_RSP_TYPE_R6;
+        host_send_command(card, &cmd, NULL, NULL);
+        card->raw_rca = (cmd.response[0] >> 16);
+    } else {
+        cmd.arg = MMC_DEFAULT_RCA << 16;
+        cmd.rsp_type = MMC_RSP_TYPE_R1;
+        host_send_command(card, &cmd, NULL, NULL);
+        card->raw_rca = MMC_DEFAULT_RCA;
+    }
     ZF_LOGD("New Card RCA: %x", card->raw_rca);
 
     /* Read CSD, Status */
@@ -240,16 +250,10 @@ static int mmc_card_registry(mmc_card_t card)
 
     /**
      * The default bus width of the card after power up or GO_IDLE (CMD0) is
-     * 1 bit. As the HostController is initialzed to 4-bit bus width,
-     * the card also needs to switch to 4-bit mode.
+     * 1 bit. Match it until the card has told us what else it supports, see
+     * mmc_bus_setup().
      */
-    cmd.index = MMC_APP_CMD;
-    cmd.arg = card->raw_rca << 16;
-    cmd.rsp_type = MMC_RSP_TYPE_R1;
-    host_send_command(card, &cmd, NULL, NULL);
-    cmd.index = SD_SET_BUS_WIDTH;
-    cmd.arg = MMC_MODE_4BIT;
-    host_send_command(card, &cmd, NULL, NULL);
+    host_set_bus_width(card, 1);
 
     /* Set read/write block length for byte addressed standard capacity cards */
     if (!card->high_capacity) {
@@ -337,6 +341,234 @@ static int mmc_voltage_validation(mmc_card_t card)
 }
 
 
+/* Send a command with a single block read data stage, and wait for it */
+static int mmc_read_reg(mmc_card_t card, uint32_t index, uint32_t arg, void *buf, uint32_t len)
+{
+    struct mmc_data data = {
+        .vbuf = buf,
+        .block_size = len,
+        .blocks = 1,
+    };
+    struct mmc_cmd cmd = {
+        .index = index,
+        .arg = arg,
+        .rsp_type = MMC_RSP_TYPE_R1,
+        .data = &data,
+    };
+
+    return host_send_command(card, &cmd, NULL, NULL);
+}
+
+static int mmc_app_cmd(mmc_card_t card)
+{
+    struct mmc_cmd cmd = {.data = NULL};
+
+    cmd.index = MMC_APP_CMD;
+    cmd.arg = card->raw_rca << 16;
+    cmd.rsp_type = MMC_RSP_TYPE_R1;
+    return host_send_command(card, &cmd, NULL, NULL);
+}
+
+/* Poll CMD13 until the card has left the programming state */
+static int mmc_poll_ready(mmc_card_t card, int timeout_ms)
+{
+    struct mmc_cmd cmd = {.data = NULL};
+    int i;
+
+    for (i = 0; i < timeout_ms; i++) {
+        cmd.index = MMC_SEND_STATUS;
+        cmd.arg = card->raw_rca << 16;
+        cmd.rsp_type = MMC_RSP_TYPE_R1;
+        if (host_send_command(card, &cmd, NULL, NULL)) {
+            return -1;
+        }
+        if ((cmd.response[0] & MMC_STATUS_READY_FOR_DATA) &&
+            MMC_STATUS_STATE(cmd.response[0]) != MMC_STATE_PRG) {
+            return (cmd.response[0] & MMC_STATUS_SWITCH_ERROR) ? -1 : 0;
+        }
+        udelay(1000);
+    }
+    ZF_LOGE("Card stuck busy");
+    return -1;
+}
+
+int mmc_wait_ready(mmc_card_t card)
+{
+    return mmc_poll_ready(card, 1000);
+}
+
+/* Write one byte of the EXT_CSD with CMD6 */
+static int mmc_switch(mmc_card_t card, uint8_t index, uint8_t value)
+{
+    struct mmc_cmd cmd = {.data = NULL};
+    int ret;
+
+    cmd.index = MMC_SWITCH;
+    cmd.arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) | (index << 16) | (value << 8);
+    cmd.rsp_type = MMC_RSP_TYPE_R1b;
+    ret = host_send_command(card, &cmd, NULL, NULL);
+    if (ret) {
+        return ret;
+    }
+    return mmc_wait_ready(card);
+}
+
+/* SD: read the SCR, then pick the bus width and speed it allows */
+static int sd_bus_setup(mmc_card_t card)
+{
+    struct mmc_cmd cmd = {.data = NULL};
+    uint8_t *buf;
+    int ret;
+
+    buf = malloc(64);
+    if (!buf) {
+        return -1;
+    }
+
+    ret = mmc_app_cmd(card);
+    if (!ret) {
+        ret = mmc_read_reg(card, SD_SEND_SCR, 0, buf, 8);
+    }
+    if (ret) {
+        ZF_LOGE("Failed to read SCR");
+        free(buf);
+        return -1;
+    }
+    /* The SCR is sent MSB first */
+    card->raw_scr[1] = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    card->raw_scr[0] = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+
+    if (SCR_BUS_WIDTHS(card->raw_scr) & SCR_BUS_WIDTH_4) {
+        mmc_app_cmd(card);
+        cmd.index = SD_SET_BUS_WIDTH;
+        cmd.arg = MMC_MODE_4BIT;
+        cmd.rsp_type = MMC_RSP_TYPE_R1;
+        if (!host_send_command(card, &cmd, NULL, NULL) && !host_set_bus_width(card, 4)) {
+            card->bus_width = 4;
+        }
+    }
+
+    /* CMD6 exists from version 1.10, query function group 1 first */
+    if (SCR_SD_SPEC(card->raw_scr) >= 1 &&
+        !mmc_read_reg(card, SD_SWITCH_FUNC, SD_SWITCH_CHECK | 0xFFFFF0, buf, 64) &&
+        (buf[13] & BIT(SD_SWITCH_FN_HS))) {
+        ret = mmc_read_reg(card, SD_SWITCH_FUNC,
+                           SD_SWITCH_SET | 0xFFFFF0 | SD_SWITCH_FN_HS, buf, 64);
+        if (!ret && (buf[16] & 0xF) == SD_SWITCH_FN_HS &&
+            !host_set_timing(card, SDIO_TIMING_HS)) {
+            card->timing = SDIO_TIMING_HS;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+/*
+ * MMC: read the EXT_CSD, then try the widest bus and the fastest timing it
+ * allows. A new bus width is checked by reading the EXT_CSD again.
+ */
+static int mmc_bus_setup(mmc_card_t card)
+{
+    static const int widths[] = { 8, 4 };
+    uint8_t *buf;
+    uint8_t type;
+    int i;
+
+    if (mmc_read_reg(card, MMC_SEND_EXT_CSD, 0, card->raw_ext_csd,
+                     sizeof(card->raw_ext_csd))) {
+        ZF_LOGE("Failed to read EXT_CSD");
+        return -1;
+    }
+    buf = malloc(sizeof(card->raw_ext_csd));
+    if (!buf) {
+        return -1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(widths) && card->bus_width == 1; i++) {
+        if (mmc_switch(card, EXT_CSD_BUS_WIDTH, (widths[i] == 8) ? 2 : 1) ||
+            host_set_bus_width(card, widths[i])) {
+            continue;
+        }
+        if (!mmc_read_reg(card, MMC_SEND_EXT_CSD, 0, buf, sizeof(card->raw_ext_csd)) &&
+            !memcmp(buf + EXT_CSD_PROPERTIES, card->raw_ext_csd + EXT_CSD_PROPERTIES,
+                    sizeof(card->raw_ext_csd) - EXT_CSD_PROPERTIES)) {
+            memcpy(card->raw_ext_csd, buf, sizeof(card->raw_ext_csd));
+            card->bus_width = widths[i];
+        }
+    }
+    if (card->bus_width == 1) {
+        mmc_switch(card, EXT_CSD_BUS_WIDTH, 0);
+        host_set_bus_width(card, 1);
+    }
+    free(buf);
+
+    /* HS200 is only defined for 1.8V (or 1.2V) I/O, the host does not switch it */
+    type = card->raw_ext_csd[EXT_CSD_CARD_TYPE];
+    if ((type & EXT_CSD_CARD_TYPE_HS200) &&
+        !(host_is_voltage_compatible(card, 1800) && host_get_signal_voltage(card) == 1800)) {
+        ZF_LOGD("Host signals at %dmV, not using HS200", host_get_signal_voltage(card));
+        type &= ~EXT_CSD_CARD_TYPE_HS200;
+    }
+    if ((type & EXT_CSD_CARD_TYPE_HS200) && card->bus_width > 1 &&
+        !mmc_switch(card, EXT_CSD_HS_TIMING, EXT_CSD_TIMING_HS200) &&
+        !host_set_timing(card, SDIO_TIMING_HS200)) {
+        if (!host_execute_tuning(card, MMC_SEND_TUNING_BLOCK_HS200, card->bus_width)) {
+            card->timing = SDIO_TIMING_HS200;
+            return 0;
+        }
+        ZF_LOGW("HS200 tuning failed, falling back to high speed");
+        host_set_timing(card, SDIO_TIMING_LEGACY);
+    }
+    if ((type & EXT_CSD_CARD_TYPE_HS52) &&
+        !mmc_switch(card, EXT_CSD_HS_TIMING, EXT_CSD_TIMING_HS) &&
+        !host_set_timing(card, SDIO_TIMING_HS)) {
+        card->timing = SDIO_TIMING_HS;
+    }
+    return 0;
+}
+
+/* Completion of a command that nobody waits for */
+static void mmc_async_cmd_cb(struct sdio_host_dev *sdio, int stat, struct mmc_cmd *cmd,
+                             void *token)
+{
+    if (stat) {
+        ZF_LOGD("CMD%d failed", cmd->index);
+    }
+    mmc_cmd_destroy(cmd);
+}
+
+/**
+ * Tell an SD card how many blocks the next multi block write will cover
+ * (ACMD23) so that it can pre-erase them. This is only a hint, so it is
+ * queued ahead of the write and any failure is ignored.
+ */
+static void mmc_pre_erase_hint(mmc_card_t card, int nblocks)
+{
+    struct mmc_cmd *app;
+    struct mmc_cmd *cmd;
+
+    app = mmc_cmd_new(MMC_APP_CMD, card->raw_rca << 16, MMC_RSP_TYPE_R1);
+    cmd = mmc_cmd_new(SD_SET_WR_BLK_ERASE_COUNT, nblocks, MMC_RSP_TYPE_R1);
+    if (app == NULL || cmd == NULL) {
+        if (app) {
+            mmc_cmd_destroy(app);
+        }
+        if (cmd) {
+            mmc_cmd_destroy(cmd);
+        }
+        return;
+    }
+    if (host_send_command(card, app, &mmc_async_cmd_cb, NULL)) {
+        mmc_cmd_destroy(app);
+        mmc_cmd_destroy(cmd);
+        return;
+    }
+    if (host_send_command(card, cmd, &mmc_async_cmd_cb, NULL)) {
+        mmc_cmd_destroy(cmd);
+    }
+}
+
 static int mmc_reset(mmc_card_t card)
 {
     /* Reset the card with CMD0 */
@@ -376,6 +608,7 @@ static void mmc_blockop_completion_cb(struct sdio_host_dev *sdio, int stat, stru
 int mmc_init(sdio_host_dev_t *sdio, ps_io_ops_t *io_ops, mmc_card_t *mmc_card)
 {
     mmc_card_t mmc;
+    int ret;
 
     /* Allocate the mmc card structure */
     mmc = (mmc_card_t)malloc(sizeof(*mmc));
@@ -385,6 +618,7 @@ int mmc_init(sdio_host_dev_t *sdio, ps_io_ops_t *io_ops, mmc_card_t *mmc_card)
     }
     mmc->dalloc = &io_ops->dma_manager;
     mmc->sdio = sdio;
+    mmc->cmdq = NULL;
     /* Reset the host controller */
     if (host_reset(mmc)) {
         ZF_LOGE("Failed to reset host controller");
@@ -416,6 +650,19 @@ int mmc_init(sdio_host_dev_t *sdio, ps_io_ops_t *io_ops, mmc_card_t *mmc_card)
         return -1;
     }
 
+    /* Negotiate bus width and speed, the card still works if this fails */
+    mmc->bus_width = 1;
+    mmc->timing = SDIO_TIMING_LEGACY;
+    if (mmc->type == CARD_TYPE_SD) {
+        ret = sd_bus_setup(mmc);
+    } else {
+        ret = mmc_bus_setup(mmc);
+    }
+    if (ret) {
+        ZF_LOGW("Bus setup failed, staying at 1-bit default speed");
+    }
+    ZF_LOGD("%d-bit bus, timing %d", mmc->bus_width, mmc->timing);
+
     *mmc_card = mmc;
     assert(mmc);
     return 0;
@@ -428,12 +675,35 @@ long transfer_data(
     int nblocks,
     void *vbuf,
     uintptr_t pbuf,
+    const struct mmc_sg *sg,
+    int nsg,
     mmc_cb cb,
     void *token,
     uint32_t command)
 {
     struct mmc_cmd *cmd;
     const int block_size = mmc_block_size(mmc_card);
+    size_t len = 0;
+
+    if (nblocks <= 0 || nblocks > MMC_MAX_BLOCK_COUNT) {
+        ZF_LOGE("Invalid block count %d", nblocks);
+        return -1;
+    }
+    if (mmc_card->cmdq) {
+        ZF_LOGE("Legacy block commands are illegal in command queue mode");
+        return -1;
+    }
+    for (int i = 0; i < nsg; i++) {
+        len += sg[i].len;
+    }
+    if (sg && (nsg <= 0 || len != (size_t)block_size * nblocks)) {
+        ZF_LOGE("Scatter-gather list does not match the transfer size");
+        return -1;
+    }
+
+    if (command == MMC_WRITE_MULTIPLE_BLOCK && mmc_card->type == CARD_TYPE_SD) {
+        mmc_pre_erase_hint(mmc_card, nblocks);
+    }
 
     /* Determine command argument */
     const uint32_t arg = (mmc_card->high_capacity)
@@ -464,6 +734,8 @@ long transfer_data(
     if (ret < 0) {
         goto exit_transfer_data;
     }
+    cmd->data->sg = sg;
+    cmd->data->nsg = nsg;
 
     if (cb) {
         mmc_token = mmc_new_completion_token(mmc_card, cb, token);
@@ -508,9 +780,11 @@ long mmc_block_read(mmc_card_t mmc_card, unsigned long start,
                nblocks,
                vbuf,
                pbuf,
+               NULL,
+               0,
                cb,
                token,
-               MMC_READ_SINGLE_BLOCK);
+               (nblocks > 1) ? MMC_READ_MULTIPLE_BLOCK : MMC_READ_SINGLE_BLOCK);
 }
 
 long mmc_block_write(mmc_card_t mmc_card, unsigned long start, int nblocks,
@@ -525,9 +799,132 @@ long mmc_block_write(mmc_card_t mmc_card, unsigned long start, int nblocks,
                nblocks,
                (void *)vbuf,
                pbuf,
+               NULL,
+               0,
+               cb,
+               token,
+               (nblocks > 1) ? MMC_WRITE_MULTIPLE_BLOCK : MMC_WRITE_BLOCK);
+}
+
+long mmc_block_read_sg(mmc_card_t mmc_card, unsigned long start, int nblocks,
+                       const struct mmc_sg *sg, int nsg, mmc_cb cb, void *token)
+{
+    return transfer_data(
+               mmc_card,
+               start,
+               nblocks,
+               NULL,
+               0,
+               sg,
+               nsg,
+               cb,
+               token,
+               (nblocks > 1) ? MMC_READ_MULTIPLE_BLOCK : MMC_READ_SINGLE_BLOCK);
+}
+
+long mmc_block_write_sg(mmc_card_t mmc_card, unsigned long start, int nblocks,
+                        const struct mmc_sg *sg, int nsg, mmc_cb cb, void *token)
+{
+    return transfer_data(
+               mmc_card,
+               start,
+               nblocks,
+               NULL,
+               0,
+               sg,
+               nsg,
                cb,
                token,
-               MMC_WRITE_BLOCK);
+               (nblocks > 1) ? MMC_WRITE_MULTIPLE_BLOCK : MMC_WRITE_BLOCK);
+}
+
+/* Smallest unit a plain erase works on, in write blocks */
+static unsigned long mmc_erase_unit(mmc_card_t card)
+{
+    uint8_t *ext_csd = card->raw_ext_csd;
+
+    if (card->type == CARD_TYPE_SD) {
+        /* Always block granular unless a version 1 CSD says otherwise */
+        if (slice_bits(card->raw_csd, 126, 2) == CSD_VERSION_1 &&
+            !slice_bits(card->raw_csd, 46, 1)) {
+            return slice_bits(card->raw_csd, 39, 7) + 1;
+        }
+        return 1;
+    }
+    if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 0x1) {
+        /* In units of 512KiB */
+        return ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] * (512 * 1024 / mmc_block_size(card));
+    }
+    return (slice_bits(card->raw_csd, 42, 5) + 1) * (slice_bits(card->raw_csd, 37, 5) + 1);
+}
+
+static int mmc_erase_cmd(mmc_card_t card, uint32_t index, uint32_t arg, int rsp_type)
+{
+    struct mmc_cmd cmd = {.data = NULL};
+
+    cmd.index = index;
+    cmd.arg = arg;
+    cmd.rsp_type = rsp_type;
+    return host_send_command(card, &cmd, NULL, NULL);
+}
+
+long mmc_block_discard(mmc_card_t mmc_card, unsigned long start, int nblocks)
+{
+    uint8_t *ext_csd = mmc_card->raw_ext_csd;
+    unsigned long end = start + nblocks;
+    unsigned long unit = 1;
+    uint32_t first_cmd, last_cmd;
+    uint32_t arg;
+
+    if (nblocks <= 0 || mmc_card->cmdq) {
+        return -1;
+    }
+
+    if (mmc_card->type == CARD_TYPE_SD) {
+        first_cmd = MMC_TAG_SECTOR_START;
+        last_cmd = MMC_TAG_SECTOR_END;
+        arg = MMC_ERASE_ARG;
+        unit = mmc_erase_unit(mmc_card);
+    } else if (mmc_card->type == CARD_TYPE_MMC) {
+        first_cmd = MMC_TAG_ERASE_GROUP_START;
+        last_cmd = MMC_TAG_ERASE_GROUP_END;
+        /* TRIM and DISCARD work on write blocks, ERASE on whole groups */
+        if (!(ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] & EXT_CSD_SEC_GB_CL_EN)) {
+            arg = MMC_ERASE_ARG;
+            unit = mmc_erase_unit(mmc_card);
+        } else if (ext_csd[EXT_CSD_REV] >= 6) {
+            arg = MMC_DISCARD_ARG;
+        } else {
+            arg = MMC_TRIM_ARG;
+        }
+    } else {
+        return -1;
+    }
+
+    /* Only whole units inside the range may go */
+    if (unit > 1) {
+        start = DIV_ROUND_UP(start, unit) * unit;
+        end = end / unit * unit;
+        if (start >= end) {
+            return 0;
+        }
+    }
+
+    if (mmc_erase_cmd(mmc_card, first_cmd,
+                      mmc_card->high_capacity ? start : start * mmc_block_size(mmc_card),
+                      MMC_RSP_TYPE_R1) ||
+        mmc_erase_cmd(mmc_card, last_cmd,
+                      mmc_card->high_capacity ? end - 1 : (end - 1) * mmc_block_size(mmc_card),
+                      MMC_RSP_TYPE_R1) ||
+        mmc_erase_cmd(mmc_card, MMC_ERASE, arg, MMC_RSP_TYPE_R1b)) {
+        ZF_LOGE("Erase of blocks %lu to %lu failed", start, end - 1);
+        return -1;
+    }
+    if (mmc_poll_ready(mmc_card, MMC_ERASE_TIMEOUT_MS)) {
+        return -1;
+    }
+
+    return (end - start) * mmc_block_size(mmc_card);
 }
 
 long long mmc_card_capacity(mmc_card_t mmc_card)
@@ -556,6 +953,295 @@ long long mmc_card_capacity(mmc_card_t mmc_card)
 }
 
 
+/*
+ * eMMC command queue.
+ *
+ * Tasks are queued in the card with CMD44/CMD45. The queue status register
+ * (CMD13 with SQS) tells which tasks the card wants to run next, and those
+ * are executed with CMD46/CMD47. Everything is chained from command
+ * completions, so it runs from mmc_handle_irq and never blocks. The QSR is
+ * read again after each completion, never in a loop: while no queued task
+ * is ready, the next query waits for mmc_cmdq_poll().
+ */
+struct mmc_cmdq_task {
+    mmc_card_t card;
+    int tag;
+    int write;
+    unsigned long start;
+    int nblocks;
+    void *vbuf;
+    uintptr_t pbuf;
+    mmc_cb cb;
+    void *token;
+};
+
+struct mmc_cmdq {
+    int depth;
+    /* Bitmaps of task IDs */
+    uint32_t busy;      //Allocated to a request
+    uint32_t queued;    //Accepted by the card
+    int running;        //Executing on the bus, or -1
+    int qsr_pending;
+    struct mmc_cmdq_task task[MMC_CMDQ_MAX_DEPTH];
+};
+
+static void mmc_cmdq_kick(mmc_card_t card);
+
+static void mmc_cmdq_task_done(mmc_card_t card, int tag, int stat)
+{
+    struct mmc_cmdq *q = card->cmdq;
+    struct mmc_cmdq_task *t = &q->task[tag];
+    struct mmc_cmd *cmd;
+
+    q->busy &= ~BIT(tag);
+    q->queued &= ~BIT(tag);
+    if (stat) {
+        /* Drop the task from the card's queue, CMD48 */
+        cmd = mmc_cmd_new(MMC_CMDQ_TASK_MGMT, (tag << 16) | MMC_CMDQ_DISCARD_TASK,
+                          MMC_RSP_TYPE_R1b);
+        if (cmd && host_send_command(card, cmd, &mmc_async_cmd_cb, NULL)) {
+            mmc_cmd_destroy(cmd);
+        }
+    }
+    t->cb(card, stat, stat ? 0 : t->nblocks * mmc_block_size(card), t->token);
+}
+
+static void mmc_cmdq_exec_cb(struct sdio_host_dev *sdio, int stat, struct mmc_cmd *cmd,
+                             void *token)
+{
+    mmc_card_t card = (mmc_card_t)token;
+    int tag = card->cmdq->running;
+
+    mmc_cmd_destroy(cmd);
+    card->cmdq->running = -1;
+    mmc_cmdq_task_done(card, tag, stat);
+    mmc_cmdq_kick(card);
+}
+
+static void mmc_cmdq_qsr_cb(struct sdio_host_dev *sdio, int stat, struct mmc_cmd *cmd,
+                            void *token)
+{
+    mmc_card_t card = (mmc_card_t)token;
+    struct mmc_cmdq *q = card->cmdq;
+    struct mmc_cmdq_task *t;
+    uint32_t ready;
+    int tag;
+
+    ready = stat ? 0 : (cmd->response[0] & q->queued);
+    mmc_cmd_destroy(cmd);
+    q->qsr_pending = 0;
+    if (!ready) {
+        /* Asking again now would only keep the bus busy with CMD13 */
+        return;
+    }
+
+    /* The card may reorder, it only tells us what is ready */
+    tag = CTZ(ready);
+    t = &q->task[tag];
+    cmd = mmc_cmd_new(t->write ? MMC_EXECUTE_WRITE_TASK : MMC_EXECUTE_READ_TASK,
+                      tag << 16, MMC_RSP_TYPE_R1);
+    if (cmd == NULL || mmc_cmd_add_data(cmd, t->vbuf, t->pbuf, t->start,
+                                        mmc_block_size(card), t->nblocks)) {
+        if (cmd) {
+            mmc_cmd_destroy(cmd);
+        }
+        mmc_cmdq_task_done(card, tag, -1);
+        mmc_cmdq_kick(card);
+        return;
+    }
+    q->running = tag;
+    if (host_send_command(card, cmd, &mmc_cmdq_exec_cb, card)) {
+        mmc_cmd_destroy(cmd);
+        q->running = -1;
+        mmc_cmdq_task_done(card, tag, -1);
+        mmc_cmdq_kick(card);
+    }
+}
+
+/* Ask the card for ready tasks, unless we are already busy with one */
+static void mmc_cmdq_kick(mmc_card_t card)
+{
+    struct mmc_cmdq *q = card->cmdq;
+    struct mmc_cmd *cmd;
+
+    if (!q->queued || q->running >= 0 || q->qsr_pending) {
+        return;
+    }
+    cmd = mmc_cmd_new(MMC_SEND_STATUS, (card->raw_rca << 16) | MMC_STATUS_SQS,
+                      MMC_RSP_TYPE_R1);
+    if (cmd == NULL) {
+        return;
+    }
+    q->qsr_pending = 1;
+    if (host_send_command(card, cmd, &mmc_cmdq_qsr_cb, card)) {
+        q->qsr_pending = 0;
+        mmc_cmd_destroy(cmd);
+    }
+}
+
+static void mmc_cmdq_queued_cb(struct sdio_host_dev *sdio, int stat, struct mmc_cmd *cmd,
+                               void *token)
+{
+    struct mmc_cmdq_task *t = (struct mmc_cmdq_task *)token;
+    mmc_card_t card = t->card;
+    int tag = t->tag;
+
+    mmc_cmd_destroy(cmd);
+    if (stat) {
+        mmc_cmdq_task_done(card, tag, -1);
+        return;
+    }
+    card->cmdq->queued |= BIT(tag);
+    mmc_cmdq_kick(card);
+}
+
+static int mmc_cmdq_submit(mmc_card_t card, int write, unsigned long start, int nblocks,
+                           void *vbuf, uintptr_t pbuf, mmc_cb cb, void *token)
+{
+    struct mmc_cmdq *q = card->cmdq;
+    struct mmc_cmdq_task *t;
+    struct mmc_cmd *params;
+    struct mmc_cmd *addr;
+    uint32_t avail;
+    int tag;
+
+    if (q == NULL || cb == NULL) {
+        ZF_LOGE("Command queue not enabled, or no call back");
+        return -1;
+    }
+    if (nblocks <= 0 || nblocks > MMC_CMDQ_MAX_BLOCKS) {
+        ZF_LOGE("Invalid block count %d", nblocks);
+        return -1;
+    }
+    avail = ~q->busy;
+    if (q->depth < 32) {
+        avail &= BIT(q->depth) - 1;
+    }
+    if (!avail) {
+        return -1;
+    }
+    tag = CTZ(avail);
+
+    params = mmc_cmd_new(MMC_QUEUED_TASK_PARAMS,
+                         (write ? 0 : MMC_CMDQ_DIR_READ) | (tag << 16) | nblocks,
+                         MMC_RSP_TYPE_R1);
+    addr = mmc_cmd_new(MMC_QUEUED_TASK_ADDRESS,
+                       card->high_capacity ? start : start * mmc_block_size(card),
+                       MMC_RSP_TYPE_R1);
+    if (params == NULL || addr == NULL) {
+        if (params) {
+            mmc_cmd_destroy(params);
+        }
+        if (addr) {
+            mmc_cmd_destroy(addr);
+        }
+        return -1;
+    }
+
+    t = &q->task[tag];
+    t->write = write;
+    t->start = start;
+    t->nblocks = nblocks;
+    t->vbuf = vbuf;
+    t->pbuf = pbuf;
+    t->cb = cb;
+    t->token = token;
+    q->busy |= BIT(tag);
+
+    if (host_send_command(card, params, &mmc_async_cmd_cb, NULL)) {
+        mmc_cmd_destroy(params);
+        mmc_cmd_destroy(addr);
+        q->busy &= ~BIT(tag);
+        return -1;
+    }
+    if (host_send_command(card, addr, &mmc_cmdq_queued_cb, t)) {
+        /* The card will ignore the lone CMD44 */
+        mmc_cmd_destroy(addr);
+        q->busy &= ~BIT(tag);
+        return -1;
+    }
+    return tag;
+}
+
+int mmc_cmdq_enable(mmc_card_t mmc_card)
+{
+    struct mmc_cmdq *q;
+    uint8_t *ext_csd = mmc_card->raw_ext_csd;
+    int i;
+
+    if (mmc_card->cmdq) {
+        return mmc_card->cmdq->depth;
+    }
+    if (mmc_card->type != CARD_TYPE_MMC || ext_csd[EXT_CSD_REV] < 8 ||
+        !(ext_csd[EXT_CSD_CMDQ_SUPPORT] & 0x1)) {
+        ZF_LOGE("Card does not support command queueing");
+        return -1;
+    }
+
+    q = (struct mmc_cmdq *)malloc(sizeof(*q));
+    if (!q) {
+        return -1;
+    }
+    memset(q, 0, sizeof(*q));
+    q->depth = (ext_csd[EXT_CSD_CMDQ_DEPTH] & 0x1F) + 1;
+    q->running = -1;
+    for (i = 0; i < q->depth; i++) {
+        q->task[i].card = mmc_card;
+        q->task[i].tag = i;
+    }
+
+    if (mmc_switch(mmc_card, EXT_CSD_CMDQ_MODE_EN, 1)) {
+        ZF_LOGE("Failed to enable command queueing");
+        free(q);
+        return -1;
+    }
+    mmc_card->cmdq = q;
+    ZF_LOGD("Command queue depth %d", q->depth);
+    return q->depth;
+}
+
+int mmc_cmdq_disable(mmc_card_t mmc_card)
+{
+    struct mmc_cmdq *q = mmc_card->cmdq;
+
+    if (q == NULL) {
+        return 0;
+    }
+    if (q->busy) {
+        ZF_LOGE("Command queue is not empty");
+        return -1;
+    }
+    if (mmc_switch(mmc_card, EXT_CSD_CMDQ_MODE_EN, 0)) {
+        return -1;
+    }
+    mmc_card->cmdq = NULL;
+    free(q);
+    return 0;
+}
+
+int mmc_cmdq_poll(mmc_card_t mmc_card)
+{
+    struct mmc_cmdq *q = mmc_card->cmdq;
+
+    if (q == NULL) {
+        return -1;
+    }
+    mmc_cmdq_kick(mmc_card);
+    return __builtin_popcount(q->busy);
+}
+
+int mmc_cmdq_read(mmc_card_t mmc_card, unsigned long start, int nblocks,
+                  void *vbuf, uintptr_t pbuf, mmc_cb cb, void *token)
+{
+    return mmc_cmdq_submit(mmc_card, 0, start, nblocks, vbuf, pbuf, cb, token);
+}
+
+int mmc_cmdq_write(mmc_card_t mmc_card, unsigned long start, int nblocks,
+                   const void *vbuf, uintptr_t pbuf, mmc_cb cb, void *token)
+{
+    return mmc_cmdq_submit(mmc_card, 1, start, nblocks, (void *)vbuf, pbuf, cb, token);
+}
+
 int mmc_nth_irq(mmc_card_t mmc, int n)
 {
     return host_nth_irq(mmc, n);
@@ -29,6 +29,7 @@
 #define MMC_READ_SINGLE_BLOCK     17 //R1
 #define MMC_READ_MULTIPLE_BLOCK   18 //R1
 #define MMC_WRITE_DAT_UNTIL_STOP  20 //R1
+#define MMC_SEND_TUNING_BLOCK_HS200 21 //R1
 #define MMC_WRITE_BLOCK           24 //R1
 #define MMC_WRITE_MULTIPLE_BLOCK  25 //R1
 #define MMC_PROGRAM_CID           26 //R1
@@ -46,6 +47,11 @@
 #define MMC_FAST_IO               39 //R4
 #define MMC_GO_IRQ_STATE          40 //R5
 #define MMC_LOCK_UNLOCK           42 //R1b
+#define MMC_QUEUED_TASK_PARAMS    44 //R1
+#define MMC_QUEUED_TASK_ADDRESS   45 //R1
+#define MMC_EXECUTE_READ_TASK     46 //R1
+#define MMC_EXECUTE_WRITE_TASK    47 //R1
+#define MMC_CMDQ_TASK_MGMT        48 //R1b
 #define MMC_IO_RW_DIRECT          52 //R5
 #define MMC_IO_RW_EXTENDED        53 //R5
 #define MMC_APP_CMD               55 //R1
@@ -53,6 +59,9 @@
 #define MMC_RW_MULTIPLE_REGISTER  60 //R1b
 #define MMC_RW_MULTIPLE_BLOCK     61 //R1b
 
+/* SD commands that share an index with a different MMC command */
+#define SD_SWITCH_FUNC            6  //R1
+
 /* Application Specific Command(ACMD). */
 #define SD_SET_BUS_WIDTH          6  //R1
 #define SD_SD_STATUS              13 //R1
@@ -69,10 +78,66 @@
 #define MMC_VDD_30_31             (1 << 18)
 #define MMC_VDD_29_30             (1 << 17)
 
+/* Largest transfer the block count register can describe */
+#define MMC_MAX_BLOCK_COUNT       0xFFFF
+
+/* Relative address the host gives an MMC, SD cards choose their own */
+#define MMC_DEFAULT_RCA     0x0001
+
 /* Bus width */
 #define MMC_MODE_8BIT       0x04
 #define MMC_MODE_4BIT       0x02
 
+/* Card status (R1) */
+#define MMC_STATUS_READY_FOR_DATA (1 << 8)
+#define MMC_STATUS_SWITCH_ERROR   (1 << 7)
+#define MMC_STATUS_STATE(r)       (((r) >> 9) & 0xF)
+#define MMC_STATE_PRG             7
+#define MMC_STATUS_SQS            (1 << 15) //CMD13 argument, send queue status
+
+/* SCR fields, raw_scr[1] holds bits 63:32 */
+#define SCR_SD_SPEC(scr)          (((scr)[1] >> 24) & 0xF)
+#define SCR_BUS_WIDTHS(scr)       (((scr)[1] >> 16) & 0xF)
+#define SCR_BUS_WIDTH_4           (1 << 2)
+
+/* SD CMD6 argument, function group 1 in the low nibble */
+#define SD_SWITCH_CHECK           (0U << 31)
+#define SD_SWITCH_SET             (1U << 31)
+#define SD_SWITCH_FN_HS           1
+
+/* MMC CMD6 */
+#define MMC_SWITCH_MODE_WRITE_BYTE 3
+
+/* EXT_CSD byte offsets and values */
+#define EXT_CSD_CMDQ_MODE_EN      15
+#define EXT_CSD_ERASE_GROUP_DEF   175
+#define EXT_CSD_BUS_WIDTH         183
+#define EXT_CSD_HS_TIMING         185
+#define EXT_CSD_REV               192
+#define EXT_CSD_CARD_TYPE         196
+#define EXT_CSD_HC_ERASE_GRP_SIZE 224
+#define EXT_CSD_SEC_FEATURE_SUPPORT 231
+#define EXT_CSD_CMDQ_DEPTH        307
+#define EXT_CSD_CMDQ_SUPPORT      308
+#define EXT_CSD_PROPERTIES        192 //Read only segment, the rest are modes
+#define EXT_CSD_CARD_TYPE_HS52    (1 << 1)
+#define EXT_CSD_CARD_TYPE_HS200   (1 << 4)
+#define EXT_CSD_TIMING_HS         1
+#define EXT_CSD_TIMING_HS200      2
+#define EXT_CSD_SEC_GB_CL_EN      (1 << 4) //TRIM and DISCARD supported
+
+/* CMD38 argument */
+#define MMC_ERASE_ARG             0x0
+#define MMC_TRIM_ARG              0x1
+#define MMC_DISCARD_ARG           0x3
+#define MMC_ERASE_TIMEOUT_MS      60000
+
+/* Command queue */
+#define MMC_CMDQ_MAX_DEPTH        32
+#define MMC_CMDQ_MAX_BLOCKS       0xFFFF
+#define MMC_CMDQ_DIR_READ         (1 << 30) //CMD44 argument
+#define MMC_CMDQ_DISCARD_TASK     2         //CMD48 TM op-code
+
 
 enum mmc_rsp_type {
     MMC_RSP_TYPE_NONE = 0,
@@ -102,6 +167,9 @@ enum mmc_card_status {
 struct mmc_data {
     uintptr_t  pbuf;
     void      *vbuf;
+    /* Scatter-gather list, used instead of pbuf/vbuf when not NULL */
+    const struct mmc_sg *sg;
+    int        nsg;
     uint32_t   data_addr;
     uint32_t   block_size;
     uint32_t   blocks;
@@ -153,17 +221,23 @@ struct csd {
     uint8_t  c_size_mult;
 };
 
+struct mmc_cmdq;
+
 struct mmc_card {
     uint32_t ocr;
     uint32_t raw_cid[4];
     uint32_t raw_csd[4];
     uint16_t raw_rca;
     uint32_t raw_scr[2];
+    uint8_t  raw_ext_csd[512];
     uint32_t type;
     uint32_t voltage;
     uint32_t version;
     uint32_t high_capacity;
     uint32_t status;
+    int bus_width;
+    enum sdio_timing timing;
+    struct mmc_cmdq *cmdq;
     ps_dma_man_t *dalloc;
     sdio_host_dev_t *sdio;
 };
@@ -188,6 +262,11 @@ static inline int host_is_voltage_compatible(struct mmc_card *card, int mv)
     return sdio_is_voltage_compatible(card->sdio, mv);
 }
 
+static inline int host_get_signal_voltage(struct mmc_card *card)
+{
+    return sdio_get_signal_voltage(card->sdio);
+}
+
 
 static inline int host_reset(struct mmc_card *card)
 {
@@ -199,6 +278,24 @@ static inline int host_set_operational(struct mmc_card *card)
     return sdio_set_operational(card->sdio);
 }
 
+static inline int host_set_bus_width(struct mmc_card *card, int width)
+{
+    return sdio_set_bus_width(card->sdio, width);
+}
+
+static inline int host_set_timing(struct mmc_card *card, enum sdio_timing timing)
+{
+    return sdio_set_timing(card->sdio, timing);
+}
+
+static inline int host_execute_tuning(struct mmc_card *card, uint32_t opcode, int width)
+{
+    return sdio_execute_tuning(card->sdio, opcode, width);
+}
+
+/* Poll CMD13 until the card has finished programming */
+int mmc_wait_ready(mmc_card_t card);
+
 
 
 
@@ -0,0 +1,515 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sdhc/mmc_cache.h>
+#include "mmc.h"
+#include "services.h"
+#include <string.h>
+#include <assert.h>
+#include <utils/util.h>
+
+/* Longest run moved with one command, through the staging buffer */
+#define MMC_CACHE_MAX_RUN    64
+/* Read-ahead window, grows while reads are sequential */
+#define MMC_CACHE_RA_MIN     4
+#define MMC_CACHE_RA_MAX     MMC_CACHE_MAX_RUN
+/* Start writing back when this share of the cache is dirty */
+#define MMC_CACHE_DIRTY_HIGH(n) ((n) * 3 / 4)
+
+struct mmc_cache_blk {
+    unsigned long block;
+    int valid;
+    int dirty;
+    void *vbuf;
+    uintptr_t pbuf;
+    /* LRU list, head is the most recently used */
+    struct mmc_cache_blk *prev;
+    struct mmc_cache_blk *next;
+    /* Hash chain */
+    struct mmc_cache_blk *hnext;
+};
+
+struct mmc_cache {
+    mmc_card_t card;
+    size_t bsize;
+    unsigned long card_blocks;
+    int nblks;
+    int ndirty;
+    struct mmc_cache_blk *blks;
+    struct mmc_cache_blk *lru_head;
+    struct mmc_cache_blk *lru_tail;
+    struct mmc_cache_blk **hash;
+    unsigned int hash_mask;
+    /* Scratch list of dirty blocks for write back */
+    struct mmc_cache_blk **sorted;
+    /* Blocks being filled by a read */
+    struct mmc_cache_blk *fill[MMC_CACHE_MAX_RUN];
+    /* Block data, and the staging buffer for runs */
+    void *vdata;
+    uintptr_t pdata;
+    void *vstage;
+    uintptr_t pstage;
+    /* Read-ahead state */
+    unsigned long next_block;
+    int ra_blocks;
+    struct mmc_cache_stats stats;
+};
+
+/*****************
+ **** Helpers ****
+ *****************/
+
+static inline struct mmc_cache_blk **hash_slot(mmc_cache_t c, unsigned long block)
+{
+    return &c->hash[(block ^ (block >> 12)) & c->hash_mask];
+}
+
+static struct mmc_cache_blk *cache_lookup(mmc_cache_t c, unsigned long block)
+{
+    struct mmc_cache_blk *b;
+
+    for (b = *hash_slot(c, block); b != NULL; b = b->hnext) {
+        if (b->block == block) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void hash_insert(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    struct mmc_cache_blk **slot = hash_slot(c, b->block);
+
+    b->hnext = *slot;
+    *slot = b;
+}
+
+static void hash_remove(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    struct mmc_cache_blk **p;
+
+    for (p = hash_slot(c, b->block); *p != NULL; p = &(*p)->hnext) {
+        if (*p == b) {
+            *p = b->hnext;
+            return;
+        }
+    }
+}
+
+static void lru_unlink(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        c->lru_head = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    } else {
+        c->lru_tail = b->prev;
+    }
+}
+
+static void lru_push_head(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    b->prev = NULL;
+    b->next = c->lru_head;
+    if (c->lru_head) {
+        c->lru_head->prev = b;
+    } else {
+        c->lru_tail = b;
+    }
+    c->lru_head = b;
+}
+
+static void lru_push_tail(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    b->next = NULL;
+    b->prev = c->lru_tail;
+    if (c->lru_tail) {
+        c->lru_tail->next = b;
+    } else {
+        c->lru_head = b;
+    }
+    c->lru_tail = b;
+}
+
+static inline void cache_touch(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    if (c->lru_head != b) {
+        lru_unlink(c, b);
+        lru_push_head(c, b);
+    }
+}
+
+/* Drop a block without writing it back, it becomes the next victim */
+static void cache_invalidate(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    if (b->valid) {
+        hash_remove(c, b);
+    }
+    if (b->dirty) {
+        c->ndirty--;
+    }
+    b->valid = 0;
+    b->dirty = 0;
+    lru_unlink(c, b);
+    lru_push_tail(c, b);
+}
+
+/***********************
+ **** Card transfer ****
+ ***********************/
+
+/* Write count consecutive blocks, first is the lowest */
+static int cache_write_run(mmc_cache_t c, struct mmc_cache_blk **run, int count)
+{
+    long ret;
+    int i;
+
+    if (count == 1) {
+        ret = mmc_block_write(c->card, run[0]->block, 1, run[0]->vbuf,
+                              run[0]->pbuf, NULL, NULL);
+    } else {
+        for (i = 0; i < count; i++) {
+            memcpy(c->vstage + i * c->bsize, run[i]->vbuf, c->bsize);
+        }
+        ret = mmc_block_write(c->card, run[0]->block, count, c->vstage,
+                              c->pstage, NULL, NULL);
+    }
+    if (ret != count * c->bsize) {
+        ZF_LOGE("Write back of %d blocks at %lu failed", count, run[0]->block);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        run[i]->dirty = 0;
+    }
+    c->ndirty -= count;
+    c->stats.writebacks++;
+    c->stats.written += count;
+    return 0;
+}
+
+/* Write back a dirty block together with its dirty neighbours */
+static int cache_write_around(mmc_cache_t c, struct mmc_cache_blk *b)
+{
+    struct mmc_cache_blk **run = c->sorted;
+    struct mmc_cache_blk *n;
+    unsigned long first = b->block;
+    int count;
+
+    while (first > 0 && b->block - first < MMC_CACHE_MAX_RUN - 1) {
+        n = cache_lookup(c, first - 1);
+        if (n == NULL || !n->dirty) {
+            break;
+        }
+        first--;
+    }
+    for (count = 0; count < MMC_CACHE_MAX_RUN; count++) {
+        n = cache_lookup(c, first + count);
+        if (n == NULL || !n->dirty) {
+            break;
+        }
+        run[count] = n;
+    }
+    return cache_write_run(c, run, count);
+}
+
+/* Take the least recently used block, writing it back if needed */
+static struct mmc_cache_blk *cache_alloc(mmc_cache_t c, unsigned long block)
+{
+    struct mmc_cache_blk *b = c->lru_tail;
+
+    if (b->dirty && cache_write_around(c, b)) {
+        return NULL;
+    }
+    if (b->valid) {
+        hash_remove(c, b);
+        c->stats.evictions++;
+    }
+    b->block = block;
+    b->valid = 1;
+    b->dirty = 0;
+    hash_insert(c, b);
+    cache_touch(c, b);
+    return b;
+}
+
+/* Read count uncached blocks from the card into the cache */
+static int cache_fill(mmc_cache_t c, unsigned long block, int count)
+{
+    struct mmc_cache_blk **run = c->fill;
+    long ret;
+    int i;
+    int j;
+
+    for (i = 0; i < count; i++) {
+        run[i] = cache_alloc(c, block + i);
+        if (run[i] == NULL) {
+            goto fail;
+        }
+    }
+
+    if (count == 1) {
+        ret = mmc_block_read(c->card, block, 1, run[0]->vbuf, run[0]->pbuf,
+                             NULL, NULL);
+    } else {
+        ret = mmc_block_read(c->card, block, count, c->vstage, c->pstage,
+                             NULL, NULL);
+        for (j = 0; ret == count * c->bsize && j < count; j++) {
+            memcpy(run[j]->vbuf, c->vstage + j * c->bsize, c->bsize);
+        }
+    }
+    if (ret == count * c->bsize) {
+        return 0;
+    }
+    ZF_LOGE("Read of %d blocks at %lu failed", count, block);
+
+fail:
+    while (i-- > 0) {
+        cache_invalidate(c, run[i]);
+    }
+    return -1;
+}
+
+static int blk_cmp(const void *a, const void *b)
+{
+    unsigned long x = (*(struct mmc_cache_blk *const *)a)->block;
+    unsigned long y = (*(struct mmc_cache_blk *const *)b)->block;
+
+    return (x > y) - (x < y);
+}
+
+/****************************
+ **** Exported functions ****
+ ****************************/
+
+int mmc_cache_init(mmc_card_t mmc_card, int nblocks, mmc_cache_t *cache)
+{
+    mmc_cache_t c;
+    long long capacity;
+    int nbuckets;
+    int i;
+
+    /* A fill must never evict the blocks it is filling */
+    if (nblocks < 2 * MMC_CACHE_MAX_RUN) {
+        ZF_LOGE("Cache of %d blocks is too small", nblocks);
+        return -1;
+    }
+    capacity = mmc_card_capacity(mmc_card);
+    if (capacity <= 0) {
+        return -1;
+    }
+
+    c = (mmc_cache_t)malloc(sizeof(*c));
+    if (!c) {
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    c->card = mmc_card;
+    c->bsize = mmc_block_size(mmc_card);
+    c->card_blocks = capacity / c->bsize;
+    c->nblks = nblocks;
+
+    for (nbuckets = 1; nbuckets < nblocks; nbuckets <<= 1);
+    c->hash_mask = nbuckets - 1;
+    c->blks = (struct mmc_cache_blk *)malloc(sizeof(*c->blks) * nblocks);
+    c->hash = (struct mmc_cache_blk **)malloc(sizeof(*c->hash) * nbuckets);
+    c->sorted = (struct mmc_cache_blk **)malloc(sizeof(*c->sorted) * nblocks);
+    c->vdata = ps_dma_alloc_pinned(mmc_card->dalloc, c->bsize * nblocks, 4096, 0,
+                                   PS_MEM_NORMAL, &c->pdata);
+    c->vstage = ps_dma_alloc_pinned(mmc_card->dalloc, c->bsize * MMC_CACHE_MAX_RUN,
+                                    4096, 0, PS_MEM_NORMAL, &c->pstage);
+    if (!c->blks || !c->hash || !c->sorted || !c->vdata || !c->vstage) {
+        ZF_LOGE("Out of memory for the block cache");
+        mmc_cache_destroy(c);
+        return -1;
+    }
+    memset(c->hash, 0, sizeof(*c->hash) * nbuckets);
+
+    for (i = 0; i < nblocks; i++) {
+        struct mmc_cache_blk *b = &c->blks[i];
+        b->valid = 0;
+        b->dirty = 0;
+        b->hnext = NULL;
+        b->vbuf = c->vdata + i * c->bsize;
+        b->pbuf = c->pdata + i * c->bsize;
+        lru_push_tail(c, b);
+    }
+    c->next_block = ~0UL;
+
+    *cache = c;
+    return 0;
+}
+
+int mmc_cache_destroy(mmc_cache_t cache)
+{
+    int ret = 0;
+
+    if (cache->blks && cache->sorted && cache->vstage) {
+        ret = mmc_cache_flush(cache);
+    }
+    if (cache->vdata) {
+        ps_dma_free_pinned(cache->card->dalloc, cache->vdata, cache->bsize * cache->nblks);
+    }
+    if (cache->vstage) {
+        ps_dma_free_pinned(cache->card->dalloc, cache->vstage,
+                           cache->bsize * MMC_CACHE_MAX_RUN);
+    }
+    free(cache->blks);
+    free(cache->hash);
+    free(cache->sorted);
+    free(cache);
+    return ret;
+}
+
+long mmc_cache_read(mmc_cache_t cache, unsigned long start, int nblocks, void *buf)
+{
+    struct mmc_cache_blk **run = cache->fill;
+    struct mmc_cache_blk *b;
+    unsigned long block;
+    int count;
+    int want;
+    int i;
+    int j;
+
+    if (nblocks <= 0 || start + nblocks > cache->card_blocks) {
+        return -1;
+    }
+
+    /* Grow the window while the reads follow on from each other */
+    if (start == cache->next_block) {
+        cache->ra_blocks = MIN(MAX(cache->ra_blocks * 2, MMC_CACHE_RA_MIN),
+                               MMC_CACHE_RA_MAX);
+    } else {
+        cache->ra_blocks = 0;
+    }
+    cache->next_block = start + nblocks;
+
+    for (i = 0; i < nblocks;) {
+        block = start + i;
+        b = cache_lookup(cache, block);
+        if (b != NULL) {
+            memcpy(buf + i * cache->bsize, b->vbuf, cache->bsize);
+            cache_touch(cache, b);
+            cache->stats.hits++;
+            i++;
+            continue;
+        }
+
+        /* Gather the run of missing blocks */
+        for (want = 1; i + want < nblocks && want < MMC_CACHE_MAX_RUN; want++) {
+            if (cache_lookup(cache, block + want)) {
+                break;
+            }
+        }
+        count = want;
+        if (i + want == nblocks) {
+            while (count < want + cache->ra_blocks && count < MMC_CACHE_MAX_RUN &&
+                   block + count < cache->card_blocks &&
+                   !cache_lookup(cache, block + count)) {
+                count++;
+            }
+        }
+
+        if (cache_fill(cache, block, count)) {
+            return -1;
+        }
+        for (j = 0; j < want; j++) {
+            memcpy(buf + (i + j) * cache->bsize, run[j]->vbuf, cache->bsize);
+        }
+        /* Read-ahead blocks have not been used yet */
+        for (j = want; j < count; j++) {
+            lru_unlink(cache, run[j]);
+            lru_push_tail(cache, run[j]);
+        }
+        cache->stats.misses += want;
+        cache->stats.readahead += count - want;
+        i += want;
+    }
+
+    return nblocks * cache->bsize;
+}
+
+long mmc_cache_write(mmc_cache_t cache, unsigned long start, int nblocks, const void *buf)
+{
+    struct mmc_cache_blk *b;
+    int i;
+
+    if (nblocks <= 0 || start + nblocks > cache->card_blocks) {
+        return -1;
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        b = cache_lookup(cache, start + i);
+        if (b == NULL) {
+            /* Whole blocks, so there is nothing to read first */
+            b = cache_alloc(cache, start + i);
+            if (b == NULL) {
+                return -1;
+            }
+        } else {
+            cache_touch(cache, b);
+        }
+        memcpy(b->vbuf, buf + i * cache->bsize, cache->bsize);
+        if (!b->dirty) {
+            b->dirty = 1;
+            cache->ndirty++;
+        }
+    }
+
+    if (cache->ndirty > MMC_CACHE_DIRTY_HIGH(cache->nblks)) {
+        if (mmc_cache_flush(cache)) {
+            return -1;
+        }
+    }
+    return nblocks * cache->bsize;
+}
+
+int mmc_cache_flush(mmc_cache_t cache)
+{
+    struct mmc_cache_blk **sorted = cache->sorted;
+    int ndirty = 0;
+    int first;
+    int i;
+
+    if (!cache->ndirty) {
+        return 0;
+    }
+    for (i = 0; i < cache->nblks; i++) {
+        if (cache->blks[i].dirty) {
+            sorted[ndirty++] = &cache->blks[i];
+        }
+    }
+    qsort(sorted, ndirty, sizeof(*sorted), &blk_cmp);
+
+    /* Coalesce consecutive blocks into one write */
+    for (first = 0, i = 1; i <= ndirty; i++) {
+        if (i == ndirty || i - first == MMC_CACHE_MAX_RUN ||
+            sorted[i]->block != sorted[i - 1]->block + 1) {
+            if (cache_write_run(cache, &sorted[first], i - first)) {
+                return -1;
+            }
+            first = i;
+        }
+    }
+    return 0;
+}
+
+int mmc_cache_barrier(mmc_cache_t cache)
+{
+    /* Write backs on eviction go in LRU order, so everything goes now */
+    if (mmc_cache_flush(cache)) {
+        return -1;
+    }
+    return mmc_wait_ready(cache->card);
+}
+
+void mmc_cache_get_stats(mmc_cache_t cache, struct mmc_cache_stats *stats)
+{
+    *stats = cache->stats;
+}
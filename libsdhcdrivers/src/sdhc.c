@@ -49,6 +49,8 @@
 #define BLK_ATT_BLKCNT_MASK     0xFFFF    //Blocks Count For Current Transfer
 #define BLK_ATT_BLKSIZE_SHF     0         //Transfer Block Size
 #define BLK_ATT_BLKSIZE_MASK    0xFFF     //Transfer Block Size
+#define BLK_ATT_SDMABUF_SHF     12        //SDMA Buffer Boundary
+#define BLK_ATT_SDMABUF_512K    0x7       //SDMA Buffer Boundary, 4KiB << 7
 
 /* Command Transfer Type Register */
 #define CMD_XFR_TYP_CMDINX_SHF  24        //Command Index
@@ -113,18 +115,50 @@
 #define HOST_CTRL_CAP_MBL_SHF   16        //Max Block Length
 #define HOST_CTRL_CAP_MBL_MASK  0x3       //Max Block Length
 
+/* Vendor Specific Register */
+#define VEND_SPEC_VSELECT       (1 << 1)  //Signal voltage 1.8V  (only IMX6)
+
+/* Protocol Control Register */
+#define PROT_CTRL_DMASEL_SHF    8         //DMA Select
+#define PROT_CTRL_DMASEL_SHF_V2 3         //DMA Select (SDHC 2.00 layout)
+#define PROT_CTRL_DMASEL_MASK   0x3       //DMA Select
+#define PROT_CTRL_DMASEL_SDMA   0x0
+#define PROT_CTRL_DMASEL_ADMA2  0x2
+#define PROT_CTRL_DTW_SHF       1         //Data Transfer Width
+#define PROT_CTRL_DTW_MASK      0x3       //Data Transfer Width
+#define PROT_CTRL_HISPD_V2      (1 << 2)  //High Speed Enable   (SDHC 2.00)
+#define PROT_CTRL_EDTW_V2       (1 << 5)  //8-bit Data Width    (SDHC 2.00)
+
 /* Mixer Control Register */
+#define MIX_CTRL_FBCLK_SEL      (1 << 25) //Feedback Clock Source Selection
+#define MIX_CTRL_SMP_CLK_SEL    (1 << 23) //Tuned Clock or Fixed Clock for Sampling
+#define MIX_CTRL_EXE_TUNE       (1 << 22) //Execute Tuning
 #define MIX_CTRL_MSBSEL         (1 << 5)  //Multi/Single Block Select.
 #define MIX_CTRL_DTDSEL         (1 << 4)  //Data Transfer Direction Select.
 #define MIX_CTRL_DDR_EN         (1 << 3)  //Dual Data Rate mode selection
 #define MIX_CTRL_AC12EN         (1 << 2)  //Auto CMD12 Enable
 #define MIX_CTRL_BCEN           (1 << 1)  //Block Count Enable
 #define MIX_CTRL_DMAEN          (1 << 0)  //DMA Enable
+#define MIX_CTRL_XFER_MASK      (MIX_CTRL_MSBSEL | MIX_CTRL_DTDSEL | MIX_CTRL_AC12EN \
+                                 | MIX_CTRL_BCEN | MIX_CTRL_DMAEN)
+
+/* Clock Tuning Control and Status Register */
+#define CLK_TUNE_DLY_CELL_SET_PRE_SHF  8  //Delay cells on the feedback clock
+#define CLK_TUNE_DLY_CELL_MAX          0x7F
 
 /* Watermark Level register */
 #define WTMK_LVL_WR_WML_SHF     16        //Write Watermark Level
 #define WTMK_LVL_RD_WML_SHF     0         //Read  Watermark Level
 
+/* ADMA2 descriptor attributes */
+#define ADMA2_VALID             (1 << 0)
+#define ADMA2_END               (1 << 1)
+#define ADMA2_INT               (1 << 2)
+#define ADMA2_ACT_TRAN          (0x2 << 4)
+#define ADMA2_ACT_LINK          (0x3 << 4)
+/* Word aligned, so that every descriptor but the last is a whole word */
+#define ADMA2_MAX_LEN           0xFFFC
+
 #define writel(v, a)  (*(volatile uint32_t*)(a) = (v))
 #define readl(a)      (*(volatile uint32_t*)(a))
 
@@ -170,7 +204,9 @@ typedef enum {
 
 typedef enum {
     CLOCK_INITIAL = 0,
-    CLOCK_OPERATIONAL
+    CLOCK_OPERATIONAL,
+    CLOCK_HIGH_SPEED,
+    CLOCK_HS200
 } clock_mode;
 
 typedef enum {
@@ -198,13 +234,29 @@ static inline enum dma_mode get_dma_mode(struct sdhc *host, struct mmc_cmd *cmd)
     if (cmd->data == NULL) {
         return DMA_MODE_NONE;
     }
+    /* ADMA2 if we have a descriptor table, it needs no boundary interrupts */
+    if (host->adma_desc && (cmd->data->sg || cmd->data->pbuf)) {
+        return DMA_MODE_ADMA;
+    }
     if (cmd->data->pbuf == 0) {
         return DMA_MODE_NONE;
     }
-    /* Currently only SDMA supported */
     return DMA_MODE_SDMA;
 }
 
+/* Everything with a data stage is read, unless it is a block write */
+static inline int cmd_is_write(struct mmc_cmd *cmd)
+{
+    return cmd->index == MMC_WRITE_BLOCK || cmd->index == MMC_WRITE_MULTIPLE_BLOCK
+           || cmd->index == MMC_EXECUTE_WRITE_TASK;
+}
+
+/* Open ended multi block transfers are stopped by the host with CMD12 */
+static inline int cmd_needs_stop(struct mmc_cmd *cmd)
+{
+    return cmd->index == MMC_READ_MULTIPLE_BLOCK || cmd->index == MMC_WRITE_MULTIPLE_BLOCK;
+}
+
 static inline int cap_sdma_supported(struct sdhc *host)
 {
     uint32_t v;
@@ -212,6 +264,13 @@ static inline int cap_sdma_supported(struct sdhc *host)
     return !!(v & HOST_CTRL_CAP_DMAS);
 }
 
+static inline int cap_adma_supported(struct sdhc *host)
+{
+    uint32_t v;
+    v = readl(host->base + HOST_CTRL_CAP);
+    return !!(v & HOST_CTRL_CAP_ADMAS);
+}
+
 static inline int cap_max_buffer_size(struct sdhc *host)
 {
     uint32_t v;
@@ -220,27 +279,152 @@ static inline int cap_max_buffer_size(struct sdhc *host)
     return 512 << v;
 }
 
+/* Number of descriptors a segment needs, or -1 if ADMA2 cannot reach it */
+static int adma_seg_ndesc(uintptr_t pbuf, size_t len)
+{
+    if (pbuf & 0x3) {
+        ZF_LOGE("ADMA2 segment at %p is not word aligned", (void *)pbuf);
+        return -1;
+    }
+    return (len + ADMA2_MAX_LEN - 1) / ADMA2_MAX_LEN;
+}
+
+/* Check that a transfer fits in the descriptor table */
+static int adma_check(struct mmc_data *data)
+{
+    int n = 0;
+    int ret;
+    int i;
+
+    if (data->sg) {
+        for (i = 0; i < data->nsg; i++) {
+            ret = adma_seg_ndesc(data->sg[i].pbuf, data->sg[i].len);
+            if (ret < 0) {
+                return -1;
+            }
+            n += ret;
+        }
+    } else {
+        n = adma_seg_ndesc(data->pbuf, data->block_size * data->blocks);
+    }
+    if (n <= 0 || n > SDHC_ADMA_NDESC) {
+        ZF_LOGE("Transfer needs %d ADMA2 descriptors", n);
+        return -1;
+    }
+    return 0;
+}
+
+/* Add descriptors for one physically contiguous segment */
+static int adma_add_seg(sdhc_dev_t host, int n, uintptr_t pbuf, size_t len)
+{
+    volatile struct sdhc_adma2_desc *d;
+    size_t l;
+
+    while (len) {
+        l = MIN(len, ADMA2_MAX_LEN);
+        d = &host->adma_desc[n++];
+        d->addr = pbuf;
+        d->len = l;
+        d->attr = ADMA2_VALID | ADMA2_ACT_TRAN;
+        pbuf += l;
+        len -= l;
+    }
+    return n;
+}
+
+/*
+ * Fill the descriptor table for the transfer at the head of the queue. The
+ * table is shared by all commands, so this is done as the command is issued.
+ */
+static void adma_build(sdhc_dev_t host, struct mmc_data *data)
+{
+    int n = 0;
+    int i;
+
+    if (data->sg) {
+        for (i = 0; i < data->nsg; i++) {
+            n = adma_add_seg(host, n, data->sg[i].pbuf, data->sg[i].len);
+        }
+    } else {
+        n = adma_add_seg(host, n, data->pbuf, data->block_size * data->blocks);
+    }
+    host->adma_desc[n - 1].attr |= ADMA2_END;
+    /* The table must be visible before the controller is started */
+    __sync_synchronize();
+}
+
+/* Select SDMA or ADMA2 for the next transfer */
+static void sdhc_set_dma_sel(sdhc_dev_t host, int sel)
+{
+    int shf = (host->version == 2) ? PROT_CTRL_DMASEL_SHF_V2 : PROT_CTRL_DMASEL_SHF;
+    uint32_t val;
+
+    val = readl(host->base + PROT_CTRL);
+    val &= ~(PROT_CTRL_DMASEL_MASK << shf);
+    val |= sel << shf;
+    writel(val, host->base + PROT_CTRL);
+}
+
+/* Recover the command and data lines after a failed command */
+static void sdhc_reset_lines(sdhc_dev_t host)
+{
+    uint32_t val;
+
+    val = readl(host->base + SYS_CTRL);
+    writel(val | SYS_CTRL_RSTC | SYS_CTRL_RSTD, host->base + SYS_CTRL);
+    while (readl(host->base + SYS_CTRL) & (SYS_CTRL_RSTC | SYS_CTRL_RSTD));
+}
+
+/* Commands with a busy signal complete on TC, not CC */
+static inline int cmd_has_busy(struct mmc_cmd *cmd)
+{
+    return cmd->rsp_type == MMC_RSP_TYPE_R1b || cmd->rsp_type == MMC_RSP_TYPE_R5b;
+}
+
+/**
+ * Issue the command at the head of the queue. This is called from the IRQ
+ * handler as the previous command completes, so it never waits for the
+ * lines; if they are still inhibited the command stays at the head and is
+ * issued on the next call to the IRQ handler. A command completes on CC,
+ * which the controller raises once it has released CMD, or on TC, raised
+ * once DAT is released, so the lines are normally free by then.
+ * @return 0 if the command was issued
+ */
 static int sdhc_next_cmd(sdhc_dev_t host)
 {
     struct mmc_cmd *cmd = host->cmd_list_head;
     uint32_t val;
+    uint32_t val2;
     uint32_t mix_ctrl;
 
+    /* Check if the Host is ready for transit. */
+    val = SDHC_PRES_STATE_CIHB;
+    if (cmd->data || cmd_has_busy(cmd)) {
+        val |= SDHC_PRES_STATE_CDIHB;
+    }
+    if (readl(host->base + PRES_STATE) & val) {
+        ZF_LOGD("Lines busy, deferring CMD%d", cmd->index);
+        return 1;
+    }
+
     /* Enable IRQs */
     val = (INT_STATUS_ADMAE | INT_STATUS_OVRCURE | INT_STATUS_DEBE
            | INT_STATUS_DCE   | INT_STATUS_DTOE    | INT_STATUS_CRM
            | INT_STATUS_CINS  | INT_STATUS_CIE     | INT_STATUS_CEBE
            | INT_STATUS_CCE   | INT_STATUS_CTOE    | INT_STATUS_TC
            | INT_STATUS_CC);
-    if (get_dma_mode(host, cmd) == DMA_MODE_NONE) {
+    switch (get_dma_mode(host, cmd)) {
+    case DMA_MODE_NONE:
         val |= INT_STATUS_BRR | INT_STATUS_BWR;
+        break;
+    case DMA_MODE_SDMA:
+        val |= INT_STATUS_DINT;
+        break;
+    default:
+        break;
     }
     writel(val, host->base + INT_STATUS_EN);
 
-    /* Check if the Host is ready for transit. */
-    while (readl(host->base + PRES_STATE) & (SDHC_PRES_STATE_CIHB | SDHC_PRES_STATE_CDIHB));
-    while (readl(host->base + PRES_STATE) & SDHC_PRES_STATE_DLA);
-
     /* Two commands need to have at least 8 clock cycles in between.
      * Lets assume that the hcd will enforce this. */
     //udelay(1000);
@@ -256,8 +440,9 @@ static int sdhc_next_cmd(sdhc_dev_t host)
         val |= 0xE << 16;
         writel(val, host->base + SYS_CTRL);
 
-        /* Set the DMA boundary. */
+        /* Set the block size, count and SDMA boundary. */
         val = (cmd->data->block_size & BLK_ATT_BLKSIZE_MASK);
+        val |= (BLK_ATT_SDMABUF_512K << BLK_ATT_SDMABUF_SHF);
         val |= (cmd->data->blocks << BLK_ATT_BLKCNT_SHF);
         writel(val, host->base + BLK_ATT);
 
@@ -266,10 +451,10 @@ static int sdhc_next_cmd(sdhc_dev_t host)
         if (val > 0x80) {
             val = 0x80;
         }
-        if (cmd->index == MMC_READ_SINGLE_BLOCK) {
-            val = (val << WTMK_LVL_RD_WML_SHF);
-        } else {
+        if (cmd_is_write(cmd)) {
             val = (val << WTMK_LVL_WR_WML_SHF);
+        } else {
+            val = (val << WTMK_LVL_RD_WML_SHF);
         }
         writel(val, host->base + WTMK_LVL);
 
@@ -278,16 +463,29 @@ static int sdhc_next_cmd(sdhc_dev_t host)
         if (cmd->data->blocks > 1) {
             mix_ctrl |= MIX_CTRL_MSBSEL;
         }
-        if (cmd->index == MMC_READ_SINGLE_BLOCK) {
+        if (cmd_needs_stop(cmd)) {
+            mix_ctrl |= MIX_CTRL_AC12EN;
+        }
+        if (!cmd_is_write(cmd)) {
             mix_ctrl |= MIX_CTRL_DTDSEL;
         }
 
         /* Configure DMA */
-        if (get_dma_mode(host, cmd) != DMA_MODE_NONE) {
-            /* Enable DMA */
+        switch (get_dma_mode(host, cmd)) {
+        case DMA_MODE_ADMA:
+            mix_ctrl |= MIX_CTRL_DMAEN;
+            adma_build(host, cmd->data);
+            sdhc_set_dma_sel(host, PROT_CTRL_DMASEL_ADMA2);
+            writel(host->adma_pdesc, host->base + ADMA_SYS_ADDR);
+            break;
+        case DMA_MODE_SDMA:
             mix_ctrl |= MIX_CTRL_DMAEN;
+            sdhc_set_dma_sel(host, PROT_CTRL_DMASEL_SDMA);
             /* Set DMA address */
             writel(cmd->data->pbuf, host->base + DS_ADDR);
+            break;
+        default:
+            break;
         }
         /* Record the number of blocks to be sent */
         host->blocks_remaining = cmd->data->blocks;
@@ -301,7 +499,9 @@ static int sdhc_next_cmd(sdhc_dev_t host)
             /* Some controllers implement MIX_CTRL as part of the XFR_TYP */
             val |= mix_ctrl;
         } else {
-            writel(mix_ctrl, host->base + MIX_CTRL);
+            /* The upper bits hold the timing and tuning state */
+            val2 = readl(host->base + MIX_CTRL) & ~MIX_CTRL_XFER_MASK;
+            writel(val2 | mix_ctrl, host->base + MIX_CTRL);
         }
     }
 
@@ -341,6 +541,7 @@ static int sdhc_next_cmd(sdhc_dev_t host)
 
     /* Issue the command. */
     writel(val, host->base + CMD_XFR_TYP);
+    host->cmd_issued = 1;
     return 0;
 }
 
@@ -357,9 +558,13 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
     uint32_t int_status;
 
     int_status = readl(host->base + INT_STATUS);
-    if (!cmd) {
-        /* Clear flags */
+    if (!cmd || !host->cmd_issued) {
+        /* Clear flags, nothing is in flight that they could belong to */
         writel(int_status, host->base + INT_STATUS);
+        /* The head of the queue may be waiting for the lines to be released */
+        if (cmd) {
+            sdhc_next_cmd(host);
+        }
         return 0;
     }
     /** Handle errors **/
@@ -434,7 +639,14 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
         ZF_LOGD("Card insertion");
     }
     if (int_status & INT_STATUS_DINT) {
+        /*
+         * SDMA stopped at a buffer boundary. DS_ADDR holds the address it
+         * got to, writing it back restarts the transfer from there.
+         */
         ZF_LOGD("DMA interrupt");
+        if (cmd->data && get_dma_mode(host, cmd) == DMA_MODE_SDMA) {
+            writel(readl(host->base + DS_ADDR), host->base + DS_ADDR);
+        }
     }
     if (int_status & INT_STATUS_BGE) {
         ZF_LOGD("Block gap event");
@@ -463,9 +675,8 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
             cmd->response[0] = readl(host->base + CMD_RSP0);
         }
 
-        /* If there is no data segment, the transfer is complete */
-        if (cmd->data == NULL) {
-            assert(cmd->complete == 0);
+        /* If there is no data segment or busy, the transfer is complete */
+        if (cmd->data == NULL && !cmd_has_busy(cmd) && cmd->complete == 0) {
             cmd->complete = 1;
         }
     }
@@ -478,7 +689,8 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
         assert(cmd->complete == 0);
         if (host->blocks_remaining) {
             io_buf = (volatile uint32_t *)((void *)host->base + DATA_BUFF_ACC_PORT);
-            usr_buf = (uint32_t *)cmd->data->vbuf;
+            usr_buf = (uint32_t *)(cmd->data->vbuf + cmd->data->block_size
+                                   * (cmd->data->blocks - host->blocks_remaining));
             if (int_status & INT_STATUS_BRR) {
                 /* Buffer Read Ready */
                 int i;
@@ -495,9 +707,8 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
             host->blocks_remaining--;
         }
     }
-    /* Data complete */
-    if (int_status & INT_STATUS_TC) {
-        assert(cmd->complete == 0);
+    /* Data complete, or the card released busy */
+    if ((int_status & INT_STATUS_TC) && cmd->complete == 0) {
         cmd->complete = 1;
     }
     /* Clear flags */
@@ -505,6 +716,12 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
 
     /* If the transaction has finished */
     if (cmd != NULL && cmd->complete != 0) {
+        /* Do not let an error hold up the rest of the queue */
+        if (cmd->complete < 0) {
+            sdhc_reset_lines(host);
+        }
+        /* Start the next command before running the call back */
+        host->cmd_issued = 0;
         if (cmd->next == NULL) {
             /* Shutdown */
             host->cmd_list_head = NULL;
@@ -517,7 +734,7 @@ static int sdhc_handle_irq(sdio_host_dev_t *sdio, int irq UNUSED)
         cmd->next = NULL;
         /* Send callback if required */
         if (cmd->cb) {
-            cmd->cb(sdio, 0, cmd, cmd->token);
+            cmd->cb(sdio, (cmd->complete < 0) ? -1 : 0, cmd, cmd->token);
         }
     }
 
@@ -529,17 +746,39 @@ static int sdhc_is_voltage_compatible(sdio_host_dev_t *sdio, int mv)
     uint32_t val;
     sdhc_dev_t host = sdio_get_sdhc(sdio);
     val = readl(host->base + HOST_CTRL_CAP);
-    if (mv == 3300 && (val & HOST_CTRL_CAP_VS33)) {
-        return 1;
-    } else {
+    switch (mv) {
+    case 3300:
+        return !!(val & HOST_CTRL_CAP_VS33);
+    case 1800:
+        return !!(val & HOST_CTRL_CAP_VS18);
+    default:
         return 0;
     }
 }
 
+/* The driver never switches the signal voltage, the board or boot loader picks it */
+static int sdhc_get_signal_voltage(sdio_host_dev_t *sdio)
+{
+    sdhc_dev_t host = sdio_get_sdhc(sdio);
+
+    if (host->version == 2) {
+        return 3300;
+    }
+    return (readl(host->base + VEND_SPEC) & VEND_SPEC_VSELECT) ? 1800 : 3300;
+}
+
 static int sdhc_send_cmd(sdio_host_dev_t *sdio, struct mmc_cmd *cmd, sdio_cb cb, void *token)
 {
     sdhc_dev_t host = sdio_get_sdhc(sdio);
-    int ret;
+
+    /* Reject transfers the DMA engine can not describe before queueing */
+    if (cmd->data && cmd->data->sg && get_dma_mode(host, cmd) != DMA_MODE_ADMA) {
+        ZF_LOGE("Scatter-gather transfers need ADMA2");
+        return -1;
+    }
+    if (get_dma_mode(host, cmd) == DMA_MODE_ADMA && adma_check(cmd->data)) {
+        return -1;
+    }
 
     /* Initialise callbacks */
     cmd->complete = 0;
@@ -550,12 +789,9 @@ static int sdhc_send_cmd(sdio_host_dev_t *sdio, struct mmc_cmd *cmd, sdio_cb cb,
     *host->cmd_list_tail = cmd;
     host->cmd_list_tail = &cmd->next;
 
-    /* If idle, bump */
+    /* If idle, bump. A busy bus is retried from the IRQ handler */
     if (host->cmd_list_head == cmd) {
-        ret = sdhc_next_cmd(host);
-        if (ret) {
-            return ret;
-        }
+        sdhc_next_cmd(host);
     }
 
     /* finalise the transacton */
@@ -618,6 +854,7 @@ static int sdhc_set_clock_div(
         val |= (dvs_div << SYS_CTRL_DVS_SHF);
 
         /* Set data timeout value */
+        val &= ~(SYS_CTRL_DTOCV_MASK << SYS_CTRL_DTOCV_SHF);
         val |= (dtocv << SYS_CTRL_DTOCV_SHF);
         writel(val, base_addr + SYS_CTRL);
     } else {
@@ -651,6 +888,14 @@ static int sdhc_set_clock(volatile void *base_addr, clock_mode clk_mode)
         /* Divide the base clock by 8 */
         rslt = sdhc_set_clock_div(base_addr, DIV_4, PRESCALER_2, SDCLK_TIMES_2_POW_29);
         break;
+    case CLOCK_HIGH_SPEED:
+        /* Divide the base clock by 4 */
+        rslt = sdhc_set_clock_div(base_addr, DIV_2, PRESCALER_2, SDCLK_TIMES_2_POW_29);
+        break;
+    case CLOCK_HS200:
+        /* Run from the base clock */
+        rslt = sdhc_set_clock_div(base_addr, DIV_1, PRESCALER_1, SDCLK_TIMES_2_POW_29);
+        break;
     default:
         ZF_LOGE("Unsupported clock mode setting");
         rslt = -1;
@@ -684,7 +929,8 @@ static int sdhc_reset(sdio_host_dev_t *sdio)
            | INT_STATUS_DCE   | INT_STATUS_DTOE    | INT_STATUS_CRM
            | INT_STATUS_CINS  | INT_STATUS_BRR     | INT_STATUS_BWR
            | INT_STATUS_CIE   | INT_STATUS_CEBE    | INT_STATUS_CCE
-           | INT_STATUS_CTOE  | INT_STATUS_TC      | INT_STATUS_CC);
+           | INT_STATUS_CTOE  | INT_STATUS_TC      | INT_STATUS_CC
+           | INT_STATUS_DINT);
     writel(val, host->base + INT_STATUS_EN);
     writel(val, host->base + INT_SIGNAL_EN);
 
@@ -750,6 +996,140 @@ static int sdhc_set_operational(struct sdio_host_dev *sdio)
     return sdhc_set_clock(host->base, CLOCK_OPERATIONAL);
 }
 
+static int sdhc_set_bus_width(sdio_host_dev_t *sdio, int width)
+{
+    sdhc_dev_t host = sdio_get_sdhc(sdio);
+    uint32_t val;
+
+    val = readl(host->base + PROT_CTRL);
+    val &= ~(PROT_CTRL_DTW_MASK << PROT_CTRL_DTW_SHF);
+    if (host->version == 2) {
+        val &= ~PROT_CTRL_EDTW_V2;
+    }
+    switch (width) {
+    case 1:
+        break;
+    case 4:
+        val |= MMC_MODE_4BIT;
+        break;
+    case 8:
+        val |= (host->version == 2) ? PROT_CTRL_EDTW_V2 : MMC_MODE_8BIT;
+        break;
+    default:
+        ZF_LOGE("Unsupported bus width %d", width);
+        return -1;
+    }
+    writel(val, host->base + PROT_CTRL);
+    return 0;
+}
+
+static int sdhc_set_timing(sdio_host_dev_t *sdio, enum sdio_timing timing)
+{
+    sdhc_dev_t host = sdio_get_sdhc(sdio);
+    uint32_t val;
+
+    /* SDHC 2.00 controllers top out at high speed, and need to be told */
+    if (host->version == 2) {
+        if (timing > SDIO_TIMING_HS) {
+            return -1;
+        }
+        val = readl(host->base + PROT_CTRL);
+        if (timing == SDIO_TIMING_HS) {
+            val |= PROT_CTRL_HISPD_V2;
+        } else {
+            val &= ~PROT_CTRL_HISPD_V2;
+        }
+        writel(val, host->base + PROT_CTRL);
+    }
+
+    switch (timing) {
+    case SDIO_TIMING_LEGACY:
+        return sdhc_set_clock(host->base, CLOCK_OPERATIONAL);
+    case SDIO_TIMING_HS:
+        return sdhc_set_clock(host->base, CLOCK_HIGH_SPEED);
+    case SDIO_TIMING_HS200:
+        return sdhc_set_clock(host->base, CLOCK_HS200);
+    default:
+        return -1;
+    }
+}
+
+/* Send one tuning block with the feedback clock delayed by dly cells */
+static int sdhc_tuning_try(sdio_host_dev_t *sdio, uint32_t opcode, int width, int dly,
+                           void *buf)
+{
+    sdhc_dev_t host = sdio_get_sdhc(sdio);
+    struct mmc_data data = {
+        .vbuf = buf,
+        .block_size = (width == 8) ? 128 : 64,
+        .blocks = 1,
+    };
+    struct mmc_cmd cmd = {
+        .index = opcode,
+        .rsp_type = MMC_RSP_TYPE_R1,
+        .data = &data,
+    };
+    uint32_t val;
+    int ret;
+
+    val = readl(host->base + MIX_CTRL);
+    val |= MIX_CTRL_EXE_TUNE | MIX_CTRL_SMP_CLK_SEL | MIX_CTRL_FBCLK_SEL;
+    writel(val, host->base + MIX_CTRL);
+    writel(dly << CLK_TUNE_DLY_CELL_SET_PRE_SHF, host->base + CLK_TUNE_CTRL_STATUS);
+
+    ret = sdhc_send_cmd(sdio, &cmd, NULL, NULL);
+    if (ret) {
+        sdhc_reset_lines(host);
+    }
+    return ret;
+}
+
+/*
+ * Manual tuning of the uSDHC: find the window of delay cell settings that
+ * pass the tuning block and sample from the middle of it.
+ */
+static int sdhc_execute_tuning(sdio_host_dev_t *sdio, uint32_t opcode, int width)
+{
+    sdhc_dev_t host = sdio_get_sdhc(sdio);
+    void *buf;
+    uint32_t val;
+    int min, max;
+    int ret;
+
+    if (host->version == 2) {
+        return -1;
+    }
+    buf = malloc(128);
+    if (!buf) {
+        return -1;
+    }
+
+    for (min = 0; min < CLK_TUNE_DLY_CELL_MAX; min++) {
+        if (!sdhc_tuning_try(sdio, opcode, width, min, buf)) {
+            break;
+        }
+    }
+    for (max = min + 1; max < CLK_TUNE_DLY_CELL_MAX; max++) {
+        if (sdhc_tuning_try(sdio, opcode, width, max, buf)) {
+            break;
+        }
+    }
+    max--;
+    ret = sdhc_tuning_try(sdio, opcode, width, (min + max) / 2, buf);
+    ZF_LOGD("Tuning window %d-%d: %s", min, max, ret ? "failed" : "ok");
+
+    /* Stop tuning, but keep sampling with the tuned clock */
+    val = readl(host->base + MIX_CTRL);
+    val &= ~MIX_CTRL_EXE_TUNE;
+    if (ret) {
+        val &= ~MIX_CTRL_SMP_CLK_SEL;
+    }
+    writel(val, host->base + MIX_CTRL);
+
+    free(buf);
+    return ret;
+}
+
 int sdhc_init(void *iobase, const int *irq_table, int nirqs, ps_io_ops_t *io_ops,
               sdio_host_dev_t *dev)
 {
@@ -767,16 +1147,31 @@ int sdhc_init(void *iobase, const int *irq_table, int nirqs, ps_io_ops_t *io_ops
     sdhc->dalloc = &io_ops->dma_manager;
     sdhc->cmd_list_head = NULL;
     sdhc->cmd_list_tail = &sdhc->cmd_list_head;
+    sdhc->cmd_issued = 0;
     sdhc->version = ((readl(sdhc->base + HOST_VERSION) >> 16) & 0xff) + 1;
     ZF_LOGD("SDHC version %d.00", sdhc->version);
+    /* One ADMA2 descriptor table for the life of the host */
+    sdhc->adma_desc = NULL;
+    if (cap_adma_supported(sdhc)) {
+        sdhc->adma_desc = ps_dma_alloc_pinned(sdhc->dalloc,
+                                              sizeof(*sdhc->adma_desc) * SDHC_ADMA_NDESC,
+                                              4096, 0, PS_MEM_NORMAL, &sdhc->adma_pdesc);
+        if (!sdhc->adma_desc) {
+            ZF_LOGW("No DMA memory for ADMA2 descriptors, using SDMA");
+        }
+    }
     /* Initialise SDIO structure */
     dev->handle_irq = &sdhc_handle_irq;
     dev->nth_irq = &sdhc_get_nth_irq;
     dev->send_command = &sdhc_send_cmd;
     dev->is_voltage_compatible = &sdhc_is_voltage_compatible;
+    dev->get_signal_voltage = &sdhc_get_signal_voltage;
     dev->reset = &sdhc_reset;
     dev->set_operational = &sdhc_set_operational;
     dev->get_present_state = &sdhc_get_present_state_register;
+    dev->set_bus_width = &sdhc_set_bus_width;
+    dev->set_timing = &sdhc_set_timing;
+    dev->execute_tuning = &sdhc_execute_tuning;
     dev->priv = sdhc;
     /* Clear IRQs */
     writel(0, sdhc->base + INT_STATUS_EN);
@@ -9,6 +9,15 @@
 #include <platsupport/io.h>
 #include <sdhc/sdio.h>
 
+/* Descriptors in the ADMA2 table, one page */
+#define SDHC_ADMA_NDESC 512
+
+struct sdhc_adma2_desc {
+    uint16_t attr;
+    uint16_t len;
+    uint32_t addr;
+};
+
 struct sdhc {
     /* Device data */
     volatile void *base;
@@ -18,7 +27,11 @@ struct sdhc {
     /* Transaction queue */
     struct mmc_cmd *cmd_list_head;
     struct mmc_cmd **cmd_list_tail;
+    int cmd_issued;
     int blocks_remaining;
+    /* ADMA2 descriptor table, NULL if not supported */
+    volatile struct sdhc_adma2_desc *adma_desc;
+    uintptr_t adma_pdesc;
     /* DMA allocator */
     ps_dma_man_t *dalloc;
 };
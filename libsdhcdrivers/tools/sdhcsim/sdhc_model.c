@@ -0,0 +1,978 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * uSDHC controller model.
+ *
+ * The register window lives in a memfd that is mapped twice: without access
+ * rights for the driver and read/write for the model. Any access from the
+ * driver faults. The fault handler runs the read side effects, opens the
+ * window and single steps the access with the trap flag. The trap handler
+ * closes the window again and, for a store, puts back the old value and
+ * applies the new one with the register's semantics.
+ *
+ * There is one command or data stage in flight at a time, so the pending
+ * work is a single timed event: the response, the next data block, the
+ * auto CMD12 or the end of the card's busy period.
+ */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <platsupport/io.h>
+#include <sdhc/sdio.h>
+#include <utils/util.h>
+
+#include "sdhc_model.h"
+
+#define REG_SIZE              0x1000
+
+/* Registers, as in src/sdhc.c */
+#define DS_ADDR               0x00
+#define BLK_ATT               0x04
+#define CMD_ARG               0x08
+#define CMD_XFR_TYP           0x0C
+#define CMD_RSP0              0x10
+#define CMD_RSP1              0x14
+#define CMD_RSP2              0x18
+#define CMD_RSP3              0x1C
+#define DATA_BUFF_ACC_PORT    0x20
+#define PRES_STATE            0x24
+#define PROT_CTRL             0x28
+#define SYS_CTRL              0x2C
+#define INT_STATUS            0x30
+#define INT_STATUS_EN         0x34
+#define INT_SIGNAL_EN         0x38
+#define HOST_CTRL_CAP         0x40
+#define WTMK_LVL              0x44
+#define MIX_CTRL              0x48
+#define ADMA_SYS_ADDR         0x58
+#define CLK_TUNE_CTRL_STATUS  0x68
+#define VEND_SPEC             0xC0
+#define HOST_VERSION          0xFC
+
+#define CMD_XFR_TYP_DPSEL     BIT(21)
+#define SYS_CTRL_INITA        BIT(27)
+#define SYS_CTRL_RSTD         BIT(26)
+#define SYS_CTRL_RSTC         BIT(25)
+#define SYS_CTRL_RSTA         BIT(24)
+#define SYS_CTRL_CLK_INT_EN   BIT(0)
+#define SYS_CTRL_CLK_STABLE   BIT(1)
+
+#define INT_DMAE              BIT(28)
+#define INT_AC12E             BIT(24)
+#define INT_DEBE              BIT(22)
+#define INT_DCE               BIT(21)
+#define INT_DTOE              BIT(20)
+#define INT_CTOE              BIT(16)
+#define INT_BRR               BIT(5)
+#define INT_BWR               BIT(4)
+#define INT_DINT              BIT(3)
+#define INT_TC                BIT(1)
+#define INT_CC                BIT(0)
+#define INT_ERRORS            0xffff0000
+
+#define CAP_VS18              BIT(26)
+#define CAP_VS33              BIT(24)
+#define CAP_VS30              BIT(25)
+#define CAP_DMAS              BIT(22)
+#define CAP_HSS               BIT(21)
+#define CAP_ADMAS             BIT(20)
+#define CAP_MBL_4096          (3 << 16)
+
+#define VEND_SPEC_VSELECT     BIT(1)
+
+#define MIX_SMP_CLK_SEL       BIT(23)
+#define MIX_MSBSEL            BIT(5)
+#define MIX_DTDSEL            BIT(4)
+#define MIX_AC12EN            BIT(2)
+#define MIX_BCEN              BIT(1)
+#define MIX_DMAEN             BIT(0)
+
+#define ADMA2_VALID           BIT(0)
+#define ADMA2_END             BIT(1)
+#define ADMA2_ACT_MASK        (0x3 << 4)
+#define ADMA2_ACT_TRAN        (0x2 << 4)
+#define ADMA2_ACT_LINK        (0x3 << 4)
+#define ADMA2_MAX_LINKS       64
+
+/* Lines idle, card present and writable, clock stable */
+#define PRES_IDLE             (SDHC_PRES_STATE_DAT3 | SDHC_PRES_STATE_DAT2 \
+                               | SDHC_PRES_STATE_DAT1 | SDHC_PRES_STATE_DAT0 \
+                               | SDHC_PRES_STATE_WPSPL | SDHC_PRES_STATE_CDPL \
+                               | SDHC_PRES_STATE_CINST | SDHC_PRES_STATE_SDSTB)
+
+/* Reset values of the i.MX6 uSDHC */
+#define HOST_VERSION_RESET    0x00000002
+#define SYS_CTRL_RESET        0x0080800F
+#define PROT_CTRL_RESET       0x08800020
+#define WTMK_LVL_RESET        0x08100810
+#define MIX_CTRL_RESET        0x80000000
+
+#define BASE_CLOCK_HZ         198000000ULL
+#define MAX_BLOCK             4096
+
+/* Bus timing, in card clocks */
+#define CMD_CLOCKS            48
+#define NCR_CLOCKS            16        /* Command to response */
+#define R2_CLOCKS             136
+#define BLOCK_CLOCKS          20        /* Start, CRC, end and CRC status */
+#define INITA_CLOCKS          80
+
+#define DATA_TIMEOUT_NS       100000000ULL
+#define REG_ACCESS_NS         100       /* An uncached device access */
+
+/* Delay cell settings that sample HS200 data correctly */
+#define TUNE_MIN              0x18
+#define TUNE_MAX              0x60
+
+#define TRAP_FLAG             0x100
+/* The driver spins on a status nobody will raise */
+#define STALL_POLLS           1000000
+
+enum phase {
+    PH_IDLE = 0,
+    PH_CMD,             /* Waiting for the response */
+    PH_DATA,            /* Waiting for the next block on the bus */
+    PH_STOP,            /* Waiting for the auto CMD12 response */
+    PH_BUSY,            /* Card holds DAT0 */
+    PH_TIMEOUT,         /* The card never starts the data stage */
+    PH_PIO_READ,        /* Waiting for the driver to drain the buffer */
+    PH_PIO_WRITE,       /* Waiting for the driver to fill the buffer */
+    PH_SDMA_WAIT,       /* Stopped at an SDMA boundary */
+};
+
+enum dma {
+    DMA_NONE = 0,
+    DMA_SDMA,
+    DMA_ADMA,
+};
+
+struct adma2_desc {
+    uint16_t attr;
+    uint16_t len;
+    uint32_t addr;
+};
+
+struct sdhc_model {
+    int fd;
+    int adma;
+    int vs18;
+    volatile uint8_t *drv;              /* Driver's view */
+    volatile uint32_t *regs;            /* Model's view */
+    struct sim_card *card;
+    uintptr_t dma_base;
+    size_t dma_size;
+
+    uint64_t now;
+    enum phase phase;
+    uint64_t ev_time;
+
+    /* Command in flight */
+    uint32_t xfr;
+    int cmd_ret;
+    uint32_t resp[4];
+
+    /* Data stage */
+    int read;
+    enum dma dma;
+    uint32_t blksz;
+    uint32_t nblocks;
+    uint32_t done;
+    int auto_stop;
+    uintptr_t dma_addr;
+    uint32_t sdma_boundary;
+    uintptr_t adma_desc;
+    uintptr_t adma_addr;
+    uint32_t adma_left;
+    int adma_end;
+    uint8_t buf[MAX_BLOCK];
+    uint32_t buf_pos;
+
+    int irq_line;
+    int idle_polls;
+
+    /* Access being single stepped */
+    int stepping;
+    int trap_write;
+    uint32_t trap_off;
+    uint32_t trap_old;
+
+    struct sdhc_model_stats stats;
+};
+
+/* The fault handlers have no context, so there is one model per process */
+static struct sdhc_model *the_model;
+
+static inline uint32_t reg(struct sdhc_model *m, uint32_t off)
+{
+    return m->regs[off / 4];
+}
+
+static inline void reg_set(struct sdhc_model *m, uint32_t off, uint32_t v)
+{
+    m->regs[off / 4] = v;
+}
+
+static void irq_update(struct sdhc_model *m)
+{
+    int line = !!(reg(m, INT_STATUS) & reg(m, INT_SIGNAL_EN));
+
+    if (line && !m->irq_line) {
+        m->stats.irqs++;
+    }
+    m->irq_line = line;
+}
+
+/* Status bits only latch if they are enabled */
+static void status_raise(struct sdhc_model *m, uint32_t bits)
+{
+    if (bits & INT_ERRORS) {
+        m->stats.errors++;
+    }
+    reg_set(m, INT_STATUS, reg(m, INT_STATUS) | (bits & reg(m, INT_STATUS_EN)));
+    irq_update(m);
+}
+
+static void inhibit(struct sdhc_model *m, uint32_t bits)
+{
+    reg_set(m, PRES_STATE, reg(m, PRES_STATE) | bits);
+}
+
+static void release(struct sdhc_model *m, uint32_t bits)
+{
+    reg_set(m, PRES_STATE, reg(m, PRES_STATE) & ~bits);
+}
+
+/*************
+ *** Clock ***
+ *************/
+
+static uint64_t card_clock(struct sdhc_model *m)
+{
+    uint32_t v = reg(m, SYS_CTRL);
+    uint32_t sdclks = (v >> 8) & 0xff;
+    uint32_t dvs = (v >> 4) & 0xf;
+
+    return BASE_CLOCK_HZ / ((sdclks ? sdclks * 2 : 1) * (dvs + 1));
+}
+
+static int bus_width(struct sdhc_model *m)
+{
+    switch ((reg(m, PROT_CTRL) >> 1) & 0x3) {
+    case 1:
+        return 4;
+    case 2:
+        return 8;
+    default:
+        return 1;
+    }
+}
+
+static uint64_t clocks_ns(struct sdhc_model *m, uint64_t clocks)
+{
+    return clocks * 1000000000ULL / card_clock(m);
+}
+
+static uint64_t block_ns(struct sdhc_model *m)
+{
+    return clocks_ns(m, m->blksz * 8 / bus_width(m) + BLOCK_CLOCKS);
+}
+
+/* Above 52MHz data is only sampled correctly with a tuned clock */
+static int sampling_ok(struct sdhc_model *m)
+{
+    uint32_t dly = (reg(m, CLK_TUNE_CTRL_STATUS) >> 8) & 0x7f;
+
+    if (card_clock(m) <= 52000000) {
+        return 1;
+    }
+    return (reg(m, MIX_CTRL) & MIX_SMP_CLK_SEL) && dly >= TUNE_MIN && dly <= TUNE_MAX;
+}
+
+static void schedule(struct sdhc_model *m, enum phase ph, uint64_t delay)
+{
+    m->phase = ph;
+    m->ev_time = m->now + delay;
+}
+
+static int has_event(struct sdhc_model *m)
+{
+    return m->phase >= PH_CMD && m->phase <= PH_TIMEOUT;
+}
+
+static void host_reset(struct sdhc_model *m)
+{
+    int i;
+
+    for (i = 0; i < REG_SIZE / 4; i++) {
+        m->regs[i] = 0;
+    }
+    reg_set(m, HOST_VERSION, HOST_VERSION_RESET);
+    reg_set(m, HOST_CTRL_CAP, CAP_VS18 | CAP_VS33 | CAP_VS30 | CAP_DMAS | CAP_HSS
+            | CAP_MBL_4096 | (m->adma ? CAP_ADMAS : 0));
+    /* Set up by the board, the driver does not switch it */
+    reg_set(m, VEND_SPEC, m->vs18 ? VEND_SPEC_VSELECT : 0);
+    reg_set(m, PRES_STATE, PRES_IDLE);
+    reg_set(m, SYS_CTRL, SYS_CTRL_RESET);
+    reg_set(m, PROT_CTRL, PROT_CTRL_RESET);
+    reg_set(m, WTMK_LVL, WTMK_LVL_RESET);
+    reg_set(m, MIX_CTRL, MIX_CTRL_RESET);
+    m->phase = PH_IDLE;
+    irq_update(m);
+}
+
+/***********
+ *** DMA ***
+ ***********/
+
+static void *dma_ptr(struct sdhc_model *m, uintptr_t pa, size_t len)
+{
+    if (pa < m->dma_base || pa + len > m->dma_base + m->dma_size) {
+        return NULL;
+    }
+    return (void *)pa;
+}
+
+/* Fetch descriptors up to the next transfer */
+static int adma_fetch(struct sdhc_model *m)
+{
+    volatile struct adma2_desc *d;
+    int i;
+
+    for (i = 0; i < ADMA2_MAX_LINKS; i++) {
+        d = dma_ptr(m, m->adma_desc, sizeof(*d));
+        if (!d || !(d->attr & ADMA2_VALID) || m->adma_end) {
+            return -1;
+        }
+        m->stats.adma_descs++;
+        m->adma_end = !!(d->attr & ADMA2_END);
+        switch (d->attr & ADMA2_ACT_MASK) {
+        case ADMA2_ACT_TRAN:
+            m->adma_addr = d->addr;
+            m->adma_left = d->len ? d->len : 0x10000;
+            m->adma_desc += sizeof(*d);
+            return 0;
+        case ADMA2_ACT_LINK:
+            m->adma_desc = d->addr;
+            break;
+        default:
+            m->adma_desc += sizeof(*d);
+            break;
+        }
+    }
+    return -1;
+}
+
+/* Move one block between the buffer and memory */
+static int dma_move(struct sdhc_model *m, int to_mem)
+{
+    uint8_t *buf = m->buf;
+    uint32_t len = m->blksz;
+    uint32_t n;
+    void *p;
+
+    if (m->dma == DMA_SDMA) {
+        p = dma_ptr(m, m->dma_addr, len);
+        if (!p) {
+            return -1;
+        }
+        if (to_mem) {
+            memcpy(p, buf, len);
+        } else {
+            memcpy(buf, p, len);
+        }
+        m->dma_addr += len;
+        return 0;
+    }
+
+    while (len) {
+        if (!m->adma_left && adma_fetch(m)) {
+            return -1;
+        }
+        n = MIN(len, m->adma_left);
+        p = dma_ptr(m, m->adma_addr, n);
+        if (!p) {
+            return -1;
+        }
+        if (to_mem) {
+            memcpy(p, buf, n);
+        } else {
+            memcpy(buf, p, n);
+        }
+        m->adma_addr += n;
+        m->adma_left -= n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*******************
+ *** Data stage ***
+ *******************/
+
+/* The data stage is dead, the driver resets the data line */
+static void data_error(struct sdhc_model *m, uint32_t bits)
+{
+    m->phase = PH_IDLE;
+    release(m, SDHC_PRES_STATE_CDIHB | SDHC_PRES_STATE_DLA);
+    status_raise(m, bits);
+}
+
+static void busy_done(struct sdhc_model *m)
+{
+    m->phase = PH_IDLE;
+    release(m, SDHC_PRES_STATE_CDIHB | SDHC_PRES_STATE_DLA);
+    status_raise(m, INT_TC);
+}
+
+static void wait_busy(struct sdhc_model *m)
+{
+    uint64_t busy = sim_card_busy_ns(m->card);
+
+    if (busy) {
+        schedule(m, PH_BUSY, busy);
+    } else {
+        busy_done(m);
+    }
+}
+
+static void data_end(struct sdhc_model *m)
+{
+    if (m->auto_stop) {
+        schedule(m, PH_STOP, clocks_ns(m, CMD_CLOCKS + NCR_CLOCKS + CMD_CLOCKS));
+    } else {
+        wait_busy(m);
+    }
+}
+
+static void block_done(struct sdhc_model *m)
+{
+    m->done++;
+    m->stats.blocks++;
+    m->stats.bytes += m->blksz;
+
+    if (m->done == m->nblocks) {
+        data_end(m);
+    } else if (m->dma == DMA_SDMA && !(m->dma_addr % m->sdma_boundary)) {
+        /* Pause until the driver writes the next address */
+        reg_set(m, DS_ADDR, m->dma_addr);
+        m->phase = PH_SDMA_WAIT;
+        m->stats.sdma_restarts++;
+        status_raise(m, INT_DINT);
+    } else if (m->dma == DMA_NONE && !m->read) {
+        m->buf_pos = 0;
+        m->phase = PH_PIO_WRITE;
+        status_raise(m, INT_BWR);
+    } else {
+        schedule(m, PH_DATA, block_ns(m));
+    }
+}
+
+/* A block has crossed the bus */
+static void data_block(struct sdhc_model *m)
+{
+    sim_card_set_bus(m->card, bus_width(m), card_clock(m));
+    if (m->read) {
+        if (!sampling_ok(m) || sim_card_read_block(m->card, m->buf, m->blksz)) {
+            data_error(m, INT_DCE);
+            return;
+        }
+        if (m->dma == DMA_NONE) {
+            m->buf_pos = 0;
+            m->phase = PH_PIO_READ;
+            status_raise(m, INT_BRR);
+            return;
+        }
+        if (dma_move(m, 1)) {
+            data_error(m, INT_DMAE);
+            return;
+        }
+    } else {
+        if (m->dma != DMA_NONE && dma_move(m, 0)) {
+            data_error(m, INT_DMAE);
+            return;
+        }
+        if (sim_card_write_block(m->card, m->buf, m->blksz)) {
+            data_error(m, INT_DCE);
+            return;
+        }
+    }
+    block_done(m);
+}
+
+static void data_start(struct sdhc_model *m)
+{
+    uint32_t mix = reg(m, MIX_CTRL);
+    uint32_t blk = reg(m, BLK_ATT);
+    struct sim_data d;
+
+    m->read = !!(mix & MIX_DTDSEL);
+    m->blksz = blk & 0xfff;
+    m->nblocks = (mix & MIX_MSBSEL) ? blk >> 16 : 1;
+    m->done = 0;
+    m->auto_stop = !!(mix & MIX_AC12EN);
+    m->dma = DMA_NONE;
+    m->buf_pos = 0;
+    if (mix & MIX_DMAEN) {
+        switch ((reg(m, PROT_CTRL) >> 8) & 0x3) {
+        case 0:
+            m->dma = DMA_SDMA;
+            m->dma_addr = reg(m, DS_ADDR);
+            /* BLK_ATT[14:12], 4KiB unless the driver asks for more */
+            m->sdma_boundary = 0x1000 << ((blk >> 12) & 0x7);
+            break;
+        case 2:
+            m->dma = DMA_ADMA;
+            m->adma_desc = reg(m, ADMA_SYS_ADDR);
+            m->adma_left = 0;
+            m->adma_end = 0;
+            break;
+        default:
+            m->stats.misuse++;
+            data_error(m, INT_DMAE);
+            return;
+        }
+    }
+    if (!m->blksz || m->blksz % 4 || m->blksz > MAX_BLOCK || !m->nblocks ||
+        ((mix & MIX_MSBSEL) && !(mix & MIX_BCEN))) {
+        m->stats.misuse++;
+        data_error(m, INT_DEBE);
+        return;
+    }
+
+    sim_card_data(m->card, &d);
+    if (d.dir == SIM_DATA_NONE || (d.dir == SIM_DATA_READ) != m->read) {
+        schedule(m, PH_TIMEOUT, DATA_TIMEOUT_NS);
+        return;
+    }
+    inhibit(m, SDHC_PRES_STATE_DLA);
+    if (m->read) {
+        schedule(m, PH_DATA, sim_card_access_ns(m->card) + block_ns(m));
+    } else if (m->dma != DMA_NONE) {
+        schedule(m, PH_DATA, block_ns(m));
+    } else {
+        m->phase = PH_PIO_WRITE;
+        status_raise(m, INT_BWR);
+    }
+}
+
+static void port_read(struct sdhc_model *m)
+{
+    uint32_t w = 0;
+
+    m->stats.port_accesses++;
+    if (m->phase != PH_PIO_READ) {
+        m->stats.misuse++;
+        reg_set(m, DATA_BUFF_ACC_PORT, 0);
+        return;
+    }
+    memcpy(&w, m->buf + m->buf_pos, sizeof(w));
+    reg_set(m, DATA_BUFF_ACC_PORT, w);
+    m->buf_pos += sizeof(w);
+    if (m->buf_pos == m->blksz) {
+        block_done(m);
+    }
+}
+
+static void port_write(struct sdhc_model *m, uint32_t w)
+{
+    m->stats.port_accesses++;
+    if (m->phase != PH_PIO_WRITE) {
+        m->stats.misuse++;
+        return;
+    }
+    memcpy(m->buf + m->buf_pos, &w, sizeof(w));
+    m->buf_pos += sizeof(w);
+    if (m->buf_pos == m->blksz) {
+        schedule(m, PH_DATA, block_ns(m));
+    }
+}
+
+/****************
+ *** Commands ***
+ ****************/
+
+static void cmd_issue(struct sdhc_model *m, uint32_t xfr)
+{
+    uint32_t rsptyp = (xfr >> 16) & 0x3;
+    int data = !!(xfr & CMD_XFR_TYP_DPSEL);
+    uint32_t lines = SDHC_PRES_STATE_CIHB;
+    uint64_t clocks = CMD_CLOCKS + NCR_CLOCKS;
+
+    if (data || rsptyp == 3) {
+        lines |= SDHC_PRES_STATE_CDIHB;
+    }
+    if (reg(m, PRES_STATE) & lines) {
+        /* The hardware ignores it */
+        m->stats.misuse++;
+        return;
+    }
+    /* HS200 clocks need 1.8V signalling */
+    if (card_clock(m) > 52000000 && !(reg(m, VEND_SPEC) & VEND_SPEC_VSELECT)) {
+        m->stats.misuse++;
+    }
+    inhibit(m, lines);
+    m->stats.cmds++;
+    m->xfr = xfr;
+
+    memset(m->resp, 0, sizeof(m->resp));
+    m->cmd_ret = -1;
+    if (m->card) {
+        sim_card_set_bus(m->card, bus_width(m), card_clock(m));
+        m->cmd_ret = sim_card_cmd(m->card, (xfr >> 24) & 0x3f, reg(m, CMD_ARG), m->resp);
+    }
+    if (rsptyp == 1) {
+        clocks += R2_CLOCKS;
+    } else if (rsptyp) {
+        clocks += CMD_CLOCKS;
+    }
+    schedule(m, PH_CMD, clocks_ns(m, clocks));
+}
+
+static void cmd_done(struct sdhc_model *m)
+{
+    uint32_t rsptyp = (m->xfr >> 16) & 0x3;
+    uint32_t *r = m->resp;
+
+    release(m, SDHC_PRES_STATE_CIHB);
+    if (rsptyp && m->cmd_ret < 0) {
+        m->phase = PH_IDLE;
+        release(m, SDHC_PRES_STATE_CDIHB);
+        status_raise(m, INT_CTOE);
+        return;
+    }
+    if (rsptyp == 1) {
+        /* Bits 127:8 of R2, without the CRC */
+        reg_set(m, CMD_RSP0, (r[0] >> 8) | (r[1] << 24));
+        reg_set(m, CMD_RSP1, (r[1] >> 8) | (r[2] << 24));
+        reg_set(m, CMD_RSP2, (r[2] >> 8) | (r[3] << 24));
+        reg_set(m, CMD_RSP3, r[3] >> 8);
+    } else if (rsptyp) {
+        reg_set(m, CMD_RSP0, r[0]);
+    }
+    status_raise(m, INT_CC);
+
+    if (m->xfr & CMD_XFR_TYP_DPSEL) {
+        data_start(m);
+    } else if (rsptyp == 3) {
+        schedule(m, PH_BUSY, sim_card_busy_ns(m->card) + clocks_ns(m, 8));
+    } else {
+        m->phase = PH_IDLE;
+    }
+}
+
+static void stop_done(struct sdhc_model *m)
+{
+    uint32_t resp[4];
+
+    m->stats.auto_cmd12++;
+    sim_card_set_bus(m->card, bus_width(m), card_clock(m));
+    if (sim_card_cmd(m->card, 12, 0, resp)) {
+        data_error(m, INT_AC12E);
+        return;
+    }
+    reg_set(m, CMD_RSP3, resp[0]);
+    wait_busy(m);
+}
+
+static void run_event(struct sdhc_model *m)
+{
+    switch (m->phase) {
+    case PH_CMD:
+        cmd_done(m);
+        break;
+    case PH_DATA:
+        data_block(m);
+        break;
+    case PH_STOP:
+        stop_done(m);
+        break;
+    case PH_BUSY:
+        busy_done(m);
+        break;
+    case PH_TIMEOUT:
+        data_error(m, INT_DTOE);
+        break;
+    default:
+        break;
+    }
+}
+
+/*****************
+ *** Registers ***
+ *****************/
+
+static void sys_ctrl_write(struct sdhc_model *m, uint32_t v)
+{
+    if (v & SYS_CTRL_RSTA) {
+        host_reset(m);
+        return;
+    }
+    if (v & SYS_CTRL_RSTC) {
+        if (m->phase == PH_CMD) {
+            m->phase = PH_IDLE;
+        }
+        release(m, SDHC_PRES_STATE_CIHB);
+        reg_set(m, INT_STATUS, reg(m, INT_STATUS) & ~INT_CC);
+    }
+    if (v & SYS_CTRL_RSTD) {
+        if (m->phase > PH_CMD) {
+            m->phase = PH_IDLE;
+        }
+        release(m, SDHC_PRES_STATE_CDIHB | SDHC_PRES_STATE_DLA);
+        reg_set(m, INT_STATUS, reg(m, INT_STATUS) & ~(INT_TC | INT_DINT | INT_BRR | INT_BWR));
+    }
+    if (v & SYS_CTRL_INITA) {
+        m->now += clocks_ns(m, INITA_CLOCKS);
+    }
+    if (v & SYS_CTRL_CLK_INT_EN) {
+        v |= SYS_CTRL_CLK_STABLE;
+    }
+    reg_set(m, SYS_CTRL, v & ~(SYS_CTRL_RSTA | SYS_CTRL_RSTC | SYS_CTRL_RSTD | SYS_CTRL_INITA));
+    irq_update(m);
+}
+
+static void reg_write(struct sdhc_model *m, uint32_t off, uint32_t v, uint32_t old)
+{
+    switch (off) {
+    case CMD_XFR_TYP:
+        reg_set(m, off, v);
+        cmd_issue(m, v);
+        break;
+    case INT_STATUS:
+        reg_set(m, off, old & ~v);
+        irq_update(m);
+        break;
+    case INT_SIGNAL_EN:
+        reg_set(m, off, v);
+        irq_update(m);
+        break;
+    case SYS_CTRL:
+        sys_ctrl_write(m, v);
+        break;
+    case DS_ADDR:
+        reg_set(m, off, v);
+        if (m->phase == PH_SDMA_WAIT) {
+            m->dma_addr = v;
+            schedule(m, PH_DATA, block_ns(m));
+        }
+        break;
+    case DATA_BUFF_ACC_PORT:
+        port_write(m, v);
+        break;
+    case CMD_RSP0:
+    case CMD_RSP1:
+    case CMD_RSP2:
+    case CMD_RSP3:
+    case PRES_STATE:
+    case HOST_CTRL_CAP:
+    case HOST_VERSION:
+        m->stats.misuse++;
+        break;
+    default:
+        reg_set(m, off, v);
+        break;
+    }
+}
+
+/* Polling a status that is not there yet lets time pass */
+static void reg_read(struct sdhc_model *m, uint32_t off)
+{
+    switch (off) {
+    case DATA_BUFF_ACC_PORT:
+        port_read(m);
+        break;
+    case INT_STATUS:
+        while (!reg(m, INT_STATUS) && sdhc_model_advance(m));
+        if (reg(m, INT_STATUS)) {
+            m->idle_polls = 0;
+        } else if (++m->idle_polls == STALL_POLLS) {
+            fprintf(stderr, "sdhc_model: INT_STATUS polled with nothing pending "
+                    "(CMD%d, INT_STATUS_EN %08x)\n", (m->xfr >> 24) & 0x3f,
+                    reg(m, INT_STATUS_EN));
+            abort();
+        }
+        break;
+    case PRES_STATE:
+        if (reg(m, PRES_STATE) & (SDHC_PRES_STATE_CIHB | SDHC_PRES_STATE_CDIHB)) {
+            sdhc_model_advance(m);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*************
+ *** Traps ***
+ *************/
+
+static void model_fault(int sig, siginfo_t *si, void *ctx)
+{
+    struct sdhc_model *m = the_model;
+    ucontext_t *uc = ctx;
+    uintptr_t addr = (uintptr_t)si->si_addr;
+
+    if (!m || addr < (uintptr_t)m->drv || addr >= (uintptr_t)m->drv + REG_SIZE) {
+        /* Not a register access, fault again without the handler */
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    m->trap_off = (addr - (uintptr_t)m->drv) & ~3UL;
+    m->trap_write = !!(uc->uc_mcontext.gregs[REG_ERR] & 2);
+    m->now += REG_ACCESS_NS;
+    if (m->trap_write) {
+        m->stats.reg_writes++;
+    } else {
+        m->stats.reg_reads++;
+        reg_read(m, m->trap_off);
+    }
+    m->trap_old = reg(m, m->trap_off);
+
+    /* Let the access through for one instruction */
+    m->stepping = 1;
+    mprotect((void *)m->drv, REG_SIZE, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+static void model_step(int sig, siginfo_t *si, void *ctx)
+{
+    struct sdhc_model *m = the_model;
+    ucontext_t *uc = ctx;
+    uint32_t v;
+
+    if (!m || !m->stepping) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+    mprotect((void *)m->drv, REG_SIZE, PROT_NONE);
+    m->stepping = 0;
+
+    v = reg(m, m->trap_off);
+    if (m->trap_write || v != m->trap_old) {
+        reg_set(m, m->trap_off, m->trap_old);
+        reg_write(m, m->trap_off, v, m->trap_old);
+    }
+}
+
+/****************
+ *** Exported ***
+ ****************/
+
+struct sdhc_model *sdhc_model_create(int adma, int vs18)
+{
+    struct sdhc_model *m;
+    struct sigaction sa;
+
+    if (the_model) {
+        fprintf(stderr, "sdhc_model: one controller per process\n");
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(*m));
+    if (!m) {
+        return NULL;
+    }
+    m->adma = adma;
+    m->vs18 = vs18;
+
+    m->fd = memfd_create("sdhc_model", 0);
+    if (m->fd < 0 || ftruncate(m->fd, REG_SIZE)) {
+        perror("sdhc_model: memfd");
+        free(m);
+        return NULL;
+    }
+    m->regs = mmap(NULL, REG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    m->drv = mmap(NULL, REG_SIZE, PROT_NONE, MAP_SHARED, m->fd, 0);
+    if (m->regs == MAP_FAILED || m->drv == MAP_FAILED) {
+        perror("sdhc_model: mmap");
+        close(m->fd);
+        free(m);
+        return NULL;
+    }
+    host_reset(m);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = model_fault;
+    if (sigaction(SIGSEGV, &sa, NULL)) {
+        perror("sdhc_model: sigaction");
+        return NULL;
+    }
+    sa.sa_sigaction = model_step;
+    if (sigaction(SIGTRAP, &sa, NULL)) {
+        perror("sdhc_model: sigaction");
+        return NULL;
+    }
+    the_model = m;
+    return m;
+}
+
+void sdhc_model_attach(struct sdhc_model *m, struct sim_card *card)
+{
+    m->card = card;
+}
+
+void *sdhc_model_regs(struct sdhc_model *m)
+{
+    return (void *)m->drv;
+}
+
+void sdhc_model_set_dma_window(struct sdhc_model *m, uintptr_t base, size_t size)
+{
+    m->dma_base = base;
+    m->dma_size = size;
+}
+
+uint32_t sdhc_model_irq_pending(struct sdhc_model *m)
+{
+    return reg(m, INT_STATUS) & reg(m, INT_SIGNAL_EN);
+}
+
+int sdhc_model_advance(struct sdhc_model *m)
+{
+    if (!has_event(m)) {
+        return 0;
+    }
+    if (m->ev_time > m->now) {
+        m->now = m->ev_time;
+    }
+    run_event(m);
+    return 1;
+}
+
+void sdhc_model_delay(struct sdhc_model *m, uint64_t ns)
+{
+    uint64_t end = m->now + ns;
+
+    while (has_event(m) && m->ev_time <= end) {
+        sdhc_model_advance(m);
+    }
+    if (end > m->now) {
+        m->now = end;
+    }
+}
+
+uint64_t sdhc_model_now(struct sdhc_model *m)
+{
+    return m->now;
+}
+
+void sdhc_model_get_stats(struct sdhc_model *m, struct sdhc_model_stats *st)
+{
+    *st = m->stats;
+    st->vtime_ns = m->now;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Software model of an i.MX6 uSDHC host controller.
+ *
+ * The model owns a register window that the unmodified driver uses as if it
+ * was MMIO. The driver's view has no access rights: every load and store
+ * faults, the model applies read side effects (the data port, time passing
+ * while the driver polls), lets the access run with the trap flag set, and
+ * applies stores with the register's real semantics (write-1-to-clear
+ * status bits, self clearing resets, commands issued by CMD_XFR_TYP).
+ *
+ * Time is virtual. Commands, data blocks, DMA and card busy periods are
+ * events that run when the driver polls a register that is waiting for
+ * them, when ps_udelay is called, or when sdhc_model_advance is called.
+ *
+ * DMA addresses are physical addresses inside the window given to
+ * sdhc_model_set_dma_window, which must be identity mapped.
+ * The trap handling is specific to x86-64 Linux, and there is one model
+ * per process.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sim_card.h"
+
+struct sdhc_model;
+
+struct sdhc_model_stats {
+    uint64_t cmds;              /* Commands issued through CMD_XFR_TYP */
+    uint64_t auto_cmd12;
+    uint64_t irqs;              /* Rising edges of the interrupt line */
+    uint64_t reg_reads;
+    uint64_t reg_writes;
+    uint64_t port_accesses;     /* Data port reads and writes, PIO */
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t sdma_restarts;     /* DMA interrupts at the SDMA boundary */
+    uint64_t adma_descs;        /* ADMA2 descriptors fetched */
+    uint64_t errors;            /* Error status bits raised */
+    uint64_t misuse;            /* Registers used in a way the hardware would not accept */
+    uint64_t vtime_ns;
+};
+
+/**
+ * Create the controller.
+ * @param adma  Advertise ADMA2, otherwise the driver has to use SDMA.
+ * @param vs18  Signal at 1.8V, as set up by the board; 3.3V otherwise.
+ */
+struct sdhc_model *sdhc_model_create(int adma, int vs18);
+
+/** Insert a card */
+void sdhc_model_attach(struct sdhc_model *m, struct sim_card *card);
+
+/** The register window, as seen by the driver */
+void *sdhc_model_regs(struct sdhc_model *m);
+
+/** Physical memory the controller may reach with DMA */
+void sdhc_model_set_dma_window(struct sdhc_model *m, uintptr_t base, size_t size);
+
+/** Interrupt status bits that are both pending and signalled */
+uint32_t sdhc_model_irq_pending(struct sdhc_model *m);
+
+/**
+ * Run the next event, moving time forward to it.
+ * @return 0 if no event is pending
+ */
+int sdhc_model_advance(struct sdhc_model *m);
+
+/** Let time pass, running the events that fall due */
+void sdhc_model_delay(struct sdhc_model *m, uint64_t ns);
+
+/** Virtual time in nanoseconds */
+uint64_t sdhc_model_now(struct sdhc_model *m);
+
+void sdhc_model_get_stats(struct sdhc_model *m, struct sdhc_model_stats *st);
@@ -0,0 +1,751 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Runs the unmodified SDHC and MMC drivers against the uSDHC model and a
+ * simulated card, then reports the cost of initialisation and of each way
+ * of moving blocks: throughput in virtual time, and commands, interrupts
+ * and register accesses per MiB.
+ *
+ * usage: sdhcsim [-t sd|mmc] [-s MiB] [-n MiB] [-i image] [-S] [-V]
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <platsupport/delay.h>
+#include <sdhc/mmc.h>
+#include <sdhc/mmc_cache.h>
+
+#include "../../src/sdhc.h"
+#include "sdhc_model.h"
+#include "sim_card.h"
+
+#define ARENA_SIZE          (256UL << 20)
+#define BLOCK               512
+#define SEQ_CHUNK           128         /* Blocks per sequential request */
+#define SMALL_CHUNK         8
+#define ASYNC_DEPTH         8
+#define SG_SEG              4096
+#define SDMA_SPAN           3072        /* Blocks in one request across SDMA boundaries */
+#define SDMA_BUF_BOUNDARY   0x80000
+#define RANDOM_READS        256
+#define CMDQ_POLLS          16          /* QSR queries without progress before giving up */
+#define PIO_BYTES           (512 * 1024)
+#define CACHE_BLOCKS        1024
+#define CACHE_WRITES        256
+#define DISCARD_START       1000
+#define DISCARD_BLOCKS      3000
+
+struct snap {
+    struct sdhc_model_stats host;
+    struct sim_card_stats card;
+    uint64_t cpu_ns;
+};
+
+struct async {
+    int outstanding;
+    unsigned long completed;
+    unsigned long next;         /* Next block to request */
+    unsigned long end;
+    int nblocks;
+    int errors;
+    int cmdq;
+    uint8_t *vbuf[ASYNC_DEPTH];
+    uintptr_t pbuf[ASYNC_DEPTH];
+    unsigned long blk[ASYNC_DEPTH];
+};
+
+static struct {
+    uint8_t *base;
+    uintptr_t top;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t peak;
+} arena;
+
+static struct sdhc_model *model;
+static struct sim_card *sim;
+static mmc_card_t card;
+static int failed;
+
+/****************
+ *** Platform ***
+ ****************/
+
+/*
+ * DMA memory is bump allocated from an arena below 4GiB where the virtual
+ * address is the physical address. Only the last allocation is given back.
+ */
+static void *sim_dma_alloc(void *cookie, size_t size, int align, int cached,
+                           ps_mem_flags_t flags)
+{
+    uintptr_t p = ALIGN_UP(arena.top, MAX(align, 64));
+
+    if (p + size > (uintptr_t)arena.base + ARENA_SIZE) {
+        return NULL;
+    }
+    arena.top = p + size;
+    arena.allocs++;
+    arena.peak = MAX(arena.peak, arena.top - (uintptr_t)arena.base);
+    return (void *)p;
+}
+
+static void sim_dma_free(void *cookie, void *addr, size_t size)
+{
+    if ((uintptr_t)addr + size == arena.top) {
+        arena.top = (uintptr_t)addr;
+    }
+    arena.frees++;
+}
+
+static uintptr_t sim_dma_pin(void *cookie, void *addr, size_t size)
+{
+    return (uintptr_t)addr;
+}
+
+static void sim_dma_unpin(void *cookie, void *addr, size_t size)
+{
+}
+
+static void sim_dma_cache_op(void *cookie, void *addr, size_t size,
+                             dma_cache_op_t op)
+{
+    /* Coherent */
+}
+
+static int sim_plat_init(ps_io_ops_t *io_ops)
+{
+    void *base;
+
+    base = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("sdhcsim: DMA arena");
+        return -1;
+    }
+    arena.base = base;
+    arena.top = (uintptr_t)base;
+    sdhc_model_set_dma_window(model, (uintptr_t)base, ARENA_SIZE);
+
+    memset(io_ops, 0, sizeof(*io_ops));
+    io_ops->dma_manager.dma_alloc_fn = sim_dma_alloc;
+    io_ops->dma_manager.dma_free_fn = sim_dma_free;
+    io_ops->dma_manager.dma_pin_fn = sim_dma_pin;
+    io_ops->dma_manager.dma_unpin_fn = sim_dma_unpin;
+    io_ops->dma_manager.dma_cache_op_fn = sim_dma_cache_op;
+    return 0;
+}
+
+/* The driver's delays are virtual time */
+void ps_udelay(unsigned long us)
+{
+    sdhc_model_delay(model, us * 1000ULL);
+}
+
+static void *dma_buf(size_t size, uintptr_t *pbuf)
+{
+    void *p = sim_dma_alloc(NULL, size, 4096, 0, PS_MEM_NORMAL);
+
+    if (!p) {
+        fprintf(stderr, "sdhcsim: out of DMA memory\n");
+        exit(1);
+    }
+    *pbuf = (uintptr_t)p;
+    return p;
+}
+
+/*****************
+ *** Reporting ***
+ *****************/
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void snap(struct snap *s)
+{
+    sdhc_model_get_stats(model, &s->host);
+    sim_card_get_stats(sim, &s->card);
+    s->cpu_ns = cpu_ns();
+}
+
+static void report(const char *name, const struct snap *a, uint64_t bytes, int errors)
+{
+    struct snap b;
+    double mib = (double)bytes / (1 << 20);
+    double vt, regs;
+
+    snap(&b);
+    vt = (double)(b.host.vtime_ns - a->host.vtime_ns) / 1e9;
+    regs = (double)(b.host.reg_reads + b.host.reg_writes - a->host.reg_reads
+                    - a->host.reg_writes);
+    printf("  %-18s %8.1f MiB/s %8.0f %8.0f %10.0f %10.0f  %s\n", name,
+           vt > 0 ? mib / vt : 0.0,
+           (b.host.cmds - a->host.cmds + b.host.auto_cmd12 - a->host.auto_cmd12) / mib,
+           (b.host.irqs - a->host.irqs) / mib, regs / mib,
+           (b.cpu_ns - a->cpu_ns) / 1e3 / mib, errors ? "FAILED" : "ok");
+    if (errors) {
+        failed = 1;
+    }
+}
+
+/******************
+ *** Block data ***
+ ******************/
+
+static uint32_t pattern(unsigned long blk, int i, uint32_t seed)
+{
+    return (blk * 0x9e3779b1U) ^ (i * 0x85ebca6bU) ^ seed;
+}
+
+static void fill(void *buf, unsigned long blk, int nblocks, uint32_t seed)
+{
+    uint32_t *w = buf;
+    int i, j;
+
+    for (i = 0; i < nblocks; i++) {
+        for (j = 0; j < BLOCK / 4; j++) {
+            *w++ = pattern(blk + i, j, seed);
+        }
+    }
+}
+
+static int check(const void *buf, unsigned long blk, int nblocks, uint32_t seed)
+{
+    const uint32_t *w = buf;
+    int i, j;
+
+    for (i = 0; i < nblocks; i++) {
+        for (j = 0; j < BLOCK / 4; j++) {
+            if (*w++ != pattern(blk + i, j, seed)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static uint8_t *image_block(unsigned long blk)
+{
+    return sim_card_image(sim) + blk * BLOCK;
+}
+
+/******************
+ *** Benchmarks ***
+ ******************/
+
+static void bench_write(const char *name, int chunk, unsigned long nblocks, uint32_t seed)
+{
+    struct snap s;
+    uintptr_t pbuf;
+    uint8_t *buf = dma_buf(chunk * BLOCK, &pbuf);
+    unsigned long blk;
+    int errors = 0;
+
+    snap(&s);
+    for (blk = 0; blk + chunk <= nblocks; blk += chunk) {
+        fill(buf, blk, chunk, seed);
+        if (mmc_block_write(card, blk, chunk, buf, pbuf, NULL, NULL) != chunk * BLOCK) {
+            errors++;
+        }
+    }
+    errors += check(image_block(0), 0, blk, seed) ? 1 : 0;
+    report(name, &s, blk * BLOCK, errors);
+    sim_dma_free(NULL, buf, chunk * BLOCK);
+}
+
+/* PIO when use_dma is not set */
+static void bench_read(const char *name, int chunk, unsigned long nblocks, int use_dma,
+                       uint32_t seed)
+{
+    struct snap s;
+    uintptr_t pbuf;
+    uint8_t *buf = dma_buf(chunk * BLOCK, &pbuf);
+    unsigned long blk;
+    int errors = 0;
+
+    fill(image_block(0), 0, nblocks, seed);
+    snap(&s);
+    for (blk = 0; blk + chunk <= nblocks; blk += chunk) {
+        memset(buf, 0, chunk * BLOCK);
+        if (mmc_block_read(card, blk, chunk, buf, use_dma ? pbuf : 0, NULL, NULL)
+            != chunk * BLOCK || check(buf, blk, chunk, seed)) {
+            errors++;
+        }
+    }
+    report(name, &s, blk * BLOCK, errors);
+    sim_dma_free(NULL, buf, chunk * BLOCK);
+}
+
+static void bench_random(const char *name, unsigned long nblocks, uint32_t seed)
+{
+    struct snap s;
+    uintptr_t pbuf;
+    uint8_t *buf = dma_buf(SMALL_CHUNK * BLOCK, &pbuf);
+    unsigned long blk;
+    int errors = 0;
+    int i;
+
+    fill(image_block(0), 0, nblocks, seed);
+    srand(seed);
+    snap(&s);
+    for (i = 0; i < RANDOM_READS; i++) {
+        blk = (rand() % (nblocks / SMALL_CHUNK)) * SMALL_CHUNK;
+        if (mmc_block_read(card, blk, SMALL_CHUNK, buf, pbuf, NULL, NULL)
+            != SMALL_CHUNK * BLOCK || check(buf, blk, SMALL_CHUNK, seed)) {
+            errors++;
+        }
+    }
+    report(name, &s, (uint64_t)RANDOM_READS * SMALL_CHUNK * BLOCK, errors);
+    sim_dma_free(NULL, buf, SMALL_CHUNK * BLOCK);
+}
+
+/* Read 64KiB requests into 4KiB pages that are not contiguous */
+static void bench_sg(const char *name, unsigned long nblocks, uint32_t seed)
+{
+    const int nsg = SEQ_CHUNK * BLOCK / SG_SEG;
+    struct mmc_sg sg[SEQ_CHUNK * BLOCK / SG_SEG];
+    struct snap s;
+    uintptr_t pbuf;
+    uint8_t *buf = dma_buf(2 * SEQ_CHUNK * BLOCK, &pbuf);
+    unsigned long blk;
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < nsg; i++) {
+        sg[i].pbuf = pbuf + (nsg - 1 - i) * 2 * SG_SEG;
+        sg[i].len = SG_SEG;
+    }
+    fill(image_block(0), 0, nblocks, seed);
+    snap(&s);
+    for (blk = 0; blk + SEQ_CHUNK <= nblocks; blk += SEQ_CHUNK) {
+        if (mmc_block_read_sg(card, blk, SEQ_CHUNK, sg, nsg, NULL, NULL) != SEQ_CHUNK * BLOCK) {
+            errors++;
+            continue;
+        }
+        for (i = 0; i < nsg; i++) {
+            if (check((void *)sg[i].pbuf, blk + i * SG_SEG / BLOCK, SG_SEG / BLOCK, seed)) {
+                errors++;
+                break;
+            }
+        }
+    }
+    report(name, &s, blk * BLOCK, errors);
+    sim_dma_free(NULL, buf, 2 * SEQ_CHUNK * BLOCK);
+}
+
+/*
+ * Write and read back single requests that start a block short of an SDMA
+ * buffer boundary and cross several more, so that the transfer has to be
+ * restarted from where the controller stopped.
+ */
+static void bench_sdma(const char *name, uint32_t seed)
+{
+    const size_t size = SDMA_SPAN * BLOCK;
+    const int restarts = (SDMA_BUF_BOUNDARY - BLOCK + size) / SDMA_BUF_BOUNDARY;
+    struct sdhc_model_stats hs;
+    struct snap s;
+    uintptr_t pbase, pbuf;
+    uint8_t *base = dma_buf(size + SDMA_BUF_BOUNDARY, &pbase);
+    uint8_t *buf;
+    size_t off;
+    int errors = 0;
+
+    off = SDMA_BUF_BOUNDARY - BLOCK - (pbase % SDMA_BUF_BOUNDARY);
+    off %= SDMA_BUF_BOUNDARY;
+    buf = base + off;
+    pbuf = pbase + off;
+
+    snap(&s);
+    fill(buf, 0, SDMA_SPAN, seed);
+    if (mmc_block_write(card, 0, SDMA_SPAN, buf, pbuf, NULL, NULL) != size ||
+        check(image_block(0), 0, SDMA_SPAN, seed)) {
+        errors++;
+    }
+    fill(image_block(0), 0, SDMA_SPAN, seed + 1);
+    memset(buf, 0, size);
+    if (mmc_block_read(card, 0, SDMA_SPAN, buf, pbuf, NULL, NULL) != size ||
+        check(buf, 0, SDMA_SPAN, seed + 1)) {
+        errors++;
+    }
+    sdhc_model_get_stats(model, &hs);
+    if (hs.sdma_restarts - s.host.sdma_restarts != 2 * restarts) {
+        printf("  %llu SDMA restarts, expected %d\n",
+               (unsigned long long)(hs.sdma_restarts - s.host.sdma_restarts), 2 * restarts);
+        errors++;
+    }
+    report(name, &s, 2 * size, errors);
+    sim_dma_free(NULL, base, size + SDMA_BUF_BOUNDARY);
+}
+
+static int async_submit(struct async *a, int slot);
+
+/*
+ * The token of every request is a pointer into this table, so that the
+ * call back finds both the run and the slot.
+ */
+static struct {
+    struct async *a;
+    int slot;
+} async_tokens[ASYNC_DEPTH];
+
+static void async_slot_cb(mmc_card_t mmc_card, int status, size_t bytes, void *token)
+{
+    struct async *a = async_tokens[(uintptr_t)token].a;
+    int slot = async_tokens[(uintptr_t)token].slot;
+
+    a->outstanding--;
+    a->completed++;
+    if (status || bytes != (size_t)a->nblocks * BLOCK ||
+        check(a->vbuf[slot], a->blk[slot], a->nblocks, 0)) {
+        a->errors++;
+    }
+    if (a->next + a->nblocks <= a->end) {
+        async_submit(a, slot);
+    }
+}
+
+static int async_submit(struct async *a, int slot)
+{
+    int ret;
+
+    a->blk[slot] = a->next;
+    memset(a->vbuf[slot], 0, a->nblocks * BLOCK);
+    if (a->cmdq) {
+        ret = mmc_cmdq_read(card, a->next, a->nblocks, a->vbuf[slot], a->pbuf[slot],
+                            async_slot_cb, (void *)(uintptr_t)slot);
+    } else {
+        ret = (int)mmc_block_read(card, a->next, a->nblocks, a->vbuf[slot], a->pbuf[slot],
+                                  async_slot_cb, (void *)(uintptr_t)slot);
+    }
+    if (ret < 0) {
+        a->errors++;
+        return -1;
+    }
+    a->next += a->nblocks;
+    a->outstanding++;
+    return 0;
+}
+
+/* Handle interrupts as they come, with time passing in between */
+static int run_irqs(struct async *a)
+{
+    unsigned long completed = a->completed;
+    int polls = 0;
+
+    while (a->outstanding) {
+        if (a->completed != completed) {
+            completed = a->completed;
+            polls = 0;
+        }
+        if (sdhc_model_irq_pending(model)) {
+            mmc_handle_irq(card, 0);
+        } else if (sdhc_model_advance(model)) {
+            continue;
+        } else if (polls++ < CMDQ_POLLS && mmc_cmdq_poll(card) > 0) {
+            /* Queued tasks the card had not made ready yet */
+            continue;
+        } else {
+            fprintf(stderr, "sdhcsim: %d requests outstanding, the controller is idle\n",
+                    a->outstanding);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads with a callback, ASYNC_DEPTH in flight */
+static void bench_async(const char *name, unsigned long nblocks, int cmdq)
+{
+    struct async a = { .nblocks = SEQ_CHUNK, .end = nblocks, .cmdq = cmdq };
+    struct snap s;
+    int i;
+
+    for (i = 0; i < ASYNC_DEPTH; i++) {
+        a.vbuf[i] = dma_buf(SEQ_CHUNK * BLOCK, &a.pbuf[i]);
+        async_tokens[i].a = &a;
+        async_tokens[i].slot = i;
+    }
+    fill(image_block(0), 0, nblocks, 0);
+    snap(&s);
+    for (i = 0; i < ASYNC_DEPTH && a.next + a.nblocks <= a.end; i++) {
+        async_submit(&a, i);
+    }
+    if (run_irqs(&a)) {
+        a.errors++;
+    }
+    report(name, &s, a.next * BLOCK, a.errors);
+    for (i = ASYNC_DEPTH - 1; i >= 0; i--) {
+        sim_dma_free(NULL, a.vbuf[i], SEQ_CHUNK * BLOCK);
+    }
+}
+
+static void bench_cache(unsigned long nblocks, uint32_t seed)
+{
+    struct mmc_cache_stats cs;
+    mmc_cache_t cache;
+    struct snap s;
+    uint8_t buf[SMALL_CHUNK * BLOCK];
+    unsigned long blk;
+    unsigned long span = MIN(nblocks, 4096UL);
+    int errors = 0;
+    int i;
+
+    if (mmc_cache_init(card, CACHE_BLOCKS, &cache)) {
+        printf("  cache              init failed\n");
+        failed = 1;
+        return;
+    }
+
+    /* Sequential small reads, served by read-ahead */
+    fill(image_block(0), 0, span, seed);
+    snap(&s);
+    for (blk = 0; blk + SMALL_CHUNK <= span; blk += SMALL_CHUNK) {
+        if (mmc_cache_read(cache, blk, SMALL_CHUNK, buf) != sizeof(buf) ||
+            check(buf, blk, SMALL_CHUNK, seed)) {
+            errors++;
+        }
+    }
+    report("cache read 4K", &s, blk * BLOCK, errors);
+
+    /* Scattered single block writes, written back in runs */
+    errors = 0;
+    srand(seed);
+    snap(&s);
+    for (i = 0; i < CACHE_WRITES; i++) {
+        blk = rand() % (CACHE_BLOCKS / 2);
+        fill(buf, blk, 1, seed + 1);
+        if (mmc_cache_write(cache, blk, 1, buf) != BLOCK) {
+            errors++;
+        }
+    }
+    if (mmc_cache_barrier(cache)) {
+        errors++;
+    }
+    srand(seed);
+    for (i = 0; i < CACHE_WRITES; i++) {
+        blk = rand() % (CACHE_BLOCKS / 2);
+        errors += check(image_block(blk), blk, 1, seed + 1) ? 1 : 0;
+    }
+    report("cache write 512", &s, (uint64_t)CACHE_WRITES * BLOCK, errors);
+
+    mmc_cache_get_stats(cache, &cs);
+    printf("  %-18s %lu hits, %lu misses, %lu read ahead, %lu writes of %lu blocks\n",
+           "", cs.hits, cs.misses, cs.readahead, cs.writebacks, cs.written);
+    if (mmc_cache_destroy(cache)) {
+        failed = 1;
+    }
+}
+
+static void bench_discard(int mmc, uint32_t seed)
+{
+    struct sim_card_stats cs;
+    struct snap s;
+    unsigned long end = DISCARD_START + DISCARD_BLOCKS;
+    unsigned long blk;
+    long ret;
+    int errors = 0;
+
+    fill(image_block(0), 0, end + SEQ_CHUNK, seed);
+    snap(&s);
+    ret = mmc_block_discard(card, DISCARD_START, DISCARD_BLOCKS);
+    if (ret <= 0 || ret > DISCARD_BLOCKS * BLOCK) {
+        errors++;
+    }
+    /* Blocks outside the range keep their data, an SD card zeroes the range */
+    errors += check(image_block(0), 0, DISCARD_START, seed) ? 1 : 0;
+    errors += check(image_block(end), end, SEQ_CHUNK, seed) ? 1 : 0;
+    for (blk = DISCARD_START; !mmc && blk < end; blk++) {
+        if (image_block(blk)[0] || memcmp(image_block(blk), image_block(blk) + 1, BLOCK - 1)) {
+            errors++;
+            break;
+        }
+    }
+    report("discard", &s, ret > 0 ? ret : 0, errors);
+
+    sim_card_get_stats(sim, &cs);
+    printf("  %-18s %llu erases, %llu trims, %llu discards, %llu unaligned\n", "",
+           (unsigned long long)cs.erases, (unsigned long long)cs.trims,
+           (unsigned long long)cs.discards, (unsigned long long)cs.unaligned_erases);
+}
+
+static void bench_cmdq(unsigned long nblocks)
+{
+    int depth = mmc_cmdq_enable(card);
+
+    if (depth < 0) {
+        printf("  cmdq               not enabled\n");
+        failed = 1;
+        return;
+    }
+    bench_async("cmdq read 64K x8", nblocks, 1);
+    if (mmc_cmdq_disable(card)) {
+        failed = 1;
+    }
+}
+
+/************
+ *** Main ***
+ ************/
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t sd|mmc] [-s MiB] [-n MiB] [-i image] [-S] [-V]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    enum sim_card_type type = SIM_CARD_SD;
+    const char *image = NULL;
+    uint64_t size = 0;
+    uint64_t xfer = 16ULL << 20;
+    int adma = 1;
+    int vs18 = 0;
+    struct sdhc_model_stats hs;
+    struct sim_card_stats cs;
+    struct snap s;
+    sdio_host_dev_t sdio;
+    ps_io_ops_t io_ops;
+    static const int irqs[] = { 0 };
+    unsigned long nblocks;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:n:i:SVh")) != -1) {
+        switch (opt) {
+        case 't':
+            if (!strcmp(optarg, "sd")) {
+                type = SIM_CARD_SD;
+            } else if (!strcmp(optarg, "mmc")) {
+                type = SIM_CARD_MMC;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 's':
+            size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'n':
+            xfer = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 'S':
+            adma = 0;
+            break;
+        case 'V':
+            vs18 = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    /* An existing image keeps its size unless one is given */
+    if (!size && !image) {
+        size = 64ULL << 20;
+    }
+
+    sim = sim_card_create(type, image, size);
+    model = sdhc_model_create(adma, vs18);
+    if (!sim || !model || sim_plat_init(&io_ops)) {
+        return 1;
+    }
+    sdhc_model_attach(model, sim);
+    size = sim_card_size(sim);
+    xfer = MIN(xfer, size);
+    nblocks = xfer / BLOCK;
+    if (nblocks < DISCARD_START + DISCARD_BLOCKS + SEQ_CHUNK) {
+        fprintf(stderr, "sdhcsim: transfer at least 2MiB\n");
+        return 2;
+    }
+
+    /* Initialisation */
+    snap(&s);
+    if (sdhc_init(sdhc_model_regs(model), irqs, 1, &io_ops, &sdio) ||
+        mmc_init(&sdio, &io_ops, &card)) {
+        fprintf(stderr, "sdhcsim: initialisation failed\n");
+        return 1;
+    }
+    sdhc_model_get_stats(model, &hs);
+    sim_card_get_stats(sim, &cs);
+    printf("%s card, %llu MiB, %s\n", type == SIM_CARD_SD ? "SD" : "eMMC",
+           (unsigned long long)(size >> 20), adma ? "ADMA2" : "SDMA");
+    printf("Initialisation %.1f ms: %llu commands, %llu register accesses, "
+           "%d-bit %s\n", (hs.vtime_ns - s.host.vtime_ns) / 1e6,
+           (unsigned long long)hs.cmds,
+           (unsigned long long)(hs.reg_reads + hs.reg_writes),
+           sim_card_bus_width(sim), sim_card_timing(sim));
+    if (mmc_card_capacity(card) != (long long)size) {
+        printf("  capacity %lld, expected %llu\n", mmc_card_capacity(card),
+               (unsigned long long)size);
+        failed = 1;
+    }
+
+    /* Transfers */
+    printf("Transfers over %llu MiB\n", (unsigned long long)(xfer >> 20));
+    printf("  %-18s %14s %8s %8s %10s %10s\n", "", "", "cmds/MiB", "irqs/MiB",
+           "regs/MiB", "host us/MiB");
+    bench_write("write 64K", SEQ_CHUNK, nblocks, 1);
+    bench_read("read 64K", SEQ_CHUNK, nblocks, 1, 2);
+    bench_read("read 4K", SMALL_CHUNK, nblocks, 1, 3);
+    bench_async("read 64K x8", nblocks, 0);
+    if (adma) {
+        bench_sg("read 64K sg", nblocks, 4);
+    } else {
+        bench_sdma("rw 1.5M unaligned", 4);
+    }
+    bench_random("read 4K random", nblocks, 5);
+    bench_read("read 4K PIO", SMALL_CHUNK, PIO_BYTES / BLOCK, 0, 6);
+    bench_cache(nblocks, 7);
+    bench_discard(type == SIM_CARD_MMC, 8);
+    if (type == SIM_CARD_MMC) {
+        bench_cmdq(nblocks);
+    }
+
+    sdhc_model_get_stats(model, &hs);
+    sim_card_get_stats(sim, &cs);
+    printf("Controller\n");
+    printf("  %llu commands, %llu auto CMD12, %llu interrupts, %.1f ms\n",
+           (unsigned long long)hs.cmds, (unsigned long long)hs.auto_cmd12,
+           (unsigned long long)hs.irqs, hs.vtime_ns / 1e6);
+    printf("  %llu register reads, %llu writes, %llu through the data port\n",
+           (unsigned long long)hs.reg_reads, (unsigned long long)hs.reg_writes,
+           (unsigned long long)hs.port_accesses);
+    printf("  %llu blocks, %llu SDMA restarts, %llu ADMA2 descriptors\n",
+           (unsigned long long)hs.blocks, (unsigned long long)hs.sdma_restarts,
+           (unsigned long long)hs.adma_descs);
+    printf("  %llu error interrupts, %llu misused registers\n",
+           (unsigned long long)hs.errors, (unsigned long long)hs.misuse);
+    printf("Card\n");
+    printf("  %llu commands, %llu application commands, %llu pre-erase hints\n",
+           (unsigned long long)cs.cmds, (unsigned long long)cs.acmds,
+           (unsigned long long)cs.pre_erase_hints);
+    printf("  %llu blocks read, %llu written, %llu queued tasks, %llu errors\n",
+           (unsigned long long)cs.blocks_read, (unsigned long long)cs.blocks_written,
+           (unsigned long long)cs.queued_tasks, (unsigned long long)cs.errors);
+    printf("DMA\n");
+    printf("  %llu allocs, %llu frees, %llu bytes peak\n",
+           (unsigned long long)arena.allocs, (unsigned long long)arena.frees,
+           (unsigned long long)arena.peak);
+    if (hs.misuse) {
+        failed = 1;
+    }
+
+    sim_card_destroy(sim);
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed;
+}
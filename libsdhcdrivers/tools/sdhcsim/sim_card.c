@@ -0,0 +1,936 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utils/util.h>
+
+#include "../../src/mmc.h"
+#include "sim_card.h"
+
+#define BLOCK               512
+#define SD_RCA              0x1234
+#define OCR_VOLTAGES        0x00FF8000
+#define OCR_BUSY            (1U << 31)     /* Power up done, active low busy */
+#define OCR_CCS             (1U << 30)     /* Sector addressed */
+#define SD_INIT_POLLS       2              /* ACMD41s before the card is ready */
+#define CMDQ_DEPTH          16
+#define SD_SEND_TUNING_BLOCK 19            /* SD UHS-I, the driver does not use it */
+
+/* Card status bits (R1) */
+#define R1_OUT_OF_RANGE     (1U << 31)
+#define R1_ADDRESS_ERROR    (1U << 30)
+#define R1_ERASE_SEQ_ERROR  (1U << 28)
+#define R1_ERASE_PARAM      (1U << 27)
+#define R1_ILLEGAL_COMMAND  (1U << 22)
+#define R1_STATE(s)         ((s) << 9)
+#define R1_READY_FOR_DATA   (1U << 8)
+#define R1_SWITCH_ERROR     (1U << 7)
+#define R1_APP_CMD          (1U << 5)
+
+/* Card timings */
+#define T_ACCESS_NS         60000          /* Read command to first block */
+#define T_PROGRAM_NS        150000         /* Busy after a write */
+#define T_PROGRAM_BLK_NS    4000
+#define T_PROGRAM_HINT_NS   90000          /* After a write that was pre-erased */
+#define T_PROGRAM_HBLK_NS   2000
+#define T_SWITCH_NS         50000
+#define T_ERASE_NS          1000000
+#define T_ERASE_GRP_NS      100000
+#define T_TRIM_NS           300000
+#define T_TRIM_BLK_NS       1000
+#define T_DISCARD_NS        100000
+
+enum card_state {
+    ST_IDLE = 0,
+    ST_READY,
+    ST_IDENT,
+    ST_STBY,
+    ST_TRAN,
+    ST_DATA,
+    ST_RCV,
+    ST_PRG,
+};
+
+struct cmdq_task {
+    int read;
+    uint32_t nblocks;
+    uint32_t addr;
+};
+
+struct sim_card {
+    enum sim_card_type type;
+    uint8_t *image;
+    uint64_t size;
+    uint64_t nblocks;
+    int fd;
+
+    enum card_state state;
+    uint16_t rca;
+    int app_cmd;
+    int init_polls;
+    uint32_t ocr;
+    uint32_t cid[4];
+    uint32_t csd[4];
+    uint8_t scr[8];
+    uint8_t ext_csd[512];
+    uint32_t status_err;            /* Reported with the next R1 */
+
+    /* Bus as switched on the card, and as driven by the host */
+    int bus_width;
+    int hs_timing;                  /* 0 legacy, 1 high speed, 2 HS200 */
+    int host_width;
+    uint32_t host_clock;
+
+    /* Data stage */
+    struct sim_data data;
+    uint8_t regbuf[512];            /* Register reads */
+    int from_reg;
+    uint64_t addr;                  /* Next block */
+    uint32_t done;
+    int cmdq_task;                  /* Task being executed, or -1 */
+    uint64_t busy_ns;
+    uint32_t hint;                  /* ACMD23 block count */
+
+    /* Erase */
+    uint64_t erase_start;
+    uint64_t erase_end;
+    int erase_tagged;
+
+    /* Command queue */
+    struct cmdq_task task[CMDQ_DEPTH];
+    uint32_t queued;
+    uint32_t ready;                 /* Queued before the last QSR query */
+    int param_task;                 /* CMD44 waiting for its CMD45 */
+
+    struct sim_card_stats stats;
+};
+
+/****************
+ *** Registers ***
+ ****************/
+
+/* Set bits [start + size - 1:start] of a 128 bit register */
+static void set_bits(uint32_t *reg, int start, int size, uint32_t val)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        int b = start + i;
+        if (val & (1U << i)) {
+            reg[b / 32] |= 1U << (b % 32);
+        } else {
+            reg[b / 32] &= ~(1U << (b % 32));
+        }
+    }
+}
+
+static void build_sd_regs(struct sim_card *c)
+{
+    memset(c->cid, 0, sizeof(c->cid));
+    set_bits(c->cid, 120, 8, 0x03);                 /* MID */
+    set_bits(c->cid, 104, 16, 0x5344);              /* OID "SD" */
+    set_bits(c->cid, 64, 32, 0x53494d53);           /* PNM "SIMSD" */
+    set_bits(c->cid, 96, 8, 'D');
+    set_bits(c->cid, 56, 8, 0x10);                  /* PRV */
+    set_bits(c->cid, 24, 32, 0x00c0ffee);           /* PSN */
+    set_bits(c->cid, 8, 12, 0x1a1);                 /* MDT */
+    set_bits(c->cid, 0, 1, 1);
+
+    /* CSD version 2.0 */
+    memset(c->csd, 0, sizeof(c->csd));
+    set_bits(c->csd, 126, 2, 1);
+    set_bits(c->csd, 112, 8, 0x0e);                 /* TAAC */
+    set_bits(c->csd, 96, 8, 0x32);                  /* TRAN_SPEED 25MHz */
+    set_bits(c->csd, 84, 12, 0x5b5);                /* CCC */
+    set_bits(c->csd, 80, 4, 9);                     /* READ_BL_LEN */
+    set_bits(c->csd, 48, 22, c->size / (512 * 1024) - 1);
+    set_bits(c->csd, 46, 1, 1);                     /* ERASE_BLK_EN */
+    set_bits(c->csd, 39, 7, 0x7f);                  /* SECTOR_SIZE */
+    set_bits(c->csd, 22, 4, 9);                     /* WRITE_BL_LEN */
+    set_bits(c->csd, 0, 1, 1);
+
+    /* SCR: version 2.00, 1 and 4 bit, erased blocks read as zero */
+    memset(c->scr, 0, sizeof(c->scr));
+    c->scr[0] = 0x02;
+    c->scr[1] = 0x05;
+}
+
+static void build_mmc_regs(struct sim_card *c)
+{
+    uint8_t *e = c->ext_csd;
+
+    memset(c->cid, 0, sizeof(c->cid));
+    set_bits(c->cid, 120, 8, 0x15);                 /* MID */
+    set_bits(c->cid, 112, 2, 1);                    /* CBX, BGA */
+    set_bits(c->cid, 56, 32, 0x53494d4d);           /* PNM "SIMMMC" */
+    set_bits(c->cid, 88, 16, 0x4d43);
+    set_bits(c->cid, 48, 8, 0x10);                  /* PRV */
+    set_bits(c->cid, 16, 32, 0x00c0ffee);           /* PSN */
+    set_bits(c->cid, 0, 1, 1);
+
+    /*
+     * The driver sizes every card from the CSD, so describe the capacity
+     * with the version 1.0 fields: C_SIZE + 1 units of 2^(7+2) blocks.
+     */
+    memset(c->csd, 0, sizeof(c->csd));
+    set_bits(c->csd, 126, 2, 0);
+    set_bits(c->csd, 122, 4, 4);                    /* SPEC_VERS */
+    set_bits(c->csd, 112, 8, 0x27);                 /* TAAC */
+    set_bits(c->csd, 96, 8, 0x32);                  /* TRAN_SPEED 26MHz */
+    set_bits(c->csd, 84, 12, 0x8f5);                /* CCC */
+    set_bits(c->csd, 80, 4, 9);                     /* READ_BL_LEN */
+    set_bits(c->csd, 62, 12, c->nblocks / 512 - 1); /* C_SIZE */
+    set_bits(c->csd, 47, 3, 7);                     /* C_SIZE_MULT */
+    set_bits(c->csd, 42, 5, 31);                    /* ERASE_GRP_SIZE */
+    set_bits(c->csd, 37, 5, 15);                    /* ERASE_GRP_MULT */
+    set_bits(c->csd, 22, 4, 9);                     /* WRITE_BL_LEN */
+    set_bits(c->csd, 0, 1, 1);
+
+    memset(e, 0, sizeof(c->ext_csd));
+    e[EXT_CSD_REV] = 8;                             /* eMMC 5.1 */
+    e[194] = 2;                                     /* CSD_STRUCTURE */
+    e[EXT_CSD_CARD_TYPE] = 0x13;                    /* HS26, HS52, HS200 */
+    e[212] = c->nblocks & 0xff;                     /* SEC_COUNT */
+    e[213] = (c->nblocks >> 8) & 0xff;
+    e[214] = (c->nblocks >> 16) & 0xff;
+    e[215] = (c->nblocks >> 24) & 0xff;
+    e[EXT_CSD_HC_ERASE_GRP_SIZE] = 1;               /* 512KiB */
+    e[EXT_CSD_SEC_FEATURE_SUPPORT] = 0x15;          /* GB_CL_EN */
+    e[EXT_CSD_CMDQ_DEPTH] = CMDQ_DEPTH - 1;
+    e[EXT_CSD_CMDQ_SUPPORT] = 1;
+    e[504] = 1;                                     /* S_CMD_SET */
+}
+
+/* 128 bits R2, as sent on the bus */
+static void resp_r2(uint32_t *resp, const uint32_t *reg)
+{
+    memcpy(resp, reg, 4 * sizeof(uint32_t));
+}
+
+static uint32_t r1(struct sim_card *c, uint32_t extra)
+{
+    uint32_t v = R1_STATE(c->state) | c->status_err | extra;
+
+    if (c->state == ST_TRAN || c->state == ST_STBY) {
+        v |= R1_READY_FOR_DATA;
+    }
+    c->status_err = 0;
+    return v;
+}
+
+/* Erase group of a plain MMC erase, in blocks */
+static uint64_t mmc_erase_group(struct sim_card *c)
+{
+    if (c->ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 1) {
+        return c->ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] * 1024ULL;
+    }
+    return 32 * 16;
+}
+
+/************
+ *** Bus ***
+ ************/
+
+static int bus_ok(struct sim_card *c)
+{
+    static const uint32_t sd_max[] = { 25000000, 50000000, 50000000 };
+    static const uint32_t mmc_max[] = { 26000000, 52000000, 200000000 };
+    uint32_t max;
+
+    if (c->host_width != c->bus_width) {
+        return 0;
+    }
+    max = (c->type == SIM_CARD_SD) ? sd_max[c->hs_timing] : mmc_max[c->hs_timing];
+    return c->host_clock <= max;
+}
+
+void sim_card_set_bus(struct sim_card *c, int width, uint32_t clock_hz)
+{
+    c->host_width = width;
+    c->host_clock = clock_hz;
+}
+
+/*****************
+ *** Commands ***
+ *****************/
+
+static void start_data(struct sim_card *c, enum sim_data_dir dir, uint32_t blksz,
+                       uint32_t nblocks)
+{
+    c->data.dir = dir;
+    c->data.blksz = blksz;
+    c->data.nblocks = nblocks;
+    c->done = 0;
+    c->from_reg = 0;
+}
+
+static void start_reg_read(struct sim_card *c, const void *buf, uint32_t len)
+{
+    memcpy(c->regbuf, buf, len);
+    start_data(c, SIM_DATA_READ, len, 1);
+    c->from_reg = 1;
+    c->state = ST_DATA;
+}
+
+static void card_reset(struct sim_card *c)
+{
+    c->state = ST_IDLE;
+    c->rca = 0;
+    c->app_cmd = 0;
+    c->init_polls = 0;
+    c->bus_width = 1;
+    c->hs_timing = 0;
+    c->erase_tagged = 0;
+    c->queued = 0;
+    c->ready = 0;
+    c->param_task = -1;
+    c->cmdq_task = -1;
+    c->data.dir = SIM_DATA_NONE;
+    if (c->type == SIM_CARD_MMC) {
+        c->ext_csd[EXT_CSD_BUS_WIDTH] = 0;
+        c->ext_csd[EXT_CSD_HS_TIMING] = 0;
+        c->ext_csd[EXT_CSD_CMDQ_MODE_EN] = 0;
+        c->ext_csd[EXT_CSD_ERASE_GROUP_DEF] = 0;
+    }
+}
+
+static int sd_switch_func(struct sim_card *c, uint32_t arg)
+{
+    uint8_t st[64];
+    uint32_t fn = arg & 0xf;
+
+    memset(st, 0, sizeof(st));
+    st[0] = 0;
+    st[1] = 100;                    /* Max current */
+    st[12] = 0x80;                  /* Group 1 support: default, high speed */
+    st[13] = 0x03;
+    if (fn == 0xf) {
+        st[16] = c->hs_timing;
+    } else if (fn <= 1) {
+        st[16] = fn;
+        if (arg & (1U << 31)) {
+            c->hs_timing = fn;
+        }
+    } else {
+        st[16] = 0xf;
+    }
+    start_reg_read(c, st, sizeof(st));
+    return 0;
+}
+
+static uint32_t mmc_switch(struct sim_card *c, uint32_t arg)
+{
+    uint32_t index = (arg >> 16) & 0xff;
+    uint32_t value = (arg >> 8) & 0xff;
+
+    if (((arg >> 24) & 0x3) != MMC_SWITCH_MODE_WRITE_BYTE) {
+        return R1_SWITCH_ERROR;
+    }
+    switch (index) {
+    case EXT_CSD_BUS_WIDTH:
+        if (value > 2) {
+            return R1_SWITCH_ERROR;
+        }
+        c->bus_width = (value == 2) ? 8 : (value == 1) ? 4 : 1;
+        break;
+    case EXT_CSD_HS_TIMING:
+        if (value > 2 || (value == 2 && !(c->ext_csd[EXT_CSD_CARD_TYPE] & 0x10))) {
+            return R1_SWITCH_ERROR;
+        }
+        c->hs_timing = value;
+        break;
+    case EXT_CSD_CMDQ_MODE_EN:
+        if (value > 1 || (!value && c->queued)) {
+            return R1_SWITCH_ERROR;
+        }
+        break;
+    case EXT_CSD_ERASE_GROUP_DEF:
+        if (value > 1) {
+            return R1_SWITCH_ERROR;
+        }
+        break;
+    default:
+        return R1_SWITCH_ERROR;
+    }
+    c->ext_csd[index] = value;
+    c->busy_ns = T_SWITCH_NS;
+    return 0;
+}
+
+static uint32_t do_erase(struct sim_card *c, uint32_t arg)
+{
+    uint64_t start = c->erase_start;
+    uint64_t end = c->erase_end + 1;
+    uint64_t grp = 1;
+    int discard = 0;
+
+    if (!c->erase_tagged || end <= start) {
+        return R1_ERASE_SEQ_ERROR;
+    }
+    c->erase_tagged = 0;
+
+    switch (arg) {
+    case MMC_ERASE_ARG:
+        c->stats.erases++;
+        if (c->type == SIM_CARD_MMC) {
+            /* A plain erase takes out every group the range touches */
+            grp = mmc_erase_group(c);
+            if (start % grp || end % grp) {
+                c->stats.unaligned_erases++;
+            }
+            start = start / grp * grp;
+            end = MIN(DIV_ROUND_UP(end, grp) * grp, c->nblocks);
+        }
+        c->busy_ns = T_ERASE_NS + T_ERASE_GRP_NS * ((end - start) / grp);
+        break;
+    case MMC_TRIM_ARG:
+        if (c->type == SIM_CARD_MMC && !(c->ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] & EXT_CSD_SEC_GB_CL_EN)) {
+            return R1_ERASE_PARAM;
+        }
+        c->stats.trims++;
+        c->busy_ns = T_TRIM_NS + T_TRIM_BLK_NS * (end - start);
+        break;
+    case MMC_DISCARD_ARG:
+        if (c->type != SIM_CARD_MMC) {
+            return R1_ERASE_PARAM;
+        }
+        c->stats.discards++;
+        c->busy_ns = T_DISCARD_NS;
+        discard = 1;
+        break;
+    default:
+        return R1_ERASE_PARAM;
+    }
+
+    /* Discarded blocks keep whatever they held, the rest read as zero */
+    if (!discard) {
+        memset(c->image + start * BLOCK, 0, (end - start) * BLOCK);
+    }
+    c->stats.blocks_erased += end - start;
+    return 0;
+}
+
+static int cmdq_on(struct sim_card *c)
+{
+    return c->type == SIM_CARD_MMC && c->ext_csd[EXT_CSD_CMDQ_MODE_EN];
+}
+
+static int sd_app_cmd(struct sim_card *c, uint32_t index, uint32_t arg, uint32_t *resp)
+{
+    c->stats.acmds++;
+    switch (index) {
+    case SD_SET_BUS_WIDTH:
+        if (c->state != ST_TRAN || (arg & 3) == 1 || (arg & 3) == 3) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        c->bus_width = (arg & 3) ? 4 : 1;
+        resp[0] = r1(c, R1_APP_CMD);
+        return 0;
+    case SD_SD_APP_OP_COND:
+        if (c->state != ST_IDLE) {
+            return -1;
+        }
+        resp[0] = OCR_VOLTAGES;
+        if (arg & OCR_VOLTAGES) {
+            if (++c->init_polls > SD_INIT_POLLS) {
+                c->ocr = OCR_VOLTAGES | OCR_BUSY | ((arg & OCR_CCS) ? OCR_CCS : 0);
+                resp[0] = c->ocr;
+                c->state = ST_READY;
+            }
+        }
+        return 0;
+    case SD_SET_WR_BLK_ERASE_COUNT:
+        if (c->state != ST_TRAN) {
+            return -1;
+        }
+        c->hint = arg & 0x7fffff;
+        c->stats.pre_erase_hints++;
+        resp[0] = r1(c, R1_APP_CMD);
+        return 0;
+    case SD_SEND_SCR:
+        if (c->state != ST_TRAN) {
+            return -1;
+        }
+        resp[0] = r1(c, R1_APP_CMD);
+        start_reg_read(c, c->scr, sizeof(c->scr));
+        return 0;
+    default:
+        c->status_err |= R1_ILLEGAL_COMMAND;
+        return -1;
+    }
+}
+
+int sim_card_cmd(struct sim_card *c, uint32_t index, uint32_t arg, uint32_t resp[4])
+{
+    int sd = c->type == SIM_CARD_SD;
+    uint32_t err;
+    int t;
+
+    c->stats.cmds++;
+    c->stats.by_index[index & 63]++;
+    c->busy_ns = 0;
+    memset(resp, 0, 4 * sizeof(uint32_t));
+
+    if (c->app_cmd) {
+        c->app_cmd = 0;
+        if (sd && index != MMC_APP_CMD) {
+            return sd_app_cmd(c, index, arg, resp);
+        }
+    }
+
+    /* A new command ends a register read that the host did not finish */
+    if (c->state == ST_DATA && index != MMC_STOP_TRANSMISSION && index != MMC_SEND_STATUS) {
+        c->state = ST_TRAN;
+    }
+    if (index != MMC_STOP_TRANSMISSION) {
+        c->data.dir = SIM_DATA_NONE;
+    }
+
+    switch (index) {
+    case MMC_GO_IDLE_STATE:
+        card_reset(c);
+        return 0;
+
+    case MMC_SEND_OP_COND:
+        if (sd || c->state != ST_IDLE) {
+            return -1;
+        }
+        /* Powered up by the boot ROM, so never busy */
+        c->ocr = OCR_VOLTAGES | 0x80 | OCR_BUSY | OCR_CCS;
+        resp[0] = c->ocr;
+        c->state = ST_READY;
+        return 0;
+
+    case MMC_ALL_SEND_CID:
+        if (c->state != ST_READY) {
+            return -1;
+        }
+        c->state = ST_IDENT;
+        resp_r2(resp, c->cid);
+        return 0;
+
+    case MMC_SEND_RELATIVE_ADDR:
+        if (c->state != ST_IDENT && !(sd && c->state == ST_STBY)) {
+            return -1;
+        }
+        if (sd) {
+            c->rca = SD_RCA;
+            resp[0] = (c->rca << 16) | R1_STATE(c->state);
+        } else {
+            c->rca = arg >> 16;
+            resp[0] = r1(c, 0);
+        }
+        c->state = ST_STBY;
+        return 0;
+
+    case MMC_SEND_CSD:
+    case MMC_SEND_CID:
+        if (c->state != ST_STBY || (arg >> 16) != c->rca) {
+            return -1;
+        }
+        resp_r2(resp, index == MMC_SEND_CSD ? c->csd : c->cid);
+        return 0;
+
+    case MMC_SELECT_CARD:
+        if (c->state < ST_STBY) {
+            return -1;
+        }
+        resp[0] = r1(c, 0);
+        c->state = ((arg >> 16) == c->rca) ? ST_TRAN : ST_STBY;
+        return 0;
+
+    case MMC_SEND_EXT_CSD:
+        if (sd) {
+            /* SEND_IF_COND, echo the check pattern for 2.7-3.6V */
+            if (c->state != ST_IDLE || ((arg >> 8) & 0xf) != 1) {
+                return -1;
+            }
+            resp[0] = arg & 0xfff;
+            return 0;
+        }
+        if (c->state != ST_TRAN) {
+            return -1;
+        }
+        resp[0] = r1(c, 0);
+        start_reg_read(c, c->ext_csd, sizeof(c->ext_csd));
+        return 0;
+
+    case MMC_SWITCH:
+        if (c->state != ST_TRAN) {
+            return -1;
+        }
+        if (sd) {
+            resp[0] = r1(c, 0);
+            return sd_switch_func(c, arg);
+        }
+        err = mmc_switch(c, arg);
+        resp[0] = r1(c, 0);
+        c->status_err |= err;
+        return 0;
+
+    case MMC_STOP_TRANSMISSION:
+        if (c->state != ST_DATA && c->state != ST_RCV) {
+            resp[0] = r1(c, 0);
+            return 0;
+        }
+        resp[0] = r1(c, 0);
+        if (c->data.dir == SIM_DATA_WRITE) {
+            c->busy_ns = (c->hint && c->hint == c->done)
+                         ? T_PROGRAM_HINT_NS + T_PROGRAM_HBLK_NS * c->done
+                         : T_PROGRAM_NS + T_PROGRAM_BLK_NS * c->done;
+            c->hint = 0;
+        }
+        c->data.dir = SIM_DATA_NONE;
+        c->state = ST_TRAN;
+        return 0;
+
+    case MMC_SEND_STATUS:
+        if (c->state < ST_STBY || (arg >> 16) != c->rca) {
+            return -1;
+        }
+        if (cmdq_on(c) && (arg & MMC_STATUS_SQS)) {
+            /*
+             * A task becomes ready at the query after the one that first
+             * sees it queued, so the host also gets to see an empty QSR.
+             */
+            resp[0] = c->ready & c->queued;
+            c->ready = c->queued;
+            return 0;
+        }
+        resp[0] = r1(c, 0);
+        return 0;
+
+    case MMC_SET_BLOCKLEN:
+        if (c->state != ST_TRAN) {
+            return -1;
+        }
+        resp[0] = r1(c, (arg != BLOCK) ? R1_ERASE_PARAM : 0);
+        return 0;
+
+    case MMC_READ_SINGLE_BLOCK:
+    case MMC_READ_MULTIPLE_BLOCK:
+    case MMC_WRITE_BLOCK:
+    case MMC_WRITE_MULTIPLE_BLOCK:
+        if (c->state != ST_TRAN || cmdq_on(c)) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        if (arg >= c->nblocks) {
+            resp[0] = r1(c, R1_OUT_OF_RANGE);
+            return 0;
+        }
+        resp[0] = r1(c, 0);
+        c->addr = arg;
+        if (index == MMC_READ_SINGLE_BLOCK || index == MMC_READ_MULTIPLE_BLOCK) {
+            start_data(c, SIM_DATA_READ, BLOCK, index == MMC_READ_SINGLE_BLOCK);
+            c->state = ST_DATA;
+        } else {
+            start_data(c, SIM_DATA_WRITE, BLOCK, index == MMC_WRITE_BLOCK);
+            c->state = ST_RCV;
+        }
+        return 0;
+
+    case SD_SEND_TUNING_BLOCK:
+    case MMC_SEND_TUNING_BLOCK_HS200: {
+        uint8_t pattern[128];
+        uint32_t len = (c->bus_width == 8) ? 128 : 64;
+        int i;
+
+        if (c->state != ST_TRAN || (sd != (index == SD_SEND_TUNING_BLOCK))) {
+            return -1;
+        }
+        for (i = 0; i < (int)len; i++) {
+            pattern[i] = (i & 1) ? 0x0f : 0xf0;
+        }
+        resp[0] = r1(c, 0);
+        start_reg_read(c, pattern, len);
+        return 0;
+    }
+
+    case MMC_TAG_SECTOR_START:
+    case MMC_TAG_SECTOR_END:
+    case MMC_TAG_ERASE_GROUP_START:
+    case MMC_TAG_ERASE_GROUP_END:
+        if (c->state != ST_TRAN ||
+            sd != (index == MMC_TAG_SECTOR_START || index == MMC_TAG_SECTOR_END)) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        if (arg >= c->nblocks) {
+            resp[0] = r1(c, R1_OUT_OF_RANGE);
+            c->erase_tagged = 0;
+            return 0;
+        }
+        if (index == MMC_TAG_SECTOR_START || index == MMC_TAG_ERASE_GROUP_START) {
+            c->erase_start = arg;
+            c->erase_tagged = 0;
+        } else {
+            c->erase_end = arg;
+            c->erase_tagged = 1;
+        }
+        resp[0] = r1(c, 0);
+        return 0;
+
+    case MMC_ERASE:
+        if (c->state != ST_TRAN) {
+            return -1;
+        }
+        err = do_erase(c, arg);
+        resp[0] = r1(c, err);
+        if (err) {
+            c->stats.errors++;
+        }
+        return 0;
+
+    case MMC_QUEUED_TASK_PARAMS:
+        if (!cmdq_on(c) || c->state != ST_TRAN) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        t = (arg >> 16) & 0x1f;
+        if (t >= CMDQ_DEPTH || (c->queued & (1U << t)) || !(arg & 0xffff)) {
+            resp[0] = r1(c, R1_ADDRESS_ERROR);
+            c->stats.errors++;
+            return 0;
+        }
+        c->task[t].read = !!(arg & MMC_CMDQ_DIR_READ);
+        c->task[t].nblocks = arg & 0xffff;
+        c->param_task = t;
+        resp[0] = r1(c, 0);
+        return 0;
+
+    case MMC_QUEUED_TASK_ADDRESS:
+        if (!cmdq_on(c) || c->param_task < 0) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        t = c->param_task;
+        c->param_task = -1;
+        if (arg + (uint64_t)c->task[t].nblocks > c->nblocks) {
+            resp[0] = r1(c, R1_OUT_OF_RANGE);
+            c->stats.errors++;
+            return 0;
+        }
+        c->task[t].addr = arg;
+        c->queued |= 1U << t;
+        c->stats.queued_tasks++;
+        resp[0] = r1(c, 0);
+        return 0;
+
+    case MMC_EXECUTE_READ_TASK:
+    case MMC_EXECUTE_WRITE_TASK:
+        t = (arg >> 16) & 0x1f;
+        if (!cmdq_on(c) || t >= CMDQ_DEPTH || !(c->queued & c->ready & (1U << t)) ||
+            c->task[t].read != (index == MMC_EXECUTE_READ_TASK)) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        resp[0] = r1(c, 0);
+        c->addr = c->task[t].addr;
+        c->cmdq_task = t;
+        start_data(c, c->task[t].read ? SIM_DATA_READ : SIM_DATA_WRITE, BLOCK,
+                   c->task[t].nblocks);
+        c->state = c->task[t].read ? ST_DATA : ST_RCV;
+        return 0;
+
+    case MMC_CMDQ_TASK_MGMT:
+        if (!cmdq_on(c)) {
+            c->status_err |= R1_ILLEGAL_COMMAND;
+            return -1;
+        }
+        if ((arg & 0xf) == 1) {
+            c->queued = 0;
+        } else if ((arg & 0xf) == MMC_CMDQ_DISCARD_TASK) {
+            c->queued &= ~(1U << ((arg >> 16) & 0x1f));
+        }
+        resp[0] = r1(c, 0);
+        return 0;
+
+    case MMC_APP_CMD:
+        if (!sd || (arg >> 16) != c->rca) {
+            return -1;
+        }
+        c->app_cmd = 1;
+        resp[0] = r1(c, R1_APP_CMD);
+        return 0;
+
+    default:
+        c->status_err |= R1_ILLEGAL_COMMAND;
+        return -1;
+    }
+}
+
+void sim_card_data(struct sim_card *c, struct sim_data *d)
+{
+    *d = c->data;
+}
+
+/* A finished data stage returns the card to transfer state */
+static void data_block_done(struct sim_card *c)
+{
+    c->done++;
+    if (c->data.nblocks && c->done == c->data.nblocks) {
+        if (c->data.dir == SIM_DATA_WRITE) {
+            c->busy_ns = T_PROGRAM_NS + T_PROGRAM_BLK_NS * c->done;
+        }
+        if (c->cmdq_task >= 0) {
+            c->queued &= ~(1U << c->cmdq_task);
+            c->cmdq_task = -1;
+        }
+        c->data.dir = SIM_DATA_NONE;
+        c->state = ST_TRAN;
+    }
+}
+
+int sim_card_read_block(struct sim_card *c, uint8_t *buf, uint32_t len)
+{
+    if (c->data.dir != SIM_DATA_READ || len != c->data.blksz || !bus_ok(c)) {
+        return -1;
+    }
+    if (c->from_reg) {
+        memcpy(buf, c->regbuf, len);
+    } else {
+        if (c->addr >= c->nblocks) {
+            c->status_err |= R1_OUT_OF_RANGE;
+            return -1;
+        }
+        memcpy(buf, c->image + c->addr * BLOCK, BLOCK);
+        c->addr++;
+        c->stats.blocks_read++;
+    }
+    data_block_done(c);
+    return 0;
+}
+
+int sim_card_write_block(struct sim_card *c, const uint8_t *buf, uint32_t len)
+{
+    if (c->data.dir != SIM_DATA_WRITE || len != BLOCK || !bus_ok(c)) {
+        return -1;
+    }
+    if (c->addr >= c->nblocks) {
+        c->status_err |= R1_OUT_OF_RANGE;
+        return -1;
+    }
+    memcpy(c->image + c->addr * BLOCK, buf, BLOCK);
+    c->addr++;
+    c->stats.blocks_written++;
+    data_block_done(c);
+    return 0;
+}
+
+uint64_t sim_card_busy_ns(struct sim_card *c)
+{
+    return c->busy_ns;
+}
+
+uint64_t sim_card_access_ns(struct sim_card *c)
+{
+    return c->from_reg ? 0 : T_ACCESS_NS;
+}
+
+/**************
+ *** Setup ***
+ **************/
+
+struct sim_card *sim_card_create(enum sim_card_type type, const char *image,
+                                 uint64_t size)
+{
+    struct sim_card *c;
+    struct stat st;
+    uint64_t unit = (type == SIM_CARD_SD) ? 512 * 1024 : 256 * 1024;
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->type = type;
+
+    if (image) {
+        c->fd = open(image, O_RDWR | O_CREAT, 0644);
+        if (c->fd < 0 || fstat(c->fd, &st)) {
+            perror(image);
+            free(c);
+            return NULL;
+        }
+        if (!size) {
+            size = st.st_size;
+        }
+    } else {
+        c->fd = memfd_create("sim_card", 0);
+    }
+    if (!size || size % unit || (type == SIM_CARD_MMC && size > (1ULL << 30))) {
+        fprintf(stderr, "sim_card: size must be a non zero multiple of %lluKiB%s\n",
+                (unsigned long long)unit / 1024,
+                type == SIM_CARD_MMC ? ", at most 1GiB" : "");
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    if (c->fd < 0 || ((!image || (uint64_t)st.st_size < size) && ftruncate(c->fd, size))) {
+        perror("sim_card: image");
+        free(c);
+        return NULL;
+    }
+    c->image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (c->image == MAP_FAILED) {
+        perror("sim_card: mmap");
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    c->size = size;
+    c->nblocks = size / BLOCK;
+
+    if (type == SIM_CARD_SD) {
+        build_sd_regs(c);
+    } else {
+        build_mmc_regs(c);
+    }
+    card_reset(c);
+    return c;
+}
+
+void sim_card_destroy(struct sim_card *c)
+{
+    munmap(c->image, c->size);
+    close(c->fd);
+    free(c);
+}
+
+uint8_t *sim_card_image(struct sim_card *c)
+{
+    return c->image;
+}
+
+uint64_t sim_card_size(struct sim_card *c)
+{
+    return c->size;
+}
+
+int sim_card_bus_width(struct sim_card *c)
+{
+    return c->bus_width;
+}
+
+const char *sim_card_timing(struct sim_card *c)
+{
+    static const char *const names[] = { "legacy", "high speed", "HS200" };
+
+    return names[c->hs_timing];
+}
+
+void sim_card_get_stats(struct sim_card *c, struct sim_card_stats *st)
+{
+    *st = c->stats;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * A simulated SD or eMMC card backed by an image file.
+ *
+ * The card implements the command set libsdhcdrivers uses: identification,
+ * CSD/CID/SCR/EXT_CSD, bus width and speed switching, tuning, single and
+ * multiple block transfers, erase/TRIM/DISCARD and the eMMC command queue.
+ * It checks the bus width and clock the host uses against the mode the card
+ * has been switched to, and fails data transfers that do not match.
+ *
+ * Cards are always high capacity (sector addressed).
+ */
+#pragma once
+
+#include <stdint.h>
+
+enum sim_card_type {
+    SIM_CARD_SD,
+    SIM_CARD_MMC,
+};
+
+enum sim_data_dir {
+    SIM_DATA_NONE = 0,
+    SIM_DATA_READ,
+    SIM_DATA_WRITE,
+};
+
+/* The data stage of the last command */
+struct sim_data {
+    enum sim_data_dir dir;
+    uint32_t blksz;
+    uint32_t nblocks;       /* 0 for open ended, until CMD12 */
+};
+
+struct sim_card_stats {
+    uint64_t cmds;
+    uint64_t acmds;
+    uint64_t by_index[64];
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t erases;
+    uint64_t trims;
+    uint64_t discards;
+    uint64_t blocks_erased;
+    uint64_t unaligned_erases;  /* Plain erases not on erase group bounds */
+    uint64_t pre_erase_hints;   /* ACMD23 */
+    uint64_t queued_tasks;
+    uint64_t errors;            /* Commands answered with an error bit */
+};
+
+struct sim_card;
+
+/**
+ * Create a card. The image is created or grown to size bytes, a size of 0
+ * takes the size of an existing image. A NULL image uses anonymous memory.
+ */
+struct sim_card *sim_card_create(enum sim_card_type type, const char *image,
+                                 uint64_t size);
+
+void sim_card_destroy(struct sim_card *c);
+
+/**
+ * Execute a command.
+ * @param[out] resp  The response: the 32 bit status, OCR or RCA word in
+ *                   resp[0], or the 128 bit CID/CSD with bits 31:0 in
+ *                   resp[0] for R2.
+ * @return           0 on success, -1 if the card does not respond.
+ */
+int sim_card_cmd(struct sim_card *c, uint32_t index, uint32_t arg,
+                 uint32_t resp[4]);
+
+/** The data stage that the last command started */
+void sim_card_data(struct sim_card *c, struct sim_data *d);
+
+/**
+ * Move the next block of the data stage. Reads past the end of the card
+ * or a bus mode mismatch fail.
+ * @return 0 on success
+ */
+int sim_card_read_block(struct sim_card *c, uint8_t *buf, uint32_t len);
+int sim_card_write_block(struct sim_card *c, const uint8_t *buf, uint32_t len);
+
+/**
+ * Tell the card how the host drives the bus, so that data transfers in a
+ * mode the card has not been switched to fail.
+ */
+void sim_card_set_bus(struct sim_card *c, int width, uint32_t clock_hz);
+
+/** Time the card holds DAT0 busy after the last command or data stage */
+uint64_t sim_card_busy_ns(struct sim_card *c);
+
+/** Time from a read command to the first data block */
+uint64_t sim_card_access_ns(struct sim_card *c);
+
+/** The backing image, for checking data */
+uint8_t *sim_card_image(struct sim_card *c);
+uint64_t sim_card_size(struct sim_card *c);
+
+int sim_card_bus_width(struct sim_card *c);
+const char *sim_card_timing(struct sim_card *c);
+
+void sim_card_get_stats(struct sim_card *c, struct sim_card_stats *st);
@@ -47,9 +47,29 @@
         if (!function) { ZF_LOGE(#function " not implemented"); return -ENOSYS; }   \
     } while(0)
 
+/*
+ * A request for tx2_bpmp_submit(). The struct and both buffers belong to the
+ * driver from submission until status is no longer -EINPROGRESS.
+ */
+struct tx2_bpmp_request {
+    int mrq;
+    void *tx_msg;
+    size_t tx_size;
+    void *rx_msg;
+    size_t rx_size;
+    /* -EINPROGRESS, then what tx2_bpmp_call() would have returned */
+    int status;
+    /* Private to the driver */
+    struct tx2_bpmp_request *next;
+};
+
 struct tx2_bpmp {
     void *data;
     int (*call)(void *data, int mrq, void *tx_msg, size_t tx_size, void *rx_msg, size_t rx_size);
+    int (*submit)(void *data, struct tx2_bpmp_request *reqs, int nreqs);
+    int (*poll)(void *data);
+    int (*wait)(void *data, struct tx2_bpmp_request *req);
+    int (*cancel)(void *data, struct tx2_bpmp_request *reqs, int nreqs);
     int (*destroy)(void *data);
 };
 
@@ -77,7 +97,8 @@ static inline int tx2_bpmp_destroy(struct tx2_bpmp *bpmp)
 }
 
 /*
- * Sends a request to the BPMP device module and waits for a response.
+ * Sends a request to the BPMP device module and waits for a response, spinning
+ * as tx2_bpmp_wait() does.
  *
  * @param bpmp An initialised BPMP interface.
  * @param mrq The Message Request (MRQ) code of the request. See MRQ_Codes below for the valid codes.
@@ -95,6 +116,77 @@ static inline int tx2_bpmp_call(struct tx2_bpmp *bpmp, int mrq, void *tx_msg, si
     return bpmp->call(bpmp->data, mrq, tx_msg, tx_size, rx_msg, rx_size);
 }
 
+/*
+ * Queues requests to the BPMP device module without waiting for them. The
+ * first is written to the channel straight away. The channel holds one
+ * request, so each of the others is written when tx2_bpmp_poll() or
+ * tx2_bpmp_wait() has read the response before it. Responses are matched to
+ * requests in submission order.
+ *
+ * @param bpmp An initialised BPMP interface.
+ * @param reqs Array of requests, see struct tx2_bpmp_request.
+ * @param nreqs Number of requests in the array.
+ *
+ * @return 0 on success, otherwise an error code, in which case the driver has
+ *         given all of the requests back with that status.
+ */
+static inline int tx2_bpmp_submit(struct tx2_bpmp *bpmp, struct tx2_bpmp_request *reqs, int nreqs)
+{
+    __BPMP_CHECK_ARGS(bpmp->submit);
+    return bpmp->submit(bpmp->data, reqs, nreqs);
+}
+
+/*
+ * Completes the requests that the BPMP has responded to and sends the next
+ * queued one, without waiting.
+ *
+ * @param bpmp An initialised BPMP interface.
+ *
+ * @return The number of requests still outstanding, otherwise an error code.
+ */
+static inline int tx2_bpmp_poll(struct tx2_bpmp *bpmp)
+{
+    __BPMP_CHECK_ARGS(bpmp->poll);
+    return bpmp->poll(bpmp->data);
+}
+
+/*
+ * Waits for a submitted request, and all requests submitted before it, to
+ * complete. This spins on the CPU until then; callers that must not spin
+ * should use tx2_bpmp_poll() from their own event loop instead.
+ *
+ * @param bpmp An initialised BPMP interface.
+ * @param req A request passed to tx2_bpmp_submit().
+ *
+ * @return 0 once the request has completed, with its status set, otherwise an
+ *         error code. On a timeout or a channel error, the request and the
+ *         ones submitted before it that were still outstanding are dropped
+ *         with the error as their status, and their responses are
+ *         discarded, so they can be reused.
+ */
+static inline int tx2_bpmp_wait(struct tx2_bpmp *bpmp, struct tx2_bpmp_request *req)
+{
+    __BPMP_CHECK_ARGS(bpmp->wait);
+    return bpmp->wait(bpmp->data, req);
+}
+
+/*
+ * Takes back submitted requests that have not completed, for instance before
+ * freeing them. They get a status of -ECANCELED, and responses to the ones
+ * already sent to the BPMP are discarded.
+ *
+ * @param bpmp An initialised BPMP interface.
+ * @param reqs Array of requests passed to tx2_bpmp_submit().
+ * @param nreqs Number of requests in the array.
+ *
+ * @return 0 on success, otherwise an error code.
+ */
+static inline int tx2_bpmp_cancel(struct tx2_bpmp *bpmp, struct tx2_bpmp_request *reqs, int nreqs)
+{
+    __BPMP_CHECK_ARGS(bpmp->cancel);
+    return bpmp->cancel(bpmp->data, reqs, nreqs);
+}
+
 /**
  * @defgroup MRQ MRQ Messages
  * @brief Messages sent to/from BPMP via IPC
@@ -92,10 +92,11 @@ static inline int tx2_hsp_doorbell_ring(tx2_hsp_t *hsp, enum tx2_doorbell_id db_
  * @param hsp Initialised HSP interface.
  * @param db_id The ID of the corresponding device module doorbell to check.
  *
- * @return 0 on success, otherwise an error code.
+ * @return 1 if the doorbell was rung since the last check, 0 if not,
+ *         otherwise an error code.
  */
 static inline int tx2_hsp_doorbell_check(tx2_hsp_t *hsp, enum tx2_doorbell_id db_id)
 {
     __HSP_CHECK_ARGS(check);
-    return hsp->check(hsp->check, db_id);
+    return hsp->check(hsp->data, db_id);
 }
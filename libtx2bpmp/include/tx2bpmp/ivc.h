@@ -144,6 +144,65 @@ int tegra_ivc_write_get_next_frame(struct tegra_ivc *ivc, void **frame);
  */
 int tegra_ivc_write_advance(struct tegra_ivc *ivc);
 
+/**
+ * tegra_ivc_read_get_frames - Locate the received frames that can be read in
+ * place.
+ *
+ * Like tegra_ivc_read_get_next_frame(), but for all received frames that
+ * follow each other in shared memory, up to the end of the buffer. Frames
+ * after a wrap are returned by the next call, once these have been consumed.
+ *
+ * @ivc		The IVC channel.
+ * @frame	Pointer to be filled with the address of the first frame.
+ * @count	Pointer to be filled with the number of frames.
+ *
+ * @return 0 if at least one frame is available, else a negative error code.
+ */
+int tegra_ivc_read_get_frames(struct tegra_ivc *ivc, void **frame, uint32_t *count);
+
+/**
+ * tegra_ivc_read_advance_n - Advance the read queue by several frames.
+ *
+ * Like tegra_ivc_read_advance(), with a single counter update, barrier and
+ * notification for all of the frames.
+ *
+ * @ivc		The IVC channel.
+ * @n		The number of frames consumed, at most the count returned by
+ *		tegra_ivc_read_get_frames().
+ *
+ * @return 0 if OK, else a negative error code.
+ */
+int tegra_ivc_read_advance_n(struct tegra_ivc *ivc, uint32_t n);
+
+/**
+ * tegra_ivc_write_get_frames - Locate the free frames that can be filled in
+ * place.
+ *
+ * Like tegra_ivc_write_get_next_frame(), but for all free frames that follow
+ * each other in shared memory, up to the end of the buffer.
+ *
+ * @ivc		The IVC channel.
+ * @frame	Pointer to be filled with the address of the first frame.
+ * @count	Pointer to be filled with the number of frames.
+ *
+ * @return 0 if at least one frame is free, else a negative error code.
+ */
+int tegra_ivc_write_get_frames(struct tegra_ivc *ivc, void **frame, uint32_t *count);
+
+/**
+ * tegra_ivc_write_advance_n - Advance the write queue by several frames.
+ *
+ * Like tegra_ivc_write_advance(), with a single counter update, pair of
+ * barriers and notification for all of the frames.
+ *
+ * @ivc		The IVC channel.
+ * @n		The number of frames filled, at most the count returned by
+ *		tegra_ivc_write_get_frames().
+ *
+ * @return 0 if OK, else a negative error code.
+ */
+int tegra_ivc_write_advance_n(struct tegra_ivc *ivc, uint32_t n);
+
 /**
  * tegra_ivc_channel_notified - handle internal messages
  *
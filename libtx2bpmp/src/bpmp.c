@@ -23,6 +23,8 @@
 
 #define BPMP_IVC_FRAME_COUNT 1
 #define BPMP_IVC_FRAME_SIZE 128
+/* Space for the message after the MRQ header */
+#define BPMP_IVC_MSG_SIZE (BPMP_IVC_FRAME_SIZE - sizeof(struct mrq_request))
 
 #define BPMP_FLAG_DO_ACK	BIT(0)
 #define BPMP_FLAG_RING_DOORBELL	BIT(1)
@@ -31,7 +33,10 @@
 #define RX_SHMEM 1
 #define NUM_SHMEM 2
 
+/* Iterations of the wait loop, not a time */
 #define TIMEOUT_THRESHOLD 2000000ul
+/* Doorbell checks between looks at the IVC channel while waiting */
+#define BPMP_CHANNEL_POLL_INTERVAL 64
 
 struct tx2_bpmp_priv {
     ps_io_ops_t *io_ops;
@@ -41,6 +46,13 @@ struct tx2_bpmp_priv {
     void *tx_base; // Virtual address base of the TX shared memory channel
     void *rx_base; // Virtual address base of the RX shared memory channel
     pmem_region_t bpmp_shmems[NUM_SHMEM];
+    /* Submitted requests not yet written to the channel */
+    struct tx2_bpmp_request *queue_head;
+    struct tx2_bpmp_request *queue_tail;
+    /* Requests written to the channel, in order, NULL if dropped */
+    struct tx2_bpmp_request *inflight[BPMP_IVC_FRAME_COUNT];
+    int inflight_head;
+    int inflight_count;
 };
 
 
@@ -48,71 +60,322 @@ static bool bpmp_initialised = false;
 static unsigned int bpmp_refcount = 0;
 static struct tx2_bpmp_priv bpmp_data = {0};
 
-static int bpmp_call(void *data, int mrq, void *tx_msg, size_t tx_size, void *rx_msg, size_t rx_size)
+/* Write queued requests into free IVC frames, a run of frames at a time */
+static int bpmp_fill_frames(struct tx2_bpmp_priv *bpmp_priv)
+{
+    int ret;
+    void *ivc_frame;
+    uint32_t count, n;
+    struct mrq_request *req;
+    struct tx2_bpmp_request *next;
+
+    while (bpmp_priv->queue_head && bpmp_priv->inflight_count < BPMP_IVC_FRAME_COUNT) {
+        ret = tegra_ivc_write_get_frames(&bpmp_priv->ivc, &ivc_frame, &count);
+        if (ret == -ENOMEM) {
+            /* The BPMP has not released a frame yet */
+            return 0;
+        } else if (ret) {
+            ZF_LOGE("tegra_ivc_write_get_frames() failed: %d\n", ret);
+            return ret;
+        }
+
+        next = bpmp_priv->queue_head;
+        count = MIN(count, BPMP_IVC_FRAME_COUNT - bpmp_priv->inflight_count);
+        for (n = 0; n < count && next; n++, next = next->next) {
+            req = ivc_frame + n * BPMP_IVC_FRAME_SIZE;
+            req->mrq = next->mrq;
+            req->flags = BPMP_FLAG_DO_ACK | BPMP_FLAG_RING_DOORBELL;
+            memcpy(req + 1, next->tx_msg, next->tx_size);
+        }
+
+        ret = tegra_ivc_write_advance_n(&bpmp_priv->ivc, n);
+        if (ret) {
+            ZF_LOGE("tegra_ivc_write_advance_n() failed: %d\n", ret);
+            return ret;
+        }
+
+        for (; n > 0; n--) {
+            next = bpmp_priv->queue_head;
+            bpmp_priv->queue_head = next->next;
+            bpmp_priv->inflight[(bpmp_priv->inflight_head + bpmp_priv->inflight_count) % BPMP_IVC_FRAME_COUNT] = next;
+            bpmp_priv->inflight_count++;
+        }
+        if (!bpmp_priv->queue_head) {
+            bpmp_priv->queue_tail = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* Complete the in-flight requests that have a response, in order */
+static int bpmp_read_frames(struct tx2_bpmp_priv *bpmp_priv)
+{
+    int ret;
+    void *ivc_frame;
+    uint32_t count, n;
+    int32_t err[BPMP_IVC_FRAME_COUNT];
+    struct mrq_response *resp;
+    struct tx2_bpmp_request *req;
+
+    while (bpmp_priv->inflight_count) {
+        ret = tegra_ivc_read_get_frames(&bpmp_priv->ivc, &ivc_frame, &count);
+        if (ret == -ENOMEM) {
+            return 0;
+        } else if (ret) {
+            ZF_LOGE("tegra_ivc_read_get_frames() failed: %d\n", ret);
+            return ret;
+        }
+
+        count = MIN(count, bpmp_priv->inflight_count);
+        for (n = 0; n < count; n++) {
+            /* A request that timed out has left a NULL behind, drop its response */
+            req = bpmp_priv->inflight[(bpmp_priv->inflight_head + n) % BPMP_IVC_FRAME_COUNT];
+            resp = ivc_frame + n * BPMP_IVC_FRAME_SIZE;
+            err[n] = resp->err;
+            if (req && !err[n] && req->rx_msg && req->rx_size) {
+                memcpy(req->rx_msg, resp + 1, req->rx_size);
+            }
+        }
+
+        ret = tegra_ivc_read_advance_n(&bpmp_priv->ivc, count);
+        if (ret) {
+            ZF_LOGE("tegra_ivc_read_advance_n() failed: %d\n", ret);
+            return ret;
+        }
+
+        for (n = 0; n < count; n++) {
+            req = bpmp_priv->inflight[bpmp_priv->inflight_head];
+            bpmp_priv->inflight_head = (bpmp_priv->inflight_head + 1) % BPMP_IVC_FRAME_COUNT;
+            bpmp_priv->inflight_count--;
+
+            if (!req) {
+                continue;
+            }
+            if (err[n]) {
+                ZF_LOGE("BPMP responded with error %d to MRQ %d\n", err[n], req->mrq);
+                /* err isn't a U-Boot error code, so don't that */
+                req->status = -EIO;
+            } else {
+                req->status = req->rx_size;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Detach the requests of an array that are still outstanding from the driver,
+ * wherever they are in the queue, so that the caller can have them back. A
+ * response to a frame that was already written is discarded.
+ */
+static void bpmp_take_back(struct tx2_bpmp_priv *bpmp_priv, struct tx2_bpmp_request *reqs, int nreqs,
+                           int status)
 {
-	int ret, err;
-	void *ivc_frame;
-	struct mrq_request *req;
-	struct mrq_response *resp;
-	unsigned long timeout = TIMEOUT_THRESHOLD;
+    struct tx2_bpmp_request **prev, *last = NULL;
 
+    for (int i = 0; i < bpmp_priv->inflight_count; i++) {
+        int slot = (bpmp_priv->inflight_head + i) % BPMP_IVC_FRAME_COUNT;
+        if (bpmp_priv->inflight[slot] >= reqs && bpmp_priv->inflight[slot] < reqs + nreqs) {
+            bpmp_priv->inflight[slot] = NULL;
+        }
+    }
+
+    for (prev = &bpmp_priv->queue_head; *prev;) {
+        if (*prev >= reqs && *prev < reqs + nreqs) {
+            *prev = (*prev)->next;
+        } else {
+            last = *prev;
+            prev = &(*prev)->next;
+        }
+    }
+    bpmp_priv->queue_tail = last;
+
+    for (int i = 0; i < nreqs; i++) {
+        if (reqs[i].status == -EINPROGRESS) {
+            reqs[i].status = status;
+        }
+    }
+}
+
+static int bpmp_submit(void *data, struct tx2_bpmp_request *reqs, int nreqs)
+{
     struct tx2_bpmp_priv *bpmp_priv = data;
+    int ret;
 
-	if ((tx_size > BPMP_IVC_FRAME_SIZE) || (rx_size > BPMP_IVC_FRAME_SIZE))
-		return -EINVAL;
-
-	ret = tegra_ivc_write_get_next_frame(&bpmp_priv->ivc, &ivc_frame);
-	if (ret) {
-		ZF_LOGE("tegra_ivc_write_get_next_frame() failed: %d\n", ret);
-		return ret;
-	}
-
-	req = ivc_frame;
-	req->mrq = mrq;
-	req->flags = BPMP_FLAG_DO_ACK | BPMP_FLAG_RING_DOORBELL;
-	memcpy(req + 1, tx_msg, tx_size);
-
-	ret = tegra_ivc_write_advance(&bpmp_priv->ivc);
-	if (ret) {
-		ZF_LOGE("tegra_ivc_write_advance() failed: %d\n", ret);
-		return ret;
-	}
-
-	for (; timeout > 0; timeout--) {
-		ret = tegra_ivc_channel_notified(&bpmp_priv->ivc);
-		if (ret) {
-			ZF_LOGE("tegra_ivc_channel_notified() failed: %d\n", ret);
-			return ret;
-		}
-
-		ret = tegra_ivc_read_get_next_frame(&bpmp_priv->ivc, &ivc_frame);
-		if (!ret)
-			break;
-	}
+    if (!reqs || nreqs <= 0) {
+        return -EINVAL;
+    }
 
-    if (!timeout) {
-        ZF_LOGE("tegra_ivc_read_get_next_frame() timed out (%d)\n", ret);
-        return -ETIMEDOUT;
+    for (int i = 0; i < nreqs; i++) {
+        if ((reqs[i].tx_size > BPMP_IVC_MSG_SIZE) || (reqs[i].rx_size > BPMP_IVC_MSG_SIZE)) {
+            ZF_LOGE("Request %d does not fit in an IVC frame", i);
+            return -EINVAL;
+        }
+    }
+
+    for (int i = 0; i < nreqs; i++) {
+        reqs[i].status = -EINPROGRESS;
+        reqs[i].next = NULL;
+        if (bpmp_priv->queue_tail) {
+            bpmp_priv->queue_tail->next = &reqs[i];
+        } else {
+            bpmp_priv->queue_head = &reqs[i];
+        }
+        bpmp_priv->queue_tail = &reqs[i];
+    }
+
+    ret = bpmp_fill_frames(bpmp_priv);
+    if (ret) {
+        bpmp_take_back(bpmp_priv, reqs, nreqs, ret);
+    }
+
+    return ret;
+}
+
+static int bpmp_poll(void *data)
+{
+    struct tx2_bpmp_priv *bpmp_priv = data;
+    struct tx2_bpmp_request *req;
+    int ret, outstanding = 0;
+
+    ret = tegra_ivc_channel_notified(&bpmp_priv->ivc);
+    if (ret) {
+        ZF_LOGE("tegra_ivc_channel_notified() failed: %d\n", ret);
+        return ret;
+    }
+
+    ret = bpmp_read_frames(bpmp_priv);
+    if (ret) {
+        return ret;
     }
 
-	resp = ivc_frame;
-	err = resp->err;
-	if (!err && rx_msg && rx_size)
-		memcpy(rx_msg, resp + 1, rx_size);
+    /* Responses free up frames for the requests still queued */
+    ret = bpmp_fill_frames(bpmp_priv);
+    if (ret) {
+        return ret;
+    }
+
+    for (int i = 0; i < bpmp_priv->inflight_count; i++) {
+        if (bpmp_priv->inflight[(bpmp_priv->inflight_head + i) % BPMP_IVC_FRAME_COUNT]) {
+            outstanding++;
+        }
+    }
+    for (req = bpmp_priv->queue_head; req; req = req->next) {
+        outstanding++;
+    }
+
+    return outstanding;
+}
+
+/*
+ * Forget an outstanding request and all requests submitted before it, which
+ * are stuck behind the same response, giving them the status. Their frames
+ * may already be with the BPMP.
+ */
+static void bpmp_drop(struct tx2_bpmp_priv *bpmp_priv, struct tx2_bpmp_request *req, int status)
+{
+    struct tx2_bpmp_request *dropped;
+
+    for (int i = 0; i < bpmp_priv->inflight_count; i++) {
+        int slot = (bpmp_priv->inflight_head + i) % BPMP_IVC_FRAME_COUNT;
+        dropped = bpmp_priv->inflight[slot];
+        if (dropped) {
+            bpmp_priv->inflight[slot] = NULL;
+            dropped->status = status;
+        }
+        if (dropped == req) {
+            return;
+        }
+    }
 
-	ret = tegra_ivc_read_advance(&bpmp_priv->ivc);
-	if (ret) {
-		ZF_LOGE("tegra_ivc_write_advance() failed: %d\n", ret);
-		return ret;
-	}
+    while (bpmp_priv->queue_head) {
+        dropped = bpmp_priv->queue_head;
+        bpmp_priv->queue_head = dropped->next;
+        dropped->status = status;
+        if (dropped == req) {
+            break;
+        }
+    }
+    if (!bpmp_priv->queue_head) {
+        bpmp_priv->queue_tail = NULL;
+    }
+}
 
-	if (err) {
-		ZF_LOGE("BPMP responded with error %d\n", err);
-		/* err isn't a U-Boot error code, so don't that */
-		return -EIO;
-	}
+static int bpmp_wait(void *data, struct tx2_bpmp_request *req)
+{
+    struct tx2_bpmp_priv *bpmp_priv = data;
+    unsigned long timeout = TIMEOUT_THRESHOLD;
+    int ret;
+
+    if (!req) {
+        return -EINVAL;
+    }
+
+    for (; timeout > 0; timeout--) {
+        /*
+         * This is still a busy wait. The BPMP rings our doorbell after
+         * writing a response, and reading the doorbell's pending register
+         * is cheaper than going through the channel's shared memory, so
+         * that is what we spin on. Look at the channel anyway now and then,
+         * in case a ring got lost. The doorbell interrupt is not used.
+         */
+        if (timeout == TIMEOUT_THRESHOLD || timeout % BPMP_CHANNEL_POLL_INTERVAL == 0 ||
+            tx2_hsp_doorbell_check(&bpmp_priv->hsp, BPMP_DBELL) > 0) {
+            ret = bpmp_poll(bpmp_priv);
+            if (ret < 0) {
+                /* The request may live on the caller's stack, let go of it */
+                if (req->status == -EINPROGRESS) {
+                    bpmp_drop(bpmp_priv, req, ret);
+                }
+                return ret;
+            }
+        }
+        if (req->status != -EINPROGRESS) {
+            return 0;
+        }
+    }
+
+    ZF_LOGE("BPMP request with MRQ %d timed out\n", req->mrq);
+    bpmp_drop(bpmp_priv, req, -ETIMEDOUT);
+    return -ETIMEDOUT;
+}
+
+static int bpmp_cancel(void *data, struct tx2_bpmp_request *reqs, int nreqs)
+{
+    struct tx2_bpmp_priv *bpmp_priv = data;
+
+    if (!reqs || nreqs <= 0) {
+        return -EINVAL;
+    }
+
+    bpmp_take_back(bpmp_priv, reqs, nreqs, -ECANCELED);
+    return 0;
+}
+
+static int bpmp_call(void *data, int mrq, void *tx_msg, size_t tx_size, void *rx_msg, size_t rx_size)
+{
+    struct tx2_bpmp_request req = {
+        .mrq = mrq,
+        .tx_msg = tx_msg,
+        .tx_size = tx_size,
+        .rx_msg = rx_msg,
+        .rx_size = rx_size,
+    };
+    int ret;
+
+    ret = bpmp_submit(data, &req, 1);
+    if (ret) {
+        return ret;
+    }
+
+    ret = bpmp_wait(data, &req);
+    if (ret) {
+        return ret;
+    }
 
-	return rx_size;
+    return req.status;
 }
 
 static void bpmp_ivc_notify(struct tegra_ivc *ivc, void *token)
@@ -253,6 +516,10 @@ success:
 
     bpmp->data = &bpmp_data;
     bpmp->call = bpmp_call;
+    bpmp->submit = bpmp_submit;
+    bpmp->poll = bpmp_poll;
+    bpmp->wait = bpmp_wait;
+    bpmp->cancel = bpmp_cancel;
     bpmp->destroy = bpmp_destroy;
     bpmp_initialised = true;
     /* Register this BPMP interface so that the reset driver can access it */
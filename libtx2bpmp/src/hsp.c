@@ -27,6 +27,9 @@
 #define HSP_BITMAP_TZ_SECURE_SHFIT 0
 #define HSP_BITMAP_TZ_NONSECURE_SHIFT 16
 
+/* The doorbell that the other modules ring to signal us */
+#define HSP_OWN_DBELL CCPLEX_TZ_UNSECURE_DBELL
+
 typedef struct tx2_hsp_priv {
     ps_io_ops_t *io_ops;
     void *hsp_base;
@@ -119,8 +122,9 @@ static int hsp_doorbell_check(void *data, enum tx2_doorbell_id db_id)
 
     /* Checking if the doorbell has been 'rung' requires checking for proper
      * bit in the bitfield. The bitfield is also split into TrustZone secure
-     * and TZ non-secure. Refer to Figure 75 in Section 14.8.5 for further details. */
-    uint32_t *pending_reg = hsp_get_doorbell_register(hsp_priv, db_id, DBELL_PENDING);
+     * and TZ non-secure. Refer to Figure 75 in Section 14.8.5 for further details.
+     * Other modules ring our own doorbell, the bit tells us who rang it. */
+    uint32_t *pending_reg = hsp_get_doorbell_register(hsp_priv, HSP_OWN_DBELL, DBELL_PENDING);
 
     enum dbell_bitmap_offset bitmap_offset;
     switch (db_id) {
@@ -149,7 +153,8 @@ static int hsp_doorbell_check(void *data, enum tx2_doorbell_id db_id)
     int is_pending = *pending_reg & (bitmap_offset << HSP_BITMAP_TZ_NONSECURE_SHIFT);
 
     if (is_pending) {
-        *pending_reg &= ~(bitmap_offset << HSP_BITMAP_TZ_NONSECURE_SHIFT);
+        /* Write 1 to clear, other modules' bits stay pending */
+        *pending_reg = bitmap_offset << HSP_BITMAP_TZ_NONSECURE_SHIFT;
     }
 
     return (is_pending != 0);
@@ -229,6 +234,10 @@ int tx2_hsp_init(ps_io_ops_t *io_ops, tx2_hsp_t *hsp, const char *path)
 
     hsp_priv->doorbell_base = hsp_priv->hsp_base + (1 + (num_sm / 2) + num_ss + num_as) * 0x10000;
 
+    /* A module can only ring our doorbell once we have enabled it */
+    uint32_t *enable_reg = hsp_get_doorbell_register(hsp_priv, HSP_OWN_DBELL, DBELL_ENABLE);
+    *enable_reg |= (CCPLEX_BIT | BPMP_BIT | SPE_BIT | SCE_BIT | APE_BIT) << HSP_BITMAP_TZ_NONSECURE_SHIFT;
+
     hsp->data = hsp_priv;
     hsp->ring = hsp_doorbell_ring;
     hsp->check = hsp_doorbell_check;
@@ -27,7 +27,12 @@
      (volatile typeof(x) *)&(x); })     
 #define ACCESS_ONCE(x) (*__ACCESS_ONCE(x))
 
+#if defined(__aarch64__) || defined(__arm__)
 #define mb() asm volatile ("dsb sy" : : : "memory")
+#else
+/* Host builds, see tools/bpmpsim */
+#define mb() __sync_synchronize()
+#endif
 
 /*
  * IVC channel reset protocol.
@@ -295,6 +300,116 @@ int tegra_ivc_write_advance(struct tegra_ivc *ivc)
 	return 0;
 }
 
+/*
+ * Number of frames the receiver may consume, 0 when the counters are invalid
+ * for the same reasons as in tegra_ivc_channel_empty().
+ */
+static inline uint32_t tegra_ivc_rx_count(struct tegra_ivc *ivc)
+{
+	uint32_t count = tegra_ivc_channel_avail_count(ivc, ivc->rx_channel);
+
+	return count > ivc->nframes ? 0 : count;
+}
+
+static inline uint32_t tegra_ivc_tx_space(struct tegra_ivc *ivc)
+{
+	uint32_t count = tegra_ivc_channel_avail_count(ivc, ivc->tx_channel);
+
+	return count >= ivc->nframes ? 0 : ivc->nframes - count;
+}
+
+int tegra_ivc_read_get_frames(struct tegra_ivc *ivc, void **frame, uint32_t *count)
+{
+	int result = tegra_ivc_check_read(ivc);
+	if (result < 0)
+		return result;
+
+	/*
+	 * Order observation of w_pos potentially indicating new data before
+	 * data read.
+	 */
+	mb();
+
+	*count = MIN(tegra_ivc_rx_count(ivc), ivc->nframes - ivc->r_pos);
+	*frame = tegra_ivc_frame_pointer(ivc, ivc->rx_channel, ivc->r_pos);
+
+	return *count ? 0 : -ENOMEM;
+}
+
+int tegra_ivc_read_advance_n(struct tegra_ivc *ivc, uint32_t n)
+{
+	uint32_t count;
+	int result;
+
+	result = tegra_ivc_check_read(ivc);
+	if (result)
+		return result;
+
+	count = tegra_ivc_rx_count(ivc);
+	if (n == 0 || n > count || n > ivc->nframes - ivc->r_pos)
+		return -EINVAL;
+
+	ACCESS_ONCE(ivc->rx_channel->r_count) =
+			ACCESS_ONCE(ivc->rx_channel->r_count) + n;
+	ivc->r_pos = (ivc->r_pos + n) % ivc->nframes;
+
+	/*
+	 * Ensure our write to r_pos occurs before our read from w_pos.
+	 */
+	mb();
+
+	/* The channel was full, the peer may be waiting for space */
+	if (tegra_ivc_channel_avail_count(ivc, ivc->rx_channel) ==
+	    ivc->nframes - n)
+		ivc->notify(ivc, ivc->notify_token);
+
+	return 0;
+}
+
+int tegra_ivc_write_get_frames(struct tegra_ivc *ivc, void **frame, uint32_t *count)
+{
+	int result = tegra_ivc_check_write(ivc);
+	if (result)
+		return result;
+
+	*count = MIN(tegra_ivc_tx_space(ivc), ivc->nframes - ivc->w_pos);
+	*frame = tegra_ivc_frame_pointer(ivc, ivc->tx_channel, ivc->w_pos);
+
+	return *count ? 0 : -ENOMEM;
+}
+
+int tegra_ivc_write_advance_n(struct tegra_ivc *ivc, uint32_t n)
+{
+	int result;
+
+	result = tegra_ivc_check_write(ivc);
+	if (result)
+		return result;
+
+	if (n == 0 || n > tegra_ivc_tx_space(ivc) || n > ivc->nframes - ivc->w_pos)
+		return -EINVAL;
+
+	/*
+	 * Order any possible stores to the frames before update of w_pos.
+	 */
+	mb();
+
+	ACCESS_ONCE(ivc->tx_channel->w_count) =
+			ACCESS_ONCE(ivc->tx_channel->w_count) + n;
+	ivc->w_pos = (ivc->w_pos + n) % ivc->nframes;
+
+	/*
+	 * Ensure our write to w_pos occurs before our read from r_pos.
+	 */
+	mb();
+
+	/* The channel was empty, the peer may be waiting for data */
+	if (tegra_ivc_channel_avail_count(ivc, ivc->tx_channel) == n)
+		ivc->notify(ivc, ivc->notify_token);
+
+	return 0;
+}
+
 /*
  * ===============================================================
  *  IVC State Transition Table - see tegra_ivc_channel_notified()
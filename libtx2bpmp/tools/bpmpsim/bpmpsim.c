@@ -0,0 +1,685 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Runs the unmodified IVC and BPMP drivers as a Linux process. Two IVC
+ * endpoints on two threads measure the channel itself: round trip latency
+ * and streaming throughput with the single frame and the burst calls. The
+ * BPMP driver is then brought up against a stand-in for the firmware on
+ * another thread, and the cost of tx2_bpmp_call and of batches of requests
+ * is measured end to end. Every reply is checked.
+ *
+ * usage: bpmpsim [-n count] [-c count] [-f frames] [-z bytes]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <platsupport/fdt.h>
+#include <platsupport/io.h>
+#include <tx2bpmp/bpmp.h>
+#include <tx2bpmp/clock_bindings.h>
+#include <tx2bpmp/ivc.h>
+#include <tx2bpmp/reset_bindings.h>
+
+#include "fake_bpmp.h"
+
+/* The BPMP channel, as in src/bpmp.c */
+#define BPMP_IVC_FRAME_COUNT    1
+#define BPMP_IVC_FRAME_SIZE     128
+
+/* Where the device tree puts the BPMP */
+#define BPMP_SRAM_PADDR         0xd000000
+#define BPMP_TX_PADDR           0x3004e000
+#define BPMP_RX_PADDR           0x3004f000
+#define BPMP_SHMEM_SIZE         0x1000
+
+#define IVC_HEADER_SIZE         128         /* struct tegra_ivc_channel_header */
+#define SPINS                   10000       /* Idle polls before yielding, with CPUs to spare */
+#define BATCH                   8
+#define TEST_CLK                TEGRA186_CLK_SDMMC4
+#define TEST_RESET              TEGRA186_RESET_SDMMC4
+
+enum loop_mode {
+    LOOP_ECHO,
+    LOOP_STREAM,
+    LOOP_STREAM_BURST,
+};
+
+struct loop_end {
+    struct tegra_ivc ivc;
+    uint64_t notifies;
+    uint64_t errors;
+};
+
+static struct {
+    uint8_t *mem;
+    enum loop_mode mode;
+    uint64_t frames;
+    struct loop_end a;          /* Driven by main */
+    struct loop_end b;          /* Driven by the peer thread */
+} loop;
+
+static struct tx2_bpmp bpmp;
+static struct fake_bpmp *fb;
+static uint64_t *lat;
+static int spins;
+static int failed;
+
+/****************
+ *** Platform ***
+ ****************/
+
+static struct sim_region {
+    uintptr_t paddr;
+    size_t size;
+    void *vaddr;
+} regions[] = {
+    { BPMP_TX_PADDR, BPMP_SHMEM_SIZE },
+    { BPMP_RX_PADDR, BPMP_SHMEM_SIZE },
+};
+
+/* The driver skips the first region of the BPMP, then maps TX and RX */
+static const struct sim_node {
+    const char *path;
+    size_t nregs;
+    pmem_region_t regs[3];
+} nodes[] = {
+    {
+        "/bpmp", 3, {
+            { .base_addr = BPMP_SRAM_PADDR, .length = 0x800000 },
+            { .base_addr = BPMP_TX_PADDR, .length = BPMP_SHMEM_SIZE },
+            { .base_addr = BPMP_RX_PADDR, .length = BPMP_SHMEM_SIZE },
+        }
+    },
+};
+
+static int sim_malloc(void *cookie, size_t size, void **ptr)
+{
+    *ptr = malloc(size);
+    return *ptr ? 0 : -ENOMEM;
+}
+
+static int sim_calloc(void *cookie, size_t nmemb, size_t size, void **ptr)
+{
+    *ptr = calloc(nmemb, size);
+    return *ptr ? 0 : -ENOMEM;
+}
+
+static int sim_free(void *cookie, size_t size, void *ptr)
+{
+    free(ptr);
+    return 0;
+}
+
+static void *sim_io_map(void *cookie, uintptr_t paddr, size_t size, int cached, ps_mem_flags_t flags)
+{
+    for (int i = 0; i < ARRAY_SIZE(regions); i++) {
+        if (paddr >= regions[i].paddr && paddr + size <= regions[i].paddr + regions[i].size) {
+            return regions[i].vaddr + (paddr - regions[i].paddr);
+        }
+    }
+    fprintf(stderr, "bpmpsim: nothing to map at %#lx\n", (unsigned long)paddr);
+    return NULL;
+}
+
+static void sim_io_unmap(void *cookie, void *vaddr, size_t size)
+{
+}
+
+static int sim_interface_register(void *cookie, ps_interface_type_t interface_type,
+                                  void *interface_instance, char **properties)
+{
+    return 0;
+}
+
+int ps_fdt_read_path(ps_io_fdt_t *io_fdt, ps_malloc_ops_t *malloc_ops, const char *path,
+                     ps_fdt_cookie_t **ret_read_cookie)
+{
+    for (int i = 0; i < ARRAY_SIZE(nodes); i++) {
+        if (!strcmp(nodes[i].path, path)) {
+            *ret_read_cookie = (ps_fdt_cookie_t *)&nodes[i];
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+int ps_fdt_walk_registers(ps_io_fdt_t *io_fdt, ps_fdt_cookie_t *read_cookie,
+                          reg_walk_cb_fn_t callback, void *token)
+{
+    const struct sim_node *node = (const struct sim_node *)read_cookie;
+    int error;
+
+    for (size_t i = 0; i < node->nregs; i++) {
+        error = callback(node->regs[i], i, node->nregs, token);
+        if (error) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+int ps_fdt_cleanup_cookie(ps_malloc_ops_t *malloc_ops, ps_fdt_cookie_t *read_cookie)
+{
+    return 0;
+}
+
+static int sim_plat_init(ps_io_ops_t *io_ops)
+{
+    memset(io_ops, 0, sizeof(*io_ops));
+    io_ops->malloc_ops.malloc = sim_malloc;
+    io_ops->malloc_ops.calloc = sim_calloc;
+    io_ops->malloc_ops.free = sim_free;
+    io_ops->io_mapper.io_map_fn = sim_io_map;
+    io_ops->io_mapper.io_unmap_fn = sim_io_unmap;
+    io_ops->interface_registration_ops.interface_register_fn = sim_interface_register;
+
+    /* Shared memory starts out zeroed, like the channels after boot */
+    for (int i = 0; i < ARRAY_SIZE(regions); i++) {
+        if (posix_memalign(&regions[i].vaddr, 0x1000, regions[i].size)) {
+            return -ENOMEM;
+        }
+        memset(regions[i].vaddr, 0, regions[i].size);
+    }
+    return 0;
+}
+
+/*****************
+ *** Reporting ***
+ *****************/
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait a little for the other thread, without starving it of the CPU */
+static void relax(int *idle)
+{
+    if (++*idle > spins) {
+        sched_yield();
+    } else {
+        asm volatile("" ::: "memory");
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Mean, median and 99th percentile of n samples, which get sorted */
+static void percentiles(uint64_t *s, int n, double *mean, uint64_t *median, uint64_t *p99)
+{
+    uint64_t sum = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum += s[i];
+    }
+    qsort(s, n, sizeof(*s), cmp_u64);
+    *mean = (double)sum / n;
+    *median = s[n / 2];
+    *p99 = s[n - 1 - n / 100];
+}
+
+/********************
+ *** IVC loopback ***
+ ********************/
+
+static void loop_notify(struct tegra_ivc *ivc, void *token)
+{
+    struct loop_end *end = token;
+
+    end->notifies++;
+}
+
+static void frame_fill(void *frame, uint32_t frame_size, uint32_t seq)
+{
+    uint32_t *w = frame;
+
+    w[0] = seq;
+    w[frame_size / 4 - 1] = ~seq;
+}
+
+static int frame_check(const void *frame, uint32_t frame_size, uint32_t seq)
+{
+    const uint32_t *w = frame;
+
+    return w[0] != seq || w[frame_size / 4 - 1] != ~seq;
+}
+
+/* Both ends reset the channel at the same time, as after a reboot */
+static void loop_establish(struct loop_end *end)
+{
+    int idle = 0;
+
+    tegra_ivc_channel_reset(&end->ivc);
+    while (tegra_ivc_channel_notified(&end->ivc)) {
+        relax(&idle);
+    }
+}
+
+static void *loop_peer(void *arg)
+{
+    struct tegra_ivc *ivc = &loop.b.ivc;
+    uint32_t fs = ivc->frame_size;
+    uint64_t seq = 0;
+    uint32_t count;
+    void *rx, *tx;
+    int idle = 0;
+
+    loop_establish(&loop.b);
+    loop.b.notifies = 0;
+    while (seq < loop.frames) {
+        switch (loop.mode) {
+        case LOOP_ECHO:
+            if (tegra_ivc_read_get_next_frame(ivc, &rx) || tegra_ivc_write_get_next_frame(ivc, &tx)) {
+                relax(&idle);
+                continue;
+            }
+            memcpy(tx, rx, fs);
+            tegra_ivc_write_advance(ivc);
+            tegra_ivc_read_advance(ivc);
+            seq++;
+            break;
+        case LOOP_STREAM:
+            if (tegra_ivc_read_get_next_frame(ivc, &rx)) {
+                relax(&idle);
+                continue;
+            }
+            loop.b.errors += frame_check(rx, fs, seq++);
+            tegra_ivc_read_advance(ivc);
+            break;
+        case LOOP_STREAM_BURST:
+            if (tegra_ivc_read_get_frames(ivc, &rx, &count)) {
+                relax(&idle);
+                continue;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                loop.b.errors += frame_check(rx + i * fs, fs, seq++);
+            }
+            tegra_ivc_read_advance_n(ivc, count);
+            break;
+        }
+        idle = 0;
+    }
+    return NULL;
+}
+
+static void loop_main(void)
+{
+    struct tegra_ivc *ivc = &loop.a.ivc;
+    uint32_t fs = ivc->frame_size;
+    uint64_t seq = 0, t;
+    uint32_t count;
+    void *frame;
+    int idle = 0;
+
+    while (seq < loop.frames) {
+        switch (loop.mode) {
+        case LOOP_ECHO:
+            t = now_ns();
+            while (tegra_ivc_write_get_next_frame(ivc, &frame)) {
+                relax(&idle);
+            }
+            frame_fill(frame, fs, seq);
+            tegra_ivc_write_advance(ivc);
+            while (tegra_ivc_read_get_next_frame(ivc, &frame)) {
+                relax(&idle);
+            }
+            loop.a.errors += frame_check(frame, fs, seq);
+            tegra_ivc_read_advance(ivc);
+            lat[seq++] = now_ns() - t;
+            break;
+        case LOOP_STREAM:
+            if (tegra_ivc_write_get_next_frame(ivc, &frame)) {
+                relax(&idle);
+                continue;
+            }
+            frame_fill(frame, fs, seq++);
+            tegra_ivc_write_advance(ivc);
+            break;
+        case LOOP_STREAM_BURST:
+            if (tegra_ivc_write_get_frames(ivc, &frame, &count)) {
+                relax(&idle);
+                continue;
+            }
+            count = MIN(count, loop.frames - seq);
+            for (uint32_t i = 0; i < count; i++) {
+                frame_fill(frame + i * fs, fs, seq++);
+            }
+            tegra_ivc_write_advance_n(ivc, count);
+            break;
+        }
+        idle = 0;
+    }
+}
+
+static void bench_loop(const char *name, enum loop_mode mode, uint64_t frames, uint32_t nframes,
+                       uint32_t frame_size)
+{
+    size_t chan = IVC_HEADER_SIZE + (size_t)nframes * frame_size;
+    pthread_t thread;
+    uint64_t t, median, p99;
+    double mean, secs;
+    int errors;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.mode = mode;
+    loop.frames = frames;
+    if (posix_memalign((void **)&loop.mem, 0x1000, 2 * chan)) {
+        fprintf(stderr, "bpmpsim: out of memory\n");
+        exit(1);
+    }
+    memset(loop.mem, 0, 2 * chan);
+    /* a sends in the first half, b in the second */
+    if (tegra_ivc_init(&loop.a.ivc, (unsigned long)loop.mem + chan, (unsigned long)loop.mem, nframes,
+                       frame_size, loop_notify, &loop.a) ||
+        tegra_ivc_init(&loop.b.ivc, (unsigned long)loop.mem, (unsigned long)loop.mem + chan, nframes,
+                       frame_size, loop_notify, &loop.b)) {
+        fprintf(stderr, "bpmpsim: bad IVC geometry\n");
+        exit(2);
+    }
+
+    if (pthread_create(&thread, NULL, loop_peer, NULL)) {
+        perror("bpmpsim: pthread_create");
+        exit(1);
+    }
+    loop_establish(&loop.a);
+    loop.a.notifies = 0;
+    t = now_ns();
+    loop_main();
+    pthread_join(thread, NULL);
+    secs = (now_ns() - t) / 1e9;
+
+    errors = loop.a.errors + loop.b.errors;
+    printf("  %-18s %10.0f", name, frames / secs);
+    if (mode == LOOP_ECHO) {
+        percentiles(lat, frames, &mean, &median, &p99);
+        printf(" %8.0f %8llu %8llu", mean, (unsigned long long)median, (unsigned long long)p99);
+    } else {
+        printf(" %8s %8s %8s", "-", "-", "-");
+    }
+    printf(" %9.3f %9.3f  %s\n", (double)loop.a.notifies / frames, (double)loop.b.notifies / frames,
+           errors ? "FAILED" : "ok");
+    if (errors) {
+        failed = 1;
+    }
+    free(loop.mem);
+}
+
+/************
+ *** BPMP ***
+ ************/
+
+static int call_ping(int i)
+{
+    struct mrq_ping_request req = { .challenge = i * 2654435761u };
+    struct mrq_ping_response resp;
+    int ret;
+
+    ret = tx2_bpmp_call(&bpmp, MRQ_PING, &req, sizeof(req), &resp, sizeof(resp));
+    return ret != sizeof(resp) || resp.reply != req.challenge << 1;
+}
+
+static int call_clk_get_rate(int i)
+{
+    struct mrq_clk_request req = { .cmd_and_id = (CMD_CLK_GET_RATE << 24) | TEST_CLK };
+    struct mrq_clk_response resp;
+    int ret;
+
+    ret = tx2_bpmp_call(&bpmp, MRQ_CLK, &req, sizeof(req), &resp, sizeof(resp));
+    return ret != sizeof(resp) || resp.clk_get_rate.rate != fake_bpmp_clk_rate(fb, TEST_CLK);
+}
+
+static int call_clk_set_rate(int i)
+{
+    struct mrq_clk_request req = { .cmd_and_id = (CMD_CLK_SET_RATE << 24) | TEST_CLK };
+    struct mrq_clk_response resp;
+    int64_t rate = 100000000 + i * 1237ll;
+    int ret;
+
+    req.clk_set_rate.rate = rate;
+    ret = tx2_bpmp_call(&bpmp, MRQ_CLK, &req, sizeof(req), &resp, sizeof(resp));
+    return ret != sizeof(resp) || resp.clk_set_rate.rate != fake_bpmp_round_rate(rate) ||
+           fake_bpmp_clk_rate(fb, TEST_CLK) != fake_bpmp_round_rate(rate);
+}
+
+static int call_clk_gate(int i)
+{
+    int enable = !(i & 1);
+    struct mrq_clk_request req = {
+        .cmd_and_id = ((enable ? CMD_CLK_ENABLE : CMD_CLK_DISABLE) << 24) | TEST_CLK
+    };
+    int ret;
+
+    ret = tx2_bpmp_call(&bpmp, MRQ_CLK, &req, sizeof(req), NULL, 0);
+    return ret != 0 || fake_bpmp_clk_enabled(fb, TEST_CLK) != enable;
+}
+
+static int call_reset(int i)
+{
+    struct mrq_reset_request req = { .cmd = CMD_RESET_MODULE, .reset_id = TEST_RESET };
+    uint64_t pulses = fake_bpmp_reset_pulses(fb, TEST_RESET);
+    int ret;
+
+    ret = tx2_bpmp_call(&bpmp, MRQ_RESET, &req, sizeof(req), NULL, 0);
+    return ret != 0 || fake_bpmp_reset_pulses(fb, TEST_RESET) != pulses + 1;
+}
+
+/* A batch of pings, waiting only for the last one */
+static int call_batch(int i)
+{
+    struct mrq_ping_request req[BATCH];
+    struct mrq_ping_response resp[BATCH];
+    struct tx2_bpmp_request reqs[BATCH];
+    int errors = 0;
+
+    for (int j = 0; j < BATCH; j++) {
+        req[j].challenge = (i * BATCH + j) * 2654435761u;
+        reqs[j] = (struct tx2_bpmp_request) {
+            .mrq = MRQ_PING,
+            .tx_msg = &req[j],
+            .tx_size = sizeof(req[j]),
+            .rx_msg = &resp[j],
+            .rx_size = sizeof(resp[j]),
+        };
+    }
+    if (tx2_bpmp_submit(&bpmp, reqs, BATCH) || tx2_bpmp_wait(&bpmp, &reqs[BATCH - 1])) {
+        return BATCH;
+    }
+    for (int j = 0; j < BATCH; j++) {
+        errors += reqs[j].status != sizeof(resp[j]) || resp[j].reply != req[j].challenge << 1;
+    }
+    return errors;
+}
+
+/*
+ * Submit pings and take them back at once. The one already with the firmware
+ * is answered anyway, the next call must not see that response.
+ */
+static int check_cancel(void)
+{
+    struct mrq_ping_request req[BATCH];
+    struct mrq_ping_response resp[BATCH];
+    struct tx2_bpmp_request reqs[BATCH];
+    int errors = 0;
+
+    for (int j = 0; j < BATCH; j++) {
+        req[j].challenge = j + 1;
+        reqs[j] = (struct tx2_bpmp_request) {
+            .mrq = MRQ_PING,
+            .tx_msg = &req[j],
+            .tx_size = sizeof(req[j]),
+            .rx_msg = &resp[j],
+            .rx_size = sizeof(resp[j]),
+        };
+    }
+    if (tx2_bpmp_submit(&bpmp, reqs, BATCH) || tx2_bpmp_cancel(&bpmp, reqs, BATCH)) {
+        return 1;
+    }
+    for (int j = 0; j < BATCH; j++) {
+        errors += reqs[j].status != -ECANCELED;
+    }
+    memset(reqs, 0xa5, sizeof(reqs));
+    return errors + call_ping(BATCH);
+}
+
+static void bench_call(const char *name, int (*call)(int), int n, int per)
+{
+    struct fake_bpmp_stats a, b;
+    uint64_t t, median, p99;
+    double mean;
+    int errors = 0;
+
+    fake_bpmp_get_stats(fb, &a);
+    for (int i = 0; i < n; i++) {
+        t = now_ns();
+        errors += call(i);
+        lat[i] = now_ns() - t;
+    }
+    fake_bpmp_get_stats(fb, &b);
+
+    percentiles(lat, n, &mean, &median, &p99);
+    printf("  %-18s %8.0f %8llu %8llu %9.3f %9.3f %9.3f  %s\n", name, mean / per,
+           (unsigned long long)median / per, (unsigned long long)p99 / per,
+           (double)(b.rings_in - a.rings_in) / (n * per),
+           (double)(b.rings_out - a.rings_out) / (n * per),
+           (double)(b.requests - a.requests) / (b.bursts - a.bursts), errors ? "FAILED" : "ok");
+    if (errors || b.requests - a.requests != (uint64_t)n * per) {
+        failed = 1;
+    }
+}
+
+/************
+ *** Main ***
+ ************/
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n count] [-c count] [-f frames] [-z bytes]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t frames = 1000000;
+    int calls = 20000;
+    uint32_t nframes = 16;
+    uint32_t frame_size = 128;
+    struct fake_bpmp_stats st;
+    struct mrq_ping_request ping = { 0 };
+    ps_io_ops_t io_ops;
+    long cpus;
+    uint64_t t;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "n:c:f:z:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            frames = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            calls = strtol(optarg, NULL, 0);
+            break;
+        case 'f':
+            nframes = strtoul(optarg, NULL, 0);
+            break;
+        case 'z':
+            frame_size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (frames < 100 || calls < 100 || !nframes || frame_size < 64) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    spins = cpus > 1 ? SPINS : 0;
+    if (cpus < 2) {
+        printf("One CPU: latencies are those of the scheduler, compare them between runs only\n");
+    }
+    lat = calloc(MAX(frames, calls), sizeof(*lat));
+    if (!lat || sim_plat_init(&io_ops)) {
+        fprintf(stderr, "bpmpsim: out of memory\n");
+        return 1;
+    }
+
+    /* The channel on its own */
+    printf("IVC, %u frames of %u bytes each way\n", nframes, frame_size);
+    printf("  %-18s %10s %8s %8s %8s %9s %9s\n", "", "frames/s", "rtt ns", "median", "p99",
+           "notify tx", "notify rx");
+    bench_loop("round trip", LOOP_ECHO, MIN(frames, calls * 10ull), nframes, frame_size);
+    bench_loop("stream", LOOP_STREAM, frames, nframes, frame_size);
+    bench_loop("stream burst", LOOP_STREAM_BURST, frames, nframes, frame_size);
+
+    /* The driver against the firmware stand-in */
+    fb = fake_bpmp_create(regions[0].vaddr, regions[1].vaddr, BPMP_IVC_FRAME_COUNT, BPMP_IVC_FRAME_SIZE,
+                          cpus < 2);
+    if (!fb) {
+        return 1;
+    }
+    t = now_ns();
+    ret = tx2_bpmp_init(&io_ops, &bpmp);
+    if (ret) {
+        fprintf(stderr, "bpmpsim: tx2_bpmp_init failed: %d\n", ret);
+        return 1;
+    }
+    printf("BPMP up in %.1f us\n", (now_ns() - t) / 1e3);
+    printf("  %-18s %8s %8s %8s %9s %9s %9s\n", "", "ns/req", "median", "p99", "rings in",
+           "rings out", "req/burst");
+    bench_call("ping", call_ping, calls, 1);
+    bench_call("clk get rate", call_clk_get_rate, calls, 1);
+    bench_call("clk set rate", call_clk_set_rate, calls, 1);
+    bench_call("clk enable/disable", call_clk_gate, calls, 1);
+    bench_call("reset module", call_reset, calls, 1);
+    bench_call("ping x8 submit", call_batch, calls / BATCH, BATCH);
+
+    if (check_cancel()) {
+        printf("  cancelled requests were not taken back\n");
+        failed = 1;
+    }
+
+    /* Errors from the firmware come back as -EIO */
+    ret = tx2_bpmp_call(&bpmp, MRQ_QUERY_TAG, &ping, sizeof(ping), NULL, 0);
+    if (ret != -EIO) {
+        printf("  unknown MRQ returned %d, expected %d\n", ret, -EIO);
+        failed = 1;
+    }
+
+    fake_bpmp_get_stats(fb, &st);
+    printf("Firmware\n");
+    printf("  %llu requests: %llu ping, %llu clk, %llu reset, %llu unknown, %llu errors\n",
+           (unsigned long long)st.requests, (unsigned long long)st.pings,
+           (unsigned long long)st.clk, (unsigned long long)st.reset,
+           (unsigned long long)st.unknown, (unsigned long long)st.errors);
+    printf("  %llu bursts, %llu doorbell rings in, %llu out\n", (unsigned long long)st.bursts,
+           (unsigned long long)st.rings_in, (unsigned long long)st.rings_out);
+    if (st.errors != 1 || st.unknown != 1) {
+        failed = 1;
+    }
+
+    tx2_bpmp_destroy(&bpmp);
+    fake_bpmp_destroy(fb);
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed;
+}
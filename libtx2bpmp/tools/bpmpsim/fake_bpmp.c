@@ -0,0 +1,407 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * BPMP firmware stand-in.
+ *
+ * The thread keeps the channel handshake going with
+ * tegra_ivc_channel_notified and answers requests in bursts: every request
+ * frame that is ready, for which there is a free response frame, is
+ * answered in place and both runs are handed back with one advance each.
+ *
+ * The CPU's doorbell is a bitmap of the modules that rang it, cleared bit
+ * by bit as the driver checks them.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tx2bpmp/bpmp.h>
+#include <tx2bpmp/clock_bindings.h>
+#include <tx2bpmp/hsp.h>
+#include <tx2bpmp/ivc.h>
+#include <tx2bpmp/reset_bindings.h>
+
+#include "fake_bpmp.h"
+
+/* Request flags, as in src/bpmp.c */
+#define BPMP_FLAG_RING_DOORBELL         BIT(1)
+
+#define CLK_BOOT_RATE                   38400000    /* The oscillator */
+#define CLK_MAX_RATE                    2000000000
+#define CLK_RATE_STEP                   1000        /* Rates are set to a whole kHz */
+
+#define IDLE_SPINS                      10000       /* Channel polls before napping */
+#define IDLE_NAP_NS                     1000
+
+struct fake_bpmp {
+    struct tegra_ivc ivc;
+    int shared_cpu;
+    pthread_t thread;
+    int stop;
+    struct fake_bpmp_stats stats;
+
+    uint32_t cpu_pending;       /* Modules that rang the CPU, by doorbell ID */
+
+    int64_t clk_rate[TEGRA186_CLK_CLK_MAX];
+    uint32_t clk_parent[TEGRA186_CLK_CLK_MAX];
+    uint8_t clk_enabled[TEGRA186_CLK_CLK_MAX];
+    uint8_t reset_asserted[TEGRA186_RESET_SIZE];
+    uint64_t reset_pulses[TEGRA186_RESET_SIZE];
+};
+
+static struct fake_bpmp *the_bpmp;
+
+/*****************
+ *** Doorbells ***
+ *****************/
+
+/* Give the CPU to the other side, if there is only one */
+static void hand_over(struct fake_bpmp *fb)
+{
+    if (fb->shared_cpu) {
+        sched_yield();
+    }
+}
+
+static void ring_cpu(struct fake_bpmp *fb)
+{
+    __atomic_fetch_or(&fb->cpu_pending, BIT(BPMP_DBELL), __ATOMIC_SEQ_CST);
+    fb->stats.rings_out++;
+}
+
+static void ivc_notify(struct tegra_ivc *ivc, void *token)
+{
+    ring_cpu(token);
+}
+
+static int hsp_ring(void *data, enum tx2_doorbell_id db_id)
+{
+    struct fake_bpmp *fb = data;
+
+    if (db_id != BPMP_DBELL) {
+        return -EINVAL;
+    }
+    /* The firmware looks at the channel all the time, the ring is only counted */
+    __atomic_fetch_add(&fb->stats.rings_in, 1, __ATOMIC_RELAXED);
+    hand_over(fb);
+    return 0;
+}
+
+static int hsp_check(void *data, enum tx2_doorbell_id db_id)
+{
+    struct fake_bpmp *fb = data;
+
+    if (db_id < CCPLEX_PM_DBELL || db_id > APE_DBELL) {
+        return -EINVAL;
+    }
+    /* Reading and writing 1 to clear, as one step */
+    if (__atomic_fetch_and(&fb->cpu_pending, ~BIT(db_id), __ATOMIC_SEQ_CST) & BIT(db_id)) {
+        return 1;
+    }
+    hand_over(fb);
+    return 0;
+}
+
+static int hsp_destroy(void *data)
+{
+    return 0;
+}
+
+int tx2_hsp_init(ps_io_ops_t *io_ops, tx2_hsp_t *hsp, const char *path)
+{
+    if (!the_bpmp) {
+        fprintf(stderr, "fake_bpmp: no BPMP to ring\n");
+        return -ENODEV;
+    }
+    hsp->data = the_bpmp;
+    hsp->ring = hsp_ring;
+    hsp->check = hsp_check;
+    hsp->destroy = hsp_destroy;
+    return 0;
+}
+
+/****************
+ *** Requests ***
+ ****************/
+
+int64_t fake_bpmp_round_rate(int64_t rate)
+{
+    if (rate > CLK_MAX_RATE) {
+        rate = CLK_MAX_RATE;
+    }
+    return rate - rate % CLK_RATE_STEP;
+}
+
+static int32_t do_ping(struct fake_bpmp *fb, const void *tx, void *rx)
+{
+    const struct mrq_ping_request *req = tx;
+    struct mrq_ping_response *resp = rx;
+
+    fb->stats.pings++;
+    resp->reply = req->challenge << 1;
+    return 0;
+}
+
+static int32_t do_clk(struct fake_bpmp *fb, const void *tx, void *rx)
+{
+    const struct mrq_clk_request *req = tx;
+    struct mrq_clk_response *resp = rx;
+    uint32_t cmd = req->cmd_and_id >> 24;
+    uint32_t id = req->cmd_and_id & MASK(24);
+    int64_t rate;
+
+    fb->stats.clk++;
+    if (id >= TEGRA186_CLK_CLK_MAX) {
+        return -BPMP_EINVAL;
+    }
+
+    switch (cmd) {
+    case CMD_CLK_GET_RATE:
+        resp->clk_get_rate.rate = fb->clk_rate[id];
+        break;
+    case CMD_CLK_SET_RATE:
+    case CMD_CLK_ROUND_RATE:
+        rate = fake_bpmp_round_rate(req->clk_set_rate.rate);
+        if (rate <= 0) {
+            return -BPMP_EINVAL;
+        }
+        if (cmd == CMD_CLK_SET_RATE) {
+            fb->clk_rate[id] = rate;
+        }
+        resp->clk_set_rate.rate = rate;
+        break;
+    case CMD_CLK_GET_PARENT:
+        resp->clk_get_parent.parent_id = fb->clk_parent[id];
+        break;
+    case CMD_CLK_SET_PARENT:
+        if (req->clk_set_parent.parent_id >= TEGRA186_CLK_CLK_MAX) {
+            return -BPMP_EINVAL;
+        }
+        fb->clk_parent[id] = req->clk_set_parent.parent_id;
+        resp->clk_set_parent.parent_id = fb->clk_parent[id];
+        break;
+    case CMD_CLK_IS_ENABLED:
+        resp->clk_is_enabled.state = fb->clk_enabled[id];
+        break;
+    case CMD_CLK_ENABLE:
+        fb->clk_enabled[id] = 1;
+        break;
+    case CMD_CLK_DISABLE:
+        fb->clk_enabled[id] = 0;
+        break;
+    case CMD_CLK_GET_ALL_INFO:
+        memset(&resp->clk_get_all_info, 0, sizeof(resp->clk_get_all_info));
+        resp->clk_get_all_info.parent = fb->clk_parent[id];
+        resp->clk_get_all_info.parents[0] = fb->clk_parent[id];
+        resp->clk_get_all_info.num_parents = 1;
+        snprintf((char *)resp->clk_get_all_info.name, MRQ_CLK_NAME_MAXLEN, "clk%u", id);
+        break;
+    case CMD_CLK_GET_MAX_CLK_ID:
+        resp->clk_get_max_clk_id.max_id = TEGRA186_CLK_CLK_MAX - 1;
+        break;
+    default:
+        return -BPMP_EBADCMD;
+    }
+    return 0;
+}
+
+static int32_t do_reset(struct fake_bpmp *fb, const void *tx)
+{
+    const struct mrq_reset_request *req = tx;
+
+    fb->stats.reset++;
+    if (req->reset_id >= TEGRA186_RESET_SIZE) {
+        return -BPMP_EINVAL;
+    }
+
+    switch (req->cmd) {
+    case CMD_RESET_ASSERT:
+        fb->reset_asserted[req->reset_id] = 1;
+        break;
+    case CMD_RESET_DEASSERT:
+        fb->reset_asserted[req->reset_id] = 0;
+        break;
+    case CMD_RESET_MODULE:
+        fb->reset_asserted[req->reset_id] = 0;
+        fb->reset_pulses[req->reset_id]++;
+        break;
+    default:
+        return -BPMP_EINVAL;
+    }
+    return 0;
+}
+
+/* Answer one request frame, return whether the CPU wants a ring */
+static int serve_one(struct fake_bpmp *fb, const struct mrq_request *req, struct mrq_response *resp)
+{
+    int32_t err;
+
+    fb->stats.requests++;
+    switch (req->mrq) {
+    case MRQ_PING:
+        err = do_ping(fb, req + 1, resp + 1);
+        break;
+    case MRQ_CLK:
+        err = do_clk(fb, req + 1, resp + 1);
+        break;
+    case MRQ_RESET:
+        err = do_reset(fb, req + 1);
+        break;
+    default:
+        fb->stats.unknown++;
+        err = -BPMP_ENODEV;
+        break;
+    }
+    if (err) {
+        fb->stats.errors++;
+    }
+    resp->err = err;
+    resp->flags = 0;
+    return !!(req->flags & BPMP_FLAG_RING_DOORBELL);
+}
+
+/* Answer the requests that are ready, return how many */
+static uint32_t serve(struct fake_bpmp *fb)
+{
+    void *rx, *tx;
+    uint32_t nrx, ntx, n;
+    int ring = 0;
+
+    if (tegra_ivc_read_get_frames(&fb->ivc, &rx, &nrx)) {
+        return 0;
+    }
+    if (tegra_ivc_write_get_frames(&fb->ivc, &tx, &ntx)) {
+        /* The CPU has not read the previous responses yet */
+        return 0;
+    }
+
+    fb->stats.bursts++;
+    n = MIN(nrx, ntx);
+    for (uint32_t i = 0; i < n; i++) {
+        ring |= serve_one(fb, rx + i * fb->ivc.frame_size, tx + i * fb->ivc.frame_size);
+    }
+    if (tegra_ivc_write_advance_n(&fb->ivc, n) || tegra_ivc_read_advance_n(&fb->ivc, n)) {
+        fprintf(stderr, "fake_bpmp: channel advance failed\n");
+        abort();
+    }
+    if (ring) {
+        ring_cpu(fb);
+    }
+    return n;
+}
+
+static void *bpmp_thread(void *arg)
+{
+    struct fake_bpmp *fb = arg;
+    struct timespec nap = { 0, IDLE_NAP_NS };
+    int idle = 0;
+
+    while (!__atomic_load_n(&fb->stop, __ATOMIC_RELAXED)) {
+        /* The firmware follows the CPU through a channel reset at any time */
+        if (tegra_ivc_channel_notified(&fb->ivc) == 0 && serve(fb)) {
+            idle = 0;
+            hand_over(fb);
+        } else if (fb->shared_cpu) {
+            sched_yield();
+        } else if (++idle > IDLE_SPINS) {
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+/****************
+ *** Exported ***
+ ****************/
+
+struct fake_bpmp *fake_bpmp_create(void *tx, void *rx, uint32_t nframes, uint32_t frame_size,
+                                   int shared_cpu)
+{
+    struct fake_bpmp *fb;
+
+    if (the_bpmp) {
+        fprintf(stderr, "fake_bpmp: one BPMP per process\n");
+        return NULL;
+    }
+    fb = calloc(1, sizeof(*fb));
+    if (!fb) {
+        return NULL;
+    }
+    fb->shared_cpu = shared_cpu;
+
+    /* Our end receives what the CPU sends */
+    if (tegra_ivc_init(&fb->ivc, (unsigned long)tx, (unsigned long)rx, nframes, frame_size,
+                       ivc_notify, fb)) {
+        fprintf(stderr, "fake_bpmp: bad channel\n");
+        free(fb);
+        return NULL;
+    }
+
+    for (int i = 0; i < TEGRA186_CLK_CLK_MAX; i++) {
+        fb->clk_rate[i] = CLK_BOOT_RATE;
+        fb->clk_parent[i] = TEGRA186_CLK_CLK_M;
+    }
+    fb->clk_parent[TEGRA186_CLK_CLK_M] = TEGRA186_CLK_OSC;
+    fb->clk_parent[TEGRA186_CLK_OSC] = TEGRA186_CLK_OSC;
+
+    if (pthread_create(&fb->thread, NULL, bpmp_thread, fb)) {
+        perror("fake_bpmp: pthread_create");
+        free(fb);
+        return NULL;
+    }
+    the_bpmp = fb;
+    return fb;
+}
+
+void fake_bpmp_destroy(struct fake_bpmp *fb)
+{
+    __atomic_store_n(&fb->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(fb->thread, NULL);
+    the_bpmp = NULL;
+    free(fb);
+}
+
+/*
+ * The state below is only written by the thread, before it hands the
+ * response over through the channel, so it is up to date for any request
+ * that has completed.
+ */
+
+void fake_bpmp_get_stats(struct fake_bpmp *fb, struct fake_bpmp_stats *st)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *st = fb->stats;
+}
+
+int64_t fake_bpmp_clk_rate(struct fake_bpmp *fb, uint32_t clk_id)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return clk_id < TEGRA186_CLK_CLK_MAX ? fb->clk_rate[clk_id] : -1;
+}
+
+int fake_bpmp_clk_enabled(struct fake_bpmp *fb, uint32_t clk_id)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return clk_id < TEGRA186_CLK_CLK_MAX ? fb->clk_enabled[clk_id] : -1;
+}
+
+int fake_bpmp_reset_asserted(struct fake_bpmp *fb, uint32_t reset_id)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return reset_id < TEGRA186_RESET_SIZE ? fb->reset_asserted[reset_id] : -1;
+}
+
+uint64_t fake_bpmp_reset_pulses(struct fake_bpmp *fb, uint32_t reset_id)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return reset_id < TEGRA186_RESET_SIZE ? fb->reset_pulses[reset_id] : 0;
+}
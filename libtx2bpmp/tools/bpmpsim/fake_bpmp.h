@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Stand-in for the BPMP firmware and the HSP doorbells between it and the
+ * CPU.
+ *
+ * The BPMP end of the IVC channel is served by a thread running the same
+ * ivc.c as the driver, with the two shared memory regions the other way
+ * around. It answers MRQ_PING, MRQ_CLK and MRQ_RESET from a table of clock
+ * rates, parents and gates and of reset lines, and everything else with
+ * -BPMP_ENODEV.
+ *
+ * The doorbells are modelled at the level of tx2_hsp_t, this file provides
+ * tx2_hsp_init in place of src/hsp.c. Rings are counted exactly and a check
+ * clears what it reports, as writing 1 to clear does on the hardware.
+ *
+ * When the thread shares the only CPU with the driver, which spins while it
+ * waits, both hand the CPU over whenever they ring or find nothing to do.
+ * There is one BPMP per process.
+ */
+#pragma once
+
+#include <stdint.h>
+
+struct fake_bpmp;
+
+struct fake_bpmp_stats {
+    uint64_t requests;
+    uint64_t pings;
+    uint64_t clk;
+    uint64_t reset;
+    uint64_t unknown;           /* MRQs without a handler */
+    uint64_t errors;            /* Responses with a non-zero err */
+    uint64_t bursts;            /* Channel reads that found requests */
+    uint64_t rings_in;          /* BPMP doorbell rung by the CPU */
+    uint64_t rings_out;         /* CPU doorbell rung by the BPMP */
+};
+
+/**
+ * Start serving the channel. Must be called before tx2_bpmp_init, which
+ * resets the channel and waits for the BPMP to take part.
+ * @param tx         Shared memory the CPU sends in, zeroed
+ * @param rx         Shared memory the CPU receives from, zeroed
+ * @param shared_cpu The thread and the driver only have one CPU between them
+ */
+struct fake_bpmp *fake_bpmp_create(void *tx, void *rx, uint32_t nframes, uint32_t frame_size,
+                                   int shared_cpu);
+
+/** Stop the thread */
+void fake_bpmp_destroy(struct fake_bpmp *fb);
+
+void fake_bpmp_get_stats(struct fake_bpmp *fb, struct fake_bpmp_stats *st);
+
+/** Firmware state, for checking what the driver asked for */
+int64_t fake_bpmp_clk_rate(struct fake_bpmp *fb, uint32_t clk_id);
+int fake_bpmp_clk_enabled(struct fake_bpmp *fb, uint32_t clk_id);
+int fake_bpmp_reset_asserted(struct fake_bpmp *fb, uint32_t reset_id);
+/** Number of CMD_RESET_MODULE pulses on a reset line */
+uint64_t fake_bpmp_reset_pulses(struct fake_bpmp *fb, uint32_t reset_id);
+
+/** The rate the firmware sets when asked for a rate */
+int64_t fake_bpmp_round_rate(int64_t rate);
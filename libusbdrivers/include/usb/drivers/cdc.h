@@ -49,7 +49,10 @@ void acm_get_line_coding(usb_dev_t *udev, struct acm_line_coding *coding);
 void acm_set_ctrl_line_state(usb_dev_t *udev, uint8_t ctrl);
 void acm_send_break(usb_dev_t *udev, uint16_t us);
 
-/* Data interface functions */
+/*
+ * Data interface functions. These do not block: read returns whatever has
+ * already been received and write returns the number of bytes queued.
+ */
 int usb_cdc_read(usb_dev_t *udev, void *buf, int len);
 int usb_cdc_write(usb_dev_t *udev, const void *buf, int len);
 
@@ -21,7 +21,20 @@ static inline int is_eth(usb_dev_t *dev)
 #include <lwip/netif.h>
 struct netif *lan9730_driver_bind(usb_dev_t *udev);
 
+/*
+ * Hands the frames received since the last call to lwIP and posts the RX
+ * buffers again. Also releases the pbufs of finished transmissions and sends
+ * frames queued behind them. Call it from the poll loop, never from
+ * interrupt context.
+ */
 int lan9730_input(struct netif *netif);
 
 int lan9730_poll_status(struct netif *netif);
+
+/*
+ * Frames whose pbufs lie entirely within this (DMA pinned) region are
+ * transmitted without being copied. Returns 0 on success, -1 on failure.
+ */
+int lan9730_set_tx_dma_region(struct netif *netif, void *vaddr,
+                              uintptr_t paddr, size_t size);
 #endif /* CONFIG_LIB_LWIP */
@@ -13,6 +13,7 @@ int usb_pl2303_bind(usb_dev_t *usb_dev);
 
 int usb_pl2303_configure(usb_dev_t *udev, uint32_t bps, uint8_t char_size,
 		enum serial_parity parity, uint8_t stop);
+/* Non-blocking, return the number of bytes queued or copied out */
 int usb_pl2303_write(usb_dev_t *udev, void *buf, int len);
 int usb_pl2303_read(usb_dev_t *udev, void *buf, int len);
 
@@ -36,6 +36,8 @@ enum port_feature {
     PORT_POWER            = 8,
     PORT_LOW_SPEED        = 9,
     PORT_HIGH_SPEED       = 10,
+    /* Reserved by the hub spec, reported by emulated xHCI root hubs only */
+    PORT_SUPER_SPEED      = 13,
     /* These only used when clearing status changes */
     C_PORT_CONNECTION     = 16,
     C_PORT_ENABLE         = 17,
@@ -46,8 +48,15 @@ enum port_feature {
     PORT_INDICATOR        = 22
 };
 
+struct usb_hub;
+
 struct usb_hub_port {
     struct usb_dev* udev;
+    struct usb_hub* hub;
+    /// A device is attached
+    int connected;
+    /// Connected, waiting to be enumerated
+    int pending;
 };
 
 struct usb_hub {
@@ -59,6 +68,8 @@ struct usb_hub {
     int nports;
     struct usb_hub_port* port;
     int power_good_delay_ms;
+/// Port requests
+    struct xact ctrl_xact[2];
 /// IRQs
     struct xact int_xact;
     uint8_t* intbm;
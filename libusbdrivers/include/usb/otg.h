@@ -36,8 +36,9 @@ typedef void (*otg_setup_cb)(usb_otg_t otg,
 /* NOTE: the "set address" request will be intercepted */
 int otg_ep0_setup(usb_otg_t otg, otg_setup_cb cb, void* token);
 
+/* bytes is the number of bytes actually moved, an OUT prime may end short */
 typedef void (*otg_prime_cb)(usb_otg_t otg, void* token,
-                             enum usb_xact_status stat);
+                             enum usb_xact_status stat, int bytes);
 int otg_prime(usb_otg_t otg, int ep, enum usb_xact_type dir,
               void* vbuf, uintptr_t pbuf, int len,
               otg_prime_cb cb, void* token);
@@ -29,8 +29,10 @@ struct usb {
     uint32_t addrbm;
     /// Next address: delays address recycling
     int next_addr;
-    /// List of devices connected to this host
-    usb_dev_t *devlist;
+    /// Devices connected to this host, indexed by address
+    usb_dev_t *devs[USB_NDEVICES];
+    /// Asynchronous enumerations waiting to be finished by usb_handle_irq
+    struct usb_enum *enum_done;
 };
 typedef struct usb usb_t;
 
@@ -89,11 +91,12 @@ struct usb_dev {
      */
     struct endpoint *ep_ctrl;         // Control endpoint of the device
     struct endpoint *ep[USB_MAX_EPS]; // Data endpoints of the device
-
-    /* For device lists */
-    struct usb_dev      *next;
+    struct endpoint *ep_map[USB_MAX_EPS]; // Data endpoints by USB_EP_INDEX
 };
 
+/* Index into ep_map for an endpoint address, OUT 0-15 and IN 16-31 */
+#define USB_EP_INDEX(epaddr) (((epaddr) & 0xf) | (((epaddr) >> 3) & 0x10))
+
 /*
  * USB requests
  */
@@ -157,7 +160,9 @@ enum DescriptorType {
     HID_PHYSICAL              = 0x23,
     CS_INTERFACE              = 0x24, //USB class-specific
     CS_ENDPOINT               = 0x25, //USB class-specific
-    HUB                       = 0x29
+    HUB                       = 0x29,
+    /* USB 3.0 */
+    SS_ENDPOINT_COMPANION     = 0x30
 };
 
 struct device_desc {
@@ -227,6 +232,14 @@ struct endpoint_desc {
     uint8_t  bInterval;
 } __attribute__ ((packed));
 
+struct ss_ep_companion_desc {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bMaxBurst;
+    uint8_t  bmAttributes;
+    uint16_t wBytesPerInterval;
+} __attribute__ ((packed));
+
 struct string_desc {
     uint8_t bLength;
     uint8_t bDescriptorType;
@@ -315,6 +328,36 @@ int usb_init(enum usb_host_id id, ps_io_ops_t* ioops, ps_mutex_ops_t *sync, usb_
 int usb_new_device(usb_dev_t *hub, int port,
                    enum usb_speed speed, usb_dev_t **d);
 
+/** A call back for asynchronous enumeration
+ * @param[in] token An unmodified token as passed to
+ *                  usb_new_device_async.
+ * @param[in] udev  The new device, or NULL if it failed to
+ *                  enumerate. The device has been released in
+ *                  that case.
+ */
+typedef void (*usb_enum_cb_t)(void* token, usb_dev_t* udev);
+
+/** Probe for a new device on the BUS without waiting for its
+ * descriptors.
+ * Returns once the device has left the default state and owns an
+ * address, so that the next device may be reset. The remaining
+ * descriptors are read in the background. The call back is
+ * invoked from usb_handle_irq once the host controller has
+ * finished its transfer completions, so it may issue synchronous
+ * requests and release devices.
+ * @param[in] hub   The USB hub that the new device is connected
+ *                  to.
+ * @param[in] port  The port on the provided hub that the new
+ *                  device is connected to.
+ * @param[in] speed The connection speed of the new device.
+ * @param[in] cb    Called once enumeration has finished.
+ * @param[in] token Passed unmodified to the call back.
+ * @return          0 if the device has been addressed, in which
+ *                  case cb will be called.
+ */
+int usb_new_device_async(usb_dev_t *hub, int port, enum usb_speed speed,
+                         usb_enum_cb_t cb, void* token);
+
 /** A call back for the configuration parser. This function is
  * called for each descriptor.
  * @param[in] token An unmodified token as passed to the
@@ -381,6 +424,36 @@ const char* usb_class_get_description(enum usb_class usb_class);
 int usbdev_schedule_xact(usb_dev_t *udev, struct endpoint *ep, struct xact* xact,
                          int nxact, usb_cb_t cb, void* token);
 
+/** Start streaming on an isochronous endpoint
+ * @param[in] udev    The USB device which owns the endpoint.
+ * @param[in] ep      The isochronous endpoint.
+ * @param[in] nslots  The number of service periods to keep queued.
+ *                    This is the depth of the stream ring.
+ * @param[in] cb      Called once for every service period; to collect
+ *                    received data or to provide data to send.
+ * @param[in] token   Passed unmodified to the call back
+ *                    function.
+ * @return            0 on success.
+ */
+int usbdev_iso_start(usb_dev_t *udev, struct endpoint *ep, int nslots,
+                     usb_iso_cb_t cb, void* token);
+
+/** Stop an isochronous stream
+ * No further call backs are made once this function returns.
+ * @param[in] udev    The USB device which owns the endpoint.
+ * @param[in] ep      The isochronous endpoint.
+ * @return            0 on success.
+ */
+int usbdev_iso_stop(usb_dev_t *udev, struct endpoint *ep);
+
+/** Find an endpoint of a device by its address
+ * @param[in] udev    The USB device which owns the endpoint.
+ * @param[in] epaddr  The endpoint address, as in bEndpointAddress.
+ * @return            The endpoint, or NULL if the device has no such
+ *                    endpoint. Endpoint 0 is the control endpoint.
+ */
+struct endpoint *usbdev_get_endpoint(usb_dev_t *udev, uint8_t epaddr);
+
 
 /** Print a list of registered devices
  * @param[in] host  the USB host device in question
@@ -402,6 +475,7 @@ usb_dev_t *usb_get_device(usb_t *host, int addr);
 void usb_probe_device(usb_dev_t *dev);
 
 /** Pass control to the devices IRQ handler
+ * Also finishes the asynchronous enumerations that completed.
  * @param[in] host    The USB host that triggered
  *                    the interrupt event.
  */
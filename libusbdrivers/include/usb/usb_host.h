@@ -21,7 +21,9 @@ enum usb_speed {
 /// 12Mbps connection
     USBSPEED_FULL = 1,
 /// 480Mbps connection
-    USBSPEED_HIGH = 2
+    USBSPEED_HIGH = 2,
+/// 5Gbps connection
+    USBSPEED_SUPER = 3
 };
 
 /*
@@ -47,6 +49,7 @@ struct endpoint {
     enum usb_endpoint_dir  dir;  // Endpoint direction
     uint16_t  max_pkt;   // Maximum packet size
     uint8_t   interval;  // Interval for polling or NAK rate for Bulk/Control
+    uint8_t   max_burst; // SuperSpeed only, packets per burst minus one
 
     /* For host controller driver only, actually holds queue head. */
     void      *hcpriv;
@@ -111,6 +114,40 @@ static inline uintptr_t xact_get_paddr(struct xact* xact)
  */
 typedef int (*usb_cb_t)(void* token, enum usb_xact_status stat, int rbytes);
 
+/** Callback type for isochronous streams
+ * Called once for every slot of the stream ring.
+ * @param[in] token  An unmodified opaque token as passed to
+ *                   the associated stream request.
+ * @param[in] stat   The status of the slot. XACTSTAT_PENDING is
+ *                   passed when an OUT slot is filled for the
+ *                   first time.
+ * @param[in] buf    The DMA buffer of the slot.
+ * @param[in] len    IN: the number of bytes received.
+ *                   OUT: the size of the buffer.
+ * @return           OUT: the number of bytes to send from buf in the
+ *                   next service period of the slot, otherwise, 0.
+ */
+typedef int (*usb_iso_cb_t)(void* token, enum usb_xact_status stat,
+                            void* buf, int len);
+
+/*
+ * Where a device sits on the bus. Handed to host controllers that keep
+ * per-device state, before the device is addressed.
+ */
+struct usb_route {
+    /// Hub ports below the root port, one per nibble, tier 1 in bits 3:0
+    uint32_t route;
+    /// Root hub port of the device, or of the tier 1 hub above it
+    uint8_t  root_port;
+    /// Parent hub, 0 if the device is on a root port
+    uint8_t  hub_addr;
+    uint8_t  hub_nports;
+    /// Transaction translator of a full/low speed device, 0 if none
+    uint8_t  tt_addr;
+    uint8_t  tt_port;
+    enum usb_speed speed;
+};
+
 struct usb_host;
 typedef struct usb_host usb_host_t;
 
@@ -130,15 +167,25 @@ struct usb_host {
     int (*schedule_xact)(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t hub_port,
                          enum usb_speed speed, struct endpoint *ep,
                          struct xact* xact, int nxact, usb_cb_t cb, void* t);
+    /// Start an isochronous stream. Stopped with cancel_xact.
+    int (*iso_start)(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t hub_port,
+                     enum usb_speed speed, struct endpoint *ep,
+                     int nslots, usb_iso_cb_t cb, void* t);
     /// Cancel all transactions for a given device endpoint
     int (*cancel_xact)(usb_host_t* hdev, struct endpoint *ep);
     /// Handle an IRQ
     void (*handle_irq)(usb_host_t* hdev);
+    /// Optional. A device has been reset and answers at address 0.
+    int (*dev_attach)(usb_host_t* hdev, struct usb_route* route);
+    /// Optional. A device is gone, its endpoints have been cancelled.
+    void (*dev_detach)(usb_host_t* hdev, uint8_t addr);
 
     /// IRQ numbers tied to this device
     const int* irqs;
     /// Host private data
     struct usb_hc_data* pdata;
+    /// Transfer capture, NULL when off. See usb/usbmon.h
+    struct usbmon* mon;
 };
 
 
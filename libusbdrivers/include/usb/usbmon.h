@@ -0,0 +1,45 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Transfer capture, in the spirit of Linux usbmon. Every transfer submitted
+ * through usbdev_schedule_xact and every completion seen by the host
+ * controller is written as a fixed size record into a ring in caller
+ * provided memory, typically shared with a logging component. The ring can
+ * be dumped and converted to pcap with tools/usbmon2pcap.
+ */
+#ifndef __USB_USBMON_H_
+#define __USB_USBMON_H_
+
+#include <stddef.h>
+#include <usb/usb.h>
+#include <usb/usbmon_ring.h>
+
+/** Clock source for record time stamps, in nanoseconds */
+typedef uint64_t (*usbmon_clock_t)(void* cookie);
+
+/** Start capturing transfers
+ * @param[in] host   The USB host to capture.
+ * @param[in] mem    Memory for the ring, at least large enough
+ *                   for the header and one record.
+ * @param[in] size   The size of mem in bytes. The ring uses the
+ *                   largest power of two number of records that
+ *                   fits.
+ * @param[in] clock  Time stamp source, may be NULL.
+ * @param[in] cookie Passed unmodified to clock.
+ * @return           0 on success.
+ */
+int usbmon_start(usb_t* host, void* mem, size_t size,
+                 usbmon_clock_t clock, void* cookie);
+
+/** Stop capturing transfers
+ * The ring is left intact for inspection. Must not race with
+ * the host controller IRQ handler.
+ * @param[in] host   The USB host.
+ */
+void usbmon_stop(usb_t* host);
+
+#endif /* __USB_USBMON_H_ */
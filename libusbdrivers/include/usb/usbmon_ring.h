@@ -0,0 +1,74 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Layout of the USB capture ring. This header is shared with host side
+ * tools, so it must not depend on anything but the C library.
+ */
+#ifndef __USB_USBMON_RING_H_
+#define __USB_USBMON_RING_H_
+
+#include <stdint.h>
+
+#define USBMON_MAGIC       0x4e4d5355  /* "USMN" */
+#define USBMON_VERSION     1
+#define USBMON_DATA_LEN    80
+
+/* Record events, as in the Linux usbmon text format */
+#define USBMON_SUBMIT      'S'
+#define USBMON_COMPLETE    'C'
+#define USBMON_ERROR       'E'
+
+/* Transfer types, as in the Linux usbmon binary format */
+#define USBMON_XFER_ISO    0
+#define USBMON_XFER_INTR   1
+#define USBMON_XFER_CTRL   2
+#define USBMON_XFER_BULK   3
+
+/* A fixed size, 128 byte, record */
+struct usbmon_record {
+    /// Record index + 1, written last. A mismatch marks a torn record.
+    uint32_t seq;
+    uint8_t  event;
+    uint8_t  xfer_type;
+    /// Endpoint number, bit 7 set for IN
+    uint8_t  epnum;
+    uint8_t  devnum;
+    uint64_t ts_ns;
+    /// Pairs a completion with its submission
+    uint64_t id;
+    /// 0 or a negative errno, as reported by Linux usbmon
+    int32_t  status;
+    /// Submitted or transferred length of the data stage
+    uint32_t length;
+    uint16_t busnum;
+    /// 0 if setup holds a SETUP packet, '-' otherwise
+    uint8_t  flag_setup;
+    /// 0 if data holds captured bytes, '<' or '>' otherwise
+    uint8_t  flag_data;
+    /// Number of bytes captured in data
+    uint32_t len_cap;
+    uint8_t  setup[8];
+    uint8_t  data[USBMON_DATA_LEN];
+};
+
+/*
+ * The ring overwrites its oldest records. A reader looks at the last
+ * min(head, nrecords) records, record i living in rec[i % nrecords].
+ */
+struct usbmon_ring {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    /// Capacity, a power of two
+    uint32_t nrecords;
+    /// Number of records ever reserved
+    volatile uint32_t head;
+    uint32_t reserved[4];
+    struct usbmon_record rec[];
+};
+
+#endif /* __USB_USBMON_RING_H_ */
@@ -10,6 +10,8 @@
 enum usb_host_id {
     USB_HOST1,
     USB_HOST2,
+    /* xHCI */
+    USB_HOST3,
     USB_NHOSTS,
     USB_HOST_DEFAULT = USB_HOST2
 };
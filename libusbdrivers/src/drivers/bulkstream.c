@@ -0,0 +1,356 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @brief Buffered byte stream over bulk endpoints
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "../services.h"
+#include "bulkstream.h"
+
+enum {
+	REQ_IDLE,
+	REQ_POSTED,		//Owned by the host controller
+	REQ_READY		//Read data waiting to be consumed
+};
+
+enum {
+	BS_OPEN,
+	BS_CLOSING,		//Cancelling outstanding transfers
+	BS_CLOSED		//Freed once the last request is handed back
+};
+
+static void bulk_stream_free(struct bulk_stream *bs)
+{
+	for (int i = 0; i < BULK_STREAM_NREADS; i++) {
+		usb_destroy_xact(bs->dman, &bs->rd[i].xact, 1);
+	}
+	for (int i = 0; i < BULK_STREAM_NWRITES; i++) {
+		usb_destroy_xact(bs->dman, &bs->wr[i].xact, 1);
+	}
+	if (bs->wr_lock) {
+		ps_mutex_destroy(bs->sync, bs->wr_lock);
+	}
+	usb_free(bs);
+}
+
+/* Must hold wr_lock. Returns 1 if the caller should free the stream. */
+static int bulk_stream_idle(struct bulk_stream *bs)
+{
+	if (bs->closed != BS_CLOSED || bs->wr_inflight) {
+		return 0;
+	}
+	for (int i = 0; i < BULK_STREAM_NREADS; i++) {
+		if (bs->rd[i].state == REQ_POSTED) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*************
+ *** Reads ***
+ *************/
+
+static int bulk_stream_read_cb(void *token, enum usb_xact_status stat,
+			       int rbytes);
+
+static int bulk_stream_post_read(struct bulk_stream_req *req)
+{
+	struct bulk_stream *bs = req->bs;
+	int err;
+
+	req->len = 0;
+	req->off = 0;
+	req->state = REQ_POSTED;
+	err = usbdev_schedule_xact(bs->udev, bs->ep_in, &req->xact, 1,
+				   bulk_stream_read_cb, req);
+	if (err) {
+		ZF_LOGE("Transaction error\n");
+		req->state = REQ_IDLE;
+	}
+	return err;
+}
+
+static int bulk_stream_read_cb(void *token, enum usb_xact_status stat,
+			       int rbytes)
+{
+	struct bulk_stream_req *req = (struct bulk_stream_req *)token;
+	struct bulk_stream *bs = req->bs;
+	int release;
+
+	ps_mutex_lock(bs->sync, bs->wr_lock);
+	if (stat == XACTSTAT_CANCELLED) {
+		req->state = REQ_IDLE;
+	} else {
+		/*
+		 * Empty reads are marked ready too, the consumer reposts
+		 * requests in ring order so that completions stay in order.
+		 */
+		if (stat == XACTSTAT_SUCCESS) {
+			req->len = req->xact.len - rbytes;
+		}
+		__atomic_store_n(&req->state, REQ_READY, __ATOMIC_RELEASE);
+	}
+	release = bulk_stream_idle(bs);
+	ps_mutex_unlock(bs->sync, bs->wr_lock);
+
+	if (release) {
+		bulk_stream_free(bs);
+	}
+
+	return 0;
+}
+
+int bulk_stream_read(struct bulk_stream *bs, void *buf, int len)
+{
+	struct bulk_stream_req *req;
+	int cnt = 0;
+	int n;
+
+	if (bs->closed != BS_OPEN) {
+		return 0;
+	}
+
+	while (cnt < len) {
+		req = &bs->rd[bs->rd_head];
+		if (req->state == REQ_IDLE) {
+			/* Reposting it failed on an earlier read, retry */
+			if (bulk_stream_post_read(req)) {
+				break;
+			}
+			bs->rd_head = (bs->rd_head + 1) % BULK_STREAM_NREADS;
+			continue;
+		}
+		if (__atomic_load_n(&req->state, __ATOMIC_ACQUIRE) != REQ_READY) {
+			break;
+		}
+
+		/* Copy out as much of this request as we can */
+		n = MIN(req->len - req->off, len - cnt);
+		memcpy((char*)buf + cnt, (char*)xact_get_vaddr(&req->xact) + req->off, n);
+		req->off += n;
+		cnt += n;
+
+		/*
+		 * Drained, give it back to the host controller. If that fails
+		 * the ring stays here, so that the request is posted again
+		 * before any later one is consumed.
+		 */
+		if (req->off == req->len) {
+			if (bulk_stream_post_read(req)) {
+				break;
+			}
+			bs->rd_head = (bs->rd_head + 1) % BULK_STREAM_NREADS;
+		}
+	}
+
+	return cnt;
+}
+
+/**************
+ *** Writes ***
+ **************/
+
+static int bulk_stream_write_cb(void *token, enum usb_xact_status stat,
+				int rbytes);
+
+/* Send the buffer that is currently being filled. Must hold wr_lock. */
+static void bulk_stream_flush(struct bulk_stream *bs)
+{
+	struct bulk_stream_req *req = &bs->wr[bs->wr_fill];
+	struct xact xact;
+	int err;
+
+	if (req->state != REQ_IDLE || req->len == 0) {
+		return;
+	}
+
+	xact = req->xact;
+	xact.len = req->len;
+	req->state = REQ_POSTED;
+	bs->wr_inflight++;
+	bs->wr_fill = (bs->wr_fill + 1) % BULK_STREAM_NWRITES;
+
+	err = usbdev_schedule_xact(bs->udev, bs->ep_out, &xact, 1,
+				   bulk_stream_write_cb, req);
+	if (err) {
+		ZF_LOGE("Transaction error\n");
+		req->state = REQ_IDLE;
+		req->len = 0;
+		bs->wr_inflight--;
+	}
+}
+
+static int bulk_stream_write_cb(void *token, enum usb_xact_status stat,
+				int rbytes)
+{
+	struct bulk_stream_req *req = (struct bulk_stream_req *)token;
+	struct bulk_stream *bs = req->bs;
+	int release;
+
+	if (stat != XACTSTAT_SUCCESS) {
+		ZF_LOGD("Write failed(%d)\n", stat);
+	}
+
+	ps_mutex_lock(bs->sync, bs->wr_lock);
+	req->len = 0;
+	req->state = REQ_IDLE;
+	bs->wr_inflight--;
+
+	/* Anything written in the mean time goes out in one transfer */
+	if (stat != XACTSTAT_CANCELLED && bs->closed == BS_OPEN) {
+		bulk_stream_flush(bs);
+	}
+	release = bulk_stream_idle(bs);
+	ps_mutex_unlock(bs->sync, bs->wr_lock);
+
+	if (release) {
+		bulk_stream_free(bs);
+	}
+
+	return 0;
+}
+
+int bulk_stream_write(struct bulk_stream *bs, const void *buf, int len)
+{
+	struct bulk_stream_req *req;
+	int cnt = 0;
+	int n;
+
+	ps_mutex_lock(bs->sync, bs->wr_lock);
+	while (cnt < len && bs->closed == BS_OPEN) {
+		req = &bs->wr[bs->wr_fill];
+		if (req->state != REQ_IDLE) {
+			/* Every buffer is in flight */
+			break;
+		}
+
+		n = MIN(BULK_STREAM_WRITE_SIZE - req->len, len - cnt);
+		memcpy((char*)xact_get_vaddr(&req->xact) + req->len,
+		       (const char*)buf + cnt, n);
+		req->len += n;
+		cnt += n;
+
+		/*
+		 * Send straight away if the bus is idle, otherwise keep
+		 * coalescing until the buffer fills up or a transfer completes.
+		 */
+		if (bs->wr_inflight == 0 || req->len == BULK_STREAM_WRITE_SIZE) {
+			bulk_stream_flush(bs);
+		}
+	}
+	ps_mutex_unlock(bs->sync, bs->wr_lock);
+
+	return cnt;
+}
+
+int bulk_stream_init(struct usb_dev *udev, struct endpoint *ep_in,
+		     struct endpoint *ep_out, struct bulk_stream **bs)
+{
+	struct bulk_stream *s;
+	int err;
+
+	if (!udev || !bs) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+	if (!ep_in || !ep_out) {
+		ZF_LOGE("USB %d: Missing bulk endpoint\n", udev->addr);
+		return -1;
+	}
+
+	s = usb_malloc(sizeof(*s));
+	if (!s) {
+		ZF_LOGE("Out of memory\n");
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	s->udev = udev;
+	s->sync = udev->host->hdev.sync;
+	s->dman = udev->dman;
+	s->ep_in = ep_in;
+	s->ep_out = ep_out;
+
+	s->wr_lock = ps_mutex_new(s->sync);
+	if (!s->wr_lock) {
+		ZF_LOGE("Failed to allocate mutex\n");
+		bulk_stream_free(s);
+		return -1;
+	}
+
+	/* Allocate DMA buffers */
+	for (int i = 0; i < BULK_STREAM_NREADS; i++) {
+		s->rd[i].bs = s;
+		s->rd[i].state = REQ_IDLE;
+		s->rd[i].xact.type = PID_IN;
+		s->rd[i].xact.len = BULK_STREAM_READ_SIZE;
+		err = usb_alloc_xact(s->dman, &s->rd[i].xact, 1);
+		if (err) {
+			ZF_LOGE("Out of DMA memory\n");
+			bulk_stream_free(s);
+			return -1;
+		}
+	}
+	for (int i = 0; i < BULK_STREAM_NWRITES; i++) {
+		s->wr[i].bs = s;
+		s->wr[i].state = REQ_IDLE;
+		s->wr[i].xact.type = PID_OUT;
+		s->wr[i].xact.len = BULK_STREAM_WRITE_SIZE;
+		err = usb_alloc_xact(s->dman, &s->wr[i].xact, 1);
+		if (err) {
+			ZF_LOGE("Out of DMA memory\n");
+			bulk_stream_free(s);
+			return -1;
+		}
+	}
+
+	/* Keep every read request posted from now on */
+	for (int i = 0; i < BULK_STREAM_NREADS; i++) {
+		err = bulk_stream_post_read(&s->rd[i]);
+		if (err) {
+			/* Reads may already be in flight */
+			bulk_stream_destroy(s);
+			return -1;
+		}
+	}
+
+	*bs = s;
+	return 0;
+}
+
+void bulk_stream_destroy(struct bulk_stream *bs)
+{
+	usb_host_t *hdev;
+	int release;
+
+	if (!bs) {
+		return;
+	}
+	hdev = &bs->udev->host->hdev;
+
+	/* Stop the callbacks from posting new transfers */
+	ps_mutex_lock(bs->sync, bs->wr_lock);
+	bs->closed = BS_CLOSING;
+	ps_mutex_unlock(bs->sync, bs->wr_lock);
+
+	hdev->cancel_xact(hdev, bs->ep_in);
+	hdev->cancel_xact(hdev, bs->ep_out);
+
+	/*
+	 * The host controller may hand cancelled requests back later, from
+	 * its interrupt handler. Whoever sees the last one frees the stream.
+	 */
+	ps_mutex_lock(bs->sync, bs->wr_lock);
+	bs->closed = BS_CLOSED;
+	release = bulk_stream_idle(bs);
+	ps_mutex_unlock(bs->sync, bs->wr_lock);
+
+	if (release) {
+		bulk_stream_free(bs);
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef _DRIVERS_BULKSTREAM_H_
+#define _DRIVERS_BULKSTREAM_H_
+
+#include <usb/usb.h>
+
+/*
+ * Byte stream over a pair of bulk endpoints, as used by the USB serial
+ * drivers. Several bulk IN requests are kept posted at all times, and writes
+ * are coalesced into pooled DMA buffers that are sent asynchronously.
+ */
+#define BULK_STREAM_NREADS       4
+#define BULK_STREAM_READ_SIZE    512
+#define BULK_STREAM_NWRITES      2
+#define BULK_STREAM_WRITE_SIZE   PAGE_SIZE_4K
+
+struct bulk_stream;
+
+struct bulk_stream_req {
+	struct bulk_stream *bs;
+	struct xact xact;
+	int len;		//Valid bytes (read), or bytes queued (write)
+	int off;		//Bytes already consumed (read)
+	int state;
+};
+
+struct bulk_stream {
+	struct usb_dev *udev;
+	ps_mutex_ops_t *sync;
+	ps_dma_man_t *dman;
+	struct endpoint *ep_in;
+	struct endpoint *ep_out;
+	/* Reads complete in submission order */
+	struct bulk_stream_req rd[BULK_STREAM_NREADS];
+	int rd_head;
+	/* Writes */
+	struct bulk_stream_req wr[BULK_STREAM_NWRITES];
+	int wr_fill;
+	int wr_inflight;
+	void *wr_lock;
+	/* Set by bulk_stream_destroy, protected by wr_lock */
+	int closed;
+};
+
+/** Create a stream and post its read requests
+ * @param[in]  udev   The device that owns the endpoints
+ * @param[in]  ep_in  The bulk IN endpoint
+ * @param[in]  ep_out The bulk OUT endpoint
+ * @param[out] bs     The new stream
+ * @return 0 on success, -1 if the endpoints are missing or out of memory
+ */
+int bulk_stream_init(struct usb_dev *udev, struct endpoint *ep_in,
+		     struct endpoint *ep_out, struct bulk_stream **bs);
+
+/** Cancel outstanding transfers and release the stream
+ * The memory is freed once the host controller has handed back every
+ * request, which may be after this call returns. Call it from the class
+ * driver's disconnect handler, while the endpoints still exist.
+ */
+void bulk_stream_destroy(struct bulk_stream *bs);
+
+/** Copy out up to len bytes that have already been received
+ * @return the number of bytes copied
+ */
+int bulk_stream_read(struct bulk_stream *bs, void *buf, int len);
+
+/** Queue up to len bytes for transmission
+ * @return the number of bytes accepted
+ */
+int bulk_stream_write(struct bulk_stream *bs, const void *buf, int len);
+
+#endif /* _DRIVERS_BULKSTREAM_H_ */
@@ -11,18 +11,10 @@
 #include <stdio.h>
 #include <string.h>
 
-#include <utils/circular_buffer.h>
-#include <platsupport/sync/atomic.h>
 #include "../services.h"
+#include "bulkstream.h"
 #include "cdc.h"
 
-/*
- * XXX: In theory the maximum xact size can be up to 20K, however, our DMA
- * allocator cannot handle that large allocation at the moment.
- */
-#define CDC_READ_XACT_SIZE  128
-#define CDC_READ_BUFFER_SIZE 4096
-
 static const char *subclass_codes[] = {
 	"Reserved",
 	"Direct Line Control Model",
@@ -90,9 +82,7 @@ struct usb_cdc_device {
 	struct endpoint *ep_int; //Interrupt endpoint
 	struct endpoint *ep_in;	 //BULK in endpoint
 	struct endpoint *ep_out; //BULK out endpoint
-	struct xact read_xact;   //Current read request
-	circ_buf_t read_buf;     //Read buffer
-	int read_in_progress;
+	struct bulk_stream *stream; //Data interface stream
 };
 
 static int
@@ -146,28 +136,17 @@ usb_cdc_config_cb(void *token, int cfg, int iface, struct anon_desc *desc)
 	return 0;
 }
 
-static int usb_cdc_read_cb(void *token, enum usb_xact_status stat, int rbytes)
+static int usb_cdc_disconnect(usb_dev_t *udev)
 {
-	struct usb_dev *udev;
 	struct usb_cdc_device *cdc;
-	char *buf;
 
-	udev = (struct usb_dev*)token;
 	cdc = (struct usb_cdc_device*)udev->dev_data;
-
-	if (stat == XACTSTAT_SUCCESS) {
-		buf = (char*)xact_get_vaddr(&cdc->read_xact);
-		for (int i = 0; i < CDC_READ_XACT_SIZE - rbytes; i++) {
-			if (!circ_buf_is_full(&cdc->read_buf)) {
-				circ_buf_put(&cdc->read_buf, buf[i]);
-			} else {
-				break;
-			}
-		}
+	if (cdc) {
+		bulk_stream_destroy(cdc->stream);
+		usb_free(cdc);
+		udev->dev_data = NULL;
 	}
 
-	sync_atomic_decrement(&cdc->read_in_progress, __ATOMIC_RELAXED);
-
 	return 0;
 }
 
@@ -189,6 +168,7 @@ int usb_cdc_bind(usb_dev_t *udev)
 		return -1;
 	}
 
+	memset(cdc, 0, sizeof(*cdc));
 	cdc->udev = udev;
 	udev->dev_data = (struct udev_priv*)cdc;
 
@@ -213,41 +193,16 @@ int usb_cdc_bind(usb_dev_t *udev)
 		}
 	}
 
-	char *buf = usb_malloc(CDC_READ_BUFFER_SIZE);
-	if (!buf) {
-		ZF_LOGD("Failed to allocate circular buffer!\n");
-		usb_free(cdc);
-		return -1;
-	}
-
-	err = circ_buf_new(buf, CDC_READ_BUFFER_SIZE, &cdc->read_buf);
-	if (err) {
-		ZF_LOGD("Failed to allocate circular buffer!\n");
-		usb_free(buf);
-		usb_free(cdc);
-		return -1;
-	}
-
 	class = usbdev_get_class(udev);
 	if (class != USB_CLASS_CDCDATA && class != USB_CLASS_COMM) {
 		ZF_LOGD("Not a CDC device(%d)\n", class);
-		circ_buf_free(&cdc->read_buf);
-		usb_free(buf);
+		udev->dev_data = NULL;
 		usb_free(cdc);
 		return -1;
 	}
 
 	ZF_LOGD("USB CDC found, subclass(%x)\n", cdc->subclass);
 
-	/* Allocate read request */
-	cdc->read_xact.type = PID_IN;
-	cdc->read_xact.len = CDC_READ_XACT_SIZE;
-	err = usb_alloc_xact(udev->dman, &cdc->read_xact, 1);
-	if (err) {
-		ZF_LOGF("Out of DMA memory\n");
-	}
-	cdc->read_in_progress = 0;
-
 	/* Activate configuration */
 	xact.len = sizeof(struct usbreq);
 	err = usb_alloc_xact(udev->dman, &xact, 1);
@@ -267,89 +222,35 @@ int usb_cdc_bind(usb_dev_t *udev)
 	}
 	usb_destroy_xact(udev->dman, &xact, 1);
 
+	/* Start streaming on the data interface */
+	err = bulk_stream_init(udev, cdc->ep_in, cdc->ep_out, &cdc->stream);
+	if (err) {
+		ZF_LOGE("Failed to start the data stream\n");
+		udev->dev_data = NULL;
+		usb_free(cdc);
+		return -1;
+	}
+	udev->disconnect = usb_cdc_disconnect;
+
 	return 0;
 }
 
 int usb_cdc_read(usb_dev_t *udev, void *buf, int len)
 {
-	int err;
-	int cnt = 0;
 	struct usb_cdc_device *cdc;
 
 	cdc = (struct usb_cdc_device*)udev->dev_data;
 
-	if (!cdc->read_in_progress) {
-		err = usbdev_schedule_xact(udev, cdc->ep_in, &cdc->read_xact, 1,
-				usb_cdc_read_cb, udev);
-		if (err) {
-			ZF_LOGF("Transaction error\n");
-		}
-		sync_atomic_increment(&cdc->read_in_progress, __ATOMIC_RELAXED);
-	}
-
-	/* Get data from the read buffer */
-	while (len--) {
-		if (!circ_buf_is_empty(&cdc->read_buf)) {
-			*((char*)buf + cnt) = circ_buf_get(&cdc->read_buf);
-			cnt++;
-		} else {
-			break;
-		}
-	}
-
-	return cnt;
+	return bulk_stream_read(cdc->stream, buf, len);
 }
 
 int usb_cdc_write(usb_dev_t *udev, const void *buf, int len)
 {
-	int err;
-	int cnt;
-	int offset;
 	struct usb_cdc_device *cdc;
-	struct xact *xact;
 
 	cdc = (struct usb_cdc_device*)udev->dev_data;
 
-	/* Xact needs to be virtually contiguous */
-	cnt = ROUND_UP(len, MAX_XACT_SIZE) / MAX_XACT_SIZE;
-
-	xact = usb_malloc(sizeof(struct xact) * cnt);
-	if (!xact) {
-		ZF_LOGF("Out of memory\n");
-	}
-
-	/* Fill in the length of each xact */
-	for (int i = 0; i < cnt; i++) {
-		xact[i].type = PID_OUT;
-		xact[i].len = len < MAX_XACT_SIZE ? len : MAX_XACT_SIZE;
-		len -= xact[i].len;
-	}
-
-	/* DMA allocation */
-	err = usb_alloc_xact(udev->dman, xact, cnt);
-	if (err) {
-		ZF_LOGF("Out of DMA memory\n");
-	}
-
-	/* Copy in */
-	offset = 0;
-	for (int i = 0; i < cnt; i++) {
-		memcpy(xact_get_vaddr(&xact[i]), (char*)buf + offset, xact[i].len);
-		offset += xact[i].len;
-	}
-
-	/* Send to the host */
-	err = usbdev_schedule_xact(udev, cdc->ep_out, xact, cnt, NULL, NULL);
-	if (err) {
-		ZF_LOGF("Transaction error\n");
-	}
-
-	/* Cleanup */
-	usb_destroy_xact(udev->dman, xact, cnt);
-
-	usb_free(xact);
-
-	return len;
+	return bulk_stream_write(cdc->stream, buf, len);
 }
 
 static void
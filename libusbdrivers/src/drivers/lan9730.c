@@ -254,6 +254,81 @@
 #define ETHTXCFG_TXFLUSH BIT(0)
 #define ETHRXCFG_RXFLUSH BIT(0)
 
+/* Bitfields for hardware configuration */
+#define ETHHWCFG_RXDOFF(x)  (((x) & 0x3) << 9)
+#define ETHHWCFG_MEF        BIT(5)
+#define ETHHWCFG_BCE        BIT(1)
+
+/*
+ * RX aggregation. With burst cap enabled, the device packs as many frames as
+ * fit into BURST_CAP bytes into a single bulk IN transfer. We keep a ring of
+ * such buffers posted to the host controller. Completions only mark a buffer
+ * done; lan9730_input(), on the driver's poll path, hands its frames to lwIP
+ * and posts it again.
+ */
+#define ETH_RX_NBUFS        4
+#define ETH_RX_BUF_SIZE     (4 * PAGE_SIZE_4K)
+#define ETH_HS_PKT_SIZE     512
+#define ETH_FS_PKT_SIZE     64
+#define ETH_BULK_IN_DLY     0x2000
+
+enum eth_rx_state {
+    RX_IDLE,
+    RX_POSTED,
+    RX_DONE
+};
+
+struct eth_rx_buf {
+    struct netif *netif;
+    struct xact xact;
+    volatile enum eth_rx_state state;
+/// Bytes received, 0 if the transfer failed
+    int len;
+};
+
+/*
+ * TX engine. Frames handed to us by lwIP are packed, each behind its
+ * TXCMDA/TXCMDB words, into a pooled DMA buffer. Frames from a registered
+ * DMA-capable pbuf region are not copied: only their command words go into
+ * the pool buffer and the pbuf payload becomes a qTD of its own. While
+ * ETH_TX_MAX_INFLIGHT bulk OUT transfers are outstanding, new frames
+ * accumulate in the next request. As on the RX side, the completion
+ * callback only marks a request done; it is reclaimed, and the next one
+ * sent, from lan9730_input() or the next lan9730_linkoutput().
+ */
+#define ETH_TX_NREQS         4
+#define ETH_TX_MAX_INFLIGHT  2
+#define ETH_TX_BUF_SIZE      (4 * PAGE_SIZE_4K)
+#define ETH_TX_MAX_XACTS     32
+#define ETH_TX_MAX_PBUFS     16
+#define ETH_TX_CMD_SIZE      (2 * sizeof(uint32_t))
+/* Command words and payload per segment, plus alignment and the final ZLP */
+#define ETH_TX_MAX_SEGS      ((ETH_TX_MAX_XACTS - 2) / 2)
+
+enum eth_tx_state {
+    TX_IDLE,
+    TX_POSTED,
+    TX_DONE
+};
+
+struct eth_tx_req {
+    struct usb_eth *eth;
+/// Pooled buffer for command words and copied frames
+    struct xact buf;
+    int used;
+/// Bulk OUT stream, in order
+    struct xact xact[ETH_TX_MAX_XACTS];
+    int nxact;
+    int stream_len;
+/// Zero-copy pbufs to release on completion
+    struct pbuf *pbufs[ETH_TX_MAX_PBUFS];
+    int npbufs;
+    int nframes;
+    volatile enum eth_tx_state state;
+/// Completion status, valid in TX_DONE
+    enum usb_xact_status stat;
+};
+
 struct usb_eth {
     struct usb_dev *udev;
 /// Endpoints
@@ -263,7 +338,17 @@ struct usb_eth {
 /// IRQs
     struct xact reg_read_xact[2];
     struct xact reg_write_xact[2];
-    struct xact rx_xact;
+/// RX ring
+    struct eth_rx_buf rx_ring[ETH_RX_NBUFS];
+    int rx_next;
+    volatile int rx_error;
+/// TX engine
+    struct eth_tx_req tx_reqs[ETH_TX_NREQS];
+    struct eth_tx_req *tx_fill;
+    int tx_inflight;
+    void *tx_dma_vaddr;
+    uintptr_t tx_dma_paddr;
+    size_t tx_dma_size;
 #if defined(ETH_ENABLE_IRQS)
     uint32_t *intbm;
     struct xact int_xact;
@@ -294,7 +379,10 @@ static inline struct usbreq __clear_remote_wakeup(uint16_t ep)
 
 static inline struct usbreq __clear_epstall(uint16_t ep)
 {
-    return __clear_ep_feature_req(ep, FEAT_EPSTALL);
+    struct usbreq r = __clear_ep_feature_req(ep, FEAT_EPSTALL);
+    /* ENDPOINT_HALT is a standard feature of the endpoint */
+    r.bmRequestType = USB_DIR_OUT | USB_TYPE_STD | USB_RCPT_ENDPOINT;
+    return r;
 }
 
 /* Get the status of an endpoint, or the device if endpoint 0 */
@@ -555,6 +643,18 @@ static int mac_init(struct usb_eth *eth)
     /* Enable TX/RX full duplex */
     v = MACCR_FULL_DUPLEX | MACCR_TXEN | MACCR_RXEN;
     write_register(eth, REG_MAC_CR, v);
+    /* Multiple frames per bulk IN transfer, bounded by the RX buffer size */
+    if (eth->udev->speed == USBSPEED_HIGH) {
+        v = ETH_RX_BUF_SIZE / ETH_HS_PKT_SIZE;
+    } else {
+        v = MIN(ETH_RX_BUF_SIZE / ETH_FS_PKT_SIZE, 0xff);
+    }
+    write_register(eth, REG_BURST_CAP, v);
+    write_register(eth, REG_BULK_IN_DLY, ETH_BULK_IN_DLY);
+    read_register(eth, REG_HW_CFG, &v);
+    v &= ~ETHHWCFG_RXDOFF(0x3);
+    v |= ETHHWCFG_MEF | ETHHWCFG_BCE;
+    write_register(eth, REG_HW_CFG, v);
 
     /*** PHY ***/
     /* Soft reset */
@@ -621,17 +721,11 @@ static int mac_init(struct usb_eth *eth)
     return 0;
 }
 
-static int do_lan9730_input(struct netif *netif, struct xact *xact)
+static int do_lan9730_input(struct netif *netif, uint32_t sts, char *payload)
 {
     struct eth_hdr *ethhdr;
     struct pbuf *p, *q;
-    uint32_t *hdr;
-    char *payload;
-    uint32_t sts;
     int len;
-    hdr = (uint32_t *) xact_get_vaddr(xact);
-    payload = (char *)&hdr[1];
-    sts = *hdr;
     if (sts & RXSTS_ERROR_STATUS) {
         printf("error frame status 0x%x\n", sts);
         return -1;
@@ -644,7 +738,11 @@ static int do_lan9730_input(struct netif *netif, struct xact *xact)
     /* Construct the packet */
     p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
     if (!p) {
-        ZF_LOGF("LWIP out of memory\n");
+        /* Drop it, the rest of the burst may still fit */
+        ZF_LOGW("LWIP out of memory\n");
+        LINK_STATS_INC(link.memerr);
+        LINK_STATS_INC(link.drop);
+        return -1;
     }
     for (q = p; q != NULL; q = q->next) {
         memcpy(q->payload, payload, q->len);
@@ -653,7 +751,6 @@ static int do_lan9730_input(struct netif *netif, struct xact *xact)
 
 #ifdef ETH_TRAFFIC_DEBUG
     printf("\n" COL_RX "RX packet (%d bytes)\n", p->tot_len);
-    payload = (char *)&hdr[1];
     dump_pbuf(p);
     printf(COL_DEF);
 #endif
@@ -686,6 +783,32 @@ static int do_lan9730_input(struct netif *netif, struct xact *xact)
     return 0;
 }
 
+/*
+ * Walk all frames packed into one bulk IN transfer. Each frame is preceded by
+ * a 32-bit status word and padded so that the next status word is aligned.
+ */
+static int lan9730_rx_burst(struct netif *netif, char *buf, int len)
+{
+    uint32_t sts;
+    int flen;
+    int off = 0;
+    int cnt = 0;
+
+    while (off + (int)sizeof(sts) <= len) {
+        memcpy(&sts, buf + off, sizeof(sts));
+        off += sizeof(sts);
+        flen = RXSTS_FRAME_LENGTH(sts);
+        if (flen == 0 || off + flen > len) {
+            break;
+        }
+        if (!do_lan9730_input(netif, sts, buf + off)) {
+            cnt++;
+        }
+        off += (flen + 3) & ~3;
+    }
+    return cnt;
+}
+
 static int eth_process_status(struct netif *netif, uint32_t status)
 {
     struct usb_eth *eth;
@@ -706,7 +829,6 @@ static int eth_irq_handler(void *token, enum usb_xact_status stat, int bytes_rem
 {
     struct netif *netif = (struct netif *)token;
     struct usb_eth *eth;
-    int err;
     int len;
 
     if (!token) {
@@ -725,11 +847,11 @@ static int eth_irq_handler(void *token, enum usb_xact_status stat, int bytes_rem
         return 1;
     }
 
-    ZF_LOGD("Handling IRQ\n");
-    err = eth_process_status(netif, *eth->intbm);
-    if (err) {
-        ZF_LOGD("Spurious IRQ\n");
-    }
+    /*
+     * INT_RXFIFO is the only status we act on, and lan9730_input() picks
+     * the frames up from the RX ring on the poll path.
+     */
+    ZF_LOGD("IRQ status 0x%x\n", *eth->intbm);
 
     usbdev_schedule_xact(eth->udev, eth->ep_int, &eth->int_xact, 1,
                          &eth_irq_handler, netif);
@@ -738,80 +860,463 @@ static int eth_irq_handler(void *token, enum usb_xact_status stat, int bytes_rem
 }
 #endif
 
-static err_t tx_packet(struct usb_eth *eth, struct pbuf *p)
+static void tx_req_reset(struct eth_tx_req *req)
+{
+    req->used = 0;
+    req->nxact = 0;
+    req->stream_len = 0;
+    req->npbufs = 0;
+    req->nframes = 0;
+    req->state = TX_IDLE;
+}
+
+/* Reserve len bytes of the pool buffer at the tail of the bulk OUT stream */
+static void *tx_req_put(struct eth_tx_req *req, int len)
+{
+    struct xact *xact = NULL;
+    char *vaddr;
+
+    if (req->nxact) {
+        xact = &req->xact[req->nxact - 1];
+    }
+    vaddr = (char *)xact_get_vaddr(&req->buf) + req->used;
+    if (xact == NULL || (char *)xact_get_vaddr(xact) + xact->len != vaddr) {
+        /* The stream tail is a zero-copy segment, start a new xact */
+        xact = &req->xact[req->nxact++];
+        xact->type = PID_OUT;
+        xact->vaddr = vaddr;
+        xact->paddr = xact_get_paddr(&req->buf) + req->used;
+        xact->len = 0;
+    }
+    xact->len += len;
+    req->used += len;
+    req->stream_len += len;
+    return vaddr;
+}
+
+/* Command words must start on a DWORD boundary of the stream */
+static void tx_req_align(struct eth_tx_req *req)
+{
+    int pad = -req->stream_len & 0x3;
+    if (pad) {
+        memset(tx_req_put(req, pad), 0, pad);
+    }
+}
+
+static void tx_req_put_cmd(struct eth_tx_req *req, uint32_t cmda, uint32_t cmdb)
 {
-    struct xact xact[2];
-    struct pbuf *q;
     uint32_t *hdr;
+    tx_req_align(req);
+    hdr = (uint32_t *)tx_req_put(req, ETH_TX_CMD_SIZE);
+    hdr[0] = cmda;
+    hdr[1] = cmdb | TXCMDB_ADD_CRC_DISABLE;
+}
+
+/* Returns the physical address of a pbuf payload if we can DMA from it */
+static uintptr_t tx_dma_lookup(struct usb_eth *eth, struct pbuf *q)
+{
+    uintptr_t v = (uintptr_t)q->payload;
+    uintptr_t base = (uintptr_t)eth->tx_dma_vaddr;
+    if (eth->tx_dma_size == 0 || v < base ||
+        v + q->len > base + eth->tx_dma_size) {
+        return 0;
+    }
+    return eth->tx_dma_paddr + (v - base);
+}
+
+static int tx_can_map(struct usb_eth *eth, struct pbuf *p)
+{
+    struct pbuf *q;
+    for (q = p; q != NULL; q = q->next) {
+        if (q->len == 0 || tx_dma_lookup(eth, q) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int tx_nsegs(struct pbuf *p)
+{
+    int n = 0;
+    for (; p != NULL; p = p->next) {
+        n++;
+    }
+    return n;
+}
+
+/* Append a frame to a request. Returns 0 on success, -1 if it does not fit */
+static int tx_req_add(struct eth_tx_req *req, struct pbuf *p)
+{
+    struct usb_eth *eth = req->eth;
+    struct pbuf *q;
     char *payload;
+    int nsegs;
+
+    /* A chain that could never fit a request's xacts is copied instead */
+    nsegs = tx_nsegs(p);
+    if (nsegs <= ETH_TX_MAX_SEGS && tx_can_map(eth, p)) {
+        /* Command words, alignment and payload for each segment */
+        if (req->nxact + 2 * nsegs + 2 > ETH_TX_MAX_XACTS ||
+            req->used + nsegs * (ETH_TX_CMD_SIZE + 3) + 3 > ETH_TX_BUF_SIZE ||
+            req->npbufs == ETH_TX_MAX_PBUFS) {
+            return -1;
+        }
+        for (q = p; q != NULL; q = q->next) {
+            struct xact *xact;
+            uint32_t cmda = TXCMDA_DATA_START_OFFSET(0) | TXCMDA_BUFFER_SIZE(q->len);
+            if (q == p) {
+                cmda |= TXCMDA_FIRST_SEGMENT;
+            }
+            if (q->next == NULL) {
+                cmda |= TXCMDA_LAST_SEGMENT;
+            }
+            tx_req_put_cmd(req, cmda, TXCMDB_FRAME_LENGTH(p->tot_len));
+            ps_dma_cache_clean(eth->udev->dman, q->payload, q->len);
+            xact = &req->xact[req->nxact++];
+            xact->type = PID_OUT;
+            xact->vaddr = q->payload;
+            xact->paddr = tx_dma_lookup(eth, q);
+            xact->len = q->len;
+            req->stream_len += q->len;
+        }
+        /* Hold on to the pbuf until the transfer completes */
+        pbuf_ref(p);
+        req->pbufs[req->npbufs++] = p;
+    } else {
+        if (req->nxact + 2 > ETH_TX_MAX_XACTS ||
+            req->used + ETH_TX_CMD_SIZE + p->tot_len + 6 > ETH_TX_BUF_SIZE) {
+            return -1;
+        }
+        tx_req_put_cmd(req, TXCMDA_DATA_START_OFFSET(0) |
+                       TXCMDA_BUFFER_SIZE(p->tot_len) |
+                       TXCMDA_FIRST_SEGMENT | TXCMDA_LAST_SEGMENT,
+                       TXCMDB_FRAME_LENGTH(p->tot_len));
+        payload = tx_req_put(req, p->tot_len);
+        for (q = p; q != NULL; q = q->next) {
+            memcpy(payload, q->payload, q->len);
+            payload += q->len;
+        }
+    }
+    req->nframes++;
+    return 0;
+}
+
+static struct eth_tx_req *tx_req_get(struct usb_eth *eth)
+{
+    for (int i = 0; i < ETH_TX_NREQS; i++) {
+        if (eth->tx_reqs[i].state == TX_IDLE && &eth->tx_reqs[i] != eth->tx_fill) {
+            return &eth->tx_reqs[i];
+        }
+    }
+    return NULL;
+}
+
+static int tx_complete(void *token, enum usb_xact_status stat, int rbytes);
+
+/* Release the pbufs of a request that the host is done with */
+static void tx_req_release(struct usb_eth *eth, struct eth_tx_req *req)
+{
+    for (int i = 0; i < req->npbufs; i++) {
+        pbuf_free(req->pbufs[i]);
+    }
+    tx_req_reset(req);
+    eth->tx_inflight--;
+}
+
+/* Send the request that is currently being filled */
+static int tx_flush(struct usb_eth *eth)
+{
+    struct eth_tx_req *req = eth->tx_fill;
+    struct xact *xact;
     int err;
 
+    if (req == NULL || req->nframes == 0) {
+        return 0;
+    }
+    tx_req_align(req);
+    /* TODO: This forces a data toggle. It is needed because we do not store
+     * the DATAx that the packet should be sent to. */
+    xact = &req->xact[req->nxact++];
+    xact->type = PID_OUT;
+    xact->vaddr = NULL;
+    xact->paddr = 0;
+    xact->len = 0;
+
+    eth->tx_fill = NULL;
+    req->state = TX_POSTED;
+    eth->tx_inflight++;
+    err = usbdev_schedule_xact(eth->udev, eth->ep_out, req->xact, req->nxact,
+                               &tx_complete, req);
+    if (err) {
+        ZF_LOGE("Transaction error\n");
+        tx_req_release(eth, req);
+    }
+    return err;
+}
+
+/*
+ * Runs in the host controller's completion context, which may be an
+ * interrupt. Nothing here touches lwIP or the fill state.
+ */
+static int tx_complete(void *token, enum usb_xact_status stat, int rbytes)
+{
+    struct eth_tx_req *req = (struct eth_tx_req *)token;
+
+    if (!token) {
+        ZF_LOGF("Invalid token\n");
+    }
+    req->stat = stat;
+    req->state = TX_DONE;
+    return 0;
+}
+
+/*
+ * Reclaims completed requests and sends the frames that queued up while
+ * they were in flight. Called from the poll and linkoutput paths only.
+ */
+static void tx_reclaim(struct usb_eth *eth)
+{
+    struct eth_tx_req *req;
+    int cancelled = 0;
+
+    for (int i = 0; i < ETH_TX_NREQS; i++) {
+        req = &eth->tx_reqs[i];
+        if (req->state != TX_DONE) {
+            continue;
+        }
+        if (req->stat == XACTSTAT_CANCELLED) {
+            /* The device is going away */
+            cancelled = 1;
+        } else if (req->stat != XACTSTAT_SUCCESS) {
+            ZF_LOGD("TX transfer failed (%d)\n", req->stat);
+        }
+        tx_req_release(eth, req);
+    }
+
+    if (!cancelled && eth->tx_inflight < ETH_TX_MAX_INFLIGHT) {
+        tx_flush(eth);
+    }
+}
+
+static err_t tx_packet(struct usb_eth *eth, struct pbuf *p)
+{
 #ifdef ETH_TRAFFIC_DEBUG
     printf("\n" COL_TX "TX packet (%d bytes)\n", p->tot_len);
     dump_pbuf(p);
     printf(COL_DEF);
 #endif
-    /* Allocate the buffers */
-    xact[0].type = PID_OUT;
-    xact[0].len = p->tot_len + sizeof(*hdr) * 2;
-    /* TODO: This forces a data toggle. It is needed because we do not store
-     * the DATAx that the packet should be sent to. */
-    xact[1].type = PID_OUT;
-    xact[1].len = 0;
-    err = usb_alloc_xact(eth->udev->dman, xact, 2);
-    if (err) {
-        return ENOMEM;
+    tx_reclaim(eth);
+    if (eth->tx_fill == NULL) {
+        eth->tx_fill = tx_req_get(eth);
+        if (eth->tx_fill == NULL) {
+            return ERR_MEM;
+        }
     }
-    hdr = (uint32_t *) xact_get_vaddr(&xact[0]);
-    payload = (char *)&hdr[2];
-    /* Construct the packet */
-    hdr[0] = TXCMDA_DATA_START_OFFSET(0) | TXCMDA_BUFFER_SIZE(p->tot_len);
-    hdr[0] |= TXCMDA_FIRST_SEGMENT | TXCMDA_LAST_SEGMENT;
-    hdr[1] = TXCMDB_FRAME_LENGTH(p->tot_len);
-    hdr[1] |= TXCMDB_ADD_CRC_DISABLE;
-    for (q = p; q != NULL; q = q->next) {
-        memcpy(payload, q->payload, q->len);
-        payload += q->len;
+    if (tx_req_add(eth->tx_fill, p)) {
+        /* The pending request is full, make room for a new one */
+        if (eth->tx_inflight >= ETH_TX_MAX_INFLIGHT) {
+            return ERR_MEM;
+        }
+        tx_flush(eth);
+        eth->tx_fill = tx_req_get(eth);
+        if (eth->tx_fill == NULL || tx_req_add(eth->tx_fill, p)) {
+            return ERR_MEM;
+        }
     }
-    /* send it */
-    err = usbdev_schedule_xact(eth->udev, eth->ep_out, xact, 2, NULL, NULL);
-    if (err) {
-        ZF_LOGF("Transaction error\n");
+    if (eth->tx_inflight < ETH_TX_MAX_INFLIGHT) {
+        tx_flush(eth);
+    }
+    return ERR_OK;
+}
+
+static int tx_engine_init(struct usb_eth *eth)
+{
+    struct eth_tx_req *req;
+    int err;
+
+    eth->tx_fill = NULL;
+    eth->tx_inflight = 0;
+    for (int i = 0; i < ETH_TX_NREQS; i++) {
+        req = &eth->tx_reqs[i];
+        req->eth = eth;
+        req->buf.type = PID_OUT;
+        req->buf.len = ETH_TX_BUF_SIZE;
+        err = usb_alloc_xact(eth->udev->dman, &req->buf, 1);
+        if (err) {
+            while (i-- > 0) {
+                usb_destroy_xact(eth->udev->dman, &eth->tx_reqs[i].buf, 1);
+            }
+            return -1;
+        }
+        tx_req_reset(req);
+    }
+    return 0;
+}
+
+int lan9730_set_tx_dma_region(struct netif *netif, void *vaddr,
+                              uintptr_t paddr, size_t size)
+{
+    struct usb_eth *eth;
+
+    if (netif->state == NULL) {
+        return -1;
     }
+    eth = netif_get_eth_driver(netif);
+    eth->tx_dma_vaddr = vaddr;
+    eth->tx_dma_paddr = paddr;
+    eth->tx_dma_size = size;
+    return 0;
+}
+
+static int eth_rx_complete(void *token, enum usb_xact_status stat, int rbytes);
+
+static int eth_rx_submit(struct usb_eth *eth, struct eth_rx_buf *rxb)
+{
+    int err;
 
+    if (rxb->state != RX_IDLE) {
+        return 0;
+    }
+    rxb->state = RX_POSTED;
+    err = usbdev_schedule_xact(eth->udev, eth->ep_in, &rxb->xact, 1,
+                               &eth_rx_complete, rxb);
+    if (err) {
+        ZF_LOGE("Transaction error\n");
+        rxb->state = RX_IDLE;
+    }
     return err;
 }
 
+static int eth_rx_complete(void *token, enum usb_xact_status stat, int rbytes)
+{
+    struct eth_rx_buf *rxb = (struct eth_rx_buf *)token;
+    struct usb_eth *eth;
+
+    if (!token) {
+        ZF_LOGF("Invalid token\n");
+    }
+    eth = netif_get_eth_driver(rxb->netif);
+
+    /* The device is going away */
+    if (stat == XACTSTAT_CANCELLED) {
+        rxb->state = RX_IDLE;
+        return 0;
+    }
+
+    /*
+     * Nothing is resubmitted from here. The frames go to lwIP from the
+     * poll path, and after an error the endpoint may have stalled, in
+     * which case a new transfer would fail again straight away.
+     */
+    if (stat == XACTSTAT_SUCCESS) {
+        rxb->len = rxb->xact.len - rbytes;
+    } else {
+        ZF_LOGD("RX transfer failed (%d)\n", stat);
+        rxb->len = 0;
+        eth->rx_error = 1;
+    }
+    rxb->state = RX_DONE;
+    return 0;
+}
+
+/* Clear a halt of the bulk IN endpoint, if the device reports one */
+static int eth_rx_clear_halt(struct usb_eth *eth)
+{
+    struct usbreq *r;
+    uint16_t *sts;
+    uint16_t ep = eth->ep_in->num | BIT(7);
+    int err;
+
+    r = xact_get_vaddr(&eth->reg_read_xact[0]);
+    sts = xact_get_vaddr(&eth->reg_read_xact[1]);
+    *r = __get_status_req(ep);
+    err = usbdev_schedule_xact(eth->udev, eth->udev->ep_ctrl,
+                               eth->reg_read_xact, 2, NULL, NULL);
+    if (err < 0) {
+        return -1;
+    }
+    if (!(*sts & BIT(0))) {
+        return 0;
+    }
+
+    r = xact_get_vaddr(&eth->reg_write_xact[0]);
+    *r = __clear_epstall(ep);
+    err = usbdev_schedule_xact(eth->udev, eth->udev->ep_ctrl,
+                               eth->reg_write_xact, 1, NULL, NULL);
+    return err < 0 ? -1 : 0;
+}
+
+static int eth_rx_ring_init(struct netif *netif, struct usb_eth *eth)
+{
+    struct eth_rx_buf *rxb;
+    int err;
+
+    for (int i = 0; i < ETH_RX_NBUFS; i++) {
+        rxb = &eth->rx_ring[i];
+        rxb->netif = netif;
+        rxb->state = RX_IDLE;
+        rxb->len = 0;
+        rxb->xact.type = PID_IN;
+        rxb->xact.len = ETH_RX_BUF_SIZE;
+        err = usb_alloc_xact(eth->udev->dman, &rxb->xact, 1);
+        if (err) {
+            while (i-- > 0) {
+                usb_destroy_xact(eth->udev->dman, &eth->rx_ring[i].xact, 1);
+            }
+            return -1;
+        }
+    }
+    eth->rx_next = 0;
+    eth->rx_error = 0;
+    return 0;
+}
+
+/*
+ * Hands the frames of completed RX ring buffers to lwIP, in the order they
+ * arrived, and posts the buffers again. Finished TX requests are reclaimed
+ * too. This is the driver's poll path, the completion callbacks never call
+ * into lwIP.
+ */
 int lan9730_input(struct netif *netif)
 {
     struct usb_eth *eth;
-    struct xact xact;
+    struct eth_rx_buf *rxb;
     int err;
 
     eth = netif_get_eth_driver(netif);
 
-    /* Allocate a buffer */
-    xact.type = PID_IN;
-    xact.len = eth->ep_in->max_pkt;
-    err = usb_alloc_xact(eth->udev->dman, &xact, 1);
-    if (err) {
-        return -1;
+    /* Completed TX requests are reclaimed here too */
+    tx_reclaim(eth);
+
+    /* Bulk IN transfers complete in the order they were posted */
+    for (int i = 0; i < ETH_RX_NBUFS; i++) {
+        rxb = &eth->rx_ring[eth->rx_next];
+        if (rxb->state != RX_DONE) {
+            break;
+        }
+        lan9730_rx_burst(netif, xact_get_vaddr(&rxb->xact), rxb->len);
+        rxb->state = RX_IDLE;
+        eth->rx_next = (eth->rx_next + 1) % ETH_RX_NBUFS;
     }
-    /* Read in a frame */
-    err = usbdev_schedule_xact(eth->udev, eth->ep_in, &xact, 1, NULL, NULL);
-    if (err) {
-        ZF_LOGF("Transaction error\n");
+
+    /* A transfer failed, make sure the endpoint is not left stalled */
+    if (eth->rx_error) {
+        eth->rx_error = 0;
+        if (eth_rx_clear_halt(eth)) {
+            eth->rx_error = 1;
+            return -1;
+        }
     }
-    if (err <= 0) {
-        /* Nothing there. Return */
-        err = 0;
-    } else {
-        /* Forward the usb packet */
-        err = do_lan9730_input(netif, &xact);
+
+    /* Post idle buffers behind those the host still owns, in ring order */
+    for (int i = 0; i < ETH_RX_NBUFS; i++) {
+        rxb = &eth->rx_ring[(eth->rx_next + i) % ETH_RX_NBUFS];
+        err = eth_rx_submit(eth, rxb);
+        if (err) {
+            return -1;
+        }
     }
-    /* Clean up */
-    usb_destroy_xact(eth->udev->dman, &xact, 1);
-    return err;
+    return 0;
 }
 
 err_t lan9730_linkoutput(struct netif *netif, struct pbuf *p)
@@ -825,13 +1330,16 @@ err_t lan9730_linkoutput(struct netif *netif, struct pbuf *p)
 #endif
 
     ret = tx_packet(usb_eth, p);
-    pbuf_ref(p);
 
 #if ETH_PAD_SIZE
     pbuf_header(p, ETH_PAD_SIZE);   /* reclaim the padding word */
 #endif
 
-    LINK_STATS_INC(link.xmit);
+    if (ret == ERR_OK) {
+        LINK_STATS_INC(link.xmit);
+    } else {
+        LINK_STATS_INC(link.drop);
+    }
 
     return ret;
 }
@@ -949,6 +1457,11 @@ struct netif *lan9730_driver_bind(usb_dev_t *udev)
 
     mac_init(eth);
 
+    err = tx_engine_init(eth);
+    if (err) {
+        ZF_LOGF("Out of DMA memory\n");
+    }
+
 #if defined(ETH_ENABLE_IRQS)
     eth->int_xact.type = PID_IN;
     eth->int_xact.len = eth->ep_int->max_pkt;
@@ -969,6 +1482,13 @@ struct netif *lan9730_driver_bind(usb_dev_t *udev)
 #endif
     netif_add(netif, NULL, NULL, NULL, eth, lan9730_init, ethernet_input);
 
+    /* Post the RX ring */
+    err = eth_rx_ring_init(netif, eth);
+    if (err) {
+        ZF_LOGF("Out of DMA memory\n");
+    }
+    lan9730_input(netif);
+
     return netif;
 }
 
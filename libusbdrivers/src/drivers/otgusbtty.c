@@ -93,7 +93,7 @@ static struct endpoint_desc otg_usbtty_ep3_desc = {
 
 static void
 freebuf_cb(usb_otg_t otg, void* token,
-           enum usb_xact_status stat)
+           enum usb_xact_status stat, int bytes)
 {
     struct free_token* t;
 
@@ -185,8 +185,8 @@ send_desc(otg_usbtty_t tty, enum DescriptorType type, int index,
             ps_dma_free_pinned(tty->dman, t->vaddr, t->size);
             ZF_LOGF("OTG device error\n");
         }
-        /* Status phase */
-        err = otg_prime(tty->otg, 0, PID_OUT, NULL, 0, 0, freebuf_cb, t);
+        /* Status phase, the data phase frees the buffer */
+        err = otg_prime(tty->otg, 0, PID_OUT, NULL, 0, 0, NULL, NULL);
         if (err) {
             ps_dma_free_pinned(tty->dman, t->vaddr, t->size);
             ZF_LOGF("OTG device error\n");
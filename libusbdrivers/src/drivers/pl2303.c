@@ -13,6 +13,7 @@
 
 #include <usb/drivers/pl2303.h>
 #include "../services.h"
+#include "bulkstream.h"
 
 #define PL2303_VENDOR_REQ  0x01
 #define PL2303_READ_TYPE   (USB_DIR_IN | USB_TYPE_VEN | USB_RCPT_DEVICE)
@@ -36,6 +37,7 @@ struct pl2303_device {
 	struct endpoint *ep_in;	 //BULK in endpoint
 	struct endpoint *ep_out; //BULK out endpoint
 	struct xact int_xact;    //Interrupt xact
+	struct bulk_stream *stream; //Serial data stream
 };
 
 static int
@@ -69,6 +71,12 @@ pl2303_interrupt_cb(void* token, enum usb_xact_status stat, int rbytes)
 	struct pl2303_device *dev;
 	struct usb_dev *udev;
 
+	/* The device is going away, or the endpoint needs attention */
+	if (stat != XACTSTAT_SUCCESS) {
+		ZF_LOGD("Interrupt transfer stopped(%d)\n", stat);
+		return 0;
+	}
+
 	udev = (struct usb_dev*)token;
 	dev = (struct pl2303_device*)udev->dev_data;
 
@@ -76,7 +84,7 @@ pl2303_interrupt_cb(void* token, enum usb_xact_status stat, int rbytes)
 	err = usbdev_schedule_xact(udev, dev->ep_int, &dev->int_xact, 1,
 			pl2303_interrupt_cb, udev);
 	if (err) {
-		ZF_LOGF("Transaction error\n");
+		ZF_LOGE("Transaction error\n");
 	}
 
 	return err;
@@ -135,6 +143,23 @@ pl2303_startup_magic(struct usb_dev *udev)
 	usb_destroy_xact(udev->dman, xact, 2);
 }
 
+static int pl2303_disconnect(usb_dev_t *udev)
+{
+	struct pl2303_device *dev;
+	usb_host_t *hdev = &udev->host->hdev;
+
+	dev = (struct pl2303_device*)udev->dev_data;
+	if (dev) {
+		bulk_stream_destroy(dev->stream);
+		hdev->cancel_xact(hdev, dev->ep_int);
+		usb_destroy_xact(udev->dman, &dev->int_xact, 1);
+		usb_free(dev);
+		udev->dev_data = NULL;
+	}
+
+	return 0;
+}
+
 int usb_pl2303_bind(usb_dev_t *udev)
 {
 	int err;
@@ -152,6 +177,7 @@ int usb_pl2303_bind(usb_dev_t *udev)
 		return -1;
 	}
 
+	memset(dev, 0, sizeof(*dev));
 	dev->udev = udev;
 	udev->dev_data = (struct udev_priv*)dev;
 
@@ -179,6 +205,8 @@ int usb_pl2303_bind(usb_dev_t *udev)
 	if (udev->vend_id != 0x067b || udev->prod_id != 0x2303) {
 		ZF_LOGD("Not a PL2303 device(%u:%u)\n",
 				udev->vend_id, udev->prod_id);
+		udev->dev_data = NULL;
+		usb_free(dev);
 		return -1;
 	}
 
@@ -220,6 +248,18 @@ int usb_pl2303_bind(usb_dev_t *udev)
 		ZF_LOGF("Transaction error\n");
 	}
 
+	/* Start streaming serial data */
+	err = bulk_stream_init(udev, dev->ep_in, dev->ep_out, &dev->stream);
+	if (err) {
+		ZF_LOGE("Failed to start the data stream\n");
+		udev->host->hdev.cancel_xact(&udev->host->hdev, dev->ep_int);
+		usb_destroy_xact(udev->dman, &dev->int_xact, 1);
+		udev->dev_data = NULL;
+		usb_free(dev);
+		return -1;
+	}
+	udev->disconnect = pl2303_disconnect;
+
 	return 0;
 }
 
@@ -303,59 +343,21 @@ int usb_pl2303_configure(usb_dev_t *udev, uint32_t bps, uint8_t char_size,
 	return 0;
 }
 
-/* TODO: Remove the 20K limitation */
 int usb_pl2303_write(usb_dev_t *udev, void *buf, int len)
 {
-	int err;
 	struct pl2303_device *dev;
-	struct xact xact;
 
 	dev = (struct pl2303_device*)udev->dev_data;
 
-	xact.type = PID_OUT;
-	xact.len = len;
-	err = usb_alloc_xact(udev->dman, &xact, 1);
-	if (err) {
-		ZF_LOGF("Out of DMA memory\n");
-	}
-
-	memcpy(xact_get_vaddr(&xact), buf, len);
-
-	err = usbdev_schedule_xact(udev, dev->ep_out, &xact, 1, NULL, NULL);
-	if (err) {
-		ZF_LOGF("Transaction error\n");
-	}
-
-	usb_destroy_xact(udev->dman, &xact, 1);
-
-	return len - err;
+	return bulk_stream_write(dev->stream, buf, len);
 }
 
-/* TODO: Remove the 20K limitation and possible babble */
 int usb_pl2303_read(usb_dev_t *udev, void *buf, int len)
 {
-	int err;
 	struct pl2303_device *dev;
-	struct xact xact;
 
 	dev = (struct pl2303_device*)udev->dev_data;
 
-	xact.type = PID_IN;
-	xact.len = len;
-	err = usb_alloc_xact(udev->dman, &xact, 1);
-	if (err) {
-		ZF_LOGF("Out of DMA memory\n");
-	}
-
-	err = usbdev_schedule_xact(udev, dev->ep_in, &xact, 1, NULL, NULL);
-	if (err) {
-		ZF_LOGF("Transaction error\n");
-	}
-
-	memcpy(buf, xact_get_vaddr(&xact), len);
-
-	usb_destroy_xact(udev->dman, &xact, 1);
-
-	return len - err;
+	return bulk_stream_read(dev->stream, buf, len);
 }
 
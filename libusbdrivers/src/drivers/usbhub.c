@@ -160,13 +160,134 @@ struct usb_hubem {
 	void *token;
 };
 
+/* Send a request on the hub's control endpoint */
+static void hub_ctrl(usb_hub_t h, struct usbreq r, int nxact)
+{
+	struct usbreq *req = xact_get_vaddr(&h->ctrl_xact[0]);
+	int ret;
+
+	*req = r;
+	ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
+				   h->ctrl_xact, nxact, NULL, NULL);
+	if (ret < 0) {
+		ZF_LOGF("Transaction error\n");
+	}
+}
+
+/*
+ * Runs from usb_handle_irq after the host controller has finished its
+ * completions, so the synchronous requests below are safe.
+ */
+static void hub_enum_cb(void *token, usb_dev_t *udev)
+{
+	struct usb_hub_port *p = (struct usb_hub_port *)token;
+	usb_hub_t h = p->hub;
+	usb_hub_t new_hub = NULL;
+	int port = p - h->port + 1;
+
+	if (!udev) {
+		/* Disable the port, the device will not be used */
+		hub_ctrl(h, __clear_port_feature_req(port, PORT_ENABLE), 1);
+		return;
+	}
+
+	/* Unplugged while we were reading its descriptors */
+	if (!p->connected) {
+		usbdev_disconnect(udev);
+		return;
+	}
+
+	p->udev = udev;
+	usb_hub_driver_bind(udev, &new_hub);
+}
+
+/* Reset a newly connected port and hand the device over to the core */
+static void _enumerate_port(usb_hub_t h, int port)
+{
+	struct port_status *sts;
+	enum usb_speed speed;
+	uint16_t status;
+	int ret;
+
+	sts = xact_get_vaddr(&h->ctrl_xact[1]);
+
+	/* Enable the connection by resetting the port */
+	hub_ctrl(h, __set_port_feature_req(port, PORT_RESET), 1);
+
+	/*
+	 * Wait for the hub to exit the resetting state, refer
+	 * to USB spec 11.5.1.5
+	 * We also need to re-read the port status, it's updated
+	 * by the reset.
+	 */
+	do {
+		ps_mdelay(10);
+		hub_ctrl(h, __get_port_status_req(port), 2);
+		status = sts->wPortStatus;
+	} while (status & BIT(PORT_RESET));
+
+	/* Reset finished, clear reset status */
+	hub_ctrl(h, __clear_port_feature_req(port, C_PORT_RESET), 1);
+
+	/* Gone again during the reset */
+	if (!(status & BIT(PORT_CONNECTION))) {
+		h->port[port - 1].connected = 0;
+		return;
+	}
+
+	/* Create the new device */
+	if (status & BIT(PORT_SUPER_SPEED)) {
+		speed = USBSPEED_SUPER;
+	} else if (status & BIT(PORT_HIGH_SPEED)) {
+		speed = USBSPEED_HIGH;
+	} else if (status & BIT(PORT_LOW_SPEED)) {
+		speed = USBSPEED_LOW;
+	} else {
+		speed = USBSPEED_FULL;
+	}
+
+	/*
+	 * Only the address assignment is done here, the device leaves the
+	 * default state before we reset the next port. Its descriptors are
+	 * read in the background.
+	 */
+	ret = usb_new_device_async(h->udev, port, speed, &hub_enum_cb,
+				   &h->port[port - 1]);
+	if (ret < 0) {
+		hub_ctrl(h, __set_port_feature_req(port, PORT_RESET), 1);
+	}
+}
+
+/* Enumerate all ports that reported a connection */
+static void _enumerate_pending(usb_hub_t h)
+{
+	int pending = 0;
+
+	for (int i = 0; i < h->nports; i++) {
+		pending |= h->port[i].pending;
+	}
+	if (!pending) {
+		return;
+	}
+
+	/*
+	 * Wait for the devices to stabilize, USB spec 9.1.2. The debounce
+	 * interval is shared by every port that connected at the same time.
+	 */
+	ps_mdelay(100);
+
+	for (int i = 0; i < h->nports; i++) {
+		if (h->port[i].pending) {
+			h->port[i].pending = 0;
+			_enumerate_port(h, i + 1);
+		}
+	}
+}
+
 static void _handle_port_change(usb_hub_t h, int port)
 {
-	struct xact xact[2];
-	struct usbreq *req;
 	struct port_status *sts;
 	uint16_t change, status;
-	int ret;
 
 	if (!h) {
 		ZF_LOGF("Invalid HUB\n");
@@ -180,24 +301,8 @@ static void _handle_port_change(usb_hub_t h, int port)
 	ZF_LOGD("Handle status change of port %d\n", port);
 
 	/* Get port status change */
-	xact[0].type = PID_SETUP;
-	xact[0].len = sizeof(struct usbreq);
-	xact[1].type = PID_IN;
-	xact[1].len = sizeof(struct port_status);
-
-	ret = usb_alloc_xact(h->udev->dman, xact, 2);
-	if (ret) {
-		ZF_LOGF("Out of DMA memory\n");
-	}
-	req = xact_get_vaddr(&xact[0]);
-	sts = xact_get_vaddr(&xact[1]);
-
-	*req = __get_port_status_req(port);
-	ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-				   xact, 2, NULL, NULL);
-	if (ret < 0) {
-		ZF_LOGF("Transaction error\n");
-	}
+	sts = xact_get_vaddr(&h->ctrl_xact[1]);
+	hub_ctrl(h, __get_port_status_req(port), 2);
 
 	/* Cache the port status, because we need to clear it right away. */
 	change = sts->wPortChange;
@@ -209,92 +314,18 @@ static void _handle_port_change(usb_hub_t h, int port)
 	/* Attach and detach detect event */
 	if (change & BIT(PORT_CONNECTION)) {
 		/* Clear the port connection status */
-		*req = __clear_port_feature_req(port, C_PORT_CONNECTION);
-		ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-					   xact, 1, NULL, NULL);
-		if (ret < 0) {
-			ZF_LOGF("Transaction error\n");
-		}
+		hub_ctrl(h, __clear_port_feature_req(port, C_PORT_CONNECTION), 1);
 
 		if (status & BIT(PORT_CONNECTION)) {
 			ZF_LOGD("Port %d connected\n", port);
-			/* Wait for the device to stabilize, USB spec 9.1.2 */
-			ps_mdelay(100);
-
-			/* Enable the connection by resetting the port */
-			*req = __set_port_feature_req(port, PORT_RESET);
-			ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-						   xact, 1, NULL, NULL);
-			if (ret < 0) {
-				ZF_LOGF("Transaction error\n");
-			}
-
-			/*
-			 * Wait for the hub to exit the resetting state, refer
-			 * to USB spec 11.5.1.5
-			 * We also need to re-read the port status, it's updated
-			 * by the reset.
-			 */
-			*req = __get_port_status_req(port);
-			do {
-				ps_mdelay(10);
-				ret =
-				    usbdev_schedule_xact(h->udev,
-							 h->udev->ep_ctrl, xact,
-							 2, NULL, NULL);
-				if (ret < 0) {
-					ZF_LOGF("Transaction error\n");
-				}
-
-				status = sts->wPortStatus;
-			} while (status & BIT(PORT_RESET));
-
-			/* Reset finished, clear reset status */
-			*req = __clear_port_feature_req(port, C_PORT_RESET);
-			ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-						   xact, 1, NULL, NULL);
-			if (ret < 0) {
-				ZF_LOGF("Transaction error\n");
-			}
-
-			/* Create the new device */
-			enum usb_speed speed;
-			struct usb_dev *new_dev = NULL;
-			usb_hub_t new_hub = NULL;
-
-			if (status & BIT(PORT_HIGH_SPEED)) {
-				speed = USBSPEED_HIGH;
-			} else if (status & BIT(PORT_LOW_SPEED)) {
-				speed = USBSPEED_LOW;
-			} else {
-				speed = USBSPEED_FULL;
-			}
-
-			ret = usb_new_device(h->udev, port, speed, &new_dev);
-			if (ret < 0) {
-				*req = __set_port_feature_req(port, PORT_RESET);
-				ret =
-				    usbdev_schedule_xact(h->udev,
-							 h->udev->ep_ctrl, xact,
-							 1, NULL, NULL);
-				if (ret < 0) {
-					ZF_LOGF("Transaction error\n");
-				}
-				if (new_dev) {
-					usbdev_disconnect(new_dev);
-				}
-			} else {
-				h->port[port - 1].udev = new_dev;
-				usb_hub_driver_bind(new_dev, &new_hub);
-			}
+			/* Enumerated once every port has been looked at */
+			h->port[port - 1].connected = 1;
+			h->port[port - 1].pending = 1;
 		} else {
 			ZF_LOGD("Port %d disconnected\n", port);
-			*req = __set_port_feature_req(port, PORT_SUSPEND);
-			ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-						   xact, 1, NULL, NULL);
-			if (ret < 0) {
-				ZF_LOGF("Transaction error\n");
-			}
+			hub_ctrl(h, __set_port_feature_req(port, PORT_SUSPEND), 1);
+			h->port[port - 1].connected = 0;
+			h->port[port - 1].pending = 0;
 			if (h->port[port - 1].udev) {
 				usbdev_disconnect(h->port[port - 1].udev);
 				h->port[port - 1].udev = NULL;
@@ -305,52 +336,30 @@ static void _handle_port_change(usb_hub_t h, int port)
 	/* Port enable */
 	if (change & BIT(PORT_ENABLE)) {
 		ZF_LOGD("Port %d enabled\n", port);
-		/* Clear the port connection status */
-		*req = __clear_port_feature_req(port, C_PORT_CONNECTION);
-		ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-					   xact, 1, NULL, NULL);
-		if (ret < 0) {
-			ZF_LOGF("Transaction error\n");
-		}
+		/* Clear the port enable status */
+		hub_ctrl(h, __clear_port_feature_req(port, C_PORT_ENABLE), 1);
 	}
 
 	/* Port suspend */
 	if (change & BIT(PORT_SUSPEND)) {
 		ZF_LOGD("Port %d suspended\n", port);
 		/* Clear suspend status */
-		*req = __clear_port_feature_req(port, C_PORT_SUSPEND);
-		ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-					   xact, 1, NULL, NULL);
-		if (ret < 0) {
-			ZF_LOGF("Transaction error\n");
-		}
+		hub_ctrl(h, __clear_port_feature_req(port, C_PORT_SUSPEND), 1);
 	}
 
 	/* Port over-current */
 	if (change & BIT(PORT_OVER_CURRENT)) {
 		ZF_LOGD("Port %d over-current\n", port);
 		/* Clear over-current status */
-		*req = __clear_port_feature_req(port, C_PORT_OVER_CURRENT);
-		ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-					   xact, 1, NULL, NULL);
-		if (ret < 0) {
-			ZF_LOGF("Transaction error\n");
-		}
+		hub_ctrl(h, __clear_port_feature_req(port, C_PORT_OVER_CURRENT), 1);
 	}
 
 	/* Port reset */
 	if (change & BIT(PORT_RESET)) {
 		ZF_LOGD("Port %d reset\n", port);
 		/* Clear reset status */
-		*req = __clear_port_feature_req(port, C_PORT_RESET);
-		ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-					   xact, 1, NULL, NULL);
-		if (ret < 0) {
-			ZF_LOGF("Transaction error\n");
-		}
+		hub_ctrl(h, __clear_port_feature_req(port, C_PORT_RESET), 1);
 	}
-
-	usb_destroy_xact(h->udev->dman, xact, 2);
 }
 
 static int
@@ -393,7 +402,10 @@ hub_irq_handler(void *token, enum usb_xact_status stat, int bytes_remaining)
 		ZF_LOGD("Spurious IRQ\n");
 	}
 
-	usbdev_schedule_xact(h->udev, h->udev->ep[0],
+	_enumerate_pending(h);
+
+	usbdev_schedule_xact(h->udev,
+			     usbdev_get_endpoint(h->udev, USB_DIR_IN | h->int_ep),
 			     &h->int_xact, 1, &hub_irq_handler, h);
 	return 0;
 }
@@ -478,6 +490,9 @@ int usb_hub_driver_bind(usb_dev_t *udev, usb_hub_t *hub)
 		ZF_LOGF("Out of memory\n");
 	}
 	memset(h->port, 0, sizeof(*h->port) * h->nports);
+	for (i = 0; i < h->nports; i++) {
+		h->port[i].hub = h;
+	}
 	ZF_LOGD("Parsing config\n");
 	h->int_ep = -1;
 	err = usbdev_parse_config(h->udev, &hub_config_cb, h);
@@ -507,28 +522,28 @@ int usb_hub_driver_bind(usb_dev_t *udev, usb_hub_t *hub)
 	}
 	usb_destroy_xact(udev->dman, xact, 1);
 
-	/* Power up ports */
-	xact[0].type = PID_SETUP;
-	xact[0].len = sizeof(*req);
+	/* Port requests share one transfer pair for the life of the hub */
+	h->ctrl_xact[0].type = PID_SETUP;
+	h->ctrl_xact[0].len = sizeof(*req);
+	h->ctrl_xact[1].type = PID_IN;
+	h->ctrl_xact[1].len = sizeof(struct port_status);
+	err = usb_alloc_xact(udev->dman, h->ctrl_xact, 2);
+	if (err) {
+		ZF_LOGF("Out of DMA memory\n");
+	}
 
-	usb_alloc_xact(h->udev->dman, xact, 1);
-	req = xact_get_vaddr(&xact[0]);
+	/* Power up ports */
 	for (i = 1; i <= h->nports; i++) {
 		ZF_LOGD("Power on port %d\n", i);
-		*req = __set_port_feature_req(i, PORT_POWER);
-		err = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-					   xact, 1, NULL, NULL);
-		if (err < 0) {
-			ZF_LOGF("Transaction error\n");
-		}
+		hub_ctrl(h, __set_port_feature_req(i, PORT_POWER), 1);
 	}
 	ps_mdelay(h->power_good_delay_ms);
-	usb_destroy_xact(udev->dman, xact, 1);
 #if !defined(HUB_ENABLE_IRQS)
 	/* Setup ports */
 	for (i = 1; i <= h->nports; i++) {
 		_handle_port_change(h, i);
 	}
+	_enumerate_pending(h);
 #endif
 #if defined(HUB_ENABLE_IRQS)
 	h->int_xact.type = PID_IN;
@@ -544,8 +559,8 @@ int usb_hub_driver_bind(usb_dev_t *udev, usb_hub_t *hub)
 	}
 	h->intbm = xact_get_vaddr(&h->int_xact);
 	ZF_LOGD("Registering for INT\n");
-	/* FIXME: Search for the right ep */
-	usbdev_schedule_xact(udev, udev->ep[0],
+	usbdev_schedule_xact(udev,
+			     usbdev_get_endpoint(udev, USB_DIR_IN | h->int_ep),
 			     &h->int_xact, 1, &hub_irq_handler, h);
 #else
 	h->intbm = NULL;
@@ -664,9 +679,9 @@ hubem_get_descriptor(usb_hubem_t dev, struct usbreq *req, void *buf, int len)
 		cp_len = MIN(act_len - pos, _hub_iface_desc.bLength);
 		memcpy(buf + pos, &_hub_iface_desc, cp_len);
 		pos += cp_len;
-		/* copy the endpoint */
+		/* copy the endpoint, bit 0 of the bitmap is the hub itself */
 		_hub_endpoint_desc.wMaxPacketSize =
-		    (dev->hubem_nports + 7) / 8;
+		    (dev->hubem_nports + 8) / 8;
 		cp_len = MIN(act_len - pos, _hub_endpoint_desc.bLength);
 		memcpy(buf + pos, &_hub_endpoint_desc, cp_len);
 		pos += cp_len;
@@ -26,11 +26,11 @@ enum usb_xact_status qtd_get_status(volatile struct TD* qtd)
 	} else if (t & TDTOK_SHALTED) {
 		if (t & TDTOK_SXACTERR) {
 			return XACTSTAT_ERROR;
-		} else if (t & TDTOK_ERROR) {
+		} else if (t & (TDTOK_ERROR & ~TDTOK_SHALTED)) {
 			return XACTSTAT_HOSTERROR;
 		}
-		ZF_LOGF("EHCI: Unknown QTD error code 0x%x\n", t);
-		return XACTSTAT_HOSTERROR;
+		/* Halted with no other error bit, the device stalled */
+		return XACTSTAT_ERROR;
 	} else {
 		return XACTSTAT_SUCCESS;
 	}
@@ -295,16 +295,11 @@ qhn_alloc(struct ehci_host *edev, uint8_t address, uint8_t hub_addr,
 		qh->epc[1] |= QHEPC1_HUB_ADDR(hub_addr) | QHEPC1_PORT(hub_port);
 	}
 
-	/* TODO: Check CMASK and SMASK */
-	if ((ep->type == EP_INTERRUPT || ep->type == EP_ISOCHRONOUS) &&
-			speed != USBSPEED_HIGH) {
-		qh->epc[1] |= QHEPC1_UFRAME_CMASK(0x1C);
-	}
+	/*
+	 * The micro frame masks of interrupt queue heads are picked by the
+	 * bandwidth allocator, see ehci_add_qhn_periodic().
+	 */
 
-	if (ep->type == EP_INTERRUPT) {
-		qh->epc[1] |= QHEPC1_UFRAME_SMASK(1);
-	}
-	
 	qh->td_overlay.next = TDLP_INVALID;
 	qh->td_overlay.alt = TDLP_INVALID;
 
@@ -355,13 +350,23 @@ qtd_enqueue(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
 		ZF_LOGF("Invalid arguments\n");
 	}
 
+	/*
+	 * Enable all TDs before they are linked in. A halted TD on the queue
+	 * would look like a failed transfer to the completion scan.
+	 */
+	for (last_tdn = tdn; last_tdn; last_tdn = last_tdn->next) {
+		last_tdn->td->token &= ~TDTOK_SHALTED;
+		last_tdn->td->token |= TDTOK_SACTIVE;
+	}
+	dsb();
+
+	ps_mutex_lock(edev->sync, qhn->lock);
+
 	/* If the queue is empty, point the TD overlay to the first TD */
 	if (!qhn->tdns) {
 		qhn->qh->td_overlay.next = tdn->ptd;
 		qhn->tdns = tdn;
 	} else {
-		ps_mutex_lock(edev->sync, qhn->lock);
-
 		/* Find the last TD */
 		last_tdn = qhn->tdns;
 		while (last_tdn->next) {
@@ -376,22 +381,15 @@ qtd_enqueue(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
 		/* Add new TD to the queue and update the termination bit */
 		last_tdn->next = tdn;
 		last_tdn->td->next = tdn->ptd & ~TDLP_INVALID;
-
-		ps_mutex_unlock(edev->sync, qhn->lock);
 	}
 
-	/* Enable all TDs */
-	while (tdn) {
-		tdn->td->token &= ~TDTOK_SHALTED;
-		tdn->td->token |= TDTOK_SACTIVE;
-		tdn = tdn->next;
-	}
+	ps_mutex_unlock(edev->sync, qhn->lock);
 
 	/* Make sure the controller sees all the active TDs */
 	dsb();
 }
 
-void qhn_destroy(ps_dma_man_t* dman, struct QHn* qhn)
+void qhn_destroy(struct ehci_host *edev, struct QHn* qhn)
 {
 	struct TDn *tdn, *tmp;
 
@@ -399,23 +397,47 @@ void qhn_destroy(ps_dma_man_t* dman, struct QHn* qhn)
 	while (tdn) {
 		tmp = tdn;
 		tdn = tdn->next;
+		usbmon_complete(edev->hdev, &tmp->mon, XACTSTAT_CANCELLED, 0);
 		if (tmp->cb) {
 			tmp->cb(tmp->token, XACTSTAT_CANCELLED, 0);
 		}
-		ps_dma_free_pinned(dman, (void*)tmp->td, sizeof(struct TD));
+		ps_dma_free_pinned(edev->dman, (void*)tmp->td, sizeof(struct TD));
 		usb_free(tmp);
 	}
 
-	ps_dma_free_pinned(dman, (void*)qhn->qh, sizeof(struct QH));
+	ps_dma_free_pinned(edev->dman, (void*)qhn->qh, sizeof(struct QH));
 	usb_free(qhn);
 }
 
+/*
+ * Restart a queue head that halted on an error at the first TD still queued
+ * on it. A STALL is cleared on the device with CLEAR_FEATURE(ENDPOINT_HALT),
+ * which resets its data toggle, so the toggle is only kept for other errors.
+ */
+void qhn_clear_halt(struct QHn *qhn)
+{
+	volatile struct TD *overlay = &qhn->qh->td_overlay;
+	uint32_t token = overlay->token;
+
+	if (!(token & (TDTOK_ERROR & ~TDTOK_SHALTED))) {
+		token &= ~TDTOK_DT;
+	}
+
+	overlay->next = qhn->tdns ? qhn->tdns->ptd : TDLP_INVALID;
+	overlay->alt = TDLP_INVALID;
+	dsb();
+	overlay->token = token & TDTOK_DT;
+	dsb();
+}
+
 void ehci_async_complete(struct ehci_host *edev)
 {
 	struct QHn *qhn;
 	struct TDn *tdn, *head, *tmp;
-	int sum;
+	enum usb_xact_status stat;
+	int sum, gen;
 
+restart:
 	qhn = edev->alist_tail;
 
 	/* Nothing to do if the queue is empty */
@@ -429,41 +451,81 @@ void ehci_async_complete(struct ehci_host *edev)
 		tdn = qhn->tdns;
 		sum = 0;
 		head = tdn;
-		while (tdn != NULL &&
-			qtd_get_status(tdn->td) == XACTSTAT_SUCCESS) {
+		while (tdn != NULL) {
+			stat = qtd_get_status(tdn->td);
+			if (stat == XACTSTAT_PENDING) {
+				break;
+			}
 			sum += TDTOK_GET_BYTES(tdn->td->token);
-			if (tdn->td->token & TDTOK_IOC) {
-				if (tdn->cb) {
-					tdn->cb(tdn->token, XACTSTAT_SUCCESS, sum);
-					sum = 0;
-				}
+			if (stat == XACTSTAT_SUCCESS &&
+				!(tdn->td->token & TDTOK_IOC)) {
+				tdn = tdn->next;
+				continue;
+			}
 
-				qhn->tdns = tdn->next;
+			/*
+			 * The queue head halts on a failed TD, the rest of
+			 * the transfer will never run. Complete it as a whole.
+			 */
+			if (stat != XACTSTAT_SUCCESS) {
+				while (!(tdn->td->token & TDTOK_IOC) && tdn->next) {
+					tdn = tdn->next;
+				}
+			}
+			qhn->tdns = tdn->next;
 
+			if (stat != XACTSTAT_SUCCESS) {
+				qhn_clear_halt(qhn);
+			} else if (qhn->tdns &&
+				qhn->qh->td_cur == tdn->ptd &&
+				qhn->qh->td_overlay.next == TDLP_INVALID) {
 				/*
 				 * Update the QH if we are about to dequeue the
 				 * "previous" last TD in the queue. This happens
 				 * when the last TD gets partially processed
 				 * while we enqueue new TDs.
 				 */
-				if (qhn->tdns &&
-					qhn->qh->td_cur == tdn->ptd &&
-					qhn->qh->td_overlay.next == TDLP_INVALID) {
-					qhn->qh->td_overlay.next = tdn->next->ptd;
-					dsb();
-				}
+				qhn->qh->td_overlay.next = tdn->next->ptd;
+				dsb();
+			}
 
-				/* Free */
-				while (head != tdn->next) {
-					tmp = head;
-					head = head->next;
-					ps_dma_free_pinned(edev->dman,
-							(void*)tmp->td,
-							sizeof(struct TD));
-					usb_free(tmp);
-				}
+			/*
+			 * The transfer is off the queue now. Drop the
+			 * lock for the callback, so that the driver can
+			 * resubmit to the same endpoint from there.
+			 */
+			gen = edev->sched_gen;
+			ps_mutex_unlock(edev->sync, qhn->lock);
+			usbmon_complete(edev->hdev, &tdn->mon, stat, sum);
+			if (tdn->cb) {
+				tdn->cb(tdn->token, stat, sum);
 			}
+
+			/* Free */
 			tdn = tdn->next;
+			while (head != tdn) {
+				tmp = head;
+				head = head->next;
+				ps_dma_free_pinned(edev->dman,
+						(void*)tmp->td,
+						sizeof(struct TD));
+				usb_free(tmp);
+			}
+
+			/*
+			 * The callback may have cancelled this or another
+			 * endpoint, or added a new one. Our place in the list
+			 * can no longer be trusted, start over.
+			 */
+			if (edev->sched_gen != gen) {
+				goto restart;
+			}
+
+			/* Restart from the (possibly refilled) head */
+			ps_mutex_lock(edev->sync, qhn->lock);
+			tdn = qhn->tdns;
+			head = tdn;
+			sum = 0;
 		}
 
 		ps_mutex_unlock(edev->sync, qhn->lock);
@@ -489,6 +551,7 @@ void ehci_add_qhn_async(struct ehci_host *edev, struct QHn *qhn)
 
 	    qhn->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
     }
+    edev->sched_gen++;
 
     dsb();
 }
@@ -497,6 +560,7 @@ void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn)
 {
 	struct TDn *tdn;
 	struct QHn *prev;
+	int cnt;
 
 	/*
 	 * The EHCI spec(section 4.8.2) gives the instructions of removing a QH
@@ -530,6 +594,34 @@ void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn)
 
 	dsb();
 
+	if (qhn->next == qhn) {
+		/*
+		 * This is the last queue head. Stop the async schedule rather
+		 * than ring the doorbell: once the controller reports the
+		 * schedule as disabled it holds no reference to the queue
+		 * head, and it can go straight away.
+		 */
+		edev->alist_tail = NULL;
+		edev->op_regs->usbcmd &= ~EHCICMD_ASYNC_EN;
+		qhn->next = NULL;
+		qhn->was_cancelled = 1;
+		edev->sched_gen++;
+		for (cnt = 3000; edev->op_regs->usbsts & EHCISTS_ASYNC_EN; cnt--) {
+			if (cnt <= 0) {
+				/*
+				 * The controller may still be reading the queue
+				 * head, so it cannot be freed. Leak it.
+				 */
+				ZF_LOGE("Async schedule did not stop(%p)\n",
+					(void*)qhn->pqh);
+				return;
+			}
+			ps_mdelay(1);
+		}
+		qhn_destroy(edev, qhn);
+		return;
+	}
+
 	/* Select another queue head to set its H-bit */
 	if ((qhn->qh->epc[0] & QHEPC0_H) && qhn->next) {
 		qhn->next->qh->epc[0] |= QHEPC0_H;
@@ -560,6 +652,7 @@ void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn)
 	}
 	qhn->next = NULL;
 	qhn->was_cancelled = 1;
+	edev->sched_gen++;
 
 	/* Ring the doorbell */
 	edev->op_regs->usbcmd |= EHCICMD_ASYNC_DB;
@@ -578,6 +671,10 @@ int ehci_wait_for_completion(struct TDn *tdn)
 				sum += TDTOK_GET_BYTES(tdn->td->token);
 				break;
 			}
+			/* Failed, the queue head has halted on this TD */
+			if (status & TDTOK_SHALTED) {
+				return -1;
+			}
 			if (cnt <= 0) {
 				ZF_LOGF("Timeout(%p, %p)\n", tdn->td,
 						(void*)tdn->ptd);
@@ -621,7 +718,7 @@ void check_doorbell(struct ehci_host* edev)
 
 		/* Two IAA cycles have passed, safe to remove */
 		if (tmp->was_cancelled > 1) {
-			qhn_destroy(edev->dman, tmp);
+			qhn_destroy(edev, tmp);
 		} else {
 			tmp->was_cancelled++;
 			if (!edev->db_pending) {
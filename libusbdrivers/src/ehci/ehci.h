@@ -13,6 +13,8 @@
 #include <usb/usb_host.h>
 #include <usb/drivers/usbhub.h>
 
+#include "../usbmon.h"
+
 /*******************
  **** Registers ****
  *******************/
@@ -182,12 +184,68 @@ struct QH {
 #define QHEPC1_UFRAME_CMASK(x) (((x) & 0xff) * BIT( 8))
 #define QHEPC1_UFRAME_SMASK(x) (((x) & 0xff) * BIT( 0))
 #define QHEPC1_UFRAME_MASK     (QHEPC1_UFRAME_CMASK(0xff) | \
-                                QHEPC1_UFRAME_CMASK(0xff))
+                                QHEPC1_UFRAME_SMASK(0xff))
 	uint32_t epc[2];
 	uint32_t td_cur;
 	struct TD td_overlay;
 };
 
+/* High speed isochronous transfer descriptor (EHCI 3.3) */
+struct ITD {
+	uint32_t next;
+#define ITDTX_ACTIVE           BIT(31)
+#define ITDTX_DBERR            BIT(30)
+#define ITDTX_BABBLE           BIT(29)
+#define ITDTX_XACTERR          BIT(28)
+#define ITDTX_ERROR            (ITDTX_DBERR | ITDTX_BABBLE | ITDTX_XACTERR)
+#define ITDTX_LEN(x)           (((x) & 0xfff) * BIT(16))
+#define ITDTX_GET_LEN(x)       (((x) >> 16) & 0xfff)
+#define ITDTX_IOC              BIT(15)
+#define ITDTX_PG(x)            (((x) &   0x7) * BIT(12))
+#define ITDTX_OFFSET(x)        (((x) & 0xfff) * BIT( 0))
+	uint32_t transaction[8];
+#define ITDBUF0_EP(x)          (((x) &   0xf) * BIT( 8))
+#define ITDBUF0_ADDR(x)        (((x) &  0x7f) * BIT( 0))
+#define ITDBUF1_DIR_IN         BIT(11)
+#define ITDBUF1_MAXPKT(x)      (((x) & 0x7ff) * BIT( 0))
+#define ITDBUF2_MULT(x)        (((x) &   0x3) * BIT( 0))
+	uint32_t buf[7];
+	uint32_t buf_hi[7];	/* 64-bit capability(Appendix B) */
+};
+
+/* Full speed (split) isochronous transfer descriptor (EHCI 3.4) */
+struct SITD {
+	uint32_t next;
+#define SITDEPC_DIR_IN         BIT(31)
+#define SITDEPC_PORT(x)        (((x) & 0x7f) * BIT(24))
+#define SITDEPC_HUB_ADDR(x)    (((x) & 0x7f) * BIT(16))
+#define SITDEPC_EP(x)          (((x) &  0xf) * BIT( 8))
+#define SITDEPC_ADDR(x)        (((x) & 0x7f) * BIT( 0))
+	uint32_t epc;
+#define SITDUF_CMASK(x)        (((x) & 0xff) * BIT( 8))
+#define SITDUF_SMASK(x)        (((x) & 0xff) * BIT( 0))
+	uint32_t uframe;
+#define SITDST_IOC             BIT(31)
+#define SITDST_PAGE            BIT(30)
+#define SITDST_BYTES(x)        (((x) & 0x3ff) * BIT(16))
+#define SITDST_GET_BYTES(x)    (((x) >> 16) & 0x3ff)
+#define SITDST_ACTIVE          BIT(7)
+#define SITDST_ERR             BIT(6)
+#define SITDST_DBERR           BIT(5)
+#define SITDST_BABBLE          BIT(4)
+#define SITDST_XACTERR         BIT(3)
+#define SITDST_MISSED_UF       BIT(2)
+#define SITDST_ERROR           (SITDST_ERR | SITDST_DBERR | SITDST_BABBLE | \
+                                SITDST_XACTERR | SITDST_MISSED_UF)
+	uint32_t state;
+#define SITDBUF1_TP_ALL        (0 * BIT(3))
+#define SITDBUF1_TP_BEGIN      (1 * BIT(3))
+#define SITDBUF1_TCOUNT(x)     (((x) & 0x7) * BIT(0))
+	uint32_t buf[2];
+	uint32_t back;
+	uint32_t buf_hi[2];	/* 64-bit capability(Appendix B) */
+};
+
 /****************************
  **** Private structures ****
  ****************************/
@@ -197,9 +255,29 @@ struct TDn {
 	uintptr_t ptd;
 	usb_cb_t cb;
 	void *token;
+	struct usbmon_xfer mon;	//Capture state, on the IOC TD only
 	struct TDn *next;
 };
 
+/*
+ * Periodic bandwidth is accounted per micro frame over a window of
+ * EHCI_BW_FRAMES frames. Endpoints with a longer period are accounted as if
+ * they ran every EHCI_BW_FRAMES frames.
+ */
+#define EHCI_BW_FRAMES      32
+#define EHCI_BW_UFRAME_MAX  100	//80% of a micro frame(USB 2.0 5.7.4)
+#define EHCI_BW_FRAME_MAX   900	//90% of a full speed frame
+
+struct ehci_bw {
+	int period;		//Frames between services, 0 if not reserved
+	int phase;		//First frame of the service
+	uint8_t smask;		//Start (split) micro frames
+	uint8_t cmask;		//Complete split micro frames
+	uint16_t ss_usecs;	//High speed bus time of a (start split) transaction
+	uint16_t cs_usecs;	//High speed bus time of a complete split
+	uint16_t tt_usecs;	//Full/low speed bus time behind the TT
+};
+
 struct QHn {
 	/* Transaction data */
 	volatile struct QH *qh;
@@ -209,15 +287,52 @@ struct QHn {
 	int rate;		//Polling frame rate(frame = 1ms, uframe = 125us)
 	int irq_pending;
 	int was_cancelled;
+	struct ehci_bw bw;
 	/* Links */
 	uint8_t owner_addr;
 	struct QHn *next;
+	struct QHn *pnext;	//Next queue head in the frames of this one
 	/* Lock */
 	void *lock;
 };
 
+/* One slot of an isochronous ring, an iTD or a siTD */
+struct ITDn {
+	volatile void *desc;
+	uintptr_t pdesc;
+	/* Packet buffers for this slot */
+	void *buf;
+	uintptr_t pbuf;
+	/* Frame the descriptor is linked into, -1 if none */
+	int frame;
+	/* Other isochronous descriptors in the same frame */
+	struct ITDn *fnext;
+};
+
+/* Isochronous stream */
+struct ISOn {
+	struct endpoint *ep;
+	int split;		//Full speed behind a TT, uses siTDs
+	uint8_t hub_addr;
+	uint8_t hub_port;
+	/* Geometry */
+	int nslots;
+	int period;		//Frames between ring slots
+	int npkts;		//Packets per slot
+	int pkt_size;
+	struct ehci_bw bw;
+	/* Ring */
+	struct ITDn *slots;
+	int next_done;
+	int last_frame;
+	usb_iso_cb_t cb;
+	void *token;
+	struct ISOn *next;
+};
+
 struct ehci_host {
 	int devid;
+	usb_host_t *hdev;
 	/* Hub emulation */
 	usb_hubem_t hubem;
 	void (*board_pwren) (int port, int state);
@@ -228,6 +343,7 @@ struct ehci_host {
 	uint32_t bmreset_c;
 	/* Async schedule */
 	struct QHn *alist_tail;
+	int sched_gen;		//Bumped when a queue head is (un)linked
 	struct QHn *db_pending;
 	struct QHn *db_active;
 	/* Periodic frame list */
@@ -236,6 +352,11 @@ struct ehci_host {
 	int flist_size;
 	struct QHn *intn_list;
 	struct QHn **shadow_flist;
+	struct ITDn **iso_flist;
+	struct ISOn *iso_list;
+	/* Periodic bandwidth, in microseconds */
+	uint16_t bw_uframe[EHCI_BW_FRAMES][8];
+	uint16_t bw_tt[EHCI_BW_FRAMES];
 	/* Standard registers */
 	volatile struct ehci_host_cap *cap_regs;
 	volatile struct ehci_host_op *op_regs;
@@ -258,8 +379,12 @@ int _get_pstat(void *token, int port, struct port_status *_ps);
  */
 void ehci_handle_irq(usb_host_t * hdev);
 int ehci_cancel_xact(usb_host_t * hdev, struct endpoint *ep);
+int ehci_iso_start(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
+		   uint8_t hub_port, enum usb_speed speed, struct endpoint *ep,
+		   int nslots, usb_iso_cb_t cb, void *t);
 
-void qhn_destroy(ps_dma_man_t * dman, struct QHn *qhn);
+void qhn_destroy(struct ehci_host *edev, struct QHn *qhn);
+void qhn_clear_halt(struct QHn *qhn);
 int ehci_wait_for_completion(struct TDn *tdn);
 void ehci_schedule_async(struct ehci_host *edev, struct QHn *qh_new);
 enum usb_xact_status qtd_get_status(volatile struct TD *qtd);
@@ -276,7 +401,7 @@ struct TDn *qtd_alloc(struct ehci_host *edev, enum usb_speed speed,
 void qhn_update(struct QHn *qhn, uint8_t address, struct endpoint *ep);
 void qtd_enqueue(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn);
 void ehci_add_qhn_async(struct ehci_host *edev, struct QHn *qhn);
-void ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn);
+int ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn);
 void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn);
 void ehci_del_qhn_periodic(struct ehci_host *edev, struct QHn *qhn);
 void ehci_async_complete(struct ehci_host *edev);
@@ -288,8 +413,24 @@ int ehci_schedule_periodic_root(struct ehci_host *edev, struct xact *xact,
 				int nxact, usb_cb_t cb, void *t);
 int ehci_schedule_periodic(struct ehci_host *edev);
 void ehci_periodic_complete(struct ehci_host *edev);
+int ehci_periodic_init(struct ehci_host *edev);
+void ehci_bw_calc(struct ehci_bw *bw, enum usb_speed speed,
+		  struct endpoint *ep, int uperiod);
+int ehci_bw_reserve(struct ehci_host *edev, struct ehci_bw *bw, int period);
+void ehci_bw_release(struct ehci_host *edev, struct ehci_bw *bw);
+void ehci_flist_set_qh(struct ehci_host *edev, int frame, struct QHn *qhn);
 enum usb_xact_status qhn_wait(struct QHn *qhn, int to_ms);
 
+/**
+ * Isochronous Scheduling
+ */
+int ehci_add_iso_stream(struct ehci_host *edev, uint8_t addr, uint8_t hub_addr,
+			uint8_t hub_port, enum usb_speed speed,
+			struct endpoint *ep, int nslots, usb_iso_cb_t cb,
+			void *t);
+void ehci_del_iso_stream(struct ehci_host *edev, struct ISOn *ison);
+void ehci_iso_complete(struct ehci_host *edev);
+
 /**
  * Debugging
  */
@@ -72,7 +72,7 @@ void ehci_sched_enable_irq(struct ehci_host *edev)
 	uint32_t irq;
 
 	irq = edev->op_regs->usbintr;
-	irq |= EHCIINTR_USBINT;
+	irq |= EHCIINTR_USBINT | EHCIINTR_USBERRINT;
 	edev->op_regs->usbintr = irq;
 }
 
@@ -81,7 +81,7 @@ void ehci_sched_disable_irq(struct ehci_host *edev)
 	uint32_t irq;
 
 	irq = edev->op_regs->usbintr;
-	irq &= ~EHCIINTR_USBINT;
+	irq &= ~(EHCIINTR_USBINT | EHCIINTR_USBERRINT);
 	edev->op_regs->usbintr = irq;
 }
 
@@ -91,8 +91,9 @@ int ehci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
 		       usb_cb_t cb, void *t)
 {
 	struct QHn *qhn;
-	struct TDn *tdn;
+	struct TDn *tdn, *last;
 	struct ehci_host *edev;
+	int uperiod;
 	int ret;
 
 	if (!hdev) {
@@ -110,6 +111,11 @@ int ehci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
 		}
 	}
 
+	if (ep->type == EP_ISOCHRONOUS) {
+		ZF_LOGE("Isochronous endpoints are driven by iso_start\n");
+		return -1;
+	}
+
 	qhn = (struct QHn *)ep->hcpriv;
 	if (!qhn) {
 		qhn = qhn_alloc(edev, addr, hub_addr, hub_port, speed, ep);
@@ -146,7 +152,22 @@ int ehci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
 				qhn->rate = 1024;
 			}
 
-			ehci_add_qhn_periodic(edev, qhn);
+			/* High speed endpoints may be polled within a frame */
+			if (speed == USBSPEED_HIGH && ep->interval < 4) {
+				uperiod = 1 << (MAX(ep->interval, 1) - 1);
+			} else {
+				uperiod = 8;
+			}
+			ehci_bw_calc(&qhn->bw, speed, ep, uperiod);
+
+			if (ehci_add_qhn_periodic(edev, qhn)) {
+				ep->hcpriv = NULL;
+				ps_mutex_destroy(edev->sync, qhn->lock);
+				ps_dma_free_pinned(edev->dman, (void*)qhn->qh,
+						   sizeof(struct QH));
+				usb_free(qhn);
+				return -1;
+			}
 		}
 
 	} else {
@@ -160,6 +181,12 @@ int ehci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
 	/* Allocate qTD */
 	tdn = qtd_alloc(edev, speed, ep, xact, nxact, cb, t);
 
+	/* The IOC TD remembers what to capture on completion */
+	if (hdev->mon) {
+		for (last = tdn; last->next; last = last->next);
+		usbmon_xfer_init(&last->mon, addr, ep, xact, nxact);
+	}
+
 	/* Add qTD to the queue head and send off over the bus */
 	if (ep->type == EP_BULK || ep->type == EP_CONTROL) {
 		ehci_schedule_async(edev, qhn);
@@ -182,6 +209,31 @@ int ehci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
 	}
 }
 
+int ehci_iso_start(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
+		   uint8_t hub_port, enum usb_speed speed, struct endpoint *ep,
+		   int nslots, usb_iso_cb_t cb, void *t)
+{
+	struct ehci_host *edev;
+
+	if (!hdev || !ep || !cb || nslots <= 0) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+	edev = _hcd_to_ehci(hdev);
+
+	/* The emulated root hub has no isochronous endpoints */
+	if (ep->type != EP_ISOCHRONOUS || hub_addr == -1) {
+		ZF_LOGE("Not an isochronous endpoint\n");
+		return -1;
+	}
+	if (ep->hcpriv) {
+		ZF_LOGE("Stream already running\n");
+		return -1;
+	}
+
+	return ehci_add_iso_stream(edev, addr, hub_addr, hub_port, speed, ep,
+				   nslots, cb, t);
+}
+
 void ehci_handle_irq(usb_host_t *hdev)
 {
 	struct ehci_host *edev = _hcd_to_ehci(hdev);
@@ -194,21 +246,22 @@ void ehci_handle_irq(usb_host_t *hdev)
 		ZF_LOGF("INT - host error\n");
 	}
 
-	if (sts & EHCISTS_USBINT) {
-		ZF_LOGD("INT - USB\n");
-		ehci_periodic_complete(edev);
-		ehci_async_complete(edev);
-	}
-
 	/*
-	 * TODO: To recover from transaction error, we need to scan both the
-	 * periodic queue and the async queue, find the error TD and reschedule
-	 * it.
+	 * A TD that fails raises USBERRINT instead. The completion scan hands
+	 * the failed transfer back with its error status and restarts the
+	 * queue head at the next one.
 	 */
 	if (sts & EHCISTS_USBERRINT) {
 		ZF_LOGD("INT - USB error\n");
 	}
 
+	if (sts & (EHCISTS_USBINT | EHCISTS_USBERRINT)) {
+		ZF_LOGD("INT - USB\n");
+		ehci_iso_complete(edev);
+		ehci_periodic_complete(edev);
+		ehci_async_complete(edev);
+	}
+
 	/*
 	 * We don't handle frame list roll over interrupt, but some controllers
 	 * don't like it always being set to 1, so simply clear it.
@@ -240,11 +293,14 @@ int ehci_cancel_xact(usb_host_t *hdev, struct endpoint *ep)
 	}
 
 	if (ep->hcpriv) {
-		if (ep->type == EP_BULK || ep->type == EP_CONTROL) {
+		if (ep->type == EP_ISOCHRONOUS) {
+			ehci_del_iso_stream(edev, ep->hcpriv);
+		} else if (ep->type == EP_BULK || ep->type == EP_CONTROL) {
 			ehci_del_qhn_async(edev, ep->hcpriv);
 		} else {
 			ehci_del_qhn_periodic(edev, ep->hcpriv);
 		}
+		ep->hcpriv = NULL;
 	}
 
 	return 0;
@@ -268,11 +324,16 @@ ehci_host_init(usb_host_t *hdev, uintptr_t regs,
 	}
 	edev = _hcd_to_ehci(hdev);
 	edev->devid = hdev->id;
+	edev->hdev = hdev;
+	hdev->mon = NULL;
 	edev->cap_regs = (volatile struct ehci_host_cap *)regs;
 	edev->op_regs = (volatile struct ehci_host_op *)(regs + edev->cap_regs->caplength);
 	hdev->schedule_xact = ehci_schedule_xact;
+	hdev->iso_start = ehci_iso_start;
 	hdev->cancel_xact = ehci_cancel_xact;
 	hdev->handle_irq = ehci_handle_irq;
+	hdev->dev_attach = NULL;
+	hdev->dev_detach = NULL;
 	edev->board_pwren = board_pwren;
 
 	/* Check some params */
@@ -309,10 +370,13 @@ ehci_host_init(usb_host_t *hdev, uintptr_t regs,
 
 	/* Terminate the periodic schedule head */
 	edev->alist_tail = NULL;
+	edev->sched_gen = 0;
 	edev->db_pending = NULL;
 	edev->db_active = NULL;
 	edev->flist = NULL;
 	edev->intn_list = NULL;
+	edev->iso_flist = NULL;
+	edev->iso_list = NULL;
 	/* Initialise IRQ */
 	edev->irq_cb = NULL;
 	edev->irq_token = NULL;
@@ -0,0 +1,531 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @brief EHCI isochronous transfer implementation.
+ *
+ * Each stream owns a ring of iTDs(high speed) or siTDs(full speed), one for
+ * every service period. The descriptors are linked into the frame list in
+ * front of the interrupt queue heads, and a completed descriptor is handed to
+ * the driver, re-armed and linked again one ring length later, so the stream
+ * keeps running without any allocation in the interrupt path.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "../services.h"
+#include "ehci.h"
+
+/* Frames between "now" and the first slot of a new stream */
+#define ISO_SCHED_DELAY    4
+/* Maximum number of frames covered by a ring */
+#define ISO_MAX_SPAN       256
+/* Maximum bytes per full speed micro frame (USB 2.0 11.18.4) */
+#define ISO_SPLIT_SIZE     188
+
+static inline int iso_cur_frame(struct ehci_host *edev)
+{
+	return (edev->op_regs->frindex >> 3) & (edev->flist_size - 1);
+}
+
+static inline int iso_frame_diff(struct ehci_host *edev, int a, int b)
+{
+	return (a - b) & (edev->flist_size - 1);
+}
+
+/* First frame at or after the given one that matches the reserved phase */
+static inline int iso_phase_frame(struct ehci_host *edev, struct ISOn *ison,
+				  int frame)
+{
+	frame += (ison->bw.phase - frame) & (ison->bw.period - 1);
+	return frame & (edev->flist_size - 1);
+}
+
+/* Interrupt every few slots, rather than on every service period */
+static inline int iso_slot_ioc(struct ISOn *ison, int slot)
+{
+	int every = MIN(MAX(ison->nslots / 4, 1), 8);
+
+	return (slot % every) == (every - 1) || slot == ison->nslots - 1;
+}
+
+/****************************
+ **** Frame list linkage ****
+ ****************************/
+static void iso_link(struct ehci_host *edev, struct ISOn *ison,
+		     struct ITDn *itdn, int frame)
+{
+	uint32_t type = ison->split ? QHLP_TYPE_SITD : QHLP_TYPE_ITD;
+
+	/* Insert at the head of the frame, the hardware follows our link */
+	itdn->frame = frame;
+	itdn->fnext = edev->iso_flist[frame];
+	*(volatile uint32_t *)itdn->desc = edev->flist[frame];
+	dsb();
+	edev->iso_flist[frame] = itdn;
+	edev->flist[frame] = itdn->pdesc | type;
+	dsb();
+}
+
+static void iso_unlink(struct ehci_host *edev, struct ITDn *itdn)
+{
+	struct ITDn *cur, *prev;
+	int frame = itdn->frame;
+
+	if (frame < 0) {
+		return;
+	}
+
+	prev = NULL;
+	cur = edev->iso_flist[frame];
+	while (cur && cur != itdn) {
+		prev = cur;
+		cur = cur->fnext;
+	}
+	if (!cur) {
+		ZF_LOGE("Isochronous descriptor not in frame %d\n", frame);
+		itdn->frame = -1;
+		return;
+	}
+
+	if (prev) {
+		*(volatile uint32_t *)prev->desc = *(volatile uint32_t *)itdn->desc;
+		prev->fnext = itdn->fnext;
+	} else {
+		edev->flist[frame] = *(volatile uint32_t *)itdn->desc;
+		edev->iso_flist[frame] = itdn->fnext;
+	}
+	dsb();
+
+	itdn->fnext = NULL;
+	itdn->frame = -1;
+}
+
+/***************************
+ **** Descriptor access ****
+ ***************************/
+static void iso_arm(struct ISOn *ison, int slot, int len)
+{
+	struct ITDn *itdn = &ison->slots[slot];
+	int ioc = iso_slot_ioc(ison, slot);
+
+	if (ison->split) {
+		volatile struct SITD *sitd = itdn->desc;
+		int nsplits;
+
+		sitd->back = TDLP_INVALID;
+		sitd->buf[0] = itdn->pbuf;
+		if (ison->ep->dir == EP_DIR_IN) {
+			sitd->uframe = SITDUF_SMASK(ison->bw.smask)
+				       | SITDUF_CMASK(ison->bw.cmask);
+			sitd->buf[1] = (itdn->pbuf + 0x1000) & ~0xfff;
+			len = ison->pkt_size;
+		} else {
+			/* One start split for every 188 bytes */
+			nsplits = MAX(DIV_ROUND_UP(len, ISO_SPLIT_SIZE), 1);
+			sitd->uframe = SITDUF_SMASK((BIT(nsplits) - 1)
+						    << CTZ(ison->bw.smask));
+			sitd->buf[1] = ((itdn->pbuf + 0x1000) & ~0xfff)
+				       | SITDBUF1_TCOUNT(nsplits)
+				       | (nsplits == 1 ? SITDBUF1_TP_ALL :
+					  SITDBUF1_TP_BEGIN);
+		}
+		dsb();
+		sitd->state = SITDST_BYTES(len) | SITDST_ACTIVE
+			      | (ioc ? SITDST_IOC : 0);
+	} else {
+		volatile struct ITD *itd = itdn->desc;
+		int last = -1;
+		int off = 0;
+		int n;
+
+		/* One packet in every reserved micro frame */
+		for (int u = 0; u < 8; u++) {
+			itd->transaction[u] = 0;
+			if (!(ison->bw.smask & BIT(u))) {
+				continue;
+			}
+			if (ison->ep->dir == EP_DIR_IN) {
+				n = ison->pkt_size;
+			} else {
+				n = MAX(MIN(ison->pkt_size, len - off), 0);
+			}
+			itd->transaction[u] = ITDTX_LEN(n)
+				| ITDTX_PG(off >> 12) | ITDTX_OFFSET(off)
+				| ITDTX_ACTIVE;
+			off += ison->pkt_size;
+			last = u;
+		}
+		if (ioc && last >= 0) {
+			itd->transaction[last] |= ITDTX_IOC;
+		}
+	}
+	dsb();
+}
+
+static int iso_active(struct ISOn *ison, struct ITDn *itdn)
+{
+	if (ison->split) {
+		volatile struct SITD *sitd = itdn->desc;
+		return !!(sitd->state & SITDST_ACTIVE);
+	} else {
+		volatile struct ITD *itd = itdn->desc;
+		for (int i = 0; i < 8; i++) {
+			if (itd->transaction[i] & ITDTX_ACTIVE) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+}
+
+static void iso_deactivate(struct ISOn *ison, struct ITDn *itdn)
+{
+	if (ison->split) {
+		volatile struct SITD *sitd = itdn->desc;
+		sitd->state &= ~SITDST_ACTIVE;
+	} else {
+		volatile struct ITD *itd = itdn->desc;
+		for (int i = 0; i < 8; i++) {
+			itd->transaction[i] &= ~ITDTX_ACTIVE;
+		}
+	}
+}
+
+/*
+ * Collect the result of a retired slot. Received packets are packed to the
+ * start of the buffer, so that the driver sees a contiguous byte stream.
+ */
+static enum usb_xact_status iso_result(struct ISOn *ison, struct ITDn *itdn,
+				       int *len)
+{
+	enum usb_xact_status stat = XACTSTAT_SUCCESS;
+
+	if (ison->split) {
+		volatile struct SITD *sitd = itdn->desc;
+		uint32_t state = sitd->state;
+
+		if (state & SITDST_ERROR) {
+			stat = XACTSTAT_ERROR;
+		}
+		*len = ison->pkt_size - SITDST_GET_BYTES(state);
+	} else {
+		volatile struct ITD *itd = itdn->desc;
+		uint32_t tx;
+		int n;
+
+		int off = 0;
+
+		*len = 0;
+		for (int u = 0; u < 8; u++) {
+			if (!(ison->bw.smask & BIT(u))) {
+				continue;
+			}
+			tx = itd->transaction[u];
+			if (tx & ITDTX_ERROR) {
+				stat = XACTSTAT_ERROR;
+			}
+			n = ITDTX_GET_LEN(tx);
+			if (ison->ep->dir == EP_DIR_IN && *len != off) {
+				memmove((char*)itdn->buf + *len,
+					(char*)itdn->buf + off, n);
+			}
+			*len += n;
+			off += ison->pkt_size;
+		}
+	}
+
+	if (ison->ep->dir == EP_DIR_OUT) {
+		*len = 0;
+	}
+	return stat;
+}
+
+/*
+ * Fill a slot for its next service period. For OUT streams the driver
+ * provides the data.
+ */
+static int iso_fill(struct ISOn *ison, int slot, enum usb_xact_status stat,
+		    int len)
+{
+	struct ITDn *itdn = &ison->slots[slot];
+	int size = ison->npkts * ison->pkt_size;
+	int ret;
+
+	ret = ison->cb(ison->token, stat, itdn->buf,
+		       ison->ep->dir == EP_DIR_IN ? len : size);
+	if (ison->ep->dir == EP_DIR_IN) {
+		return size;
+	}
+	return MAX(MIN(ret, size), 0);
+}
+
+/***************************
+ **** Stream management ****
+ ***************************/
+static void iso_free(struct ehci_host *edev, struct ISOn *ison)
+{
+	struct ITDn *itdn;
+	int desc_size;
+	int buf_size;
+
+	desc_size = ison->split ? sizeof(struct SITD) : sizeof(struct ITD);
+	buf_size = ALIGN_UP(ison->npkts * ison->pkt_size, PAGE_SIZE_4K);
+	if (ison->slots) {
+		for (int i = 0; i < ison->nslots; i++) {
+			itdn = &ison->slots[i];
+			if (itdn->desc) {
+				ps_dma_free_pinned(edev->dman, (void*)itdn->desc,
+						   desc_size);
+			}
+			if (itdn->buf) {
+				ps_dma_free_pinned(edev->dman, itdn->buf, buf_size);
+			}
+		}
+		usb_free(ison->slots);
+	}
+	usb_free(ison);
+}
+
+static int iso_alloc_slots(struct ehci_host *edev, struct ISOn *ison,
+			   uint8_t addr)
+{
+	struct ITDn *itdn;
+	int desc_size;
+	int buf_size;
+	int maxp;
+
+	desc_size = ison->split ? sizeof(struct SITD) : sizeof(struct ITD);
+	buf_size = ALIGN_UP(ison->npkts * ison->pkt_size, PAGE_SIZE_4K);
+
+	ison->slots = usb_malloc(sizeof(struct ITDn) * ison->nslots);
+	if (!ison->slots) {
+		ZF_LOGE("Out of memory\n");
+		return -1;
+	}
+
+	maxp = ison->ep->max_pkt & 0x7ff;
+	for (int i = 0; i < ison->nslots; i++) {
+		itdn = &ison->slots[i];
+		itdn->frame = -1;
+		itdn->desc = ps_dma_alloc_pinned(edev->dman, desc_size, 32, 0,
+						 PS_MEM_NORMAL, &itdn->pdesc);
+		itdn->buf = ps_dma_alloc_pinned(edev->dman, buf_size, 0x1000, 0,
+						PS_MEM_NORMAL, &itdn->pbuf);
+		if (!itdn->desc || !itdn->buf) {
+			ZF_LOGE("Out of DMA memory\n");
+			return -1;
+		}
+		memset((void*)itdn->desc, 0, desc_size);
+
+		/* Static endpoint information */
+		if (ison->split) {
+			volatile struct SITD *sitd = itdn->desc;
+
+			sitd->next = TDLP_INVALID;
+			sitd->epc = SITDEPC_PORT(ison->hub_port)
+				    | SITDEPC_HUB_ADDR(ison->hub_addr)
+				    | SITDEPC_EP(ison->ep->num)
+				    | SITDEPC_ADDR(addr);
+			if (ison->ep->dir == EP_DIR_IN) {
+				sitd->epc |= SITDEPC_DIR_IN;
+			}
+		} else {
+			volatile struct ITD *itd = itdn->desc;
+
+			itd->next = TDLP_INVALID;
+			for (int p = 0; p < 7; p++) {
+				if (p * PAGE_SIZE_4K < buf_size) {
+					itd->buf[p] = itdn->pbuf + p * PAGE_SIZE_4K;
+				}
+			}
+			itd->buf[0] |= ITDBUF0_EP(ison->ep->num) | ITDBUF0_ADDR(addr);
+			itd->buf[1] |= ITDBUF1_MAXPKT(maxp);
+			if (ison->ep->dir == EP_DIR_IN) {
+				itd->buf[1] |= ITDBUF1_DIR_IN;
+			}
+			itd->buf[2] |= ITDBUF2_MULT(((ison->ep->max_pkt >> 11) & 0x3) + 1);
+		}
+	}
+
+	return 0;
+}
+
+int ehci_add_iso_stream(struct ehci_host *edev, uint8_t addr, uint8_t hub_addr,
+			uint8_t hub_port, enum usb_speed speed,
+			struct endpoint *ep, int nslots, usb_iso_cb_t cb,
+			void *t)
+{
+	struct ISOn *ison;
+	int interval;
+	int uperiod;
+	int frame;
+	int len;
+
+	if (speed == USBSPEED_LOW) {
+		ZF_LOGE("Low speed isochronous transfer is not allowed\n");
+		return -1;
+	}
+
+	if (!edev->flist) {
+		ehci_periodic_init(edev);
+	}
+
+	ison = usb_malloc(sizeof(struct ISOn));
+	if (!ison) {
+		ZF_LOGE("Out of memory\n");
+		return -1;
+	}
+	ison->ep = ep;
+	ison->cb = cb;
+	ison->token = t;
+	ison->hub_addr = hub_addr;
+	ison->hub_port = hub_port;
+
+	/*
+	 * Service period, USB spec 9.6.6. The interval is in micro frames
+	 * for high speed endpoints, and in frames for full speed.
+	 */
+	interval = 1 << (MIN(MAX(ep->interval, 1), 16) - 1);
+	if (speed == USBSPEED_HIGH) {
+		ison->split = 0;
+		if (interval < 8) {
+			ison->period = 1;
+			ison->npkts = 8 / interval;
+			uperiod = interval;
+		} else {
+			ison->period = interval / 8;
+			ison->npkts = 1;
+			uperiod = 8;
+		}
+		ison->pkt_size = (ep->max_pkt & 0x7ff)
+				 * (((ep->max_pkt >> 11) & 0x3) + 1);
+	} else {
+		ison->split = 1;
+		ison->period = interval;
+		ison->npkts = 1;
+		uperiod = 8;
+		ison->pkt_size = ep->max_pkt & 0x3ff;
+	}
+	ison->period = MIN(ison->period, ISO_MAX_SPAN);
+
+	/* Claim bus time before anything is linked */
+	ehci_bw_calc(&ison->bw, speed, ep, uperiod);
+	if (ehci_bw_reserve(edev, &ison->bw, ison->period)) {
+		usb_free(ison);
+		return -1;
+	}
+
+	/* Keep the ring well within the frame list */
+	ison->nslots = MAX(MIN(nslots, ISO_MAX_SPAN / ison->period), 1);
+
+	if (iso_alloc_slots(edev, ison, addr)) {
+		ehci_bw_release(edev, &ison->bw);
+		iso_free(edev, ison);
+		return -1;
+	}
+
+	/* Prime the ring and link it into the schedule */
+	frame = iso_phase_frame(edev, ison, iso_cur_frame(edev) + ISO_SCHED_DELAY);
+	for (int i = 0; i < ison->nslots; i++) {
+		frame &= edev->flist_size - 1;
+		len = iso_fill(ison, i, XACTSTAT_PENDING, 0);
+		iso_arm(ison, i, len);
+		iso_link(edev, ison, &ison->slots[i], frame);
+		ison->last_frame = frame;
+		frame += ison->period;
+	}
+	ison->next_done = 0;
+
+	ison->next = edev->iso_list;
+	edev->iso_list = ison;
+	ep->hcpriv = ison;
+
+	return ehci_schedule_periodic(edev);
+}
+
+void ehci_del_iso_stream(struct ehci_host *edev, struct ISOn *ison)
+{
+	struct ISOn *cur;
+
+	/* Remove from the stream list */
+	if (edev->iso_list == ison) {
+		edev->iso_list = ison->next;
+	} else {
+		cur = edev->iso_list;
+		while (cur && cur->next != ison) {
+			cur = cur->next;
+		}
+		if (cur) {
+			cur->next = ison->next;
+		}
+	}
+
+	/* Take the ring out of the schedule */
+	for (int i = 0; i < ison->nslots; i++) {
+		iso_deactivate(ison, &ison->slots[i]);
+		iso_unlink(edev, &ison->slots[i]);
+	}
+
+	/* The host controller may still hold a descriptor of the current frame */
+	ps_mdelay(2);
+
+	ison->ep->hcpriv = NULL;
+	ehci_bw_release(edev, &ison->bw);
+	iso_free(edev, ison);
+}
+
+void ehci_iso_complete(struct ehci_host *edev)
+{
+	enum usb_xact_status stat;
+	struct ISOn *ison;
+	struct ITDn *itdn;
+	int cur, diff;
+	int frame;
+	int len;
+
+	for (ison = edev->iso_list; ison; ison = ison->next) {
+		/* Slots retire in ring order */
+		for (int n = 0; n < ison->nslots; n++) {
+			itdn = &ison->slots[ison->next_done];
+			cur = iso_cur_frame(edev);
+			diff = iso_frame_diff(edev, cur, itdn->frame);
+
+			/* Still in the future, or being processed right now */
+			if (diff == 0 || diff >= edev->flist_size / 2) {
+				break;
+			}
+			if (iso_active(ison, itdn)) {
+				/* Give the host controller time to finish the frame */
+				if (diff < 2) {
+					break;
+				}
+				/* Missed service period */
+				iso_deactivate(ison, itdn);
+				stat = XACTSTAT_ERROR;
+				len = 0;
+			} else {
+				stat = iso_result(ison, itdn, &len);
+			}
+
+			iso_unlink(edev, itdn);
+			len = iso_fill(ison, ison->next_done, stat, len);
+			iso_arm(ison, ison->next_done, len);
+
+			/* Next service period of this slot, if it is still ahead */
+			frame = (ison->last_frame + ison->period) & (edev->flist_size - 1);
+			diff = iso_frame_diff(edev, frame, iso_cur_frame(edev));
+			if (diff < 2 || diff >= edev->flist_size / 2) {
+				frame = iso_phase_frame(edev, ison,
+						iso_cur_frame(edev) + ISO_SCHED_DELAY);
+			}
+			iso_link(edev, ison, itdn, frame);
+			ison->last_frame = frame;
+
+			ison->next_done = (ison->next_done + 1) % ison->nslots;
+		}
+	}
+}
@@ -9,82 +9,318 @@
 /**************************
  **** Queue scheduling ****
  **************************/
+int ehci_periodic_init(struct ehci_host *edev)
+{
+	/* XXX: The frame list size is default to 1024 */
+	edev->flist_size = 1024;
+	edev->flist = ps_dma_alloc_pinned(edev->dman,
+			edev->flist_size * sizeof(uint32_t*), 0x1000, 0,
+			PS_MEM_NORMAL, &edev->pflist);
+	if (!edev->flist) {
+		ZF_LOGF("Out of DMA memory\n");
+	}
+
+	/* Mark all frames as disabled */
+	for (int i = 0; i < edev->flist_size; i++) {
+		edev->flist[i] = TDLP_INVALID;
+	}
+
+	/*
+	 * Allocate shadow frame list to keep track of the virtual
+	 * address of the queue heads.
+	 */
+	edev->shadow_flist = (struct QHn**)usb_malloc(
+			sizeof(struct QHn*) * edev->flist_size);
+	if (!edev->shadow_flist) {
+		ZF_LOGF("Out of memory\n");
+	}
+
+	/*
+	 * Isochronous descriptors sit in front of the queue heads of each
+	 * frame, keep track of them separately.
+	 */
+	edev->iso_flist = (struct ITDn**)usb_malloc(
+			sizeof(struct ITDn*) * edev->flist_size);
+	if (!edev->iso_flist) {
+		ZF_LOGF("Out of memory\n");
+	}
+
+	return 0;
+}
+
 /*
- * TODO: We only support interrupt endpoint at the moment, this function is
- * subject to change when we add isochronous endpoint support.
+ * Point a frame at the given interrupt queue head, after any isochronous
+ * descriptors that are linked into the frame.
  */
-void ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
+void ehci_flist_set_qh(struct ehci_host *edev, int frame, struct QHn *qhn)
 {
-	struct QHn *cur;
+	struct ITDn *itdn;
+	uint32_t link;
 
-	/* Allocate the frame list */
-	if (!edev->flist) {
-		/* XXX: The frame list size is default to 1024 */
-		edev->flist_size = 1024;
-		edev->flist = ps_dma_alloc_pinned(edev->dman,
-				edev->flist_size * sizeof(uint32_t*), 0x1000, 0,
-				PS_MEM_NORMAL, &edev->pflist);
-		if (!edev->flist) {
-			ZF_LOGF("Out of DMA memory\n");
-		}
+	if (qhn) {
+		link = qhn->pqh | QHLP_TYPE_QH;
+	} else {
+		link = TDLP_INVALID;
+	}
 
-		/* Mark all frames as disabled */
-		for (int i = 0; i < edev->flist_size; i++) {
-			edev->flist[i] = TDLP_INVALID;
+	itdn = edev->iso_flist[frame];
+	if (!itdn) {
+		edev->flist[frame] = link;
+	} else {
+		while (itdn->fnext) {
+			itdn = itdn->fnext;
 		}
+		/* Both iTDs and siTDs start with the link pointer */
+		*(volatile uint32_t *)itdn->desc = link;
+	}
+}
 
-		/*
-		 * Allocate shadow frame list to keep track of the virtual
-		 * address of the queue heads.
-		 */
-		edev->shadow_flist = (struct QHn**)usb_malloc(
-				sizeof(struct QHn*) * edev->flist_size);
-		if (!edev->shadow_flist) {
-			ZF_LOGF("Out of memory\n");
-		}
+/***************************
+ **** Bandwidth budgets ****
+ ***************************/
+/* Bus time estimates, USB 2.0 spec 5.11.3 */
+#define BW_HOST_DELAY       5	//ns
+#define BW_HUB_LS_SETUP     333	//ns
+#define BW_BIT_TIME(bytes)  (7 * 8 * (bytes) / 6)
+#define BW_SPLIT_SIZE       188	//Full speed bytes per micro frame
+
+static int bw_hs_usecs(int bytes, int iso)
+{
+	int ns;
+
+	ns = ((iso ? 38 : 55) * 8 * 2083
+	      + 2083 * (3 + BW_BIT_TIME(bytes))) / 1000 + BW_HOST_DELAY;
+	return DIV_ROUND_UP(ns, 1000);
+}
+
+static int bw_tt_usecs(enum usb_speed speed, int bytes, int iso, int in)
+{
+	int ns;
+
+	if (speed == USBSPEED_LOW) {
+		ns = (in ? 64060 : 64107) + 2 * BW_HUB_LS_SETUP
+		     + 677 * (3 + BW_BIT_TIME(bytes)) + BW_HOST_DELAY;
+	} else if (iso) {
+		ns = (in ? 7268 : 6265) + 84 * (3 + BW_BIT_TIME(bytes))
+		     + BW_HOST_DELAY;
+	} else {
+		ns = 9107 + 84 * (3 + BW_BIT_TIME(bytes)) + BW_HOST_DELAY;
 	}
+	return DIV_ROUND_UP(ns, 1000);
+}
 
-	/* Check if the queue head has already been scheduled */
-	cur = edev->intn_list;
-	while (cur) {
-		if (cur == qhn) {
-			return;
+/*
+ * Work out the bus time of a periodic endpoint and the shape of its micro
+ * frame masks. The masks are positioned by ehci_bw_reserve().
+ */
+void ehci_bw_calc(struct ehci_bw *bw, enum usb_speed speed,
+		  struct endpoint *ep, int uperiod)
+{
+	int iso = (ep->type == EP_ISOCHRONOUS);
+	int in = (ep->dir == EP_DIR_IN);
+	int maxp = ep->max_pkt & 0x7ff;
+	int nsplits;
+
+	bw->period = 0;
+	bw->phase = 0;
+	bw->smask = 0;
+	bw->cmask = 0;
+	bw->ss_usecs = 0;
+	bw->cs_usecs = 0;
+	bw->tt_usecs = 0;
+
+	if (speed == USBSPEED_HIGH) {
+		maxp *= ((ep->max_pkt >> 11) & 0x3) + 1;
+		bw->ss_usecs = bw_hs_usecs(maxp, iso);
+		if (uperiod < 8) {
+			for (int u = 0; u < 8; u += uperiod) {
+				bw->smask |= BIT(u);
+			}
+		} else {
+			bw->smask = 0x01;
 		}
-		cur = cur->next;
+		return;
 	}
 
-	/*
-	 * Insert the queue head into the list. The queue heads are sorted, from
-	 * low rate to high rate.
-	 */
-	cur = edev->intn_list;
-	qhn->qh->qhlptr = QHLP_INVALID;
-	if (!cur) {
-		edev->intn_list = qhn;
-		qhn->next = NULL;
+	/* Split transactions through the TT, EHCI spec 4.12.3 */
+	maxp &= 0x3ff;
+	bw->tt_usecs = bw_tt_usecs(speed, maxp, iso, in);
+	if (iso && !in) {
+		nsplits = MAX(DIV_ROUND_UP(maxp, BW_SPLIT_SIZE), 1);
+		bw->smask = BIT(nsplits) - 1;
+		bw->ss_usecs = bw_hs_usecs(MIN(maxp, BW_SPLIT_SIZE), 1);
+	} else if (iso) {
+		bw->smask = 0x01;
+		bw->cmask = 0xfc;
+		bw->ss_usecs = bw_hs_usecs(1, 1);
+		bw->cs_usecs = bw_hs_usecs(MIN(maxp, BW_SPLIT_SIZE), 1);
 	} else {
-		while (cur->next && cur->next->rate >= qhn->rate) {
-			cur = cur->next;
+		bw->smask = 0x01;
+		bw->cmask = 0x1c;
+		bw->ss_usecs = bw_hs_usecs(in ? 1 : maxp, 0);
+		bw->cs_usecs = bw_hs_usecs(in ? maxp : 0, 0);
+	}
+}
+
+/* Worst micro frame load if the masks were placed at the given phase */
+static int bw_load(struct ehci_host *edev, struct ehci_bw *bw, int period,
+		   int phase, uint8_t smask, uint8_t cmask)
+{
+	int worst = 0;
+	int load;
+
+	for (int f = phase; f < EHCI_BW_FRAMES; f += period) {
+		if (edev->bw_tt[f] + bw->tt_usecs > EHCI_BW_FRAME_MAX) {
+			return -1;
+		}
+		for (int u = 0; u < 8; u++) {
+			load = edev->bw_uframe[f][u];
+			if (smask & BIT(u)) {
+				load += bw->ss_usecs;
+			}
+			if (cmask & BIT(u)) {
+				load += bw->cs_usecs;
+			}
+			if (load > EHCI_BW_UFRAME_MAX) {
+				return -1;
+			}
+			worst = MAX(worst, load);
+		}
+	}
+	return worst;
+}
+
+static void bw_account(struct ehci_host *edev, struct ehci_bw *bw, int sign)
+{
+	for (int f = bw->phase; f < EHCI_BW_FRAMES; f += bw->period) {
+		edev->bw_tt[f] += sign * bw->tt_usecs;
+		for (int u = 0; u < 8; u++) {
+			if (bw->smask & BIT(u)) {
+				edev->bw_uframe[f][u] += sign * bw->ss_usecs;
+			}
+			if (bw->cmask & BIT(u)) {
+				edev->bw_uframe[f][u] += sign * bw->cs_usecs;
+			}
 		}
-		qhn->next = cur->next;
-		cur->next = qhn;
+	}
+}
+
+/*
+ * Place a periodic endpoint at the least loaded frame phase and micro frame,
+ * and claim its bus time.
+ */
+int ehci_bw_reserve(struct ehci_host *edev, struct ehci_bw *bw, int period)
+{
+	int best = -1;
+	int best_phase = 0;
+	int best_shift = 0;
+	int load;
+
+	if (bw->period) {
+		return 0;
+	}
 
-		cur->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
-		if (qhn->next) {
-			qhn->qh->qhlptr = qhn->next->pqh | QHLP_TYPE_QH;
+	period = MIN(MAX(period, 1), EHCI_BW_FRAMES);
+	for (int phase = 0; phase < period; phase++) {
+		for (int shift = 0; shift < 8; shift++) {
+			if (((bw->smask | bw->cmask) << shift) > 0xff) {
+				break;
+			}
+			load = bw_load(edev, bw, period, phase,
+				       bw->smask << shift, bw->cmask << shift);
+			if (load >= 0 && (best < 0 || load < best)) {
+				best = load;
+				best_phase = phase;
+				best_shift = shift;
+			}
 		}
 	}
+	if (best < 0) {
+		ZF_LOGE("Periodic bandwidth exhausted\n");
+		return -1;
+	}
+
+	bw->period = period;
+	bw->phase = best_phase;
+	bw->smask <<= best_shift;
+	bw->cmask <<= best_shift;
+	bw_account(edev, bw, 1);
+
+	return 0;
+}
+
+void ehci_bw_release(struct ehci_host *edev, struct ehci_bw *bw)
+{
+	if (!bw->period) {
+		return;
+	}
+	bw_account(edev, bw, -1);
+	bw->period = 0;
+}
+
+/*
+ * The interrupt queue heads form a tree. Each frame points to a chain of
+ * queue heads sorted from the longest period to the shortest, and all
+ * frames that share a queue head share the rest of its chain as well.
+ */
+int ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
+{
+	struct QHn *cur, *prev;
+	uint32_t epc1;
+
+	/* Allocate the frame list */
+	if (!edev->flist) {
+		ehci_periodic_init(edev);
+	}
+
+	/* Check if the queue head has already been scheduled */
+	if (qhn->bw.period) {
+		return 0;
+	}
+
+	if (ehci_bw_reserve(edev, &qhn->bw, qhn->rate)) {
+		return -1;
+	}
+	epc1 = qhn->qh->epc[1] & ~QHEPC1_UFRAME_MASK;
+	qhn->qh->epc[1] = epc1 | QHEPC1_UFRAME_SMASK(qhn->bw.smask)
+			  | QHEPC1_UFRAME_CMASK(qhn->bw.cmask);
+
+	qhn->next = edev->intn_list;
+	edev->intn_list = qhn;
 
 	/* Update the frame list */
-	for (int i = qhn->rate - 1; i < edev->flist_size; i += qhn->rate) {
+	qhn->pnext = NULL;
+	qhn->qh->qhlptr = QHLP_INVALID;
+	for (int i = qhn->bw.phase; i < edev->flist_size; i += qhn->rate) {
+		prev = NULL;
 		cur = edev->shadow_flist[i];
-		if (!cur || cur->rate < qhn->rate) {
+		while (cur && cur->rate > qhn->rate) {
+			prev = cur;
+			cur = cur->pnext;
+		}
+
+		/* Linked through a parent in an earlier frame */
+		if (prev && prev->pnext == qhn) {
+			continue;
+		}
+
+		qhn->pnext = cur;
+		if (cur) {
+			qhn->qh->qhlptr = cur->pqh | QHLP_TYPE_QH;
+		}
+		dsb();
+
+		if (prev) {
+			prev->pnext = qhn;
+			prev->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
+		} else {
 			edev->shadow_flist[i] = qhn;
-			edev->flist[i] = qhn->pqh | QHLP_TYPE_QH;
+			ehci_flist_set_qh(edev, i, qhn);
 		}
 	}
 
 	dsb();
+	return 0;
 }
 
 /*
@@ -96,54 +332,64 @@ void ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
  */
 void ehci_del_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
 {
-	struct QHn *cur;
+	struct QHn *cur, *prev;
 	struct TDn *tdn;
 
 	/* Remove the active bit from the TD */
 	tdn = qhn->tdns;
-	tdn->td->token &= ~TDTOK_SACTIVE;
+	if (tdn) {
+		tdn->td->token &= ~TDTOK_SACTIVE;
+	}
 
 	/* Remove from the software list */
 	cur = edev->intn_list;
 	if (cur == qhn) {
 		edev->intn_list = qhn->next;
 	} else {
-		while (cur->next && cur->next != qhn) {
+		while (cur && cur->next != qhn) {
 			cur = cur->next;
 		}
-		cur->next = qhn->next;
-		if (qhn->next) {
-			cur->qh->qhlptr = qhn->next->pqh | QHLP_TYPE_QH;
-		} else {
-			cur->qh->qhlptr = QHLP_INVALID;
+		if (cur) {
+			cur->next = qhn->next;
 		}
 	}
 
 	/* Remove from the periodic schedule table */
-	for (int i = qhn->rate - 1; i < edev->flist_size; i += qhn->rate) {
+	for (int i = qhn->bw.phase; i < edev->flist_size; i += qhn->rate) {
+		prev = NULL;
 		cur = edev->shadow_flist[i];
+		while (cur && cur != qhn) {
+			prev = cur;
+			cur = cur->pnext;
+		}
+		if (!cur) {
+			continue;
+		}
 
 		/*
-		 * If we are removing the first element, we need to update the
-		 * hardware frame list. There's no need to check if removing
-		 * queue head points to another valid queue head, because even
-		 * if this queue head points to NULL, its horizontal link pointer
-		 * should have already had the terminate bit set to 1.
+		 * Bypass the queue head. Its horizontal link pointer already
+		 * points to the rest of the chain, or has the terminate bit set.
 		 */
-		if (cur == qhn) {
-			edev->shadow_flist[i] = qhn->next;
-			edev->flist[i] = qhn->qh->qhlptr;
+		if (prev) {
+			prev->pnext = qhn->pnext;
+			prev->qh->qhlptr = qhn->qh->qhlptr;
+		} else {
+			edev->shadow_flist[i] = qhn->pnext;
+			ehci_flist_set_qh(edev, i, qhn->pnext);
 		}
 	}
 
 	dsb();
+	ehci_bw_release(edev, &qhn->bw);
 
 	/* Free */
-	ps_dma_free_pinned(edev->dman, qhn->tdns, sizeof(struct TDn));
-	usb_free(qhn->tdns);
-	qhn->tdns = NULL;
+	if (tdn) {
+		ps_dma_free_pinned(edev->dman, (void*)tdn->td, sizeof(struct TD));
+		usb_free(tdn);
+		qhn->tdns = NULL;
+	}
 
-	ps_dma_free_pinned(edev->dman, qhn, sizeof(struct QHn));
+	ps_dma_free_pinned(edev->dman, (void*)qhn->qh, sizeof(struct QH));
 	usb_free(qhn);
 }
 
@@ -193,24 +439,37 @@ void ehci_periodic_complete(struct ehci_host *edev)
 {
 	struct QHn *qhn;
 	struct TDn *tdn;
-	int sum;
+	enum usb_xact_status stat;
+	int sum, gen;
 
 	/* Interrupt endpoints would never queue multiple TDs */
+restart:
 	qhn = edev->intn_list;
 	while (qhn) {
 		tdn = qhn->tdns;
-		if (tdn && qtd_get_status(tdn->td) == XACTSTAT_SUCCESS) {
+		stat = tdn ? qtd_get_status(tdn->td) : XACTSTAT_PENDING;
+		if (stat != XACTSTAT_PENDING) {
 			/* Restore the queue head to its initial state */
 			qhn->tdns = NULL;
+			if (stat != XACTSTAT_SUCCESS) {
+				qhn_clear_halt(qhn);
+			}
 
 			sum = TDTOK_GET_BYTES(tdn->td->token);
+			gen = edev->sched_gen;
+			usbmon_complete(edev->hdev, &tdn->mon, stat, sum);
 			if (tdn->cb) {
-				tdn->cb(tdn->token, XACTSTAT_SUCCESS, sum);
+				tdn->cb(tdn->token, stat, sum);
 			}
 
 			ps_dma_free_pinned(edev->dman, (void*)tdn->td,
 					sizeof(struct TD));
 			usb_free(tdn);
+
+			/* The callback may have cancelled an endpoint */
+			if (edev->sched_gen != gen) {
+				goto restart;
+			}
 		}
 		qhn = qhn->next;
 	}
@@ -18,6 +18,9 @@
 
 #define MAX_PKT_SIZE 64
 
+/* A dTD has 5 page pointers, 16KB always fits whatever the offset */
+#define DTD_MAX_LEN  0x4000
+
 struct ehci_host_cap {
     uint8_t  caplength;        /* +0x00 */
     uint8_t  res0[4];
@@ -140,6 +143,7 @@ struct dTD {
 #define DTDNEXT_INVALID      0x1
     uint32_t dTD_next;
 #define DTDTOK_BYTES(x)    (((x) & 0x7fff) << 16)
+#define DTDTOK_GET_BYTES(x) (((x) >> 16) & 0x7fff)
 #define DTDTOK_IOC         BIT(15)
 #define DTDTOK_MULTO(x)    (((x) & 0x3) << 10)
 #define DTDTOK_ACTIVE      BIT(7)
@@ -174,6 +178,9 @@ struct dTDn {
     uintptr_t pdtd;
     void *buf;
     uintptr_t pbuf;
+    int len;
+    /* Only the last dTD of a prime has a call back */
+    int last;
     otg_prime_cb cb;
     void* token;
     struct dTDn* next;
@@ -181,8 +188,12 @@ struct dTDn {
 
 struct otg_ep {
     volatile struct dQH* dqh;
+    /* Primed dTDs, oldest first */
     struct dTDn* dtdn;
+    struct dTDn* dtdn_tail;
     int ep;
+    /* Bit of this endpoint in the prime, flush and status registers */
+    uint32_t epbit;
 };
 
 struct ehci_otg {
@@ -200,6 +211,8 @@ struct ehci_otg {
      * TODO should this be plat dependant? */
     otg_setup_cb setup_cb;
     void* setup_token;
+    /* Free dTDs, allocated a page at a time and never returned */
+    struct dTDn* dtd_pool;
 };
 
 struct usb_otg_data {
@@ -387,37 +400,82 @@ dtd_get_status(volatile struct dTD* dtd)
     }
 }
 
+/* Carve a page of DMA memory into free dTDs */
+static int
+otg_dtd_pool_grow(usb_otg_t otg)
+{
+    struct ehci_otg* odev = &otg->pdata->otg;
+    struct dTDn* dtdn;
+    volatile struct dTD* dtd;
+    uintptr_t pdtd;
+    int n = 0x1000 / sizeof(*dtd);
+    int i;
+
+    dtdn = usb_malloc(sizeof(*dtdn) * n);
+    if (dtdn == NULL) {
+        ZF_LOGE("OTG: Out of memory\n");
+        return -1;
+    }
+    dtd = ps_dma_alloc_pinned(otg->dman, 0x1000, 0x1000, 0, PS_MEM_NORMAL,
+                              &pdtd);
+    if (dtd == NULL) {
+        ZF_LOGE("OTG: Out of DMA memory\n");
+        usb_free(dtdn);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        dtdn[i].dtd = &dtd[i];
+        dtdn[i].pdtd = pdtd + i * sizeof(*dtd);
+        dtdn[i].next = odev->dtd_pool;
+        odev->dtd_pool = &dtdn[i];
+    }
+    return 0;
+}
+
+static void
+otg_dtdn_free(usb_otg_t otg, struct dTDn* dtdn)
+{
+    struct ehci_otg* odev = &otg->pdata->otg;
+    struct dTDn* next;
+
+    while (dtdn) {
+        next = dtdn->next;
+        dtdn->next = odev->dtd_pool;
+        odev->dtd_pool = dtdn;
+        dtdn = next;
+    }
+}
+
 static struct dTDn*
-otg_dtdn_new(usb_otg_t otg, void* buf, uintptr_t pbuf, int len) {
+otg_dtdn_new(usb_otg_t otg, void* buf, uintptr_t pbuf, int len, int ioc) {
+    struct ehci_otg* odev;
     struct dTDn* dtdn;
     volatile struct dTD* dtd;
     int cur_len;
     int i;
 
-    if (!otg) {
+    if (!otg || len > DTD_MAX_LEN) {
 	    ZF_LOGF("Invalid arguments\n");
     }
 
-    /* Allocate a descriptor */
-    dtdn = usb_malloc(sizeof(*dtdn));
-    if (dtdn == NULL) {
-	ZF_LOGE("OTG: Out of memory\n");
-        return NULL;
-    }
-    dtd = ps_dma_alloc_pinned(otg->dman, sizeof(*dtdn->dtd), 32,
-                              0, PS_MEM_NORMAL, &dtdn->pdtd);
-    if (dtd == NULL) {
-	ZF_LOGE("OTG: Out of DMA memory\n");
+    /* Take a descriptor from the pool */
+    odev = &otg->pdata->otg;
+    if (odev->dtd_pool == NULL && otg_dtd_pool_grow(otg)) {
         return NULL;
     }
-    dtdn->dtd = dtd;
+    dtdn = odev->dtd_pool;
+    odev->dtd_pool = dtdn->next;
+    dtd = dtdn->dtd;
     dtdn->buf = buf;
+    dtdn->pbuf = pbuf;
+    dtdn->len = len;
+    dtdn->last = 0;
     dtdn->cb = NULL;
     dtdn->token = NULL;
     dtdn->next = NULL;
     /* Initialise the DTD */
     dtd->dTD_next = DTDNEXT_INVALID;
-    dtd->token = DTDTOK_BYTES(len) | DTDTOK_IOC
+    dtd->token = DTDTOK_BYTES(len) | (ioc ? DTDTOK_IOC : 0)
                  | DTDTOK_MULTO(0) | DTDTOK_ACTIVE;
     cur_len = 0;
     for (i = 0; i < sizeof(dtd->buf) / sizeof(*dtd->buf); i++) {
@@ -434,6 +492,45 @@ otg_dtdn_new(usb_otg_t otg, void* buf, uintptr_t pbuf, int len) {
     return dtdn;
 }
 
+/*
+ * Build the dTD chain of one prime. Buffers larger than a dTD are split and
+ * the controller walks the chain without help. For TX only the last dTD
+ * interrupts. An RX prime may end early with a short packet, so every RX dTD
+ * interrupts and the driver sees where it stopped.
+ */
+static struct dTDn*
+otg_dtdn_chain(usb_otg_t otg, void* buf, uintptr_t pbuf, int len, int rx,
+               struct dTDn** tail)
+{
+    struct dTDn* head = NULL;
+    struct dTDn* last = NULL;
+    struct dTDn* dtdn;
+    int off = 0;
+    int this_len;
+
+    do {
+        this_len = MIN(len - off, DTD_MAX_LEN);
+        dtdn = otg_dtdn_new(otg, buf ? (uint8_t*)buf + off : NULL,
+                            pbuf ? pbuf + off : 0, this_len,
+                            rx || off + this_len == len);
+        if (dtdn == NULL) {
+            otg_dtdn_free(otg, head);
+            return NULL;
+        }
+        if (last) {
+            last->dtd->dTD_next = dtdn->pdtd;
+            last->next = dtdn;
+        } else {
+            head = dtdn;
+        }
+        last = dtdn;
+        off += this_len;
+    } while (off < len);
+
+    last->last = 1;
+    *tail = last;
+    return head;
+}
 
 /***********************
  **** EP operations ****
@@ -443,10 +540,10 @@ flush_ep(usb_otg_t otg, struct otg_ep* ep)
 {
     struct ehci_otg* odev;
     odev = &otg->pdata->otg;
-    odev->op_regs->otg_endptflush = OTGTX(BIT(ep->ep));
-    while (ep->dtdn) {
-        ep->dtdn = ep->dtdn->next;
-    }
+    odev->op_regs->otg_endptflush = ep->epbit;
+    otg_dtdn_free(otg, ep->dtdn);
+    ep->dtdn = NULL;
+    ep->dtdn_tail = NULL;
     ep->dqh->overlay.dTD_next = DTDNEXT_INVALID;
 }
 
@@ -467,12 +564,12 @@ imx6_otg_prime(usb_otg_t otg, int epno, enum usb_xact_type dir,
 {
     struct otg_ep* ep;
     struct ehci_otg* odev;
-    struct dTDn** dtdn_ptr;
     struct dTDn* dtdn;
+    struct dTDn* tail;
     volatile struct dTD* dtd_prev;
     uint32_t epbit;
 
-    if (!otg || epno < 0) {
+    if (!otg || epno < 0 || len < 0) {
 	    ZF_LOGF("OTG: Invalid arguments\n");
     }
 
@@ -481,28 +578,25 @@ imx6_otg_prime(usb_otg_t otg, int epno, enum usb_xact_type dir,
     if (dir == PID_IN) {
         ep++;
     }
-    /* Create the descriptor */
-    dtdn = otg_dtdn_new(otg, buf, pbuf, len);
+    /* Create the descriptors */
+    dtdn = otg_dtdn_chain(otg, buf, pbuf, len, dir != PID_IN, &tail);
     if (dtdn == NULL) {
         ZF_LOGE("OTG: Failed to create descriptor\n");;
         return -1;
     }
-    dtdn->cb = cb;
-    dtdn->token = token;
+    tail->cb = cb;
+    tail->token = token;
     /* Add to the tail of the dTD node list */
-    dtdn_ptr = &ep->dtdn;
-    dtd_prev = &ep->dqh->overlay;
-    while (*dtdn_ptr) {
-        dtd_prev = (*dtdn_ptr)->dtd;
-        dtdn_ptr = &(*dtdn_ptr)->next;
-    }
-    *dtdn_ptr = dtdn;
-    /* Ensure the driver will process it */
-    if (dir == PID_IN) {
-        epbit = OTGTX(BIT(ep->ep));
+    if (ep->dtdn_tail) {
+        dtd_prev = ep->dtdn_tail->dtd;
+        ep->dtdn_tail->next = dtdn;
     } else {
-        epbit = OTGRX(BIT(ep->ep));
+        dtd_prev = &ep->dqh->overlay;
+        ep->dtdn = dtdn;
     }
+    ep->dtdn_tail = tail;
+    /* Ensure the driver will process it */
+    epbit = ep->epbit;
     /* imx6 64.4.6.5.3 */
     /* Check DCD driver to see if pipe is empty */
     if (dtd_prev->dTD_next != DTDNEXT_INVALID) {
@@ -525,7 +619,7 @@ imx6_otg_prime(usb_otg_t otg, int epno, enum usb_xact_type dir,
                 /* 4) Read endpoint status */
                 sts = odev->op_regs->otg_endptstat;
                 /* 5) Read trip, if 0 goto 3 */
-            } while (!(odev->op_regs->usbcmd &= OTGCMD_DTDTRIP));
+            } while (!(odev->op_regs->usbcmd & OTGCMD_DTDTRIP));
             /* 6) Write 0 to clear trip */
             odev->op_regs->usbcmd &= ~OTGCMD_DTDTRIP;
             if (sts & epbit) {
@@ -611,32 +705,119 @@ otg_handle_setup(usb_otg_t otg, struct otg_ep* ep)
     }
 }
 
+/*
+ * Stop the controller on dTDs that belong to a prime that already ended with
+ * a short packet, and restart it on the primes queued behind them.
+ */
+static void
+otg_drop_dtds(usb_otg_t otg, struct otg_ep* ep, struct dTDn* dtdn)
+{
+    struct ehci_otg* odev = &otg->pdata->otg;
+    struct dTDn* next;
+    int active = 0;
+
+    for (next = dtdn; next; next = next->next) {
+        if (dtd_get_status(next->dtd) == XACTSTAT_PENDING) {
+            active = 1;
+        } else if (DTDTOK_GET_BYTES(next->dtd->token) != next->len) {
+            ZF_LOGW("OTG: EP %d data after a short packet dropped\n", ep->ep);
+        }
+    }
+
+    /* The controller moved on by itself */
+    if (!active) {
+        otg_dtdn_free(otg, dtdn);
+        return;
+    }
+    odev->op_regs->otg_endptflush = ep->epbit;
+    while (odev->op_regs->otg_endptflush & ep->epbit);
+    otg_dtdn_free(otg, dtdn);
+    if (ep->dtdn) {
+        ep->dqh->overlay.dTD_next = ep->dtdn->pdtd;
+        ep->dqh->overlay.token &= ~(DTDTOK_HALTED | DTDTOK_ACTIVE);
+        odev->op_regs->otg_endptprime |= ep->epbit;
+    } else {
+        ep->dqh->overlay.dTD_next = DTDNEXT_INVALID;
+    }
+}
+
+/*
+ * Retire finished primes one at a time and call back with the number of
+ * bytes moved. A prime ends with its last dTD, or with an RX dTD that was cut
+ * short. The call backs may prime the endpoint again while the controller
+ * keeps working on the rest.
+ */
 static void
 otg_handle_complete(usb_otg_t otg, struct otg_ep* ep)
 {
+    enum usb_xact_status stat, xfer_stat;
+    struct dTDn* done;
+    struct dTDn* end;
+    struct dTDn* tail;
+    struct dTDn* rest;
     struct dTDn* dtdn;
-    dtdn = ep->dtdn;
+    otg_prime_cb cb;
+    void* token;
+    int rx = !!(ep->epbit & OTGRX(0xffff));
+    int bytes;
 
-    if (!dtdn) {
+    if (!ep->dtdn) {
 	    ZF_LOGF("Invalid arguments\n");
     }
 
-    while (dtdn) {
-        enum usb_xact_status stat;
-        struct dTDn* tmp;
-        stat = dtd_get_status(dtdn->dtd);
-        if (stat == XACTSTAT_PENDING) {
-            break;
+    for (;;) {
+        /* Find where the oldest prime ended, if it did */
+        end = NULL;
+        for (dtdn = ep->dtdn; dtdn; dtdn = dtdn->next) {
+            stat = dtd_get_status(dtdn->dtd);
+            if (stat == XACTSTAT_PENDING) {
+                break;
+            }
+            if (dtdn->last || stat != XACTSTAT_SUCCESS ||
+                (rx && DTDTOK_GET_BYTES(dtdn->dtd->token))) {
+                end = dtdn;
+                break;
+            }
+        }
+        if (!end) {
+            return;
+        }
+
+        /* The call back lives on the last dTD of the prime */
+        for (tail = end; !tail->last; tail = tail->next);
+        cb = tail->cb;
+        token = tail->token;
+
+        done = ep->dtdn;
+        rest = end->next;
+        end->next = NULL;
+        ep->dtdn = tail->next;
+        if (!ep->dtdn) {
+            ep->dtdn_tail = NULL;
+        }
+        tail->next = NULL;
+
+        xfer_stat = XACTSTAT_SUCCESS;
+        bytes = 0;
+        for (dtdn = done; dtdn; dtdn = dtdn->next) {
+            stat = dtd_get_status(dtdn->dtd);
+            if (stat != XACTSTAT_SUCCESS) {
+                xfer_stat = stat;
+            }
+            bytes += dtdn->len - DTDTOK_GET_BYTES(dtdn->dtd->token);
+        }
+        otg_dtdn_free(otg, done);
+        if (end != tail) {
+            otg_drop_dtds(otg, ep, rest);
+        }
+
+        if (cb) {
+            cb(otg, token, xfer_stat, bytes);
         }
-        if (dtdn->cb) {
-            dtdn->cb(otg, dtdn->token, stat);
+        if (!ep->dtdn) {
+            return;
         }
-        ps_dma_free_pinned(otg->dman, (void*)dtdn->dtd, sizeof(*dtdn->dtd));
-        tmp = dtdn;
-        dtdn = dtdn->next;
-        usb_free(tmp);
     }
-    ep->dtdn = dtdn;
 }
 
 
@@ -723,7 +904,7 @@ ehci_otg_init(usb_otg_t odev, uintptr_t cap_regs)
     struct otg_ep* ep;
     int i;
     odev->pdata = usb_malloc(sizeof(*odev->pdata));
-    if (odev->pdata) {
+    if (!odev->pdata) {
 	    ZF_LOGE("Out of memory\n");
 	    return -1;
     }
@@ -732,6 +913,7 @@ ehci_otg_init(usb_otg_t odev, uintptr_t cap_regs)
 
     otg = &odev->pdata->otg;
     otg->devid = odev->id;
+    otg->dtd_pool = NULL;
     otg->cap_regs = (void*)cap_regs;
     otg->op_regs = (void*)(cap_regs + otg->cap_regs->caplength);
     /* Setup endpoints */
@@ -758,6 +940,9 @@ ehci_otg_init(usb_otg_t odev, uintptr_t cap_regs)
         ep->dqh->overlay.dTD_next = DTDNEXT_INVALID;
 
         ep->ep = i >> 1;
+        ep->epbit = (i & 1) ? OTGTX(BIT(ep->ep)) : OTGRX(BIT(ep->ep));
+        ep->dtdn = NULL;
+        ep->dtdn_tail = NULL;
     }
     /* Initialise the controller */
     otg->op_regs->otg_deviceaddr = 0;
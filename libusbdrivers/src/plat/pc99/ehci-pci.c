@@ -8,6 +8,7 @@
 
 #include <usb/usb_host.h>
 #include "../../ehci/ehci.h"
+#include "../../xhci/xhci.h"
 #include "../../services.h"
 
 #define USBLEGSUP            0x0
@@ -44,6 +45,16 @@
 #define USB_HOST2_VID    0x8086
 #define USB_HOST2_DID    0x1E2D
 
+/* xHCI controllers we know of, the first one found is used */
+static const struct {
+	uint16_t vid;
+	uint16_t did;
+} xhci_ids[] = {
+	{ 0x8086, 0x1E31 },	/* Intel Panther Point */
+	{ 0x1033, 0x0194 },	/* NEC uPD720200 */
+	{ 0x1b36, 0x000D },	/* QEMU */
+};
+
 /*
  * TODO: Should get these numbers from IOAPIC tables. Remove them once we have a
  * proper parser for the IOAPIC tables.
@@ -100,6 +111,33 @@ static uintptr_t ehci_pci_init(uint16_t vid, uint16_t did,
 	return (uintptr_t)cap_regs;
 }
 
+/* The xHCI legacy capability lives in MMIO, it is handled by the driver */
+static uintptr_t xhci_pci_init(ps_io_ops_t *io_ops)
+{
+	libpci_device_t *dev = NULL;
+	uintptr_t regs;
+	int i;
+
+	libpci_scan(io_ops->io_port_ops);
+	for (i = 0; !dev && i < ARRAY_SIZE(xhci_ids); i++) {
+		dev = libpci_find_device(xhci_ids[i].vid, xhci_ids[i].did);
+	}
+	if (!dev) {
+		ZF_LOGE("xHCI: Host device not found!\n");
+		return 0;
+	}
+
+	libpci_read_ioconfig(&dev->cfg, dev->bus, dev->dev, dev->fun);
+	regs = (uintptr_t)MAP_DEVICE(io_ops, dev->cfg.base_addr[0],
+				     dev->cfg.base_addr_size[0]);
+	if (!regs) {
+		ZF_LOGF("Invalid Registers\n");
+	}
+	_irq_line = dev->interrupt_line;
+
+	return regs;
+}
+
 int
 usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, ps_mutex_ops_t *sync,
 		usb_host_t* hdev)
@@ -108,7 +146,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, ps_mutex_ops_t *sync,
 	uint16_t vid, did;
 	uintptr_t usb_regs;
 
-	if (id < 0 || id > USB_NHOSTS) {
+	if (id < 0 || id >= USB_NHOSTS) {
 		return -1;
 	}
 	
@@ -129,6 +167,12 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, ps_mutex_ops_t *sync,
 			vid = USB_HOST2_VID;
 			did = USB_HOST2_DID;
 			break;
+		case USB_HOST3:
+			usb_regs = xhci_pci_init(io_ops);
+			if (!usb_regs) {
+				return -1;
+			}
+			return xhci_host_init(hdev, usb_regs);
 		default:
 			ZF_LOGF("Invalid host\n");
 			break;
@@ -164,6 +208,9 @@ usb_host_irqs(usb_host_t* host, int* nirqs)
 		case USB_HOST2:
 			_irq_line = USB_HOST2_IRQ;
 			break;
+		case USB_HOST3:
+			/* Whatever the BIOS routed */
+			break;
 		default:
 			ZF_LOGF("Invalid host\n");
 			break;
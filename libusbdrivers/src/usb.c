@@ -11,11 +11,9 @@
 #include <usb/drivers/usbhub.h>
 #include <usb/usb.h>
 #include "services.h"
+#include "usbmon.h"
 #include <string.h>
 #include <utils/util.h>
-#include <utils/sglib.h>
-
-#define NUM_DEVICES 32
 
 #define CLASS_RESERVED_STR "<Reserved>"
 
@@ -98,74 +96,65 @@ static inline struct usbreq __new_address_req(int addr)
 
 /**** Device list ****/
 
-/* Initialise the device list */
+/* Initialise the device table, address 0 is reserved for enumeration */
 static void devlist_init(usb_t * host)
 {
-	host->devlist = NULL;
+	memset(host->devs, 0, sizeof(host->devs));
 	host->addrbm = 1;
 	host->next_addr = 1;
+	host->enum_done = NULL;
 }
 
-/* Insert a device into the list, return the index at which it was inserted */
+/* Insert a device into the table, return the address allocated to it */
 static int devlist_insert(struct usb_dev *d)
 {
 	usb_t *host = d->host;
-	int i = host->next_addr;
-	/* Early exit */
-	if (host->addrbm == (1ULL << NUM_DEVICES) - 1) {
+	uint32_t free;
+	uint32_t above;
+	int i;
+
+	free = ~host->addrbm;
+	if (!free) {
 		return -1;
 	}
-	/* cycle the list searching for a free address */
-	while (host->addrbm & (1 << i)) {
-		if (i == NUM_DEVICES) {
-			/* Remember address 0 is a special case */
-			i = 1;
-		} else {
-			i++;
-		}
-	}
-	/* Add the device to the list */
-	SGLIB_LIST_ADD(struct usb_dev, host->devlist, d, next);
-	host->addrbm |= (1 << i);
+	/* Prefer addresses from next_addr up to delay recycling */
+	above = free & ~(BIT(host->next_addr) - 1);
+	i = CTZ(above ? above : free);
+
+	host->devs[i] = d;
+	host->addrbm |= BIT(i);
 
 	/* Update the next address for next insertion */
-	if ((i + 1) == NUM_DEVICES) {
+	if (i + 1 == USB_NDEVICES) {
 		host->next_addr = 1;
 	} else {
 		host->next_addr = i + 1;
 	}
 
-	/* return address */
 	return i;
 }
 
-/* Remove the device from the list */
-static void devlist_remove(struct usb_dev *d)
+/* Remove the device from the table */
+static void devlist_remove(struct usb_dev *d, int addr)
 {
 	usb_t *host = d->host;
 
-	SGLIB_LIST_DELETE(struct usb_dev, host->devlist, d, next);
-
-	d->next = NULL;
-	host->addrbm &= ~(1 << d->addr);
-	d->addr = -1;
+	if (addr <= 0 || addr >= USB_NDEVICES || host->devs[addr] != d) {
+		return;
+	}
+	host->devs[addr] = NULL;
+	host->addrbm &= ~BIT(addr);
 }
 
-/* Retrieve a device from the list */
+/* Retrieve a device from the table */
 static struct usb_dev *devlist_at(usb_t *host, int addr)
 {
-	struct usb_dev *d;
-	if (addr < 0 || addr > NUM_DEVICES) {
+	if (addr < 0 || addr >= USB_NDEVICES) {
 		ZF_LOGW("USB: Device not found\n");
+		return NULL;
 	}
 
-	for (d = host->devlist; d != NULL; d = d->next) {
-		if (d->addr == addr) {
-			return d;
-		}
-	}
-
-	return NULL;
+	return host->devs[addr];
 }
 
 /************************
@@ -354,66 +343,6 @@ static void print_string_desc(struct string_desc *desc)
 	printf("\n");
 }
 
-static void
-usb_get_string_desc(struct usb_dev *udev, int index, struct string_desc *desc)
-{
-	int err;
-	int lang;
-	struct xact xact[2];
-	struct usbreq *req;
-	struct string_desc *sdesc;
-
-	if (index == 0) {
-		return;
-	}
-
-	/* XXX: xact allocation relies on the xact.len */
-	xact[0].len = sizeof(struct usbreq);
-	xact[1].len = sizeof(struct string_desc);
-
-	/* Get memory for the request */
-	err = usb_alloc_xact(udev->dman, xact,
-			   sizeof(xact) / sizeof(struct xact));
-	if (err) {
-		ZF_LOGE("USB %d: Not enough DMA memory!\n", udev->addr);
-		return;
-	}
-
-	/* Fill in the SETUP packet */
-	xact[0].type = PID_SETUP;
-	xact[1].type = PID_IN;
-	req = xact_get_vaddr(&xact[0]);
-	sdesc = (struct string_desc *)xact[1].vaddr;
-
-	/* Get language ID */
-	*req = __get_descriptor_req(STRING, 0, 0, sizeof(struct string_desc));
-	err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-
-	if (err < 0) {
-		ZF_LOGD("USB %d: USB request failed.\n", udev->addr);
-		usb_destroy_xact(udev->dman, xact, 2);
-		return;
-	}
-
-	lang = sdesc->bString[1] << 8 | sdesc->bString[0];
-
-	/* Get the string descriptor */
-	*req = __get_descriptor_req(STRING, index, lang,
-				 sizeof(struct string_desc));
-	err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-
-	if (err < 0) {
-		ZF_LOGD("USB %d: USB request failed.\n", udev->addr);
-		usb_destroy_xact(udev->dman, xact, 2);
-		return;
-	}
-
-	if (desc) {
-		memcpy(desc, sdesc, sdesc->bLength);
-	}
-	usb_destroy_xact(udev->dman, xact, 2);
-}
-
 static void print_dev(struct usb_dev *d)
 {
 	if (d) {
@@ -497,7 +426,7 @@ static void print_dev_graph(usb_t * host, struct usb_dev *d, int depth)
 		print_dev(d);
 	}
 	/* Search for connected devices */
-	for (i = 1; i < NUM_DEVICES; i++) {
+	for (i = 1; i < USB_NDEVICES; i++) {
 		struct usb_dev *d2;
 		d2 = devlist_at(host, i);
 		if (d2 && d2->hub == d) {
@@ -506,6 +435,28 @@ static void print_dev_graph(usb_t * host, struct usb_dev *d, int depth)
 	}
 }
 
+/*
+ * Find the endpoint a previous parse allocated for epaddr, so that it keeps
+ * its host controller state, and move it to slot cnt. Slots below cnt
+ * belong to the current parse.
+ */
+static struct endpoint *
+parse_config_reuse_ep(struct usb_dev *udev, int cnt, uint8_t epaddr)
+{
+	struct endpoint *ep;
+
+	for (int i = cnt; i < USB_MAX_EPS; i++) {
+		ep = udev->ep[i];
+		if (ep && ep->num == (epaddr & 0xF) &&
+		    ep->dir == (epaddr >> 0x7)) {
+			udev->ep[i] = udev->ep[cnt];
+			udev->ep[cnt] = ep;
+			return ep;
+		}
+	}
+	return NULL;
+}
+
 static int
 parse_config(struct usb_dev *udev, struct anon_desc *d, int tot_len,
 	     usb_config_cb cb, void *t)
@@ -520,6 +471,9 @@ parse_config(struct usb_dev *udev, struct anon_desc *d, int tot_len,
 	int err = 0;
 	int cnt = 0;
 
+	/* Rebuilt below, a previous parse must not leave entries behind */
+	memset(udev->ep_map, 0, sizeof(udev->ep_map));
+
 	/*
 	 * FIXME: Not all devices report the total length of its descriptors
 	 * correctly. We should always check the details of each descriptor.
@@ -559,9 +513,18 @@ parse_config(struct usb_dev *udev, struct anon_desc *d, int tot_len,
 			break;
 		case ENDPOINT:
 			edsc = (struct endpoint_desc *)usrd;
-			ep = usb_malloc(sizeof(struct endpoint));
+			if (cnt >= USB_MAX_EPS) {
+				ZF_LOGW("USB: Too many endpoints\n");
+				break;
+			}
+			/* Parsed before, keep the host controller state */
+			ep = parse_config_reuse_ep(udev, cnt,
+						   edsc->bEndpointAddress);
 			if (!ep) {
-				ZF_LOGF("Out of memory\n");
+				ep = usb_malloc(sizeof(struct endpoint));
+				if (!ep) {
+					ZF_LOGF("Out of memory\n");
+				}
 			}
 
 			/* Fill in the endpoint structure, USB standard(9.6.6) */
@@ -572,6 +535,15 @@ parse_config(struct usb_dev *udev, struct anon_desc *d, int tot_len,
 			ep->interval = edsc->bInterval;
 
 			udev->ep[cnt++] = ep;
+			udev->ep_map[USB_EP_INDEX(edsc->bEndpointAddress)] = ep;
+			break;
+		case SS_ENDPOINT_COMPANION:
+			/* Follows the endpoint it describes */
+			if (cnt > 0) {
+				udev->ep[cnt - 1]->max_burst =
+				    ((struct ss_ep_companion_desc *)
+				     usrd)->bMaxBurst;
+			}
 			break;
 		default:
 			break;
@@ -596,18 +568,305 @@ parse_config(struct usb_dev *udev, struct anon_desc *d, int tot_len,
 	return err;
 }
 
+/**** Enumeration ****/
+
+/*
+ * Enumeration is split in two. Address assignment talks to address 0, which
+ * every freshly reset device answers to, so it is always done synchronously
+ * and one device at a time. The descriptors that follow are fetched with a
+ * small state machine, which runs either synchronously or from transfer
+ * completions, so that a hub can reset and address its next port while the
+ * previous devices are still being read.
+ *
+ * An enumeration that finishes in a transfer completion is not wrapped up
+ * there: releasing a failed device cancels the very control endpoint that is
+ * completing, and the caller's call back may issue synchronous requests. It
+ * is queued on the host instead and finished by usb_handle_irq once the
+ * host controller is done with its completions.
+ */
+enum usb_enum_state {
+	ENUM_DEVICE_DESC,
+	ENUM_LANG,
+	ENUM_MANUFACTURER,
+	ENUM_PRODUCT,
+	ENUM_DONE
+};
+
+struct usb_enum {
+	struct usb_dev *udev;
+	/* One request/response pair for the whole enumeration */
+	struct xact xact[2];
+	enum usb_enum_state state;
+	int lang;
+	uint8_t iManufacturer;
+	uint8_t iProduct;
+	struct string_desc manufacturer;
+	struct string_desc product;
+	/* NULL for synchronous enumeration */
+	usb_enum_cb_t cb;
+	void *token;
+	/* Waiting to be finished by usb_handle_irq */
+	int err;
+	struct usb_enum *next;
+};
+
+static int usb_enum_cb(void *token, enum usb_xact_status stat, int rbytes);
+
+/* Send the request of the current state */
+static int usb_enum_submit(struct usb_enum *e)
+{
+	struct usbreq *req = xact_get_vaddr(&e->xact[0]);
+	int len = sizeof(struct string_desc);
+
+	switch (e->state) {
+	case ENUM_DEVICE_DESC:
+		len = sizeof(struct device_desc);
+		*req = __new_desc_req(DEVICE, len);
+		break;
+	case ENUM_LANG:
+		*req = __get_descriptor_req(STRING, 0, 0, len);
+		break;
+	case ENUM_MANUFACTURER:
+		*req = __get_descriptor_req(STRING, e->iManufacturer, e->lang, len);
+		break;
+	case ENUM_PRODUCT:
+		*req = __get_descriptor_req(STRING, e->iProduct, e->lang, len);
+		break;
+	default:
+		ZF_LOGF("USB: Invalid enumeration state\n");
+	}
+	e->xact[1].len = len;
+
+	return usbdev_schedule_xact(e->udev, e->udev->ep_ctrl, e->xact, 2,
+				    e->cb ? usb_enum_cb : NULL, e);
+}
+
+/*
+ * Consume the response of the current state and move on.
+ * @return 0 if there is more to fetch, 1 when done, -1 on failure.
+ */
+static int usb_enum_advance(struct usb_enum *e, int ok)
+{
+	struct device_desc *d_desc;
+	struct string_desc *sdesc;
+	struct usb_dev *udev = e->udev;
+
+	switch (e->state) {
+	case ENUM_DEVICE_DESC:
+		if (!ok) {
+			return -1;
+		}
+		d_desc = xact_get_vaddr(&e->xact[1]);
+		udev->prod_id = d_desc->idProduct;
+		udev->vend_id = d_desc->idVendor;
+		udev->class = d_desc->bDeviceClass;
+		e->iManufacturer = d_desc->iManufacturer;
+		e->iProduct = d_desc->iProduct;
+		if (e->iManufacturer || e->iProduct) {
+			e->state = ENUM_LANG;
+		} else {
+			e->state = ENUM_DONE;
+		}
+		break;
+	case ENUM_LANG:
+		/* Strings are informational only */
+		if (!ok) {
+			ZF_LOGD("USB %d: USB request failed.\n", udev->addr);
+			e->state = ENUM_DONE;
+			break;
+		}
+		sdesc = xact_get_vaddr(&e->xact[1]);
+		e->lang = sdesc->bString[1] << 8 | sdesc->bString[0];
+		e->state = e->iManufacturer ? ENUM_MANUFACTURER : ENUM_PRODUCT;
+		break;
+	case ENUM_MANUFACTURER:
+		sdesc = xact_get_vaddr(&e->xact[1]);
+		if (ok) {
+			memcpy(&e->manufacturer, sdesc, sdesc->bLength);
+		}
+		e->state = e->iProduct ? ENUM_PRODUCT : ENUM_DONE;
+		break;
+	case ENUM_PRODUCT:
+		sdesc = xact_get_vaddr(&e->xact[1]);
+		if (ok) {
+			memcpy(&e->product, sdesc, sdesc->bLength);
+		}
+		e->state = ENUM_DONE;
+		break;
+	default:
+		ZF_LOGF("USB: Invalid enumeration state\n");
+	}
+
+	return e->state == ENUM_DONE;
+}
+
+static struct usb_dev *usb_enum_finish(struct usb_enum *e, int err)
+{
+	struct usb_dev *udev = e->udev;
+
+	usb_destroy_xact(udev->dman, e->xact, 2);
+	if (err) {
+		ZF_LOGE("USB %d: Failed to read the device descriptor\n",
+			udev->addr);
+		usbdev_disconnect(udev);
+		udev = NULL;
+	} else {
+		printf("USB %d: idVendor  0x%04x | ", udev->addr, udev->vend_id);
+		print_string_desc(&e->manufacturer);
+		printf("USB %d: idProduct 0x%04x | ", udev->addr, udev->prod_id);
+		print_string_desc(&e->product);
+	}
+
+	if (e->cb) {
+		e->cb(e->token, udev);
+	}
+	usb_free(e);
+	return udev;
+}
+
+/* Queue a finished enumeration, in completion order */
+static void usb_enum_defer(struct usb_enum *e, int err)
+{
+	struct usb_enum **p = &e->udev->host->enum_done;
+
+	while (*p) {
+		p = &(*p)->next;
+	}
+	e->err = err;
+	e->next = NULL;
+	*p = e;
+}
+
+/* Finish the enumerations that completed during the last interrupt */
+static void usb_enum_reap(usb_t *host)
+{
+	struct usb_enum *e;
+
+	while (host->enum_done) {
+		e = host->enum_done;
+		host->enum_done = e->next;
+		usb_enum_finish(e, e->err);
+	}
+}
+
+static int usb_enum_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+	struct usb_enum *e = (struct usb_enum *)token;
+	int ret;
+
+	ret = usb_enum_advance(e, stat == XACTSTAT_SUCCESS);
+	if (ret == 0 && usb_enum_submit(e) < 0) {
+		ret = -1;
+	}
+	if (ret) {
+		usb_enum_defer(e, ret < 0);
+	}
+
+	return 0;
+}
+
+/* Bring the device from the default state to the addressed state */
+static int usb_enum_address(struct usb_enum *e)
+{
+	struct usb_dev *udev = e->udev;
+	struct device_desc *d_desc;
+	struct usbreq *req;
+	int addr;
+	int err;
+
+	req = xact_get_vaddr(&e->xact[0]);
+	d_desc = xact_get_vaddr(&e->xact[1]);
+
+	/* USB transactions are O(n) when trying to bind a driver.
+	 * This is a good time to at least cache
+	 * a) Max packet size for EP 0
+	 * b) product and vendor ID
+	 * c) device class
+	 */
+	ZF_LOGD("USB: Determining maximum packet size on the control endpoint\n");
+	/*
+	 * We need the value of bMaxPacketSize in order to request
+	 * the bMaxPacketSize. A work around to this circular
+	 * dependency is to set the maximum packet size to 8 and
+	 * limit the size of our packets to prevent splitting until
+	 * we know what the correct value is NOTE: High speed
+	 * devices must always have a MaxPacketSize of 64 on the
+	 * control endpoint (see USB spec) but we do not consider
+	 * special cases.
+	 */
+	e->xact[1].len = 8;
+	*req = __new_desc_req(DEVICE, 8);
+	err = usbdev_schedule_xact(udev, udev->ep_ctrl, e->xact, 2, NULL, NULL);
+	if (err < 0) {
+		ZF_LOGE("USB: Transaction error");
+		return -1;
+	}
+
+	/* SuperSpeed devices report an exponent */
+	if (udev->speed == USBSPEED_SUPER) {
+		udev->ep_ctrl->max_pkt = 1 << d_desc->bMaxPacketSize0;
+	} else {
+		udev->ep_ctrl->max_pkt = d_desc->bMaxPacketSize0;
+	}
+
+	/* Find the next available address */
+	addr = devlist_insert(udev);
+	if (addr < 0) {
+		ZF_LOGE("USB: Too many devices\n");
+		return -1;
+	}
+
+	/* Set the address */
+	*req = __new_address_req(addr);
+	ZF_LOGD("USB: Setting address to %d\n", addr);
+	err = usbdev_schedule_xact(udev, udev->ep_ctrl, e->xact, 1, NULL, NULL);
+	if (err < 0) {
+		devlist_remove(udev, addr);
+		return -1;
+	}
+
+	/* Device has 2ms to start responding to new address */
+	ps_mdelay(2);
+	udev->addr = addr;
+
+	return 0;
+}
+
+/* Describe the position of a device for the host controller */
+static void usb_dev_route(struct usb_dev *udev, struct usb_route *r)
+{
+	struct usb_dev *d = udev;
+	usb_hub_t h;
+
+	r->route = 0;
+	/* Devices on a root port have the emulated root hub as parent */
+	while (d->hub && d->hub->hub) {
+		r->route = (r->route << 4) | MIN(d->port, 15);
+		d = d->hub;
+	}
+	r->root_port = d->port;
+	r->hub_addr = udev->hub->hub ? udev->hub->addr : 0;
+	r->hub_nports = 0;
+	h = (usb_hub_t)udev->hub->dev_data;
+	if (r->hub_addr && h) {
+		r->hub_nports = h->nports;
+	}
+	r->tt_addr = udev->tt_addr;
+	r->tt_port = udev->tt_port;
+	r->speed = udev->speed;
+}
+
 static int
 usb_new_device_with_host(struct usb_dev *hub, usb_t * host, int port,
-			 enum usb_speed speed, struct usb_dev **d)
+			 enum usb_speed speed, usb_enum_cb_t cb, void *token,
+			 struct usb_dev **d)
 {
 	struct usb_dev *udev = NULL;
 	struct usb_dev *parent = NULL, *child = NULL;
-	struct usbreq *req;
-	struct device_desc *d_desc;
-	struct string_desc s_desc;
-	struct xact xact[2];
-	int addr = 0;
+	struct usb_route route;
+	struct usb_enum *e;
 	int err;
+	int ret;
 
 	ZF_LOGD("USB: New USB device!\n");
 	udev = (struct usb_dev*)usb_malloc(sizeof(*udev));
@@ -631,7 +890,7 @@ usb_new_device_with_host(struct usb_dev *hub, usb_t * host, int port,
 	 * Work out the TT hub for full/low speed devices.
 	 * Assuming all high speed hubs have TT.
 	 */
-	if (speed != USBSPEED_HIGH) {
+	if (speed == USBSPEED_LOW || speed == USBSPEED_FULL) {
 		parent = hub;
 		child = udev;
 		while (parent) {
@@ -649,8 +908,8 @@ usb_new_device_with_host(struct usb_dev *hub, usb_t * host, int port,
 	/*
 	 * Allocate control endpoint
 	 * Every device should have one control endpoint, the endpoint number is
-	 * always zero and we initialize the maximum packet size to 8 for sending
-	 * the very first request.
+	 * always zero and we initialize the maximum packet size to the smallest
+	 * allowed for the speed, for sending the very first request.
 	 */
 	udev->ep_ctrl = (struct endpoint *)usb_malloc(sizeof(struct endpoint));
 	if (!udev->ep_ctrl) {
@@ -661,110 +920,85 @@ usb_new_device_with_host(struct usb_dev *hub, usb_t * host, int port,
 	}
 	udev->ep_ctrl->type = EP_CONTROL;
 	udev->ep_ctrl->num = 0;
-	udev->ep_ctrl->max_pkt = 8;
-
-	xact[0].type = PID_SETUP;
-	xact[0].len = sizeof(*req);
-	xact[1].type = PID_IN;
-	xact[1].len = sizeof(*d_desc);
-	err = usb_alloc_xact(udev->dman, xact, 2);
-	if (err) {
-		ZF_LOGE("USB: No DMA memory for new USB device\n");
-		usb_free(udev);
-		udev = NULL;
-		return -1;
+	switch (speed) {
+	case USBSPEED_SUPER:
+		udev->ep_ctrl->max_pkt = 512;
+		break;
+	case USBSPEED_HIGH:
+		udev->ep_ctrl->max_pkt = 64;
+		break;
+	default:
+		udev->ep_ctrl->max_pkt = 8;
+		break;
 	}
-	req = xact_get_vaddr(&xact[0]);
-	d_desc = xact_get_vaddr(&xact[1]);
 
-	/* USB transactions are O(n) when trying to bind a driver.
-	 * This is a good time to at least cache
-	 * a) Max packet size for EP 0
-	 * b) product and vendor ID
-	 * c) device class
-	 */
-	ZF_LOGD("USB: Determining maximum packet size on the control endpoint\n");
-	/*
-	 * We need the value of bMaxPacketSize in order to request
-	 * the bMaxPacketSize. A work around to this circular
-	 * dependency is to set the maximum packet size to 8 and
-	 * limit the size of our packets to prevent splitting until
-	 * we know what the correct value is NOTE: High speed
-	 * devices must always have a MaxPacketSize of 64 on the
-	 * control endpoint (see USB spec) but we do not consider
-	 * special cases.
-	 */
-	xact[1].len = 8;
-	*req = __new_desc_req(DEVICE, 8);
-	err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-	if (err < 0) {
-		usb_destroy_xact(udev->dman, xact, 2);
+	e = (struct usb_enum *)usb_malloc(sizeof(*e));
+	if (!e) {
+		ZF_LOGE("USB: No heap memory for new USB device\n");
+		usb_free(udev->ep_ctrl);
 		usb_free(udev);
-		udev = NULL;
-		ZF_LOGE("USB: Transaction error");
 		return -1;
 	}
-
-	udev->ep_ctrl->max_pkt = d_desc->bMaxPacketSize0;
-
-	/* Find the next available address */
-	addr = devlist_insert(udev);
-	if (addr < 0) {
-		ZF_LOGE("USB: Too many devices\n");
-		usb_destroy_xact(udev->dman, xact,
-				 sizeof(xact) / sizeof(*xact));
+	e->udev = udev;
+	e->state = ENUM_DEVICE_DESC;
+	e->cb = cb;
+	e->token = token;
+
+	e->xact[0].type = PID_SETUP;
+	e->xact[0].len = sizeof(struct usbreq);
+	e->xact[1].type = PID_IN;
+	e->xact[1].len = MAX(sizeof(struct device_desc), sizeof(struct string_desc));
+	err = usb_alloc_xact(udev->dman, e->xact, 2);
+	if (err) {
+		ZF_LOGE("USB: No DMA memory for new USB device\n");
+		usb_free(e);
+		usb_free(udev->ep_ctrl);
 		usb_free(udev);
 		udev = NULL;
 		return -1;
 	}
 
-	/* Set the address */
-	*req = __new_address_req(addr);
-	ZF_LOGD("USB: Setting address to %d\n", addr);
-	err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 1, NULL, NULL);
-	if (err < 0) {
-		usb_destroy_xact(udev->dman, xact, 2);
+	/* Controllers that track devices need to know where this one is */
+	err = 0;
+	if (hub && host->hdev.dev_attach) {
+		usb_dev_route(udev, &route);
+		err = host->hdev.dev_attach(&host->hdev, &route);
+	}
+	if (!err) {
+		err = usb_enum_address(e);
+		if (err && hub && host->hdev.dev_detach) {
+			host->hdev.dev_detach(&host->hdev, 0);
+		}
+	}
+	if (err) {
+		usb_destroy_xact(udev->dman, e->xact, 2);
+		usb_free(e);
+		usb_free(udev->ep_ctrl);
 		usb_free(udev);
 		udev = NULL;
 		return -1;
 	}
 
-	/* Device has 2ms to start responding to new address */
-	ps_mdelay(2);
-	udev->addr = addr;
-
 	/* All settled, start processing standard USB descriptors */
 	ZF_LOGD("USB %d: Retrieving device descriptor\n", udev->addr);
-	xact[1].len = sizeof(*d_desc);
-	*req = __new_desc_req(DEVICE, sizeof(*d_desc));
-	err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-	if (err < 0) {
-		usb_destroy_xact(udev->dman, xact, 2);
-		usb_free(udev);
-		udev = NULL;
-		return -1;
+	if (cb) {
+		/* The rest is driven by transfer completions */
+		if (usb_enum_submit(e) < 0) {
+			usb_enum_finish(e, 1);
+		}
+		return 0;
 	}
 
-	udev->prod_id = d_desc->idProduct;
-	udev->vend_id = d_desc->idVendor;
-	udev->class = d_desc->bDeviceClass;
-	printf("USB %d: idVendor  0x%04x | ", udev->addr, udev->vend_id);
-	if (d_desc->iManufacturer) {
-		usb_get_string_desc(udev, d_desc->iManufacturer, &s_desc);
-		print_string_desc(&s_desc);
-	} else {
-		printf("\n");
-	}
-	printf("USB %d: idProduct 0x%04x | ", udev->addr, udev->prod_id);
-	if (d_desc->iProduct) {
-		usb_get_string_desc(udev, d_desc->iProduct, &s_desc);
-		print_string_desc(&s_desc);
-	} else {
-		printf("\n");
-	}
+	do {
+		err = usb_enum_submit(e);
+		ret = usb_enum_advance(e, err >= 0);
+	} while (ret == 0);
 
+	udev = usb_enum_finish(e, ret < 0);
+	if (!udev) {
+		return -1;
+	}
 	*d = udev;
-	usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
 
 	return 0;
 }
@@ -791,7 +1025,7 @@ usb_init(enum usb_host_id id, ps_io_ops_t * ioops, ps_mutex_ops_t * sync,
 		ZF_LOGE("USB: Platform error\n");
 		return -1;
 	}
-	err = usb_new_device_with_host(NULL, host, 1, 0, &udev);
+	err = usb_new_device_with_host(NULL, host, 1, 0, NULL, NULL, &udev);
 	if (err) {
 		ZF_LOGE("USB: Host error\n");
 		return -1;
@@ -808,12 +1042,23 @@ usb_init(enum usb_host_id id, ps_io_ops_t * ioops, ps_mutex_ops_t * sync,
 
 int usb_new_device(usb_dev_t *hub, int port, enum usb_speed speed, usb_dev_t **d)
 {
-	return usb_new_device_with_host(hub, hub->host, port, speed, d);
+	return usb_new_device_with_host(hub, hub->host, port, speed, NULL, NULL,
+					d);
+}
+
+int usb_new_device_async(usb_dev_t *hub, int port, enum usb_speed speed,
+			 usb_enum_cb_t cb, void *token)
+{
+	if (!hub || !cb) {
+		ZF_LOGF("USB: Invalid arguments\n");
+	}
+	return usb_new_device_with_host(hub, hub->host, port, speed, cb, token,
+					NULL);
 }
 
 usb_dev_t *usb_get_device(usb_t * host, int addr)
 {
-	if (addr <= 0 || addr >= NUM_DEVICES) {
+	if (addr <= 0 || addr >= USB_NDEVICES) {
 		return NULL;
 	} else {
 		return devlist_at(host, addr);
@@ -918,7 +1163,7 @@ void usbdev_disconnect(usb_dev_t *udev)
 	err = hdev->cancel_xact(hdev, udev->ep_ctrl);
 
 	/* Remove all other endpoints */
-	while (udev->ep[cnt] && cnt < USB_MAX_EPS) {
+	while (cnt < USB_MAX_EPS && udev->ep[cnt]) {
 		err = hdev->cancel_xact(hdev, udev->ep[cnt]);
 		cnt++;
 	}
@@ -928,9 +1173,13 @@ void usbdev_disconnect(usb_dev_t *udev)
 			udev->addr);
 	}
 
-	(void)hdev;
-	devlist_remove(udev);
+	if (udev->hub && hdev->dev_detach) {
+		hdev->dev_detach(hdev, udev->addr);
+	}
+	devlist_remove(udev, udev->addr);
+	udev->addr = -1;
 	/* destroy it */
+	memset(udev->ep_map, 0, sizeof(udev->ep_map));
 	usb_free(udev->ep_ctrl);
 	for (int i = 0; i < USB_MAX_EPS; i++) {
 		if (udev->ep[i]) {
@@ -950,6 +1199,9 @@ void usb_handle_irq(usb_t *host)
 
 	hdev = &host->hdev;
 	hdev->handle_irq(hdev);
+
+	/* Outside of any transfer completion */
+	usb_enum_reap(host);
 }
 
 int
@@ -970,19 +1222,75 @@ usbdev_schedule_xact(usb_dev_t *udev, struct endpoint *ep, struct xact *xact,
 	} else {
 		hub_addr = -1;
 	}
+	/* The emulated root hub is not captured */
+	if (udev->hub) {
+		usbmon_submit(hdev, udev->addr, ep, xact, nxact, 0);
+	}
 	err =
 	    usb_hcd_schedule(hdev, udev->addr, hub_addr, udev->tt_port,
 			     udev->speed, ep, xact, nxact, cb, token);
+	if (err < 0 && udev->hub) {
+		usbmon_submit(hdev, udev->addr, ep, xact, nxact, err);
+	}
 	return err;
 }
 
+int
+usbdev_iso_start(usb_dev_t *udev, struct endpoint *ep, int nslots,
+		 usb_iso_cb_t cb, void *token)
+{
+	usb_host_t *hdev;
+	uint8_t hub_addr;
+
+	if (!udev || !ep || !cb) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+
+	hdev = &udev->host->hdev;
+	if (!hdev->iso_start) {
+		ZF_LOGE("Isochronous transfer not supported\n");
+		return -1;
+	}
+	if (udev->hub) {
+		hub_addr = udev->tt_addr;
+	} else {
+		hub_addr = -1;
+	}
+	return hdev->iso_start(hdev, udev->addr, hub_addr, udev->tt_port,
+			       udev->speed, ep, nslots, cb, token);
+}
+
+int usbdev_iso_stop(usb_dev_t *udev, struct endpoint *ep)
+{
+	usb_host_t *hdev;
+
+	if (!udev || !ep) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+
+	hdev = &udev->host->hdev;
+	return hdev->cancel_xact(hdev, ep);
+}
+
+struct endpoint *usbdev_get_endpoint(usb_dev_t *udev, uint8_t epaddr)
+{
+	if (!udev) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+
+	if ((epaddr & 0xf) == 0) {
+		return udev->ep_ctrl;
+	}
+	return udev->ep_map[USB_EP_INDEX(epaddr)];
+}
+
 void usb_lsusb(usb_t * host, int v)
 {
 	int i;
 	printf("\n");
 	if (v == 0) {
 		/* Print a simple list */
-		for (i = 1; i < NUM_DEVICES; i++) {
+		for (i = 1; i < USB_NDEVICES; i++) {
 			struct usb_dev *d = devlist_at(host, i);
 			print_dev(d);
 		}
@@ -993,7 +1301,7 @@ void usb_lsusb(usb_t * host, int v)
 	/* Print out all the configs */
 	if (v > 1) {
 		printf("\n");
-		for (i = 1; i < NUM_DEVICES; i++) {
+		for (i = 1; i < USB_NDEVICES; i++) {
 			struct usb_dev *d = devlist_at(host, i);
 			if (d) {
 				print_dev(d);
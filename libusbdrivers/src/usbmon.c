@@ -0,0 +1,248 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @brief Transfer capture into a shared memory ring
+ */
+#include <string.h>
+
+#include <usb/usbmon.h>
+#include "services.h"
+#include "usbmon.h"
+
+/* Status codes, as Linux usbmon reports them */
+#define MON_EINPROGRESS   (-115)
+#define MON_ECONNRESET    (-104)
+#define MON_EPROTO        (-71)
+#define MON_EIO           (-5)
+
+struct usbmon {
+	struct usbmon_ring *ring;
+	uint32_t mask;
+	uint16_t busnum;
+	usbmon_clock_t clock;
+	void *cookie;
+};
+
+static uint8_t usbmon_xfer_type(struct endpoint *ep)
+{
+	switch (ep->type) {
+	case EP_CONTROL:
+		return USBMON_XFER_CTRL;
+	case EP_ISOCHRONOUS:
+		return USBMON_XFER_ISO;
+	case EP_BULK:
+		return USBMON_XFER_BULK;
+	default:
+		return USBMON_XFER_INTR;
+	}
+}
+
+static int32_t usbmon_status(enum usb_xact_status stat)
+{
+	switch (stat) {
+	case XACTSTAT_SUCCESS:
+		return 0;
+	case XACTSTAT_PENDING:
+		return MON_EINPROGRESS;
+	case XACTSTAT_CANCELLED:
+		return MON_ECONNRESET;
+	default:
+		return MON_EPROTO;
+	}
+}
+
+/*
+ * Claim the next record. Writers never wait, the oldest record is simply
+ * overwritten. The sequence number is cleared first so that a reader can
+ * tell a record that is being rewritten.
+ */
+static struct usbmon_record *usbmon_reserve(struct usbmon *mon, uint32_t *seq)
+{
+	struct usbmon_record *rec;
+	uint32_t idx;
+
+	idx = __atomic_fetch_add(&mon->ring->head, 1, __ATOMIC_RELAXED);
+	rec = &mon->ring->rec[idx & mon->mask];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	*seq = idx + 1;
+	return rec;
+}
+
+static void usbmon_commit(struct usbmon_record *rec, uint32_t seq)
+{
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+static void usbmon_fill(struct usbmon *mon, struct usbmon_record *rec,
+			uint8_t event, uint8_t addr, struct usbmon_xfer *x)
+{
+	rec->event = event;
+	rec->xfer_type = x->type;
+	rec->epnum = x->epnum;
+	rec->devnum = addr;
+	rec->busnum = mon->busnum;
+	rec->id = x->id;
+	rec->ts_ns = mon->clock ? mon->clock(mon->cookie) : 0;
+	rec->flag_setup = '-';
+	rec->len_cap = 0;
+}
+
+static void usbmon_capture(struct usbmon_record *rec, void *data, int len)
+{
+	if (data && len > 0) {
+		rec->len_cap = MIN(len, USBMON_DATA_LEN);
+		memcpy(rec->data, data, rec->len_cap);
+	}
+	rec->flag_data = 0;
+}
+
+void usbmon_xfer_init(struct usbmon_xfer *x, uint8_t addr, struct endpoint *ep,
+		      struct xact *xact, int nxact)
+{
+	int i;
+
+	x->id = xact[0].paddr;
+	x->addr = addr;
+	x->type = usbmon_xfer_type(ep);
+	x->epnum = ep->num;
+	x->data = NULL;
+	x->len = 0;
+
+	/* The data stage is whatever follows the SETUP packet */
+	for (i = 0; i < nxact; i++) {
+		if (xact[i].type != PID_SETUP) {
+			x->data = xact_get_vaddr(&xact[i]);
+			x->len = xact[i].len;
+			if (xact[i].type == PID_IN) {
+				x->epnum |= 0x80;
+			}
+			break;
+		}
+	}
+	if (ep->type != EP_CONTROL && ep->dir == EP_DIR_IN) {
+		x->epnum |= 0x80;
+	}
+	x->captured = 1;
+}
+
+void __usbmon_submit(usb_host_t *hdev, uint8_t addr, struct endpoint *ep,
+		     struct xact *xact, int nxact, int err)
+{
+	struct usbmon *mon = hdev->mon;
+	struct usbmon_record *rec;
+	struct usbmon_xfer x;
+	uint32_t seq;
+
+	usbmon_xfer_init(&x, addr, ep, xact, nxact);
+
+	rec = usbmon_reserve(mon, &seq);
+	usbmon_fill(mon, rec, err ? USBMON_ERROR : USBMON_SUBMIT, addr, &x);
+	rec->status = err ? MON_EIO : MON_EINPROGRESS;
+	rec->length = x.len;
+	if (xact[0].type == PID_SETUP) {
+		rec->flag_setup = 0;
+		memcpy(rec->setup, xact_get_vaddr(&xact[0]), sizeof(rec->setup));
+	}
+
+	/* OUT data is recorded on the way out, IN data on the way back */
+	if (x.epnum & 0x80) {
+		rec->flag_data = '<';
+	} else {
+		usbmon_capture(rec, x.data, x.len);
+	}
+	usbmon_commit(rec, seq);
+}
+
+void __usbmon_complete(usb_host_t *hdev, struct usbmon_xfer *x,
+		       enum usb_xact_status stat, int rbytes)
+{
+	struct usbmon *mon = hdev->mon;
+	struct usbmon_record *rec;
+	uint32_t seq;
+	int len;
+
+	if (stat == XACTSTAT_SUCCESS) {
+		len = MAX(x->len - rbytes, 0);
+	} else {
+		len = 0;
+	}
+
+	rec = usbmon_reserve(mon, &seq);
+	usbmon_fill(mon, rec, USBMON_COMPLETE, x->addr, x);
+	rec->status = usbmon_status(stat);
+	rec->length = len;
+	if (x->epnum & 0x80) {
+		usbmon_capture(rec, x->data, len);
+	} else {
+		rec->flag_data = '>';
+	}
+	usbmon_commit(rec, seq);
+}
+
+int usbmon_start(usb_t *host, void *mem, size_t size,
+		 usbmon_clock_t clock, void *cookie)
+{
+	struct usbmon_ring *ring = (struct usbmon_ring *)mem;
+	struct usbmon *mon;
+	uint32_t n;
+
+	if (!host || !mem) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+	if (size < sizeof(*ring) + sizeof(struct usbmon_record)) {
+		ZF_LOGE("Capture ring too small\n");
+		return -1;
+	}
+	if (host->hdev.mon) {
+		ZF_LOGE("Capture already running\n");
+		return -1;
+	}
+
+	/* Largest power of two number of records that fits */
+	n = (size - sizeof(*ring)) / sizeof(struct usbmon_record);
+	while (n & (n - 1)) {
+		n &= n - 1;
+	}
+
+	mon = usb_malloc(sizeof(*mon));
+	if (!mon) {
+		ZF_LOGE("Out of memory\n");
+		return -1;
+	}
+
+	memset(ring, 0, sizeof(*ring) + n * sizeof(struct usbmon_record));
+	ring->magic = USBMON_MAGIC;
+	ring->version = USBMON_VERSION;
+	ring->record_size = sizeof(struct usbmon_record);
+	ring->nrecords = n;
+
+	mon->ring = ring;
+	mon->mask = n - 1;
+	mon->busnum = host->hdev.id + 1;
+	mon->clock = clock;
+	mon->cookie = cookie;
+
+	__atomic_store_n(&host->hdev.mon, mon, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void usbmon_stop(usb_t *host)
+{
+	struct usbmon *mon;
+
+	if (!host) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+
+	mon = __atomic_exchange_n(&host->hdev.mon, NULL, __ATOMIC_ACQ_REL);
+	if (mon) {
+		usb_free(mon);
+	}
+}
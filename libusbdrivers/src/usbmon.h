@@ -0,0 +1,48 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <usb/usb_host.h>
+#include <usb/usbmon_ring.h>
+
+/*
+ * What the host controller keeps of a transfer, so that the completion can
+ * be recorded without the caller's xact array.
+ */
+struct usbmon_xfer {
+	uintptr_t id;
+	uint8_t addr;		//Device address
+	void *data;		//Data stage buffer
+	int len;		//Data stage length
+	uint8_t epnum;		//Endpoint number, bit 7 set for IN
+	uint8_t type;		//USBMON_XFER_*
+	uint8_t captured;	//Submission was recorded
+};
+
+void usbmon_xfer_init(struct usbmon_xfer *x, uint8_t addr, struct endpoint *ep,
+		      struct xact *xact, int nxact);
+void __usbmon_submit(usb_host_t *hdev, uint8_t addr, struct endpoint *ep,
+		     struct xact *xact, int nxact, int err);
+void __usbmon_complete(usb_host_t *hdev, struct usbmon_xfer *x,
+		       enum usb_xact_status stat, int rbytes);
+
+/* Capture hooks, cheap when capture is off */
+static inline void usbmon_submit(usb_host_t *hdev, uint8_t addr,
+				 struct endpoint *ep, struct xact *xact,
+				 int nxact, int err)
+{
+	if (hdev->mon) {
+		__usbmon_submit(hdev, addr, ep, xact, nxact, err);
+	}
+}
+
+static inline void usbmon_complete(usb_host_t *hdev, struct usbmon_xfer *x,
+				   enum usb_xact_status stat, int rbytes)
+{
+	if (hdev->mon && x->captured) {
+		__usbmon_complete(hdev, x, stat, rbytes);
+	}
+}
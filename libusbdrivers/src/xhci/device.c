@@ -0,0 +1,990 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @brief xHCI device slots, endpoints and transfers.
+ *
+ * The controller owns device addresses. A device is given a slot when the
+ * core attaches it, and stays in the default state until the core sends
+ * SET_ADDRESS, which is turned into an Address Device command. The address
+ * the core picked is only used to find the slot.
+ *
+ * Bulk streams(xHCI 4.12) are not supported. Endpoint contexts always have
+ * MaxPStreams of 0, so every endpoint has a single transfer ring and UAS
+ * devices have to be used through their bulk-only interface.
+ */
+#include "../services.h"
+#include "xhci.h"
+
+#define XHCI_TRB_MAX_LEN       0x10000
+
+/*****************
+ **** Helpers ****
+ *****************/
+
+static int xhci_speed_id(enum usb_speed speed)
+{
+	switch (speed) {
+	case USBSPEED_LOW:
+		return XHCI_SPEED_LOW;
+	case USBSPEED_FULL:
+		return XHCI_SPEED_FULL;
+	case USBSPEED_HIGH:
+		return XHCI_SPEED_HIGH;
+	default:
+		return XHCI_SPEED_SUPER;
+	}
+}
+
+static int xhci_ep_dci(struct endpoint *ep)
+{
+	if (ep->type == EP_CONTROL) {
+		return XHCI_DCI(ep->num, 1);
+	}
+	return XHCI_DCI(ep->num, ep->dir == EP_DIR_IN);
+}
+
+/*
+ * Endpoint service interval as an exponent of 125us(xHCI 6.2.3.6). Full and
+ * low speed interrupt endpoints give it in frames, everything else already
+ * as an exponent.
+ */
+static int xhci_ep_interval(enum usb_speed speed, struct endpoint *ep)
+{
+	int interval;
+
+	if (ep->type == EP_CONTROL || ep->type == EP_BULK) {
+		return 0;
+	}
+
+	if (speed == USBSPEED_HIGH || speed == USBSPEED_SUPER) {
+		interval = MAX(ep->interval, 1) - 1;
+	} else if (ep->type == EP_ISOCHRONOUS) {
+		interval = MAX(ep->interval, 1) + 2;
+	} else {
+		interval = 3;
+		while (interval < 10 && (1 << (interval - 2)) <= ep->interval) {
+			interval++;
+		}
+	}
+
+	return MIN(interval, 15);
+}
+
+/* Input control context with nothing added or dropped */
+static volatile struct xhci_input_ctrl_ctx *
+xhci_input_reset(struct xhci_host *xhci, struct xhci_dev *xdev)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+
+	icc = xhci_ctx(xhci, xdev->in_ctx, 0);
+	icc->drop = 0;
+	icc->add = 0;
+
+	return icc;
+}
+
+/* Fill the input slot context from what is known about the device */
+static void xhci_input_slot(struct xhci_host *xhci, struct xhci_dev *xdev)
+{
+	volatile struct xhci_slot_ctx *sctx;
+	struct xhci_dev *tt;
+	int entries;
+
+	for (entries = XHCI_MAX_DCI; entries > 1; entries--) {
+		if (xdev->eps[entries]) {
+			break;
+		}
+	}
+
+	sctx = xhci_ctx(xhci, xdev->in_ctx, 1);
+	memset((void *)sctx, 0, sizeof(*sctx));
+	sctx->info0 = SLOTCTX0_ROUTE(xdev->route.route) |
+	    SLOTCTX0_SPEED(xhci_speed_id(xdev->speed)) |
+	    SLOTCTX0_ENTRIES(entries);
+	sctx->info1 = SLOTCTX1_ROOT_PORT(xdev->route.root_port);
+	if (xdev->is_hub) {
+		sctx->info0 |= SLOTCTX0_HUB;
+		sctx->info1 |= SLOTCTX1_NPORTS(xdev->nports);
+	}
+
+	/* Full and low speed devices behind a high speed hub */
+	if ((xdev->speed == USBSPEED_LOW || xdev->speed == USBSPEED_FULL) &&
+	    xdev->route.route && xdev->route.tt_addr) {
+		tt = xhci->devs[xdev->route.tt_addr];
+		if (tt) {
+			sctx->tt = SLOTCTX2_TT_SLOT(tt->slot) |
+			    SLOTCTX2_TT_PORT(xdev->route.tt_port);
+		}
+	}
+}
+
+static void xhci_input_ep0(struct xhci_host *xhci, struct xhci_dev *xdev,
+			   struct xhci_ep *xep)
+{
+	volatile struct xhci_ep_ctx *ectx;
+	uintptr_t deq = xhci_ring_ptr(&xep->ring);
+
+	ectx = xhci_ctx(xhci, xdev->in_ctx, 2);
+	memset((void *)ectx, 0, sizeof(*ectx));
+	ectx->info1 = EPCTX1_CERR(3) | EPCTX1_TYPE(EPTYPE_CONTROL) |
+	    EPCTX1_MAX_PKT(xep->max_pkt);
+	ectx->deq_lo = deq;
+	ectx->deq_hi = xhci_hi(deq);
+	ectx->tx_info = EPCTX4_AVG_TRB(8);
+}
+
+static void xhci_input_ep(struct xhci_host *xhci, struct xhci_dev *xdev,
+			  struct xhci_ep *xep)
+{
+	volatile struct xhci_ep_ctx *ectx;
+	struct endpoint *ep = xep->ep;
+	uintptr_t deq = xhci_ring_ptr(&xep->ring);
+	int in = (ep->dir == EP_DIR_IN);
+	int type, burst, esit, avg, cerr;
+
+	switch (ep->type) {
+	case EP_ISOCHRONOUS:
+		type = in ? EPTYPE_ISOC_IN : EPTYPE_ISOC_OUT;
+		break;
+	case EP_BULK:
+		type = in ? EPTYPE_BULK_IN : EPTYPE_BULK_OUT;
+		break;
+	case EP_INTERRUPT:
+		type = in ? EPTYPE_INT_IN : EPTYPE_INT_OUT;
+		break;
+	default:
+		type = EPTYPE_CONTROL;
+		break;
+	}
+
+	/* High speed periodic endpoints keep extra transactions in bit 11-12 */
+	burst = 0;
+	if (xdev->speed == USBSPEED_SUPER) {
+		burst = ep->max_burst;
+	} else if (xdev->speed == USBSPEED_HIGH &&
+		   (ep->type == EP_INTERRUPT || ep->type == EP_ISOCHRONOUS)) {
+		burst = (ep->max_pkt >> 11) & 0x3;
+	}
+
+	esit = 0;
+	cerr = 3;
+	switch (ep->type) {
+	case EP_INTERRUPT:
+		esit = xep->max_pkt * (burst + 1);
+		avg = esit;
+		break;
+	case EP_ISOCHRONOUS:
+		esit = xep->max_pkt * (burst + 1);
+		avg = esit;
+		cerr = 0;
+		break;
+	case EP_BULK:
+		avg = 3 * 1024;
+		break;
+	default:
+		avg = 8;
+		break;
+	}
+
+	ectx = xhci_ctx(xhci, xdev->in_ctx, xep->dci + 1);
+	memset((void *)ectx, 0, sizeof(*ectx));
+	ectx->info0 = EPCTX0_INTERVAL(xhci_ep_interval(xdev->speed, ep)) |
+	    EPCTX0_ESIT_HI(esit);
+	ectx->info1 = EPCTX1_CERR(cerr) | EPCTX1_TYPE(type) |
+	    EPCTX1_MAX_BURST(burst) | EPCTX1_MAX_PKT(xep->max_pkt);
+	ectx->deq_lo = deq;
+	ectx->deq_hi = xhci_hi(deq);
+	ectx->tx_info = EPCTX4_AVG_TRB(avg) | EPCTX4_ESIT_LO(esit);
+}
+
+static struct xhci_ep *xhci_ep_alloc(struct xhci_host *xhci,
+				     struct xhci_dev *xdev, int dci,
+				     int max_pkt)
+{
+	struct xhci_ep *xep;
+
+	xep = (struct xhci_ep *)usb_malloc(sizeof(*xep));
+	if (!xep) {
+		ZF_LOGE("Out of memory\n");
+		return NULL;
+	}
+	memset(xep, 0, sizeof(*xep));
+	xep->xdev = xdev;
+	xep->dci = dci;
+	xep->max_pkt = max_pkt;
+
+	if (xhci_ring_init(xhci, &xep->ring)) {
+		usb_free(xep);
+		return NULL;
+	}
+
+	return xep;
+}
+
+static void xhci_ep_free(struct xhci_host *xhci, struct xhci_ep *xep)
+{
+	struct xhci_td *td;
+
+	/* Completed TDs waiting for their call back may still point here */
+	for (td = xhci->done; td; td = td->next) {
+		if (td->xep == xep) {
+			td->xep = NULL;
+		}
+	}
+	if (xep->ep) {
+		xep->ep->hcpriv = NULL;
+	}
+	xhci_ring_free(xhci, &xep->ring);
+	usb_free(xep);
+}
+
+static void xhci_dev_free(struct xhci_host *xhci, struct xhci_dev *xdev)
+{
+	if (xdev->in_ctx) {
+		ps_dma_free_pinned(xhci->dman, (void *)xdev->in_ctx,
+				   (XHCI_MAX_DCI + 2) * xhci->ctx_size);
+	}
+	if (xdev->out_ctx) {
+		ps_dma_free_pinned(xhci->dman, (void *)xdev->out_ctx,
+				   (XHCI_MAX_DCI + 1) * xhci->ctx_size);
+	}
+	usb_free(xdev);
+}
+
+/* Let the controller know that a device is a hub, so that it can use the TT */
+static int xhci_hub_update(struct xhci_host *xhci, struct xhci_dev *xdev,
+			   int nports)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+	int slot = xdev->slot;
+	int cc;
+
+	xdev->is_hub = 1;
+	xdev->nports = nports;
+	icc = xhci_input_reset(xhci, xdev);
+	icc->add = BIT(0);
+	xhci_input_slot(xhci, xdev);
+
+	cc = xhci_command(xhci, xdev->pin_ctx, TRB_TYPE(TRB_CONFIG_EP), &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Failed to configure hub slot %d(%d)\n",
+			xdev->slot, cc);
+		xdev->is_hub = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*****************
+ **** Devices ****
+ *****************/
+
+struct xhci_dev *xhci_find_dev(struct xhci_host *xhci, uint8_t addr)
+{
+	if (addr == 0) {
+		return xhci->dflt;
+	}
+	if (addr >= ARRAY_SIZE(xhci->devs)) {
+		return NULL;
+	}
+	return xhci->devs[addr];
+}
+
+int xhci_dev_attach(struct xhci_host *xhci, struct usb_route *route)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+	struct xhci_dev *xdev;
+	struct xhci_dev *hub;
+	struct xhci_ep *xep;
+	int slot = 0;
+	int mps;
+	int cc;
+
+	/* The core enumerates one device at a time through address 0 */
+	if (xhci->dflt) {
+		ZF_LOGE("xHCI: Device already in default state\n");
+		return -1;
+	}
+
+	if (route->hub_addr) {
+		hub = xhci->devs[route->hub_addr];
+		if (!hub) {
+			ZF_LOGE("xHCI: Unknown hub %d\n", route->hub_addr);
+			return -1;
+		}
+		if (!hub->is_hub && xhci_hub_update(xhci, hub, route->hub_nports)) {
+			return -1;
+		}
+	}
+
+	cc = xhci_command(xhci, 0, TRB_TYPE(TRB_ENABLE_SLOT), &slot);
+	if (cc != TRBCC_SUCCESS || slot <= 0 || slot > xhci->max_slots) {
+		ZF_LOGE("xHCI: No device slot available(%d)\n", cc);
+		return -1;
+	}
+
+	xdev = (struct xhci_dev *)usb_malloc(sizeof(*xdev));
+	if (!xdev) {
+		ZF_LOGE("Out of memory\n");
+		goto disable_slot;
+	}
+	memset(xdev, 0, sizeof(*xdev));
+	xdev->slot = slot;
+	xdev->speed = route->speed;
+	xdev->route = *route;
+
+	/* Input context has the input control context in front */
+	xdev->in_ctx = xhci_dma_alloc(xhci, (XHCI_MAX_DCI + 2) * xhci->ctx_size,
+				      0x1000, &xdev->pin_ctx);
+	xdev->out_ctx = xhci_dma_alloc(xhci, (XHCI_MAX_DCI + 1) * xhci->ctx_size,
+				       0x1000, &xdev->pout_ctx);
+	if (!xdev->in_ctx || !xdev->out_ctx) {
+		ZF_LOGE("Out of DMA memory\n");
+		goto free_dev;
+	}
+	memset((void *)xdev->in_ctx, 0, (XHCI_MAX_DCI + 2) * xhci->ctx_size);
+	memset((void *)xdev->out_ctx, 0, (XHCI_MAX_DCI + 1) * xhci->ctx_size);
+
+	/* Same guess of the control endpoint packet size as the core */
+	switch (route->speed) {
+	case USBSPEED_SUPER:
+		mps = 512;
+		break;
+	case USBSPEED_HIGH:
+		mps = 64;
+		break;
+	default:
+		mps = 8;
+		break;
+	}
+	xep = xhci_ep_alloc(xhci, xdev, 1, mps);
+	if (!xep) {
+		goto free_dev;
+	}
+	xdev->eps[1] = xep;
+
+	xhci->slots[slot] = xdev;
+	xhci->dcbaa[slot] = xdev->pout_ctx;
+
+	/* Address Device with BSR leaves the device at address 0 */
+	icc = xhci_input_reset(xhci, xdev);
+	icc->add = BIT(0) | BIT(1);
+	xhci_input_slot(xhci, xdev);
+	xhci_input_ep0(xhci, xdev, xep);
+	cc = xhci_command(xhci, xdev->pin_ctx,
+			  TRB_TYPE(TRB_ADDRESS_DEV) | TRB_BSR, &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Failed to enable slot %d(%d)\n", slot, cc);
+		xhci->slots[slot] = NULL;
+		xhci->dcbaa[slot] = 0;
+		xhci_ep_free(xhci, xep);
+		goto free_dev;
+	}
+
+	xhci->dflt = xdev;
+	return 0;
+
+free_dev:
+	xhci_dev_free(xhci, xdev);
+disable_slot:
+	xhci_command(xhci, 0, TRB_TYPE(TRB_DISABLE_SLOT), &slot);
+	return -1;
+}
+
+void xhci_dev_detach(struct xhci_host *xhci, uint8_t addr)
+{
+	struct xhci_dev *xdev;
+	struct xhci_ep *xep;
+	int slot;
+	int cc;
+	int i;
+
+	xdev = xhci_find_dev(xhci, addr);
+	if (!xdev) {
+		return;
+	}
+
+	/* Disabling the slot stops all of its endpoints */
+	slot = xdev->slot;
+	cc = xhci_command(xhci, 0, TRB_TYPE(TRB_DISABLE_SLOT), &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGW("xHCI: Failed to disable slot %d(%d)\n", xdev->slot, cc);
+	}
+
+	for (i = 1; i <= XHCI_MAX_DCI; i++) {
+		xep = xdev->eps[i];
+		if (xep) {
+			while (xep->tds) {
+				xhci_td_complete(xhci, xep->tds,
+						 XACTSTAT_CANCELLED);
+			}
+			xhci_ep_free(xhci, xep);
+		}
+	}
+
+	xhci->dcbaa[xdev->slot] = 0;
+	xhci->slots[xdev->slot] = NULL;
+	if (addr) {
+		xhci->devs[addr] = NULL;
+	} else {
+		xhci->dflt = NULL;
+	}
+	xhci_dev_free(xhci, xdev);
+}
+
+int xhci_set_address(struct xhci_host *xhci, struct xhci_dev *xdev,
+		     uint8_t addr)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+	int slot = xdev->slot;
+	int cc;
+
+	if (xdev != xhci->dflt || !addr || addr >= ARRAY_SIZE(xhci->devs) ||
+	    xhci->devs[addr]) {
+		ZF_LOGE("xHCI: Invalid address %d\n", addr);
+		return -1;
+	}
+
+	/* The control endpoint resumes where the ring is now */
+	icc = xhci_input_reset(xhci, xdev);
+	icc->add = BIT(0) | BIT(1);
+	xhci_input_slot(xhci, xdev);
+	xhci_input_ep0(xhci, xdev, xdev->eps[1]);
+	cc = xhci_command(xhci, xdev->pin_ctx, TRB_TYPE(TRB_ADDRESS_DEV), &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Address device failed on slot %d(%d)\n",
+			xdev->slot, cc);
+		return -1;
+	}
+
+	xdev->addr = addr;
+	xhci->devs[addr] = xdev;
+	xhci->dflt = NULL;
+
+	return 0;
+}
+
+/*******************
+ **** Endpoints ****
+ *******************/
+
+/* Find the endpoint, configure it on first use */
+struct xhci_ep *xhci_ep_get(struct xhci_host *xhci, struct xhci_dev *xdev,
+			    struct endpoint *ep)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+	struct xhci_ep *xep;
+	int dci = xhci_ep_dci(ep);
+	int slot = xdev->slot;
+	int cc;
+
+	if (ep->hcpriv) {
+		return (struct xhci_ep *)ep->hcpriv;
+	}
+
+	/* The control endpoint was set up with the slot */
+	xep = xdev->eps[dci];
+	if (xep) {
+		xep->ep = ep;
+		ep->hcpriv = xep;
+		return xep;
+	}
+
+	xep = xhci_ep_alloc(xhci, xdev, dci, ep->max_pkt & 0x7ff);
+	if (!xep) {
+		return NULL;
+	}
+	xep->ep = ep;
+	xdev->eps[dci] = xep;
+
+	icc = xhci_input_reset(xhci, xdev);
+	icc->add = BIT(0) | BIT(dci);
+	xhci_input_slot(xhci, xdev);
+	xhci_input_ep(xhci, xdev, xep);
+	cc = xhci_command(xhci, xdev->pin_ctx, TRB_TYPE(TRB_CONFIG_EP), &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Failed to configure endpoint %d(%d)\n",
+			ep->num, cc);
+		xdev->eps[dci] = NULL;
+		xep->ep = NULL;
+		xhci_ep_free(xhci, xep);
+		return NULL;
+	}
+	ep->hcpriv = xep;
+
+	return xep;
+}
+
+/*
+ * The maximum packet size of the control endpoint is only known after the
+ * first descriptor read, update the endpoint context accordingly.
+ */
+int xhci_ep_update(struct xhci_host *xhci, struct xhci_ep *xep)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+	struct xhci_dev *xdev = xep->xdev;
+	int slot = xdev->slot;
+	int cc;
+
+	if (xep->dci != 1 || xep->ep->max_pkt == xep->max_pkt) {
+		return 0;
+	}
+
+	xep->max_pkt = xep->ep->max_pkt;
+	icc = xhci_input_reset(xhci, xdev);
+	icc->add = BIT(1);
+	xhci_input_ep0(xhci, xdev, xep);
+	cc = xhci_command(xhci, xdev->pin_ctx, TRB_TYPE(TRB_EVAL_CTX), &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Failed to update control endpoint(%d)\n", cc);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Recover a halted endpoint, the failed TD is gone from the ring */
+int xhci_ep_reset(struct xhci_host *xhci, struct xhci_ep *xep)
+{
+	uintptr_t deq;
+	int slot = xep->xdev->slot;
+	int cc;
+
+	xep->halted = 0;
+	cc = xhci_command(xhci, 0, TRB_TYPE(TRB_RESET_EP) | TRB_EP(xep->dci),
+			  &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Failed to reset endpoint(%d)\n", cc);
+		return -1;
+	}
+
+	deq = xep->tds ? xep->tds->deq : xhci_ring_ptr(&xep->ring);
+	cc = xhci_command(xhci, deq, TRB_TYPE(TRB_SET_DEQ) | TRB_EP(xep->dci),
+			  &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGE("xHCI: Failed to set dequeue pointer(%d)\n", cc);
+		return -1;
+	}
+
+	if (xep->tds) {
+		xhci_doorbell(xhci, xep->xdev->slot, xep->dci);
+	}
+
+	return 0;
+}
+
+/* Stop the endpoint and complete everything on its ring */
+void xhci_ep_flush(struct xhci_host *xhci, struct xhci_ep *xep,
+		   enum usb_xact_status stat)
+{
+	volatile struct xhci_ep_ctx *ectx;
+	int slot = xep->xdev->slot;
+	int state;
+
+	ectx = xhci_ctx(xhci, xep->xdev->out_ctx, xep->dci);
+	state = EPCTX0_STATE(ectx->info0);
+	if (state == EPSTATE_DISABLED) {
+		return;
+	}
+
+	if (state == EPSTATE_HALTED) {
+		xhci_command(xhci, 0, TRB_TYPE(TRB_RESET_EP) | TRB_EP(xep->dci),
+			     &slot);
+	} else if (state == EPSTATE_RUNNING) {
+		xhci_command(xhci, 0, TRB_TYPE(TRB_STOP_EP) | TRB_EP(xep->dci),
+			     &slot);
+	}
+	xep->halted = 0;
+
+	while (xep->tds) {
+		xhci_td_complete(xhci, xep->tds, stat);
+	}
+
+	xhci_command(xhci, xhci_ring_ptr(&xep->ring),
+		     TRB_TYPE(TRB_SET_DEQ) | TRB_EP(xep->dci), &slot);
+}
+
+/* Drop an endpoint from its slot, the control endpoint stays until detach */
+void xhci_ep_destroy(struct xhci_host *xhci, struct xhci_ep *xep)
+{
+	volatile struct xhci_input_ctrl_ctx *icc;
+	struct xhci_dev *xdev = xep->xdev;
+	int slot = xdev->slot;
+	int cc;
+
+	xhci_ep_flush(xhci, xep, XACTSTAT_CANCELLED);
+	if (xep->dci == 1) {
+		xep->ep->hcpriv = NULL;
+		xep->ep = NULL;
+		return;
+	}
+
+	xdev->eps[xep->dci] = NULL;
+	icc = xhci_input_reset(xhci, xdev);
+	icc->drop = BIT(xep->dci);
+	icc->add = BIT(0);
+	xhci_input_slot(xhci, xdev);
+	cc = xhci_command(xhci, xdev->pin_ctx, TRB_TYPE(TRB_CONFIG_EP), &slot);
+	if (cc != TRBCC_SUCCESS) {
+		ZF_LOGW("xHCI: Failed to drop endpoint(%d)\n", cc);
+	}
+
+	xhci_ep_free(xhci, xep);
+}
+
+/*******************
+ **** Transfers ****
+ *******************/
+
+static inline int xhci_trb_next(int idx)
+{
+	return (idx + 1 == XHCI_RING_TRBS - 1) ? 0 : idx + 1;
+}
+
+/* Distance of a TRB from the start of a TD, link TRBs do not count */
+static inline int xhci_td_offset(struct xhci_td *td, int idx)
+{
+	return (idx - td->first + XHCI_RING_TRBS - 1) % (XHCI_RING_TRBS - 1);
+}
+
+/* TRBs needed for a buffer, none may cross a 64KB boundary */
+static int xhci_xact_trbs(struct xact *xact)
+{
+	uintptr_t start = xact->paddr;
+	uintptr_t end = xact->paddr + xact->len;
+
+	if (xact->len == 0) {
+		return 1;
+	}
+	return (ALIGN_UP(end, XHCI_TRB_MAX_LEN) -
+		(start & ~(uintptr_t)(XHCI_TRB_MAX_LEN - 1))) / XHCI_TRB_MAX_LEN;
+}
+
+/*
+ * Queue the buffer of one xact as chained TRBs. The TD size field counts
+ * the packets left in the TD after each TRB(xHCI 4.11.2.4).
+ */
+static int xhci_xact_push(struct xhci_ring *ring, struct xact *xact,
+			  uint32_t type, uint32_t flags, int max_pkt,
+			  int *remain, int *hold)
+{
+	uintptr_t paddr = xact->paddr;
+	int left = xact->len;
+	uint32_t control;
+	int len, pkts;
+	int idx;
+
+	do {
+		len = MIN(left, XHCI_TRB_MAX_LEN - (paddr & (XHCI_TRB_MAX_LEN - 1)));
+		left -= len;
+		*remain -= len;
+		pkts = MIN(DIV_ROUND_UP(*remain, max_pkt), 31);
+
+		control = TRB_TYPE(type) | flags;
+		if (left || *remain) {
+			control |= TRB_CH;
+		}
+		idx = xhci_ring_push(ring, paddr,
+				     TRBSTS_LEN(len) | TRBSTS_TD_SIZE(pkts),
+				     control, *hold);
+		*hold = 0;
+		paddr += len;
+		/* Only the first TRB of a data stage is a Data Stage TRB */
+		type = TRB_NORMAL;
+		flags &= ~TRB_DIR_IN;
+	} while (left);
+
+	return idx;
+}
+
+struct xhci_td *xhci_td_queue(struct xhci_host *xhci, struct xhci_ep *xep,
+			      struct xact *xact, int nxact, usb_cb_t cb,
+			      void *token)
+{
+	struct xhci_ring *ring = &xep->ring;
+	struct xhci_td *td, **pp;
+	struct usbreq *req;
+	uint64_t setup;
+	uint32_t flags;
+	int ntrbs, total, remain;
+	int hold = 1;
+	int data_in;
+	int i, idx;
+
+	if (!xact || nxact <= 0) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+
+	ntrbs = 0;
+	total = 0;
+	for (i = 0; i < nxact; i++) {
+		if (xact[i].len && !xhci_dma_ok(xhci, xact[i].paddr, xact[i].len)) {
+			ZF_LOGE("xHCI: Buffer above 4GiB without AC64\n");
+			return NULL;
+		}
+		ntrbs += xhci_xact_trbs(&xact[i]);
+		if (xact[i].type != PID_SETUP) {
+			total += xact[i].len;
+		}
+	}
+	/* Status stage */
+	if (xep->ep->type == EP_CONTROL) {
+		ntrbs++;
+	}
+	if (ntrbs >= xhci_ring_space(ring)) {
+		ZF_LOGE("xHCI: Transfer ring full\n");
+		return NULL;
+	}
+
+	td = (struct xhci_td *)usb_malloc(sizeof(*td));
+	if (!td) {
+		ZF_LOGE("Out of memory\n");
+		return NULL;
+	}
+	memset(td, 0, sizeof(*td));
+	td->xep = xep;
+	td->cb = cb;
+	td->token = token;
+	td->deq = xhci_ring_ptr(ring);
+	td->first = ring->enq;
+
+	remain = total;
+	if (xep->ep->type == EP_CONTROL) {
+		if (xact[0].type != PID_SETUP || xact[0].len != sizeof(*req)) {
+			ZF_LOGF("Invalid control transfer\n");
+		}
+		data_in = (nxact > 1 && xact[1].type == PID_IN);
+		req = xact_get_vaddr(&xact[0]);
+		memcpy(&setup, req, sizeof(setup));
+		flags = TRB_IDT;
+		if (nxact > 1 && total) {
+			flags |= data_in ? TRB_TRT_IN : TRB_TRT_OUT;
+		}
+		xhci_ring_push(ring, setup, TRBSTS_LEN(8),
+			       TRB_TYPE(TRB_SETUP) | flags, hold);
+		hold = 0;
+
+		for (i = 1; i < nxact; i++) {
+			flags = data_in ? (TRB_DIR_IN | TRB_ISP) : 0;
+			xhci_xact_push(ring, &xact[i], i == 1 ? TRB_DATA : TRB_NORMAL,
+				       flags, xep->max_pkt, &remain, &hold);
+		}
+
+		/* The status stage goes the other way */
+		flags = (data_in && total) ? 0 : TRB_DIR_IN;
+		idx = xhci_ring_push(ring, 0, 0,
+				     TRB_TYPE(TRB_STATUS) | flags | TRB_IOC, 0);
+	} else {
+		flags = (xep->ep->dir == EP_DIR_IN) ? TRB_ISP : 0;
+		for (i = 0; i < nxact; i++) {
+			idx = xhci_xact_push(ring, &xact[i], TRB_NORMAL, flags,
+					     xep->max_pkt, &remain, &hold);
+		}
+		ring->trb[idx].control |= TRB_IOC;
+	}
+	td->last = idx;
+	td->ntrbs = ntrbs;
+
+	if (xhci->hdev->mon) {
+		usbmon_xfer_init(&td->mon, xep->xdev->addr, xep->ep, xact, nxact);
+	}
+
+	/* Queue behind other TDs of the endpoint */
+	for (pp = &xep->tds; *pp; pp = &(*pp)->next);
+	*pp = td;
+
+	/* Hand the TD over to the controller */
+	dsb();
+	ring->trb[td->first].control ^= TRB_CYCLE;
+	if (!xep->halted) {
+		xhci_doorbell(xhci, xep->xdev->slot, xep->dci);
+	}
+
+	return td;
+}
+
+/* Move the head TD of an endpoint out of the ring */
+void xhci_td_complete(struct xhci_host *xhci, struct xhci_td *td,
+		      enum usb_xact_status stat)
+{
+	struct xhci_ep *xep = td->xep;
+
+	xep->tds = td->next;
+	xep->ring.used -= td->ntrbs;
+	td->next = NULL;
+	td->stat = stat;
+	td->done = 1;
+	if (stat != XACTSTAT_SUCCESS) {
+		td->rbytes = 0;
+	}
+	usbmon_complete(xhci->hdev, &td->mon, stat, td->rbytes);
+
+	/* Synchronous TDs belong to xhci_td_wait() */
+	if (!td->cb) {
+		return;
+	}
+	if (xhci->done_tail) {
+		xhci->done_tail->next = td;
+	} else {
+		xhci->done = td;
+	}
+	xhci->done_tail = td;
+}
+
+/* Bytes of the TD that were not transferred after a short packet */
+static int xhci_td_residue(struct xhci_ring *ring, struct xhci_td *td,
+			   int idx, uint32_t evt_status)
+{
+	int sum = TRBSTS_EVT_LEN(evt_status);
+	int type;
+
+	while (idx != td->last) {
+		idx = xhci_trb_next(idx);
+		type = TRB_GET_TYPE(ring->trb[idx].control);
+		if (type == TRB_NORMAL || type == TRB_DATA) {
+			sum += TRBSTS_GET_LEN(ring->trb[idx].status);
+		}
+	}
+
+	return sum;
+}
+
+void xhci_xfer_event(struct xhci_host *xhci, volatile struct xhci_trb *evt)
+{
+	volatile struct xhci_ep_ctx *ectx;
+	struct xhci_dev *xdev = NULL;
+	struct xhci_ep *xep = NULL;
+	struct xhci_td *td;
+	uint64_t ptr;
+	int slot, dci, cc;
+	int idx;
+
+	slot = TRB_GET_SLOT(evt->control);
+	dci = TRB_GET_EP(evt->control);
+	cc = TRBSTS_CODE(evt->status);
+	if (slot > 0 && slot <= xhci->max_slots) {
+		xdev = xhci->slots[slot];
+	}
+	if (xdev) {
+		xep = xdev->eps[dci];
+	}
+	if (!xep || !xep->tds) {
+		ZF_LOGD("xHCI: Stale transfer event slot %d ep %d\n", slot, dci);
+		return;
+	}
+
+	/* Stop Endpoint reports where it stopped, the TDs are flushed */
+	if (cc == TRBCC_STOPPED || cc == TRBCC_STOPPED_LEN ||
+	    cc == TRBCC_STOPPED_SHORT) {
+		return;
+	}
+
+	/* TDs complete in order, anything else is left over from the last one */
+	td = xep->tds;
+	ptr = evt->ptr_lo | (uint64_t)evt->ptr_hi << 32;
+	if (ptr < xep->ring.ptrb ||
+	    ptr >= xep->ring.ptrb + XHCI_RING_TRBS * sizeof(struct xhci_trb)) {
+		ZF_LOGD("xHCI: Transfer event outside the ring\n");
+		return;
+	}
+	idx = (ptr - xep->ring.ptrb) / sizeof(struct xhci_trb);
+	if (xhci_td_offset(td, idx) > xhci_td_offset(td, td->last)) {
+		return;
+	}
+
+	switch (cc) {
+	case TRBCC_SUCCESS:
+		if (idx == td->last) {
+			xhci_td_complete(xhci, td, XACTSTAT_SUCCESS);
+		}
+		break;
+	case TRBCC_SHORT_PKT:
+		/* The status stage of a control transfer still follows */
+		td->rbytes = xhci_td_residue(&xep->ring, td, idx, evt->status);
+		if (xep->ep->type != EP_CONTROL || idx == td->last) {
+			xhci_td_complete(xhci, td, XACTSTAT_SUCCESS);
+		}
+		break;
+	default:
+		ZF_LOGD("xHCI: Transfer error %d on slot %d ep %d\n", cc, slot,
+			dci);
+		xhci_td_complete(xhci, td, XACTSTAT_ERROR);
+		ectx = xhci_ctx(xhci, xdev->out_ctx, dci);
+		if (EPCTX0_STATE(ectx->info0) == EPSTATE_HALTED ||
+		    EPCTX0_STATE(ectx->info0) == EPSTATE_ERROR) {
+			xep->halted = 1;
+		}
+		break;
+	}
+}
+
+/*
+ * Run what was deferred while handling events: call backs of finished TDs,
+ * endpoint recovery and root hub changes. These may issue commands, so this
+ * never runs while a command is outstanding.
+ */
+void xhci_td_reap(struct xhci_host *xhci)
+{
+	struct xhci_td *td;
+
+	if (xhci->cmd_pending) {
+		return;
+	}
+
+	if (xhci->port_event && xhci->irq_cb) {
+		xhci->port_event = 0;
+		xhci_root_irq(xhci);
+	}
+
+	while ((td = xhci->done)) {
+		xhci->done = td->next;
+		if (!xhci->done) {
+			xhci->done_tail = NULL;
+		}
+		if (td->xep && td->xep->halted) {
+			xhci_ep_reset(xhci, td->xep);
+		}
+		td->cb(td->token, td->stat, td->rbytes);
+		usb_free(td);
+	}
+}
+
+/*
+ * Wait for a synchronous TD by polling the event ring.
+ * @return The bytes remaining, or -1 on error.
+ */
+int xhci_td_wait(struct xhci_host *xhci, struct xhci_td *td)
+{
+	volatile struct xhci_intr_regs *ir = &xhci->rt_regs->ir[0];
+	struct xhci_ep *xep = td->xep;
+	uint32_t iman;
+	int cnt;
+	int ret;
+
+	iman = ir->iman;
+	ir->iman = iman & ~(XHCIIMAN_IE | XHCIIMAN_IP);
+	for (cnt = XHCI_XFER_TIMEOUT_MS * 10; !td->done && cnt; cnt--) {
+		if (!xhci_handle_event(xhci)) {
+			ps_udelay(100);
+		}
+	}
+	ir->iman = iman & ~XHCIIMAN_IP;
+
+	if (!td->done) {
+		ZF_LOGE("xHCI: Transfer timeout\n");
+		xhci_ep_flush(xhci, xep, XACTSTAT_ERROR);
+	}
+	if (xep->halted) {
+		xhci_ep_reset(xhci, xep);
+	}
+
+	ret = (td->stat == XACTSTAT_SUCCESS) ? td->rbytes : -1;
+	usb_free(td);
+
+	return ret;
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @brief xHCI host controller driver
+ */
+#include "../services.h"
+#include "xhci.h"
+
+struct usb_hc_data {
+	struct xhci_host xhci;
+};
+
+/*****************
+ **** Helpers ****
+ *****************/
+
+static inline struct xhci_host *_hcd_to_xhci(usb_host_t *hcd)
+{
+	struct usb_hc_data *hc_data = (struct usb_hc_data *)hcd->pdata;
+
+	if (!hc_data) {
+		ZF_LOGF("Host controller data not found\n");
+	}
+
+	return &hc_data->xhci;
+}
+
+static int _is_set_address(struct xact *xact, int nxact)
+{
+	struct usbreq *req;
+
+	if (xact[0].type != PID_SETUP || xact[0].len < sizeof(*req)) {
+		return 0;
+	}
+	req = xact_get_vaddr(&xact[0]);
+	return req->bmRequestType == (USB_DIR_OUT | USB_TYPE_STD | USB_RCPT_DEVICE)
+	    && req->bRequest == SET_ADDRESS;
+}
+
+/* Take the controller from the BIOS(xHCI 7.1) */
+static void _bios_handoff(struct xhci_host *xhci)
+{
+	volatile uint32_t *xcap;
+	uint32_t off;
+	int cnt;
+
+	off = XHCI_HCC_XECP(xhci->cap_regs->hccparams1);
+	xcap = (volatile uint32_t *)xhci->cap_regs + off;
+	while (off) {
+		if (XHCI_XCAP_ID(*xcap) == XHCI_XCAP_LEGACY) {
+			*xcap |= XHCI_LEGACY_OS;
+			for (cnt = 1000; (*xcap & XHCI_LEGACY_BIOS) && cnt; cnt--) {
+				ps_mdelay(1);
+			}
+			if (*xcap & XHCI_LEGACY_BIOS) {
+				ZF_LOGW("xHCI: BIOS did not release the controller\n");
+				*xcap &= ~XHCI_LEGACY_BIOS;
+			}
+			return;
+		}
+		off = XHCI_XCAP_NEXT(*xcap);
+		xcap += off;
+	}
+}
+
+static int _scratchpad_init(struct xhci_host *xhci)
+{
+	int i;
+
+	xhci->nspbufs = XHCI_HCS2_MAX_SPBUF(xhci->cap_regs->hcsparams2);
+	if (!xhci->nspbufs) {
+		return 0;
+	}
+
+	xhci->spbuf_array = xhci_dma_alloc(xhci, sizeof(uint64_t) * xhci->nspbufs,
+					   64, &xhci->pspbuf_array);
+	xhci->spbufs = usb_malloc(sizeof(void *) * xhci->nspbufs);
+	if (!xhci->spbuf_array || !xhci->spbufs) {
+		ZF_LOGE("Out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < xhci->nspbufs; i++) {
+		uintptr_t pbuf;
+
+		xhci->spbufs[i] = xhci_dma_alloc(xhci, 0x1000, 0x1000, &pbuf);
+		if (!xhci->spbufs[i]) {
+			ZF_LOGE("Out of DMA memory\n");
+			return -1;
+		}
+		memset(xhci->spbufs[i], 0, 0x1000);
+		xhci->spbuf_array[i] = pbuf;
+	}
+	xhci->dcbaa[0] = xhci->pspbuf_array;
+
+	return 0;
+}
+
+/*****************************
+ **** Host controller ops ****
+ *****************************/
+
+int xhci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
+		       uint8_t hub_port, enum usb_speed speed,
+		       struct endpoint *ep, struct xact *xact, int nxact,
+		       usb_cb_t cb, void *t)
+{
+	struct xhci_host *xhci;
+	struct xhci_dev *xdev;
+	struct xhci_ep *xep;
+	struct xhci_td *td;
+	struct usbmon_xfer mon;
+	struct usbreq *req;
+	int ret;
+
+	if (!hdev) {
+		ZF_LOGF("Invalid USB host\n");
+	}
+	xhci = _hcd_to_xhci(hdev);
+	if (hub_addr == -1) {
+		/* Send off to root handler */
+		if (ep->type == EP_INTERRUPT) {
+			return xhci_schedule_periodic_root(xhci, xact, nxact,
+							   cb, t);
+		} else {
+			return hubem_process_xact(xhci->hubem, xact, nxact, cb,
+						  t);
+		}
+	}
+
+	if (ep->type == EP_ISOCHRONOUS) {
+		ZF_LOGE("xHCI: Isochronous transfers are not supported\n");
+		return -1;
+	}
+
+	xdev = xhci_find_dev(xhci, addr);
+	if (!xdev) {
+		ZF_LOGE("xHCI: No slot for device %d\n", addr);
+		return -1;
+	}
+
+	/* The controller sends SET_ADDRESS itself */
+	if (ep->type == EP_CONTROL && _is_set_address(xact, nxact)) {
+		req = xact_get_vaddr(&xact[0]);
+		ret = xhci_set_address(xhci, xdev, req->wValue);
+		if (hdev->mon) {
+			usbmon_xfer_init(&mon, addr, ep, xact, nxact);
+			usbmon_complete(hdev, &mon, ret ? XACTSTAT_ERROR :
+					XACTSTAT_SUCCESS, 0);
+		}
+		if (cb) {
+			cb(t, ret ? XACTSTAT_ERROR : XACTSTAT_SUCCESS, 0);
+			return 0;
+		}
+		return ret;
+	}
+
+	xep = xhci_ep_get(xhci, xdev, ep);
+	if (!xep || xhci_ep_update(xhci, xep)) {
+		return -1;
+	}
+
+	td = xhci_td_queue(xhci, xep, xact, nxact, cb, t);
+	if (!td) {
+		return -1;
+	}
+
+	if (cb) {
+		ret = 0;
+	} else {
+		ret = xhci_td_wait(xhci, td);
+	}
+	xhci_td_reap(xhci);
+
+	return ret;
+}
+
+void xhci_handle_irq(usb_host_t *hdev)
+{
+	struct xhci_host *xhci = _hcd_to_xhci(hdev);
+	volatile struct xhci_intr_regs *ir = &xhci->rt_regs->ir[0];
+	uint32_t sts;
+
+	sts = xhci->op_regs->usbsts & XHCISTS_MASK;
+
+	/* We cannot recover from fatal host error */
+	if (sts & XHCISTS_HSE) {
+		ZF_LOGF("INT - host error\n");
+	}
+
+	/* Write to clear, before the event ring is drained */
+	xhci->op_regs->usbsts = sts;
+	ir->iman = ir->iman | XHCIIMAN_IP;
+
+	while (xhci_handle_event(xhci)) ;
+	xhci_td_reap(xhci);
+}
+
+int xhci_cancel_xact(usb_host_t *hdev, struct endpoint *ep)
+{
+	struct xhci_host *xhci = _hcd_to_xhci(hdev);
+
+	if (!ep) {
+		ZF_LOGF("Invalid endpoint\n");
+	}
+
+	if (ep->hcpriv) {
+		xhci_ep_destroy(xhci, ep->hcpriv);
+		xhci_td_reap(xhci);
+	}
+
+	return 0;
+}
+
+static int xhci_attach(usb_host_t *hdev, struct usb_route *route)
+{
+	return xhci_dev_attach(_hcd_to_xhci(hdev), route);
+}
+
+static void xhci_detach(usb_host_t *hdev, uint8_t addr)
+{
+	struct xhci_host *xhci = _hcd_to_xhci(hdev);
+
+	xhci_dev_detach(xhci, addr);
+	xhci_td_reap(xhci);
+}
+
+/****************************
+ **** Exported functions ****
+ ****************************/
+int xhci_host_init(usb_host_t *hdev, uintptr_t regs)
+{
+	usb_hubem_t hubem;
+	struct xhci_host *xhci;
+	volatile struct xhci_intr_regs *ir;
+	int pwr_delay_ms;
+	int err;
+
+	hdev->pdata = (struct usb_hc_data *)usb_malloc(sizeof(struct usb_hc_data));
+	if (hdev->pdata == NULL) {
+		return -1;
+	}
+	xhci = _hcd_to_xhci(hdev);
+	memset(xhci, 0, sizeof(*xhci));
+	xhci->devid = hdev->id;
+	xhci->hdev = hdev;
+	hdev->mon = NULL;
+	xhci->cap_regs = (volatile struct xhci_host_cap *)regs;
+	xhci->op_regs = (volatile struct xhci_host_op *)(regs + xhci->cap_regs->caplength);
+	xhci->rt_regs = (volatile struct xhci_host_rt *)(regs + (xhci->cap_regs->rtsoff & ~0x1f));
+	xhci->db_regs = (volatile uint32_t *)(regs + (xhci->cap_regs->dboff & ~0x3));
+	hdev->schedule_xact = xhci_schedule_xact;
+	hdev->iso_start = NULL;
+	hdev->cancel_xact = xhci_cancel_xact;
+	hdev->handle_irq = xhci_handle_irq;
+	hdev->dev_attach = xhci_attach;
+	hdev->dev_detach = xhci_detach;
+	xhci->dman = hdev->dman;
+	xhci->sync = hdev->sync;
+	ir = &xhci->rt_regs->ir[0];
+
+	/* Check some params */
+	xhci->nports = XHCI_HCS1_MAX_PORTS(xhci->cap_regs->hcsparams1);
+	xhci->max_slots = XHCI_HCS1_MAX_SLOTS(xhci->cap_regs->hcsparams1);
+	if (xhci->nports <= 0 || xhci->max_slots <= 0) {
+		ZF_LOGF("Invalid HCS register\n");
+	}
+	hdev->nports = xhci->nports;
+	xhci->ctx_size = (xhci->cap_regs->hccparams1 & XHCI_HCC_CSZ) ? 64 : 32;
+	xhci->ac64 = !!(xhci->cap_regs->hccparams1 & XHCI_HCC_AC64);
+
+	_bios_handoff(xhci);
+
+	/* Make sure we are halted before before reset */
+	while (xhci->op_regs->usbsts & XHCISTS_CNR) ;
+	xhci->op_regs->usbcmd &= ~XHCICMD_RUNSTOP;
+	while (!(xhci->op_regs->usbsts & XHCISTS_HCH)) ;
+	/* Reset the HC */
+	xhci->op_regs->usbcmd |= XHCICMD_HCRST;
+	while (xhci->op_regs->usbcmd & XHCICMD_HCRST) ;
+	while (xhci->op_regs->usbsts & XHCISTS_CNR) ;
+
+	/* Device slots */
+	xhci->op_regs->config = XHCICFG_MAX_SLOTS_EN(xhci->max_slots);
+	xhci->slots = usb_malloc(sizeof(*xhci->slots) * (xhci->max_slots + 1));
+	xhci->dcbaa = xhci_dma_alloc(xhci, sizeof(uint64_t) * (xhci->max_slots + 1),
+				     64, &xhci->pdcbaa);
+	if (!xhci->slots || !xhci->dcbaa) {
+		ZF_LOGE("Out of memory\n");
+		return -1;
+	}
+	memset(xhci->slots, 0, sizeof(*xhci->slots) * (xhci->max_slots + 1));
+	memset((void *)xhci->dcbaa, 0, sizeof(uint64_t) * (xhci->max_slots + 1));
+	if (_scratchpad_init(xhci)) {
+		return -1;
+	}
+	xhci->op_regs->dcbaap_lo = xhci->pdcbaa;
+	xhci->op_regs->dcbaap_hi = xhci_hi(xhci->pdcbaa);
+
+	/* Command and event rings */
+	if (xhci_ring_init(xhci, &xhci->cmd_ring)) {
+		return -1;
+	}
+	xhci->op_regs->crcr_lo = xhci->cmd_ring.ptrb | XHCICRCR_RCS;
+	xhci->op_regs->crcr_hi = xhci_hi(xhci->cmd_ring.ptrb);
+	if (xhci_event_ring_init(xhci)) {
+		return -1;
+	}
+
+	/* Initialise the hub emulation */
+	pwr_delay_ms = 20;	/* xHCI 5.4.8, 20ms after PP */
+	err = usb_hubem_driver_init(xhci, hdev->nports, pwr_delay_ms,
+				    &xhci_set_pf, &xhci_clr_pf, &xhci_get_pstat,
+				    &hubem);
+	if (err) {
+		return -1;
+	}
+	xhci->hubem = hubem;
+
+	/* Moderate to 40us, enable interrupts and run */
+	ir->imod = XHCIIMOD_INTERVAL(160);
+	ir->iman = XHCIIMAN_IE | XHCIIMAN_IP;
+	xhci->op_regs->usbcmd |= XHCICMD_INTE | XHCICMD_HSEE | XHCICMD_RUNSTOP;
+	while (xhci->op_regs->usbsts & XHCISTS_HCH) ;
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "../services.h"
+#include "xhci.h"
+
+/***************************
+ *** Hub emulation stubs ***
+ ***************************/
+volatile uint32_t *xhci_get_portsc(struct xhci_host *xhci, int port)
+{
+	if (port <= 0 || port > xhci->nports) {
+		ZF_LOGF("Invalid port\n");
+	}
+	return &xhci->op_regs->port[port - 1].portsc;
+}
+
+/*
+ * A value that changes nothing when written back. PED and the change bits
+ * are write-1-to-clear, PR and LWS trigger actions.
+ */
+static inline uint32_t xhci_port_neutral(uint32_t v)
+{
+	return v & XHCI_PORT_PRESERVE;
+}
+
+int xhci_set_pf(void *token, int port, enum port_feature feature)
+{
+	struct xhci_host *xhci = (struct xhci_host *)token;
+	volatile uint32_t *ps_reg = xhci_get_portsc(xhci, port);
+	uint32_t v = xhci_port_neutral(*ps_reg);
+
+	switch (feature) {
+	case PORT_ENABLE:
+		/* Ports are enabled by a reset */
+		return 0;
+	case PORT_POWER:
+		v |= XHCI_PORT_PP;
+		break;
+	case PORT_RESET:
+		/* USB 3 ports train by themselves, but a warm reset is harmless */
+		*ps_reg = v | XHCI_PORT_PR;
+		while (*ps_reg & XHCI_PORT_PR) ;
+		return 0;
+	case PORT_SUSPEND:
+		if (!(*ps_reg & XHCI_PORT_PED)) {
+			ZF_LOGE("xHCI: Port %d must be enabled to suspend\n", port);
+			return -1;
+		}
+		v |= XHCI_PORT_LWS | XHCI_PORT_PLS(XHCI_PLS_U3);
+		break;
+	default:
+		ZF_LOGD("xHCI: Unknown feature %d for set feature request\n",
+			feature);
+		return -1;
+	}
+	*ps_reg = v;
+	return 0;
+}
+
+int xhci_clr_pf(void *token, int port, enum port_feature feature)
+{
+	struct xhci_host *xhci = (struct xhci_host *)token;
+	volatile uint32_t *ps_reg = xhci_get_portsc(xhci, port);
+	uint32_t v = xhci_port_neutral(*ps_reg);
+
+	switch (feature) {
+	case PORT_ENABLE:
+		/* Writing one disables the port */
+		v |= XHCI_PORT_PED;
+		break;
+	case PORT_POWER:
+		v &= ~XHCI_PORT_PP;
+		break;
+	case PORT_SUSPEND:
+		if (XHCI_PORT_GET_PLS(*ps_reg) != XHCI_PLS_U3) {
+			ZF_LOGE("xHCI: Port %d is not suspended\n", port);
+			return -1;
+		}
+		v |= XHCI_PORT_LWS | XHCI_PORT_PLS(XHCI_PLS_U0);
+		break;
+	case C_PORT_CONNECTION:
+		v |= XHCI_PORT_CSC;
+		break;
+	case C_PORT_ENABLE:
+		v |= XHCI_PORT_PEC | XHCI_PORT_CEC;
+		break;
+	case C_PORT_SUSPEND:
+		v |= XHCI_PORT_PLC;
+		break;
+	case C_PORT_OVER_CURRENT:
+		v |= XHCI_PORT_OCC;
+		break;
+	case C_PORT_RESET:
+		v |= XHCI_PORT_PRC | XHCI_PORT_WRC;
+		break;
+	default:
+		ZF_LOGD("xHCI: Unknown feature %d for clear feature request\n",
+			feature);
+		return -1;
+	}
+	*ps_reg = v;
+	return 0;
+}
+
+int xhci_get_pstat(void *token, int port, struct port_status *_ps)
+{
+	struct xhci_host *xhci = (struct xhci_host *)token;
+	struct port_status ps;
+	uint32_t v;
+
+	v = *xhci_get_portsc(xhci, port);
+	ps.wPortStatus =
+	    ((v & XHCI_PORT_CCS) ? BIT(PORT_CONNECTION) : 0) |
+	    ((v & XHCI_PORT_PED) ? BIT(PORT_ENABLE) : 0) |
+	    ((XHCI_PORT_GET_PLS(v) == XHCI_PLS_U3) ? BIT(PORT_SUSPEND) : 0) |
+	    ((v & XHCI_PORT_OCA) ? BIT(PORT_OVER_CURRENT) : 0) |
+	    ((v & XHCI_PORT_PR) ? BIT(PORT_RESET) : 0) |
+	    ((v & XHCI_PORT_PP) ? BIT(PORT_POWER) : 0) | 0;
+	ps.wPortChange =
+	    ((v & XHCI_PORT_CSC) ? BIT(PORT_CONNECTION) : 0) |
+	    ((v & (XHCI_PORT_PEC | XHCI_PORT_CEC)) ? BIT(PORT_ENABLE) : 0) |
+	    ((v & XHCI_PORT_PLC) ? BIT(PORT_SUSPEND) : 0) |
+	    ((v & XHCI_PORT_OCC) ? BIT(PORT_OVER_CURRENT) : 0) |
+	    ((v & (XHCI_PORT_PRC | XHCI_PORT_WRC)) ? BIT(PORT_RESET) : 0) | 0;
+
+	/* The speed is only valid while something is connected */
+	if (v & XHCI_PORT_CCS) {
+		switch (XHCI_PORT_SPEED(v)) {
+		case XHCI_SPEED_FULL:
+			break;
+		case XHCI_SPEED_LOW:
+			ps.wPortStatus |= BIT(PORT_LOW_SPEED);
+			break;
+		case XHCI_SPEED_HIGH:
+			ps.wPortStatus |= BIT(PORT_HIGH_SPEED);
+			break;
+		default:
+			ps.wPortStatus |= BIT(PORT_SUPER_SPEED);
+			break;
+		}
+	}
+	*_ps = ps;
+	return 0;
+}
+
+/*************************
+ *** Root hub IRQ data ***
+ *************************/
+
+void xhci_root_irq(struct xhci_host *xhci)
+{
+	uint8_t *portbm;
+	int nports;
+	int port;
+	int resched;
+
+	if (!xhci->irq_cb) {
+		return;
+	}
+
+	nports = MIN(xhci->nports, xhci->irq_xact.len * 8 - 1);
+	portbm = xact_get_vaddr(&xhci->irq_xact);
+	memset(portbm, 0, xhci->irq_xact.len);
+	/* Hub itself is at position 0 */
+	for (port = 1; port <= nports; port++) {
+		if (*xhci_get_portsc(xhci, port) & XHCI_PORT_CHANGE) {
+			portbm[port / 8] |= BIT(port & 0x7);
+		}
+	}
+
+	resched = xhci->irq_cb(xhci->irq_token, XACTSTAT_SUCCESS, 0);
+	if (resched) {
+		ZF_LOGF("Root IRQ unhandled\n");
+	}
+}
+
+int xhci_schedule_periodic_root(struct xhci_host *xhci, struct xact *xact,
+				int nxact, usb_cb_t cb, void *t)
+{
+	int port;
+
+	if (!xact->vaddr || !cb) {
+		ZF_LOGF("Invalid arguments\n");
+	}
+	xhci->irq_xact = *xact;
+	xhci->irq_cb = cb;
+	xhci->irq_token = t;
+
+	/* Changes from before the hub driver was listening */
+	for (port = 1; port <= xhci->nports; port++) {
+		if (*xhci_get_portsc(xhci, port) & XHCI_PORT_CHANGE) {
+			xhci->port_event = 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @brief xHCI command, event and transfer rings.
+ */
+#include "../services.h"
+#include "xhci.h"
+
+/*
+ * Memory the controller reads or writes. A controller without AC64 cannot
+ * reach memory above 4GiB, so such an allocation is given back.
+ */
+void *xhci_dma_alloc(struct xhci_host *xhci, size_t size, int align,
+		     uintptr_t *paddr)
+{
+	void *vaddr;
+
+	vaddr = ps_dma_alloc_pinned(xhci->dman, size, align, 0, PS_MEM_NORMAL,
+				    paddr);
+	if (vaddr && !xhci_dma_ok(xhci, *paddr, size)) {
+		ZF_LOGE("xHCI: DMA memory above 4GiB without AC64\n");
+		ps_dma_free_pinned(xhci->dman, vaddr, size);
+		vaddr = NULL;
+	}
+	return vaddr;
+}
+
+/***********************
+ **** Producer rings ****
+ ***********************/
+
+/*
+ * Transfer rings and the command ring are a single segment of one page. The
+ * last TRB links back to the start and toggles the cycle state.
+ */
+int xhci_ring_init(struct xhci_host *xhci, struct xhci_ring *ring)
+{
+	volatile struct xhci_trb *link;
+
+	ring->trb = xhci_dma_alloc(xhci, sizeof(struct xhci_trb) * XHCI_RING_TRBS,
+				   0x1000, &ring->ptrb);
+	if (!ring->trb) {
+		ZF_LOGE("Out of DMA memory\n");
+		return -1;
+	}
+	memset((void *)ring->trb, 0, sizeof(struct xhci_trb) * XHCI_RING_TRBS);
+
+	link = &ring->trb[XHCI_RING_TRBS - 1];
+	link->ptr_lo = ring->ptrb;
+	link->ptr_hi = xhci_hi(ring->ptrb);
+	link->control = TRB_TYPE(TRB_LINK) | TRB_TC;
+
+	ring->enq = 0;
+	ring->cycle = TRB_CYCLE;
+	ring->used = 0;
+
+	return 0;
+}
+
+void xhci_ring_free(struct xhci_host *xhci, struct xhci_ring *ring)
+{
+	if (ring->trb) {
+		ps_dma_free_pinned(xhci->dman, (void *)ring->trb,
+				   sizeof(struct xhci_trb) * XHCI_RING_TRBS);
+		ring->trb = NULL;
+	}
+}
+
+/* Free TRBs, not counting the link TRB */
+int xhci_ring_space(struct xhci_ring *ring)
+{
+	return XHCI_RING_TRBS - 1 - ring->used;
+}
+
+/*
+ * Physical address of the next TRB to fill, with the cycle state. This is
+ * where the controller picks up when an endpoint is (re)started.
+ */
+uintptr_t xhci_ring_ptr(struct xhci_ring *ring)
+{
+	return (ring->ptrb + ring->enq * sizeof(struct xhci_trb)) | ring->cycle;
+}
+
+/*
+ * Fill the next TRB. A held TRB is written with the cycle bit inverted so
+ * that the controller does not see it yet. The first TRB of a TD is held
+ * until the whole TD is on the ring, then its cycle bit is flipped.
+ * @return the index of the TRB
+ */
+int xhci_ring_push(struct xhci_ring *ring, uint64_t ptr, uint32_t status,
+		   uint32_t control, int hold)
+{
+	volatile struct xhci_trb *trb;
+	int idx = ring->enq;
+
+	trb = &ring->trb[idx];
+	trb->ptr_lo = (uint32_t)ptr;
+	trb->ptr_hi = (uint32_t)(ptr >> 32);
+	trb->status = status;
+	trb->control = control | (hold ? ring->cycle ^ TRB_CYCLE : ring->cycle);
+	ring->used++;
+
+	/* Step over the link TRB, it is part of the TD when chained */
+	if (++ring->enq == XHCI_RING_TRBS - 1) {
+		trb = &ring->trb[ring->enq];
+		trb->control = TRB_TYPE(TRB_LINK) | TRB_TC |
+		    (control & TRB_CH) | ring->cycle;
+		ring->enq = 0;
+		ring->cycle ^= TRB_CYCLE;
+	}
+
+	return idx;
+}
+
+void xhci_doorbell(struct xhci_host *xhci, int slot, int target)
+{
+	dsb();
+	xhci->db_regs[slot] = target;
+}
+
+/********************
+ **** Event ring ****
+ ********************/
+
+int xhci_event_ring_init(struct xhci_host *xhci)
+{
+	volatile struct xhci_intr_regs *ir = &xhci->rt_regs->ir[0];
+
+	xhci->evt = xhci_dma_alloc(xhci, sizeof(struct xhci_trb) * XHCI_EVENT_TRBS,
+				   0x1000, &xhci->pevt);
+	xhci->erst = xhci_dma_alloc(xhci, sizeof(struct xhci_erst), 64,
+				    &xhci->perst);
+	if (!xhci->evt || !xhci->erst) {
+		ZF_LOGE("Out of DMA memory\n");
+		return -1;
+	}
+	memset((void *)xhci->evt, 0, sizeof(struct xhci_trb) * XHCI_EVENT_TRBS);
+
+	xhci->erst->base_lo = xhci->pevt;
+	xhci->erst->base_hi = xhci_hi(xhci->pevt);
+	xhci->erst->size = XHCI_EVENT_TRBS;
+	xhci->erst->res0 = 0;
+	xhci->evt_deq = 0;
+	xhci->evt_cycle = TRB_CYCLE;
+
+	/* The segment table base must be written last(xHCI 4.9.4) */
+	ir->erstsz = 1;
+	ir->erdp_lo = xhci->pevt;
+	ir->erdp_hi = xhci_hi(xhci->pevt);
+	dsb();
+	ir->erstba_lo = xhci->perst;
+	ir->erstba_hi = xhci_hi(xhci->perst);
+
+	return 0;
+}
+
+static void xhci_cmd_event(struct xhci_host *xhci, volatile struct xhci_trb *evt)
+{
+	if (!xhci->cmd_pending) {
+		ZF_LOGW("xHCI: Unexpected command completion\n");
+		return;
+	}
+	xhci->cmd_status = evt->status;
+	xhci->cmd_control = evt->control;
+	xhci->cmd_ring.used--;
+	xhci->cmd_pending = 0;
+}
+
+/*
+ * Consume one event. The dequeue pointer moves on before the event is
+ * handled, so that completion call backs may wait for further events.
+ * @return 0 if the event ring is empty
+ */
+int xhci_handle_event(struct xhci_host *xhci)
+{
+	volatile struct xhci_intr_regs *ir = &xhci->rt_regs->ir[0];
+	volatile struct xhci_trb *evt;
+	struct xhci_trb copy;
+
+	evt = &xhci->evt[xhci->evt_deq];
+	if ((evt->control & TRB_CYCLE) != xhci->evt_cycle) {
+		return 0;
+	}
+	copy = *evt;
+
+	if (++xhci->evt_deq == XHCI_EVENT_TRBS) {
+		xhci->evt_deq = 0;
+		xhci->evt_cycle ^= TRB_CYCLE;
+	}
+	ir->erdp_lo = (xhci->pevt + xhci->evt_deq * sizeof(struct xhci_trb)) |
+	    XHCIERDP_EHB;
+	ir->erdp_hi = xhci_hi(xhci->pevt);
+
+	switch (TRB_GET_TYPE(copy.control)) {
+	case TRB_EVT_TRANSFER:
+		xhci_xfer_event(xhci, &copy);
+		break;
+	case TRB_EVT_CMD:
+		xhci_cmd_event(xhci, &copy);
+		break;
+	case TRB_EVT_PORT:
+		/* The hub driver may issue commands, see xhci_td_reap() */
+		ZF_LOGD("INT - port %d change\n", TRBPORT_ID(copy.ptr_lo));
+		xhci->port_event = 1;
+		break;
+	case TRB_EVT_HOST:
+		ZF_LOGE("xHCI: Host controller event %d\n",
+			TRBSTS_CODE(copy.status));
+		break;
+	default:
+		ZF_LOGD("xHCI: Ignored event type %d\n",
+			TRB_GET_TYPE(copy.control));
+		break;
+	}
+
+	return 1;
+}
+
+/**********************
+ **** Command ring ****
+ **********************/
+
+/*
+ * Issue a command and wait for its completion. Commands are only issued from
+ * the enumeration and transfer paths, which already serialise on the
+ * driver, so there is never more than one outstanding.
+ * @param[in/out] slot  The slot ID to pass in the command and the slot ID
+ *                      returned in the completion event. May be NULL.
+ * @return              The completion code, or -1 on timeout.
+ */
+int xhci_command(struct xhci_host *xhci, uint64_t ptr, uint32_t control,
+		 int *slot)
+{
+	volatile struct xhci_intr_regs *ir = &xhci->rt_regs->ir[0];
+	volatile struct xhci_trb *trb;
+	uint32_t iman;
+	int idx;
+	int cnt;
+
+	if (xhci->cmd_pending) {
+		ZF_LOGF("xHCI: Nested command\n");
+	}
+	if (slot) {
+		control |= TRB_SLOT(*slot);
+	}
+
+	idx = xhci_ring_push(&xhci->cmd_ring, ptr, 0, control, 1);
+	trb = &xhci->cmd_ring.trb[idx];
+	xhci->cmd_pending = 1;
+	dsb();
+	trb->control ^= TRB_CYCLE;
+	xhci_doorbell(xhci, 0, 0);
+
+	/* Poll for the completion, other events are handled on the way */
+	iman = ir->iman;
+	ir->iman = iman & ~(XHCIIMAN_IE | XHCIIMAN_IP);
+	for (cnt = XHCI_CMD_TIMEOUT_MS * 10; xhci->cmd_pending && cnt; cnt--) {
+		if (!xhci_handle_event(xhci)) {
+			ps_udelay(100);
+		}
+	}
+	ir->iman = iman & ~XHCIIMAN_IP;
+
+	if (xhci->cmd_pending) {
+		ZF_LOGE("xHCI: Command %d timeout\n", TRB_GET_TYPE(control));
+		xhci->cmd_pending = 0;
+		return -1;
+	}
+	if (slot) {
+		*slot = TRB_GET_SLOT(xhci->cmd_control);
+	}
+
+	return TRBSTS_CODE(xhci->cmd_status);
+}
@@ -0,0 +1,521 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef _XHCI_XHCI_H_
+#define _XHCI_XHCI_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <usb/usb_host.h>
+#include <usb/drivers/usbhub.h>
+
+#include "../usbmon.h"
+
+/*******************
+ **** Registers ****
+ *******************/
+
+struct xhci_host_cap {
+	uint8_t caplength;	/* +0x00 */
+	uint8_t res0[1];
+	uint16_t hciversion;	/* +0x02 */
+#define XHCI_HCS1_MAX_SLOTS(x)  (((x) >>  0) & 0xff)
+#define XHCI_HCS1_MAX_INTRS(x)  (((x) >>  8) & 0x7ff)
+#define XHCI_HCS1_MAX_PORTS(x)  (((x) >> 24) & 0xff)
+	uint32_t hcsparams1;	/* +0x04 */
+#define XHCI_HCS2_ERST_MAX(x)   (((x) >>  4) & 0xf)
+#define XHCI_HCS2_MAX_SPBUF(x)  ((((x) >> 16) & 0x3e0) | (((x) >> 27) & 0x1f))
+	uint32_t hcsparams2;	/* +0x08 */
+	uint32_t hcsparams3;	/* +0x0C */
+#define XHCI_HCC_XECP(x)        (((x) >> 16) & 0xffff)
+#define XHCI_HCC_PPC            BIT(3)
+#define XHCI_HCC_CSZ            BIT(2)
+#define XHCI_HCC_AC64           BIT(0)
+	uint32_t hccparams1;	/* +0x10 */
+	uint32_t dboff;		/* +0x14 */
+	uint32_t rtsoff;	/* +0x18 */
+	uint32_t hccparams2;	/* +0x1C */
+};
+
+struct xhci_port_regs {
+#define XHCI_PORT_WPR          BIT(31)
+#define XHCI_PORT_DR           BIT(30)
+#define XHCI_PORT_WOE          BIT(27)
+#define XHCI_PORT_WDE          BIT(26)
+#define XHCI_PORT_WCE          BIT(25)
+#define XHCI_PORT_CAS          BIT(24)
+#define XHCI_PORT_CEC          BIT(23)
+#define XHCI_PORT_PLC          BIT(22)
+#define XHCI_PORT_PRC          BIT(21)
+#define XHCI_PORT_OCC          BIT(20)
+#define XHCI_PORT_WRC          BIT(19)
+#define XHCI_PORT_PEC          BIT(18)
+#define XHCI_PORT_CSC          BIT(17)
+#define XHCI_PORT_LWS          BIT(16)
+#define XHCI_PORT_PIC_MASK     (0x3 * BIT(14))
+#define XHCI_PORT_SPEED(x)     (((x) >> 10) & 0xf)
+#define XHCI_PORT_SPEED_MASK   (0xf * BIT(10))
+#define XHCI_PORT_PP           BIT(9)
+#define XHCI_PORT_PLS(x)       (((x) & 0xf) * BIT(5))
+#define XHCI_PORT_GET_PLS(x)   (((x) >> 5) & 0xf)
+#define XHCI_PORT_PLS_MASK     XHCI_PORT_PLS(0xf)
+#define XHCI_PORT_PR           BIT(4)
+#define XHCI_PORT_OCA          BIT(3)
+#define XHCI_PORT_PED          BIT(1)
+#define XHCI_PORT_CCS          BIT(0)
+#define XHCI_PORT_CHANGE       (XHCI_PORT_CSC | XHCI_PORT_PEC | \
+                                XHCI_PORT_WRC | XHCI_PORT_OCC | \
+                                XHCI_PORT_PRC | XHCI_PORT_PLC | \
+                                XHCI_PORT_CEC)
+/* Bits that keep their value when written back, see xhci_port_neutral() */
+#define XHCI_PORT_PRESERVE     (XHCI_PORT_CCS | XHCI_PORT_OCA | \
+                                XHCI_PORT_PP | XHCI_PORT_SPEED_MASK | \
+                                XHCI_PORT_PIC_MASK | XHCI_PORT_CAS | \
+                                XHCI_PORT_WCE | XHCI_PORT_WDE | \
+                                XHCI_PORT_WOE | XHCI_PORT_DR)
+	uint32_t portsc;
+	uint32_t portpmsc;
+	uint32_t portli;
+	uint32_t porthlpmc;
+};
+
+/* Link states(xHCI 5.4.8) */
+#define XHCI_PLS_U0            0
+#define XHCI_PLS_U3            3
+#define XHCI_PLS_RESUME        15
+
+/* Port speed IDs of the default speed ID mapping(xHCI 7.2.2.1.1) */
+#define XHCI_SPEED_FULL        1
+#define XHCI_SPEED_LOW         2
+#define XHCI_SPEED_HIGH        3
+#define XHCI_SPEED_SUPER       4
+#define XHCI_SPEED_SUPER_PLUS  5
+
+struct xhci_host_op {
+#define XHCICMD_HSEE           BIT(3)
+#define XHCICMD_INTE           BIT(2)
+#define XHCICMD_HCRST          BIT(1)
+#define XHCICMD_RUNSTOP        BIT(0)
+	uint32_t usbcmd;	/* +0x00 */
+#define XHCISTS_HCE            BIT(12)
+#define XHCISTS_CNR            BIT(11)
+#define XHCISTS_PCD            BIT( 4)
+#define XHCISTS_EINT           BIT( 3)
+#define XHCISTS_HSE            BIT( 2)
+#define XHCISTS_HCH            BIT( 0)
+#define XHCISTS_MASK           (XHCISTS_HSE | XHCISTS_EINT | XHCISTS_PCD)
+	uint32_t usbsts;	/* +0x04 */
+	uint32_t pagesize;	/* +0x08 */
+	uint32_t res0[2];
+	uint32_t dnctrl;	/* +0x14 */
+#define XHCICRCR_CRR           BIT(3)
+#define XHCICRCR_CA            BIT(2)
+#define XHCICRCR_CS            BIT(1)
+#define XHCICRCR_RCS           BIT(0)
+	uint32_t crcr_lo;	/* +0x18 */
+	uint32_t crcr_hi;	/* +0x1C */
+	uint32_t res1[4];
+	uint32_t dcbaap_lo;	/* +0x30 */
+	uint32_t dcbaap_hi;	/* +0x34 */
+#define XHCICFG_MAX_SLOTS_EN(x) (((x) & 0xff) * BIT(0))
+	uint32_t config;	/* +0x38 */
+	uint32_t res2[241];
+	struct xhci_port_regs port[];	/* +0x400 */
+};
+
+struct xhci_intr_regs {
+#define XHCIIMAN_IE            BIT(1)
+#define XHCIIMAN_IP            BIT(0)
+	uint32_t iman;		/* +0x00 */
+#define XHCIIMOD_INTERVAL(x)   (((x) & 0xffff) * BIT(0))
+	uint32_t imod;		/* +0x04 */
+	uint32_t erstsz;	/* +0x08 */
+	uint32_t res0;
+	uint32_t erstba_lo;	/* +0x10 */
+	uint32_t erstba_hi;	/* +0x14 */
+#define XHCIERDP_EHB           BIT(3)
+	uint32_t erdp_lo;	/* +0x18 */
+	uint32_t erdp_hi;	/* +0x1C */
+};
+
+struct xhci_host_rt {
+	uint32_t mfindex;	/* +0x00 */
+	uint32_t res0[7];
+	struct xhci_intr_regs ir[];	/* +0x20 */
+};
+
+/* Extended capabilities(xHCI 7) */
+#define XHCI_XCAP_ID(x)        ((x) & 0xff)
+#define XHCI_XCAP_NEXT(x)      (((x) >> 8) & 0xff)
+#define XHCI_XCAP_LEGACY       1
+#define XHCI_LEGACY_OS         BIT(24)
+#define XHCI_LEGACY_BIOS       BIT(16)
+
+/*********************
+ **** Descriptors ****
+ *********************/
+
+/* Transfer request block(xHCI 6.4) */
+struct xhci_trb {
+	uint32_t ptr_lo;
+	uint32_t ptr_hi;
+#define TRBSTS_CODE(x)         (((x) >> 24) & 0xff)
+#define TRBSTS_TD_SIZE(x)      (((x) & 0x1f) * BIT(17))
+#define TRBSTS_LEN(x)          (((x) & 0x1ffff) * BIT(0))
+#define TRBSTS_GET_LEN(x)      ((x) & 0x1ffff)
+#define TRBSTS_EVT_LEN(x)      ((x) & 0xffffff)
+	uint32_t status;
+#define TRB_SLOT(x)            (((x) & 0xff) * BIT(24))
+#define TRB_GET_SLOT(x)        (((x) >> 24) & 0xff)
+#define TRB_EP(x)              (((x) & 0x1f) * BIT(16))
+#define TRB_GET_EP(x)          (((x) >> 16) & 0x1f)
+#define TRB_DIR_IN             BIT(16)
+#define TRB_TRT_NONE           (0 * BIT(16))
+#define TRB_TRT_OUT            (2 * BIT(16))
+#define TRB_TRT_IN             (3 * BIT(16))
+#define TRB_TYPE(x)            (((x) & 0x3f) * BIT(10))
+#define TRB_GET_TYPE(x)        (((x) >> 10) & 0x3f)
+#define TRB_BSR                BIT(9)
+#define TRB_DC                 BIT(9)
+#define TRB_IDT                BIT(6)
+#define TRB_IOC                BIT(5)
+#define TRB_CH                 BIT(4)
+#define TRB_ISP                BIT(2)
+#define TRB_TC                 BIT(1)
+#define TRB_CYCLE              BIT(0)
+	uint32_t control;
+};
+
+/* TRB types */
+#define TRB_NORMAL             1
+#define TRB_SETUP              2
+#define TRB_DATA               3
+#define TRB_STATUS             4
+#define TRB_LINK               6
+#define TRB_ENABLE_SLOT        9
+#define TRB_DISABLE_SLOT       10
+#define TRB_ADDRESS_DEV        11
+#define TRB_CONFIG_EP          12
+#define TRB_EVAL_CTX           13
+#define TRB_RESET_EP           14
+#define TRB_STOP_EP            15
+#define TRB_SET_DEQ            16
+#define TRB_NOOP_CMD           23
+#define TRB_EVT_TRANSFER       32
+#define TRB_EVT_CMD            33
+#define TRB_EVT_PORT           34
+#define TRB_EVT_HOST           37
+
+/* Completion codes */
+#define TRBCC_SUCCESS          1
+#define TRBCC_DATA_BUF         2
+#define TRBCC_BABBLE           3
+#define TRBCC_XACT             4
+#define TRBCC_TRB              5
+#define TRBCC_STALL            6
+#define TRBCC_SHORT_PKT        13
+#define TRBCC_STOPPED          26
+#define TRBCC_STOPPED_LEN      27
+#define TRBCC_STOPPED_SHORT    28
+
+/* Port ID of a port status change event */
+#define TRBPORT_ID(x)          (((x) >> 24) & 0xff)
+
+/* Event ring segment table entry */
+struct xhci_erst {
+	uint32_t base_lo;
+	uint32_t base_hi;
+	uint32_t size;
+	uint32_t res0;
+};
+
+/*
+ * Contexts are 32 bytes, or 64 bytes when HCCPARAMS1.CSZ is set. Only the
+ * first 32 bytes are used, the driver steps through them with the size the
+ * controller reports, see xhci_ctx().
+ */
+struct xhci_slot_ctx {
+#define SLOTCTX0_ROUTE(x)      (((x) & 0xfffff) * BIT(0))
+#define SLOTCTX0_SPEED(x)      (((x) & 0xf) * BIT(20))
+#define SLOTCTX0_MTT           BIT(25)
+#define SLOTCTX0_HUB           BIT(26)
+#define SLOTCTX0_ENTRIES(x)    (((x) & 0x1f) * BIT(27))
+#define SLOTCTX0_ENTRIES_MASK  SLOTCTX0_ENTRIES(0x1f)
+#define SLOTCTX0_GET_ENTRIES(x) (((x) >> 27) & 0x1f)
+	uint32_t info0;
+#define SLOTCTX1_ROOT_PORT(x)  (((x) & 0xff) * BIT(16))
+#define SLOTCTX1_NPORTS(x)     (((x) & 0xff) * BIT(24))
+	uint32_t info1;
+#define SLOTCTX2_TT_SLOT(x)    (((x) & 0xff) * BIT(0))
+#define SLOTCTX2_TT_PORT(x)    (((x) & 0xff) * BIT(8))
+	uint32_t tt;
+#define SLOTCTX3_ADDR(x)       ((x) & 0xff)
+#define SLOTCTX3_STATE(x)      (((x) >> 27) & 0x1f)
+	uint32_t state;
+	uint32_t res0[4];
+};
+
+struct xhci_ep_ctx {
+#define EPCTX0_STATE(x)        ((x) & 0x7)
+#define EPCTX0_MULT(x)         (((x) & 0x3) * BIT(8))
+#define EPCTX0_INTERVAL(x)     (((x) & 0xff) * BIT(16))
+#define EPCTX0_ESIT_HI(x)      ((((x) >> 16) & 0xff) * BIT(24))
+	uint32_t info0;
+#define EPCTX1_CERR(x)         (((x) & 0x3) * BIT(1))
+#define EPCTX1_TYPE(x)         (((x) & 0x7) * BIT(3))
+#define EPCTX1_MAX_BURST(x)    (((x) & 0xff) * BIT(8))
+#define EPCTX1_MAX_PKT(x)      (((x) & 0xffff) * BIT(16))
+#define EPCTX1_MAX_PKT_MASK    EPCTX1_MAX_PKT(0xffff)
+	uint32_t info1;
+#define EPCTX2_DCS             BIT(0)
+	uint32_t deq_lo;
+	uint32_t deq_hi;
+#define EPCTX4_AVG_TRB(x)      (((x) & 0xffff) * BIT(0))
+#define EPCTX4_ESIT_LO(x)      (((x) & 0xffff) * BIT(16))
+	uint32_t tx_info;
+	uint32_t res0[3];
+};
+
+/* Endpoint context states */
+#define EPSTATE_DISABLED       0
+#define EPSTATE_RUNNING        1
+#define EPSTATE_HALTED         2
+#define EPSTATE_STOPPED        3
+#define EPSTATE_ERROR          4
+
+/* Endpoint context types */
+#define EPTYPE_ISOC_OUT        1
+#define EPTYPE_BULK_OUT        2
+#define EPTYPE_INT_OUT         3
+#define EPTYPE_CONTROL         4
+#define EPTYPE_ISOC_IN         5
+#define EPTYPE_BULK_IN         6
+#define EPTYPE_INT_IN          7
+
+struct xhci_input_ctrl_ctx {
+	uint32_t drop;
+	uint32_t add;
+	uint32_t res0[6];
+};
+
+/* Device context index of an endpoint, the control endpoint is 1 */
+#define XHCI_DCI(num, dir)     ((num) * 2 + ((num) ? (dir) : 1))
+#define XHCI_MAX_DCI           31
+
+/****************************
+ **** Private structures ****
+ ****************************/
+
+#define XHCI_RING_TRBS         256	//One page, the last TRB links back
+#define XHCI_EVENT_TRBS        256
+#define XHCI_CMD_TIMEOUT_MS    1000
+#define XHCI_XFER_TIMEOUT_MS   3000
+
+struct xhci_ring {
+	volatile struct xhci_trb *trb;
+	uintptr_t ptrb;
+	int enq;		//Next TRB to fill
+	uint32_t cycle;		//Producer cycle state
+	int used;		//TRBs owned by the controller
+};
+
+struct xhci_ep;
+
+/* A transfer, one TD on the ring of its endpoint */
+struct xhci_td {
+	struct xhci_ep *xep;
+	uintptr_t deq;		//Dequeue pointer of the first TRB
+	int first;		//First TRB
+	int last;		//Last TRB, the one with IOC set
+	int ntrbs;		//Not counting link TRBs
+	int rbytes;		//Bytes short, once known
+	int done;
+	enum usb_xact_status stat;
+	usb_cb_t cb;
+	void *token;
+	struct usbmon_xfer mon;
+	struct xhci_td *next;
+};
+
+struct xhci_dev;
+
+struct xhci_ep {
+	struct xhci_dev *xdev;
+	struct endpoint *ep;
+	int dci;
+	int max_pkt;		//As programmed into the endpoint context
+	struct xhci_ring ring;
+	struct xhci_td *tds;	//In flight, oldest first
+	int halted;		//Needs a reset before it runs again
+};
+
+/* A device slot */
+struct xhci_dev {
+	int slot;
+	uint8_t addr;		//Address used by the core, 0 in default state
+	enum usb_speed speed;
+	struct usb_route route;
+	int is_hub;
+	int nports;		//Hubs only
+	/* Contexts */
+	volatile void *in_ctx;
+	uintptr_t pin_ctx;
+	volatile void *out_ctx;
+	uintptr_t pout_ctx;
+	struct xhci_ep *eps[XHCI_MAX_DCI + 1];
+};
+
+struct xhci_host {
+	int devid;
+	usb_host_t *hdev;
+	/* Hub emulation */
+	usb_hubem_t hubem;
+	/* Root hub IRQ data */
+	struct xact irq_xact;
+	usb_cb_t irq_cb;
+	void *irq_token;
+	/* Standard registers */
+	volatile struct xhci_host_cap *cap_regs;
+	volatile struct xhci_host_op *op_regs;
+	volatile struct xhci_host_rt *rt_regs;
+	volatile uint32_t *db_regs;
+	int ctx_size;
+	int max_slots;
+	int nports;
+	int ac64;		//Controller drives all 64 address bits
+	/* Device context base address array and scratchpad */
+	volatile uint64_t *dcbaa;
+	uintptr_t pdcbaa;
+	volatile uint64_t *spbuf_array;
+	uintptr_t pspbuf_array;
+	void **spbufs;
+	int nspbufs;
+	/* Command ring, one command at a time */
+	struct xhci_ring cmd_ring;
+	int cmd_pending;
+	uint32_t cmd_status;
+	uint32_t cmd_control;
+	/* Event ring of interrupter 0 */
+	volatile struct xhci_trb *evt;
+	uintptr_t pevt;
+	int evt_deq;
+	uint32_t evt_cycle;
+	volatile struct xhci_erst *erst;
+	uintptr_t perst;
+	/* Devices, by slot ID and by address */
+	struct xhci_dev **slots;
+	struct xhci_dev *devs[128];
+	struct xhci_dev *dflt;	//The device at address 0
+	/* Completions deferred until no command is outstanding */
+	struct xhci_td *done;
+	struct xhci_td *done_tail;
+	int port_event;
+	/* Support */
+	ps_dma_man_t *dman;
+	ps_mutex_ops_t *sync;
+};
+
+/* Upper half of a DMA address, for the _hi half of a register or field */
+static inline uint32_t xhci_hi(uint64_t paddr)
+{
+	return (uint32_t)(paddr >> 32);
+}
+
+/* Without AC64 the controller only drives the low 32 address bits */
+static inline int xhci_dma_ok(struct xhci_host *xhci, uintptr_t paddr,
+			      size_t len)
+{
+	return xhci->ac64 || (uint64_t)paddr + len <= (1ULL << 32);
+}
+
+/* Pointer to context idx of a device or input context */
+static inline volatile void *xhci_ctx(struct xhci_host *xhci,
+				      volatile void *base, int idx)
+{
+	return (volatile void *)((uintptr_t)base + idx * xhci->ctx_size);
+}
+
+/**
+ * Hub Emulation
+ */
+volatile uint32_t *xhci_get_portsc(struct xhci_host *xhci, int port);
+int xhci_set_pf(void *token, int port, enum port_feature feature);
+int xhci_clr_pf(void *token, int port, enum port_feature feature);
+int xhci_get_pstat(void *token, int port, struct port_status *_ps);
+int xhci_schedule_periodic_root(struct xhci_host *xhci, struct xact *xact,
+				int nxact, usb_cb_t cb, void *t);
+void xhci_root_irq(struct xhci_host *xhci);
+
+/**
+ * Rings and events
+ */
+void *xhci_dma_alloc(struct xhci_host *xhci, size_t size, int align,
+		     uintptr_t *paddr);
+int xhci_ring_init(struct xhci_host *xhci, struct xhci_ring *ring);
+void xhci_ring_free(struct xhci_host *xhci, struct xhci_ring *ring);
+int xhci_ring_space(struct xhci_ring *ring);
+int xhci_ring_push(struct xhci_ring *ring, uint64_t ptr, uint32_t status,
+		   uint32_t control, int hold);
+uintptr_t xhci_ring_ptr(struct xhci_ring *ring);
+int xhci_event_ring_init(struct xhci_host *xhci);
+int xhci_handle_event(struct xhci_host *xhci);
+int xhci_command(struct xhci_host *xhci, uint64_t ptr, uint32_t control,
+		 int *slot);
+void xhci_doorbell(struct xhci_host *xhci, int slot, int target);
+
+/**
+ * Devices and endpoints
+ */
+int xhci_dev_attach(struct xhci_host *xhci, struct usb_route *route);
+void xhci_dev_detach(struct xhci_host *xhci, uint8_t addr);
+struct xhci_dev *xhci_find_dev(struct xhci_host *xhci, uint8_t addr);
+int xhci_set_address(struct xhci_host *xhci, struct xhci_dev *xdev,
+		     uint8_t addr);
+struct xhci_ep *xhci_ep_get(struct xhci_host *xhci, struct xhci_dev *xdev,
+			    struct endpoint *ep);
+int xhci_ep_update(struct xhci_host *xhci, struct xhci_ep *xep);
+int xhci_ep_reset(struct xhci_host *xhci, struct xhci_ep *xep);
+void xhci_ep_flush(struct xhci_host *xhci, struct xhci_ep *xep,
+		   enum usb_xact_status stat);
+void xhci_ep_destroy(struct xhci_host *xhci, struct xhci_ep *xep);
+
+/**
+ * Transfers
+ */
+struct xhci_td *xhci_td_queue(struct xhci_host *xhci, struct xhci_ep *xep,
+			      struct xact *xact, int nxact, usb_cb_t cb,
+			      void *token);
+int xhci_td_wait(struct xhci_host *xhci, struct xhci_td *td);
+void xhci_td_complete(struct xhci_host *xhci, struct xhci_td *td,
+		      enum usb_xact_status stat);
+void xhci_xfer_event(struct xhci_host *xhci, volatile struct xhci_trb *evt);
+void xhci_td_reap(struct xhci_host *xhci);
+
+/**
+ * Host controller ops
+ */
+int xhci_schedule_xact(usb_host_t *hdev, uint8_t addr, int8_t hub_addr,
+		       uint8_t hub_port, enum usb_speed speed,
+		       struct endpoint *ep, struct xact *xact, int nxact,
+		       usb_cb_t cb, void *t);
+void xhci_handle_irq(usb_host_t *hdev);
+int xhci_cancel_xact(usb_host_t *hdev, struct endpoint *ep);
+
+/**
+ * Initialise a xHCI host controller
+ * @param[in/out] hdev      A host controller structure to
+ *                          populate. Must be pre-filled with a
+ *                          DMA allocator. This function will
+ *                          fill the private data and function
+ *                          pointers of this structure.
+ * @param[in]     cap_regs  memory location of the mapped xHCI
+ *                          capability registers
+ * @return                  0 on success
+ */
+int xhci_host_init(usb_host_t *hdev, uintptr_t cap_regs);
+
+#endif /* _XHCI_XHCI_H_ */
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * A device that takes an address and then stalls the read of its device
+ * descriptor, so that enumeration fails half way. The host must release
+ * the address and disable the port.
+ *
+ * args: "fs" for a full speed device, high speed otherwise
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+/* The host gives up on the device by disabling its port */
+static int dead_settled(struct sim_dev *d)
+{
+    return !d->parent || !sim_hub_port_enabled(d->parent, d->port);
+}
+
+struct sim_dev *sim_dead_new(const char *args)
+{
+    struct sim_dev *d;
+    enum usb_speed speed = USBSPEED_HIGH;
+
+    if (args && !strcmp(args, "fs")) {
+        speed = USBSPEED_FULL;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (!d) {
+        return NULL;
+    }
+
+    sim_dev_init(d, "dead", speed, 0x0525, 0xdead, 0);
+    d->bad_desc = 1;
+    d->settled = dead_settled;
+    return d;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Full speed boot protocol keyboard that types a script. Every character is
+ * a key press report followed by a release report, the interrupt endpoint
+ * NAKs once the script is done.
+ *
+ * args: the text to type, default "hello"
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+#define HID_EP_IN           0x81
+#define HID_REPORT_LEN      8
+
+#define HID_GET_REPORT      0x01
+#define HID_GET_IDLE        0x02
+#define HID_GET_PROTOCOL    0x03
+#define HID_SET_REPORT      0x09
+#define HID_SET_IDLE        0x0a
+#define HID_SET_PROTOCOL    0x0b
+
+#define MOD_LSHIFT          0x02
+
+/* Boot keyboard report descriptor, HID 1.11 appendix B.1 */
+static const uint8_t kbd_report_desc[] = {
+    0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07,
+    0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+    0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+    0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+    0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07,
+    0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0
+};
+
+struct sim_hid {
+    struct sim_dev dev;
+    const char *script;
+    int pos;            /* Next character */
+    int released;       /* The last key has been released */
+    int nreports;
+    uint8_t leds;
+    uint8_t protocol;
+    uint8_t idle;
+};
+
+static struct sim_hid *to_hid(struct sim_dev *d)
+{
+    return (struct sim_hid *)d->priv;
+}
+
+static void hid_key(char c, uint8_t *mod, uint8_t *code)
+{
+    *mod = isupper((unsigned char)c) ? MOD_LSHIFT : 0;
+    c = tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'z') {
+        *code = 4 + c - 'a';
+    } else if (c >= '1' && c <= '9') {
+        *code = 30 + c - '1';
+    } else if (c == '0') {
+        *code = 39;
+    } else if (c == '\n') {
+        *code = 40;
+    } else if (c == ' ') {
+        *code = 44;
+    } else {
+        *code = 56;     /* '/' for anything else */
+    }
+}
+
+static int hid_packet(struct sim_dev *d, int ep, uint8_t *buf, int len)
+{
+    struct sim_hid *h = to_hid(d);
+    uint8_t report[HID_REPORT_LEN] = {0};
+
+    if (ep != HID_EP_IN) {
+        return SIM_STALL;
+    }
+    if (!h->script[h->pos] && h->released) {
+        return SIM_NAK;
+    }
+
+    if (h->released) {
+        hid_key(h->script[h->pos], &report[0], &report[2]);
+        h->released = 0;
+    } else {
+        h->pos++;
+        h->released = 1;
+    }
+    h->nreports++;
+
+    len = MIN(len, HID_REPORT_LEN);
+    memcpy(buf, report, len);
+    return len;
+}
+
+static int hid_request(struct sim_dev *d, struct usbreq *req, uint8_t *buf)
+{
+    struct sim_hid *h = to_hid(d);
+
+    /* Report descriptor, a standard request to the interface */
+    if (req->bRequest == GET_DESCRIPTOR) {
+        if ((req->wValue >> 8) != HID_REPORT) {
+            return SIM_STALL;
+        }
+        memcpy(buf, kbd_report_desc, sizeof(kbd_report_desc));
+        return sizeof(kbd_report_desc);
+    }
+
+    switch (req->bRequest) {
+    case HID_GET_REPORT:
+        memset(buf, 0, HID_REPORT_LEN);
+        return HID_REPORT_LEN;
+    case HID_GET_IDLE:
+        buf[0] = h->idle;
+        return 1;
+    case HID_GET_PROTOCOL:
+        buf[0] = h->protocol;
+        return 1;
+    case HID_SET_REPORT:
+        /* The data stage holds the LED state */
+        h->leds = buf[0];
+        return 0;
+    case HID_SET_IDLE:
+        h->idle = req->wValue >> 8;
+        return 0;
+    case HID_SET_PROTOCOL:
+        h->protocol = req->wValue & 0xff;
+        return 0;
+    default:
+        return SIM_STALL;
+    }
+}
+
+static void hid_reset(struct sim_dev *d)
+{
+    struct sim_hid *h = to_hid(d);
+
+    h->protocol = 1;
+    h->leds = 0;
+}
+
+int sim_hid_reports(struct sim_dev *d)
+{
+    return to_hid(d)->nreports;
+}
+
+struct sim_dev *sim_hid_new(const char *args)
+{
+    struct sim_hid *h;
+    struct hid_desc hdesc = {
+        .bLength = sizeof(hdesc),
+        .bDescriptorType = HID,
+        .bcdHID = 0x111,
+        .bNumDescriptors = 1,
+        .bReportDescriptorType = HID_REPORT,
+        .wReportDescriptorLength = sizeof(kbd_report_desc),
+    };
+
+    h = calloc(1, sizeof(*h));
+    if (!h) {
+        return NULL;
+    }
+    h->script = strdup(args && *args ? args : "hello");
+    h->released = 1;
+    h->protocol = 1;
+
+    sim_dev_init(&h->dev, "keyboard", USBSPEED_FULL, 0x046d, 0xc31c, 0);
+    sim_dev_add_iface(&h->dev, USB_CLASS_HID, 1, 1, 1);
+    sim_dev_add_desc(&h->dev, &hdesc, sizeof(hdesc));
+    sim_dev_add_ep(&h->dev, HID_EP_IN, EP_INTERRUPT, HID_REPORT_LEN, 10);
+
+    h->dev.request = hid_request;
+    h->dev.packet = hid_packet;
+    h->dev.reset = hid_reset;
+    h->dev.priv = h;
+    return &h->dev;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * High speed hub with a single transaction translator. Port resets complete
+ * immediately.
+ *
+ * args: number of ports, default 4
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb/drivers/usbhub.h>
+#include "sim_dev.h"
+
+#define HUB_MAX_PORTS   7
+#define HUB_REQ_TYPE    0x60
+
+struct sim_hub_port {
+    struct sim_dev *child;
+    uint16_t status;
+    uint16_t change;
+};
+
+struct sim_hub {
+    struct sim_dev dev;
+    int nports;
+    struct sim_hub_port port[HUB_MAX_PORTS];
+};
+
+static struct sim_hub *to_hub(struct sim_dev *d)
+{
+    return (struct sim_hub *)d->priv;
+}
+
+static void port_connect(struct sim_hub_port *p)
+{
+    if (!(p->status & BIT(PORT_POWER))) {
+        return;
+    }
+    if (p->child) {
+        p->status |= BIT(PORT_CONNECTION);
+        if (p->child->speed == USBSPEED_LOW) {
+            p->status |= BIT(PORT_LOW_SPEED);
+        } else if (p->child->speed == USBSPEED_HIGH) {
+            p->status |= BIT(PORT_HIGH_SPEED);
+        }
+        p->child->t_attach = sim_now_ns();
+    } else {
+        p->status &= ~(BIT(PORT_CONNECTION) | BIT(PORT_ENABLE) |
+                       BIT(PORT_LOW_SPEED) | BIT(PORT_HIGH_SPEED));
+    }
+    p->change |= BIT(PORT_CONNECTION);
+}
+
+static int hub_port_feature(struct sim_hub_port *p, int set, int feature)
+{
+    if (set) {
+        switch (feature) {
+        case PORT_POWER:
+            if (!(p->status & BIT(PORT_POWER))) {
+                p->status |= BIT(PORT_POWER);
+                port_connect(p);
+            }
+            return 0;
+        case PORT_RESET:
+            if (!(p->status & BIT(PORT_CONNECTION))) {
+                return 0;
+            }
+            sim_dev_reset(p->child);
+            p->status |= BIT(PORT_ENABLE);
+            p->change |= BIT(PORT_RESET);
+            return 0;
+        case PORT_SUSPEND:
+            p->status |= BIT(PORT_SUSPEND);
+            return 0;
+        default:
+            return 0;
+        }
+    }
+
+    switch (feature) {
+    case PORT_ENABLE:
+        p->status &= ~BIT(PORT_ENABLE);
+        break;
+    case PORT_SUSPEND:
+        p->status &= ~BIT(PORT_SUSPEND);
+        break;
+    case PORT_POWER:
+        p->status = 0;
+        break;
+    case C_PORT_CONNECTION:
+    case C_PORT_ENABLE:
+    case C_PORT_SUSPEND:
+    case C_PORT_OVER_CURRENT:
+    case C_PORT_RESET:
+        p->change &= ~BIT(feature - C_PORT_CONNECTION);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static int hub_request(struct sim_dev *d, struct usbreq *req, uint8_t *buf)
+{
+    struct sim_hub *h = to_hub(d);
+    struct sim_hub_port *p = NULL;
+    struct port_status *ps;
+    int port;
+
+    if ((req->bmRequestType & HUB_REQ_TYPE) != USB_TYPE_CLS) {
+        return SIM_STALL;
+    }
+
+    port = req->wIndex & 0xff;
+    if ((req->bmRequestType & 0x1f) == USB_RCPT_OTHER) {
+        if (port < 1 || port > h->nports) {
+            return SIM_STALL;
+        }
+        p = &h->port[port - 1];
+    }
+
+    switch (req->bRequest) {
+    case GET_DESCRIPTOR:
+        buf[0] = 9;
+        buf[1] = HUB;
+        buf[2] = h->nports;
+        buf[3] = 0x09;      /* Individual power switching and over-current */
+        buf[4] = 0;
+        buf[5] = 50;        /* 100ms power on to power good */
+        buf[6] = 0;
+        buf[7] = 0;         /* No non-removable devices */
+        buf[8] = 0xff;
+        return 9;
+    case GET_STATUS:
+        ps = (struct port_status *)buf;
+        if (p) {
+            ps->wPortStatus = p->status;
+            ps->wPortChange = p->change;
+        } else {
+            ps->wPortStatus = 0;
+            ps->wPortChange = 0;
+        }
+        return sizeof(*ps);
+    case SET_FEATURE:
+    case CLR_FEATURE:
+        if (!p) {
+            return 0;
+        }
+        return hub_port_feature(p, req->bRequest == SET_FEATURE,
+                                req->wValue);
+    default:
+        return SIM_STALL;
+    }
+}
+
+/* Status change endpoint, a bitmap of ports with pending changes */
+static int hub_packet(struct sim_dev *d, int ep, uint8_t *buf, int len)
+{
+    struct sim_hub *h = to_hub(d);
+    uint8_t bm = 0;
+    int i;
+
+    if (ep != 0x81) {
+        return SIM_STALL;
+    }
+    for (i = 0; i < h->nports; i++) {
+        if (h->port[i].change) {
+            bm |= BIT(i + 1);
+        }
+    }
+    if (!bm) {
+        return SIM_NAK;
+    }
+    if (len > 0) {
+        buf[0] = bm;
+    }
+    return MIN(len, 1);
+}
+
+static void hub_reset(struct sim_dev *d)
+{
+    struct sim_hub *h = to_hub(d);
+    int i;
+
+    /* Ports lose power, children go back to the default state */
+    for (i = 0; i < h->nports; i++) {
+        h->port[i].status = 0;
+        h->port[i].change = 0;
+        if (h->port[i].child) {
+            sim_dev_reset(h->port[i].child);
+        }
+    }
+}
+
+static struct sim_dev *hub_route(struct sim_dev *d, uint8_t addr)
+{
+    struct sim_hub *h = to_hub(d);
+    struct sim_dev *r;
+    int i;
+
+    for (i = 0; i < h->nports; i++) {
+        if (h->port[i].child && (h->port[i].status & BIT(PORT_ENABLE))) {
+            r = sim_dev_route(h->port[i].child, addr);
+            if (r) {
+                return r;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int hub_settled(struct sim_dev *d)
+{
+    struct sim_hub *h = to_hub(d);
+    int i;
+
+    for (i = 0; i < h->nports; i++) {
+        if (h->port[i].child && !sim_dev_settled(h->port[i].child)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int sim_hub_port_enabled(struct sim_dev *d, int port)
+{
+    struct sim_hub *h = to_hub(d);
+
+    if (port < 1 || port > h->nports) {
+        return 0;
+    }
+    return !!(h->port[port - 1].status & BIT(PORT_ENABLE));
+}
+
+int sim_hub_attach(struct sim_dev *d, int port, struct sim_dev *child)
+{
+    struct sim_hub *h = to_hub(d);
+
+    if (port < 1 || port > h->nports || h->port[port - 1].child) {
+        return -1;
+    }
+    h->port[port - 1].child = child;
+    child->parent = d;
+    child->port = port;
+    port_connect(&h->port[port - 1]);
+    return 0;
+}
+
+struct sim_dev *sim_hub_new(const char *args)
+{
+    struct sim_hub *h;
+    int nports = 4;
+
+    if (args && *args) {
+        nports = atoi(args);
+    }
+    if (nports < 1 || nports > HUB_MAX_PORTS) {
+        fprintf(stderr, "hub: 1 to %d ports\n", HUB_MAX_PORTS);
+        return NULL;
+    }
+
+    h = calloc(1, sizeof(*h));
+    if (!h) {
+        return NULL;
+    }
+    h->nports = nports;
+
+    sim_dev_init(&h->dev, "hub", USBSPEED_HIGH, 0x0424, 0x2514,
+                 USB_CLASS_HUB);
+    h->dev.desc.bDeviceProtocol = 1;    /* Single TT */
+    sim_dev_add_iface(&h->dev, USB_CLASS_HUB, 0, 0, 1);
+    sim_dev_add_ep(&h->dev, 0x81, EP_INTERRUPT, 1, 12);
+
+    h->dev.request = hub_request;
+    h->dev.packet = hub_packet;
+    h->dev.reset = hub_reset;
+    h->dev.route = hub_route;
+    h->dev.settled = hub_settled;
+    h->dev.priv = h;
+    return &h->dev;
+}
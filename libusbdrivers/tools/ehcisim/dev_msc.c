@@ -0,0 +1,311 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Bulk-only mass storage device with a RAM disk. It implements the SCSI
+ * commands the storage and UFI drivers issue. The disk is filled with a
+ * pattern that depends on the block address, so reads can be checked.
+ *
+ * args: disk size, with an optional K or M suffix, default 8M
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+#define MSC_BLOCK       512
+#define MSC_EP_IN       0x81
+#define MSC_EP_OUT      0x02
+
+#define CBW_SIGN        0x43425355
+#define CSW_SIGN        0x53425355
+#define CBW_LEN         31
+#define CSW_LEN         13
+
+#define CSW_PASS        0
+#define CSW_FAIL        1
+
+enum msc_state {
+    MSC_CBW,
+    MSC_DATA_IN,
+    MSC_DATA_OUT,
+    MSC_CSW
+};
+
+struct sim_msc {
+    struct sim_dev dev;
+    uint8_t *disk;
+    uint32_t nblocks;
+
+    enum msc_state state;
+    uint32_t tag;
+    uint32_t xfer_len;      /* dCBWDataTransferLength */
+    uint8_t status;
+    /* Data phase, either a disk range or the reply buffer */
+    uint8_t *data;
+    uint32_t data_len;
+    uint32_t data_pos;
+    uint8_t reply[64];
+};
+
+static struct sim_msc *to_msc(struct sim_dev *d)
+{
+    return (struct sim_msc *)d->priv;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void msc_reply(struct sim_msc *m, int len)
+{
+    m->data = m->reply;
+    m->data_len = len;
+}
+
+/* Range check a read or write and point the data phase at the disk */
+static void msc_rw(struct sim_msc *m, uint32_t lba, uint32_t count)
+{
+    if (lba >= m->nblocks || count > m->nblocks - lba) {
+        m->status = CSW_FAIL;
+        return;
+    }
+    m->data = m->disk + (size_t)lba * MSC_BLOCK;
+    m->data_len = count * MSC_BLOCK;
+}
+
+static void msc_scsi(struct sim_msc *m, const uint8_t *cb)
+{
+    memset(m->reply, 0, sizeof(m->reply));
+    m->data = NULL;
+    m->data_len = 0;
+    m->status = CSW_PASS;
+
+    switch (cb[0]) {
+    case 0x00:  /* TEST UNIT READY */
+    case 0x1e:  /* PREVENT ALLOW MEDIUM REMOVAL */
+        break;
+    case 0x03:  /* REQUEST SENSE */
+        m->reply[0] = 0x70;
+        m->reply[7] = 10;
+        msc_reply(m, 18);
+        break;
+    case 0x12:  /* INQUIRY */
+        m->reply[1] = 0x80;
+        m->reply[2] = 0x04;
+        m->reply[3] = 0x02;
+        m->reply[4] = 31;
+        memcpy(&m->reply[8], "seL4    ehcisim disk    1.0 ", 28);
+        msc_reply(m, 36);
+        break;
+    case 0x1a:  /* MODE SENSE(6) */
+        m->reply[0] = 3;
+        msc_reply(m, 4);
+        break;
+    case 0x23:  /* READ FORMAT CAPACITIES */
+        m->reply[3] = 8;
+        put_be32(&m->reply[4], m->nblocks);
+        m->reply[8] = 0x02;
+        m->reply[10] = MSC_BLOCK >> 8;
+        m->reply[11] = MSC_BLOCK & 0xff;
+        msc_reply(m, 12);
+        break;
+    case 0x25:  /* READ CAPACITY(10) */
+        put_be32(&m->reply[0], m->nblocks - 1);
+        put_be32(&m->reply[4], MSC_BLOCK);
+        msc_reply(m, 8);
+        break;
+    case 0x28:  /* READ(10) */
+    case 0x2a:  /* WRITE(10) */
+        msc_rw(m, get_be32(&cb[2]), (cb[7] << 8) | cb[8]);
+        break;
+    case 0xa8:  /* READ(12) */
+    case 0xaa:  /* WRITE(12) */
+        msc_rw(m, get_be32(&cb[2]), get_be32(&cb[6]));
+        break;
+    default:
+        m->status = CSW_FAIL;
+        break;
+    }
+}
+
+static int msc_cbw(struct sim_msc *m, uint8_t *buf, int len)
+{
+    if (len != CBW_LEN || get_le32(buf) != CBW_SIGN) {
+        return SIM_STALL;
+    }
+
+    m->tag = get_le32(&buf[4]);
+    m->xfer_len = get_le32(&buf[8]);
+    msc_scsi(m, &buf[15]);
+
+    /* The host decides how much data moves */
+    m->data_len = MIN(m->data_len, m->xfer_len);
+    m->data_pos = 0;
+    if (m->xfer_len == 0 || m->data_len == 0) {
+        m->state = MSC_CSW;
+    } else if (buf[12] & 0x80) {
+        m->state = MSC_DATA_IN;
+    } else {
+        m->state = MSC_DATA_OUT;
+    }
+    return len;
+}
+
+static int msc_csw(struct sim_msc *m, uint8_t *buf, int len)
+{
+    uint32_t residue = m->xfer_len - m->data_pos;
+    uint8_t csw[CSW_LEN];
+
+    put_le32(&csw[0], CSW_SIGN);
+    put_le32(&csw[4], m->tag);
+    put_le32(&csw[8], residue);
+    csw[12] = m->status;
+
+    len = MIN(len, CSW_LEN);
+    memcpy(buf, csw, len);
+    m->state = MSC_CBW;
+    return len;
+}
+
+static int msc_packet(struct sim_dev *d, int ep, uint8_t *buf, int len)
+{
+    struct sim_msc *m = to_msc(d);
+    int n;
+
+    switch (ep) {
+    case MSC_EP_OUT:
+        if (m->state == MSC_CBW) {
+            return msc_cbw(m, buf, len);
+        }
+        if (m->state != MSC_DATA_OUT) {
+            return SIM_NAK;
+        }
+        n = MIN((uint32_t)len, m->data_len - m->data_pos);
+        memcpy(m->data + m->data_pos, buf, n);
+        m->data_pos += n;
+        if (m->data_pos == m->data_len) {
+            m->state = MSC_CSW;
+        }
+        return n;
+    case MSC_EP_IN:
+        if (m->state == MSC_CSW) {
+            return msc_csw(m, buf, len);
+        }
+        if (m->state != MSC_DATA_IN) {
+            return SIM_NAK;
+        }
+        n = MIN((uint32_t)len, m->data_len - m->data_pos);
+        memcpy(buf, m->data + m->data_pos, n);
+        m->data_pos += n;
+        if (m->data_pos == m->data_len) {
+            m->state = MSC_CSW;
+        }
+        return n;
+    default:
+        return SIM_STALL;
+    }
+}
+
+static int msc_request(struct sim_dev *d, struct usbreq *req, uint8_t *buf)
+{
+    struct sim_msc *m = to_msc(d);
+
+    switch (req->bRequest) {
+    case 0xfe:  /* Get max LUN */
+        buf[0] = 0;
+        return 1;
+    case 0xff:  /* Bulk-only mass storage reset */
+        m->state = MSC_CBW;
+        return 0;
+    default:
+        return SIM_STALL;
+    }
+}
+
+static void msc_reset(struct sim_dev *d)
+{
+    to_msc(d)->state = MSC_CBW;
+}
+
+int sim_msc_blocks(struct sim_dev *d, uint8_t **disk)
+{
+    struct sim_msc *m = to_msc(d);
+
+    if (disk) {
+        *disk = m->disk;
+    }
+    return m->nblocks;
+}
+
+struct sim_dev *sim_msc_new(const char *args)
+{
+    struct sim_msc *m;
+    unsigned long size = 8UL << 20;
+    char *end;
+    size_t i;
+
+    if (args && *args) {
+        size = strtoul(args, &end, 0);
+        if (*end == 'K' || *end == 'k') {
+            size <<= 10;
+        } else if (*end == 'M' || *end == 'm') {
+            size <<= 20;
+        }
+    }
+    if (size < MSC_BLOCK) {
+        fprintf(stderr, "msc: disk too small\n");
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(*m));
+    if (!m) {
+        return NULL;
+    }
+    m->nblocks = size / MSC_BLOCK;
+    m->disk = malloc((size_t)m->nblocks * MSC_BLOCK);
+    if (!m->disk) {
+        free(m);
+        return NULL;
+    }
+    for (i = 0; i < (size_t)m->nblocks * MSC_BLOCK; i++) {
+        m->disk[i] = (i / MSC_BLOCK) * 13 + i * 7;
+    }
+
+    sim_dev_init(&m->dev, "msc", USBSPEED_HIGH, 0x0781, 0x5567, 0);
+    sim_dev_add_iface(&m->dev, USB_CLASS_STORAGE, 0x06, 0x50, 2);
+    sim_dev_add_ep(&m->dev, MSC_EP_IN, EP_BULK, sim_bulk_max_pkt(&m->dev), 0);
+    sim_dev_add_ep(&m->dev, MSC_EP_OUT, EP_BULK, sim_bulk_max_pkt(&m->dev), 0);
+
+    m->dev.request = msc_request;
+    m->dev.packet = msc_packet;
+    m->dev.reset = msc_reset;
+    m->dev.priv = m;
+    return &m->dev;
+}
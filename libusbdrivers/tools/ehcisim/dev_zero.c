@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Bulk source and sink, in the spirit of the Linux gadget zero. It never
+ * NAKs, so the bus side costs nothing and benchmarks measure the host
+ * controller driver.
+ *
+ * The vendor request ZERO_REQ_HALT stalls an endpoint until the host clears
+ * the halt.
+ *
+ * args: "fs" for a full speed device, high speed otherwise
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+#define ZERO_EP_IN   0x81
+#define ZERO_EP_OUT  0x02
+
+struct sim_zero {
+    struct sim_dev dev;
+    uint8_t seq;
+    int halt_in;
+    int halt_out;
+};
+
+static int *zero_halt(struct sim_zero *z, int ep)
+{
+    switch (ep) {
+    case ZERO_EP_IN:
+        return &z->halt_in;
+    case ZERO_EP_OUT:
+        return &z->halt_out;
+    default:
+        return NULL;
+    }
+}
+
+static int zero_request(struct sim_dev *d, struct usbreq *req, uint8_t *buf)
+{
+    struct sim_zero *z = (struct sim_zero *)d->priv;
+    int *halt = zero_halt(z, req->wIndex & 0xff);
+
+    if (!halt) {
+        return SIM_STALL;
+    }
+    if ((req->bmRequestType & 0x60) == USB_TYPE_VEN &&
+        req->bRequest == ZERO_REQ_HALT) {
+        *halt = 1;
+        return 0;
+    }
+    if ((req->bmRequestType & 0x60) == USB_TYPE_STD &&
+        req->bRequest == CLR_FEATURE) {
+        *halt = 0;
+        return 0;
+    }
+    return SIM_STALL;
+}
+
+static int zero_packet(struct sim_dev *d, int ep, uint8_t *buf, int len)
+{
+    struct sim_zero *z = (struct sim_zero *)d->priv;
+    int *halt = zero_halt(z, ep);
+
+    if (halt && *halt) {
+        return SIM_STALL;
+    }
+
+    switch (ep) {
+    case ZERO_EP_IN:
+        memset(buf, z->seq++, len);
+        return len;
+    case ZERO_EP_OUT:
+        return len;
+    default:
+        return SIM_STALL;
+    }
+}
+
+struct sim_dev *sim_zero_new(const char *args)
+{
+    struct sim_zero *z;
+    enum usb_speed speed = USBSPEED_HIGH;
+
+    if (args && !strcmp(args, "fs")) {
+        speed = USBSPEED_FULL;
+    }
+
+    z = calloc(1, sizeof(*z));
+    if (!z) {
+        return NULL;
+    }
+
+    sim_dev_init(&z->dev, "zero", speed, 0x0525, 0xa4a0, 0);
+    sim_dev_add_iface(&z->dev, 0xff, 0, 0, 2);
+    sim_dev_add_ep(&z->dev, ZERO_EP_IN, EP_BULK, sim_bulk_max_pkt(&z->dev), 0);
+    sim_dev_add_ep(&z->dev, ZERO_EP_OUT, EP_BULK, sim_bulk_max_pkt(&z->dev), 0);
+
+    z->dev.request = zero_request;
+    z->dev.packet = zero_packet;
+    z->dev.priv = z;
+    return &z->dev;
+}
@@ -0,0 +1,1177 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * EHCI controller model.
+ *
+ * The register block lives in a memfd that is mapped twice: read only for
+ * the driver and read/write for the model. A store from the driver faults,
+ * the fault handler decodes the instruction, applies the store with the
+ * register's semantics through the writable alias and steps over it.
+ *
+ * Schedules are walked by a thread that follows the wall clock, one micro
+ * frame every 125us for the periodic schedule, and runs the asynchronous
+ * schedule as fast as the devices accept packets.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "../../src/ehci/ehci.h"
+#include "ehci_model.h"
+
+#define REG_SIZE         0x1000
+#define CAP_LENGTH       0x40       /* Operational registers follow */
+
+#define UFRAME_NS        125000
+#define MAX_CATCHUP      64         /* Micro frames run late before skipping */
+#define ASYNC_BUDGET     64         /* Packets per queue head and pass */
+#define MAX_WALK         1024       /* Descriptors in one list walk */
+#define MAX_PACKET       3072
+
+#define OP(reg)          offsetof(struct ehci_host_op, reg)
+#define LINK_ADDR(x)     ((x) & ~0x1fU)
+#define LINK_TYPE(x)     ((x) & QHLP_TYPE_FSTN)
+
+struct ehci_model {
+    int nports;
+    int fd;
+    volatile uint8_t *ro;               /* Driver's view */
+    volatile uint8_t *rw;               /* Model's view */
+    volatile struct ehci_host_cap *cap;
+    volatile struct ehci_host_op *op;
+    /* Serialises register updates between the driver and the model */
+    atomic_flag lock;
+
+    struct sim_dev *port[EHCI_MODEL_MAX_PORTS];
+
+    /* Schedule walker */
+    pthread_t thread;
+    volatile int running;
+    uint64_t t0;                        /* Time of micro frame 0 */
+    uint64_t uframe;
+    uint32_t irq_deferred;              /* Held back by the IRQ threshold */
+
+    struct ehci_model_stats stats;
+};
+
+/* The fault handler has no context, so there is one model per process */
+static struct ehci_model *the_model;
+
+static void model_lock(struct ehci_model *m)
+{
+    while (atomic_flag_test_and_set_explicit(&m->lock, memory_order_acquire));
+}
+
+static void model_unlock(struct ehci_model *m)
+{
+    atomic_flag_clear_explicit(&m->lock, memory_order_release);
+}
+
+static void *phys(uint32_t paddr)
+{
+    /* DMA memory is identity mapped */
+    return (void *)(uintptr_t)paddr;
+}
+
+static void irq_raise_locked(struct ehci_model *m, uint32_t bits)
+{
+    if (bits & ~m->op->usbsts & m->op->usbintr) {
+        m->stats.irqs++;
+    }
+    m->op->usbsts |= bits;
+}
+
+static void irq_raise(struct ehci_model *m, uint32_t bits)
+{
+    model_lock(m);
+    irq_raise_locked(m, bits);
+    model_unlock(m);
+}
+
+/* Completion interrupts are delivered at the IRQ threshold */
+static void irq_defer(struct ehci_model *m, uint32_t bits)
+{
+    m->irq_deferred |= bits;
+}
+
+/*****************
+ *** Registers ***
+ *****************/
+
+static uint32_t port_line_state(struct sim_dev *d)
+{
+    /* High speed devices are in SE0 once the chirp is done */
+    switch (d->speed) {
+    case USBSPEED_LOW:
+        return EHCI_PORT_KSTATE;
+    case USBSPEED_FULL:
+        return EHCI_PORT_JSTATE;
+    default:
+        return 0;
+    }
+}
+
+static void hc_reset(struct ehci_model *m)
+{
+    volatile struct ehci_host_op *op = m->op;
+    uint32_t change = 0;
+    int i;
+
+    op->usbcmd = EHCICMD_IRQTHRES(8);
+    op->usbsts = EHCISTS_HCHALTED;
+    op->usbintr = 0;
+    op->frindex = 0;
+    op->ctrldssegment = 0;
+    op->periodiclistbase = 0;
+    op->asynclistaddr = 0;
+    op->configflag = 0;
+    m->irq_deferred = 0;
+
+    /* Ports are always powered, a connected device shows up again */
+    for (i = 0; i < m->nports; i++) {
+        op->portsc[i] = EHCI_PORT_POWER;
+        if (m->port[i]) {
+            op->portsc[i] |= EHCI_PORT_CONNECT | EHCI_PORT_CONNECT_C |
+                             port_line_state(m->port[i]);
+            change = EHCISTS_PORTC_DET;
+        }
+    }
+    op->usbsts |= change;
+}
+
+static void cmd_write(struct ehci_model *m, uint32_t v)
+{
+    volatile struct ehci_host_op *op = m->op;
+    uint32_t sts;
+
+    if (v & EHCICMD_HCRESET) {
+        hc_reset(m);
+        return;
+    }
+
+    /* The doorbell is cleared by the controller only */
+    v |= op->usbcmd & EHCICMD_ASYNC_DB;
+    op->usbcmd = v & ~EHCICMD_LIGHT_RST;
+
+    /* Status follows the command at once */
+    sts = op->usbsts & ~(EHCISTS_HCHALTED | EHCISTS_ASYNC_EN |
+                         EHCISTS_PERI_EN);
+    if (!(v & EHCICMD_RUNSTOP)) {
+        sts |= EHCISTS_HCHALTED;
+    }
+    if (v & EHCICMD_ASYNC_EN) {
+        sts |= EHCISTS_ASYNC_EN;
+    }
+    if (v & EHCICMD_PERI_EN) {
+        sts |= EHCISTS_PERI_EN;
+    }
+    op->usbsts = sts;
+}
+
+static void portsc_write(struct ehci_model *m, int i, uint32_t v)
+{
+    volatile struct ehci_host_op *op = m->op;
+    struct sim_dev *d = m->port[i];
+    uint32_t old = op->portsc[i];
+    uint32_t rw = EHCI_PORT_WO_OCURRENT | EHCI_PORT_WO_DCONNECT |
+                  EHCI_PORT_WO_CONNECT | EHCI_PORT_OWNER |
+                  EHCI_PORT_SUSPEND;
+    uint32_t sc;
+
+    sc = old & ~(v & EHCI_PORT_CHANGE);
+    sc = (sc & ~rw) | (v & rw);
+    /* Software can disable a port, only a reset enables it */
+    if (!(v & EHCI_PORT_ENABLE)) {
+        sc &= ~EHCI_PORT_ENABLE;
+    }
+    /* Resume completes immediately */
+    if (v & EHCI_PORT_FORCE_RESUME) {
+        sc &= ~EHCI_PORT_SUSPEND;
+    }
+
+    if ((v & EHCI_PORT_RESET) && !(old & EHCI_PORT_RESET)) {
+        sc |= EHCI_PORT_RESET;
+        sc &= ~(EHCI_PORT_ENABLE | EHCI_PORT_SUSPEND);
+        if (d) {
+            sim_dev_reset(d);
+        }
+    } else if (!(v & EHCI_PORT_RESET) && (old & EHCI_PORT_RESET)) {
+        sc &= ~EHCI_PORT_RESET;
+        if (d && (sc & EHCI_PORT_CONNECT) && d->speed == USBSPEED_HIGH) {
+            sc |= EHCI_PORT_ENABLE;
+        }
+    }
+    op->portsc[i] = sc;
+}
+
+/* A 32 bit store to the register at off */
+static void reg_write(struct ehci_model *m, uint32_t off, uint32_t v)
+{
+    volatile struct ehci_host_op *op = m->op;
+    int port;
+
+    /* Capability registers are read only */
+    if (off < CAP_LENGTH) {
+        return;
+    }
+    off -= CAP_LENGTH;
+
+    switch (off) {
+    case OP(usbcmd):
+        cmd_write(m, v);
+        break;
+    case OP(usbsts):
+        op->usbsts &= ~(v & EHCISTS_MASK);
+        break;
+    case OP(usbintr):
+        op->usbintr = v & 0x3f;
+        break;
+    case OP(frindex):
+        if (op->usbsts & EHCISTS_HCHALTED) {
+            op->frindex = v & 0x3fff;
+        }
+        break;
+    case OP(ctrldssegment):
+        op->ctrldssegment = v;
+        break;
+    case OP(periodiclistbase):
+        op->periodiclistbase = v & ~0xfffU;
+        break;
+    case OP(asynclistaddr):
+        op->asynclistaddr = LINK_ADDR(v);
+        break;
+    case OP(configflag):
+        op->configflag = v & EHCICFLAG_CFLAG;
+        break;
+    default:
+        port = (int)(off - OP(portsc)) / 4;
+        if (off >= OP(portsc) && port < m->nports) {
+            portsc_write(m, port, v);
+        }
+        break;
+    }
+}
+
+/**************************
+ *** Store instructions ***
+ **************************/
+
+enum store_op {
+    ST_MOV,
+    ST_ADD,
+    ST_OR,
+    ST_AND,
+    ST_SUB,
+    ST_XOR,
+    ST_NONE
+};
+
+struct store {
+    int len;            /* Instruction length */
+    int width;          /* Bytes written */
+    enum store_op op;
+    uint64_t src;
+};
+
+/* 80/81/83 /n */
+static const enum store_op grp1_op[8] = {
+    ST_ADD, ST_OR, ST_NONE, ST_NONE, ST_AND, ST_SUB, ST_XOR, ST_NONE
+};
+
+static const int gregs_map[16] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+static uint64_t reg_operand(ucontext_t *uc, int r, int width, int rex)
+{
+    greg_t *g = uc->uc_mcontext.gregs;
+
+    /* Without a REX prefix byte registers 4-7 are AH, CH, DH and BH */
+    if (width == 1 && !rex && r >= 4) {
+        return (g[gregs_map[r - 4]] >> 8) & 0xff;
+    }
+    return g[gregs_map[r]];
+}
+
+/* Bytes taken by ModRM, SIB and the displacement */
+static int modrm_len(const uint8_t *p)
+{
+    int mod = p[0] >> 6;
+    int rm = p[0] & 7;
+    int len = 1;
+
+    if (rm == 4) {
+        len++;
+        if (mod == 0 && (p[1] & 7) == 5) {
+            len += 4;
+        }
+    } else if (mod == 0 && rm == 5) {
+        len += 4;
+    }
+    if (mod == 1) {
+        len += 1;
+    } else if (mod == 2) {
+        len += 4;
+    }
+    return len;
+}
+
+/*
+ * Decode the x86-64 store at the faulting instruction pointer. Only the
+ * forms compilers emit for volatile MMIO accesses are understood: mov and
+ * the read-modify-write ALU operations with a memory destination. The
+ * address comes from the fault, so addressing modes are only skipped.
+ */
+static int decode_store(ucontext_t *uc, struct store *st)
+{
+    const uint8_t *ip = (const uint8_t *)uc->uc_mcontext.gregs[REG_RIP];
+    const uint8_t *p = ip;
+    int opsize = 4;
+    int rex = 0;
+    int immlen = 0;
+    int byte, reg;
+    uint8_t opc;
+    int32_t imm32;
+    int16_t imm16;
+
+    /* Operand size, lock and segment prefixes */
+    for (;; p++) {
+        if (*p == 0x66) {
+            opsize = 2;
+        } else if (*p != 0xf0 && (*p & 0xe7) != 0x26 &&
+                   *p != 0x64 && *p != 0x65) {
+            break;
+        }
+    }
+    if ((*p & 0xf0) == 0x40) {
+        rex = *p++;
+        if (rex & 0x8) {
+            opsize = 8;
+        }
+    }
+
+    opc = *p++;
+    if ((p[0] >> 6) == 3) {
+        return -1;
+    }
+    reg = ((p[0] >> 3) & 7) | ((rex & 0x4) ? 8 : 0);
+    byte = !(opc & 1);
+
+    switch (opc) {
+    case 0x88:
+    case 0x89:
+        st->op = ST_MOV;
+        break;
+    case 0x00:
+    case 0x01:
+        st->op = ST_ADD;
+        break;
+    case 0x08:
+    case 0x09:
+        st->op = ST_OR;
+        break;
+    case 0x20:
+    case 0x21:
+        st->op = ST_AND;
+        break;
+    case 0x28:
+    case 0x29:
+        st->op = ST_SUB;
+        break;
+    case 0x30:
+    case 0x31:
+        st->op = ST_XOR;
+        break;
+    case 0xc6:
+    case 0xc7:
+        if (reg & 7) {
+            return -1;
+        }
+        st->op = ST_MOV;
+        immlen = byte ? 1 : MIN(opsize, 4);
+        break;
+    case 0x80:
+    case 0x81:
+    case 0x83:
+        st->op = grp1_op[reg & 7];
+        if (st->op == ST_NONE) {
+            return -1;
+        }
+        byte = opc == 0x80;
+        immlen = opc == 0x81 ? MIN(opsize, 4) : 1;
+        break;
+    default:
+        return -1;
+    }
+
+    st->width = byte ? 1 : opsize;
+    p += modrm_len(p);
+    switch (immlen) {
+    case 0:
+        st->src = reg_operand(uc, reg, st->width, rex);
+        break;
+    case 1:
+        st->src = (int64_t)(int8_t)p[0];
+        break;
+    case 2:
+        memcpy(&imm16, p, sizeof(imm16));
+        st->src = (int64_t)imm16;
+        break;
+    default:
+        memcpy(&imm32, p, sizeof(imm32));
+        st->src = (int64_t)imm32;
+        break;
+    }
+    p += immlen;
+    st->len = p - ip;
+    return 0;
+}
+
+/* Apply a store of any width to the registers, a word at a time */
+static void reg_store(struct ehci_model *m, uint32_t off, struct store *st)
+{
+    uint64_t old = 0;
+    uint64_t val;
+    uint32_t w, word;
+    int b, pos;
+
+    memcpy(&old, (const void *)(m->rw + off), st->width);
+    switch (st->op) {
+    case ST_ADD:
+        val = old + st->src;
+        break;
+    case ST_OR:
+        val = old | st->src;
+        break;
+    case ST_AND:
+        val = old & st->src;
+        break;
+    case ST_SUB:
+        val = old - st->src;
+        break;
+    case ST_XOR:
+        val = old ^ st->src;
+        break;
+    default:
+        val = st->src;
+        break;
+    }
+
+    for (w = off & ~3U; w < off + st->width; w += 4) {
+        word = *(volatile uint32_t *)(m->rw + w);
+        for (b = 0; b < 4; b++) {
+            pos = w + b - off;
+            if (pos >= 0 && pos < st->width) {
+                word &= ~(0xffU << (8 * b));
+                word |= ((val >> (8 * pos)) & 0xff) << (8 * b);
+            }
+        }
+        reg_write(m, w, word);
+    }
+}
+
+static void model_fault(int sig, siginfo_t *si, void *ctx)
+{
+    struct ehci_model *m = the_model;
+    ucontext_t *uc = ctx;
+    uintptr_t addr = (uintptr_t)si->si_addr;
+    struct store st;
+
+    if (!m || addr < (uintptr_t)m->ro || addr >= (uintptr_t)m->ro + REG_SIZE) {
+        /* Not a register access, fault again without the handler */
+        signal(sig, SIG_DFL);
+        return;
+    }
+    if (decode_store(uc, &st)) {
+        fprintf(stderr, "ehci_model: unknown register store at %p\n",
+                (void *)uc->uc_mcontext.gregs[REG_RIP]);
+        abort();
+    }
+
+    model_lock(m);
+    reg_store(m, addr - (uintptr_t)m->ro, &st);
+    m->stats.reg_writes++;
+    model_unlock(m);
+
+    uc->uc_mcontext.gregs[REG_RIP] += st.len;
+}
+
+/****************
+ *** Transfer ***
+ ****************/
+
+static struct sim_dev *model_route(struct ehci_model *m, uint8_t addr)
+{
+    struct sim_dev *d;
+    uint32_t sc;
+    int i;
+
+    for (i = 0; i < m->nports; i++) {
+        d = m->port[i];
+        sc = m->op->portsc[i];
+        if (d && (sc & EHCI_PORT_ENABLE) && !(sc & EHCI_PORT_SUSPEND)) {
+            d = sim_dev_route(d, addr);
+            if (d) {
+                return d;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Copy between a packet and a buffer made of 4K pages, starting at offset
+ * off into page pg. Returns -1 if the buffer runs out of pages.
+ */
+static int page_copy(const volatile uint32_t *pages, int npages, int pg,
+                     uint32_t off, uint8_t *pkt, int len, int to_mem)
+{
+    uint8_t *p;
+    int n;
+
+    while (len > 0) {
+        if (pg >= npages) {
+            return -1;
+        }
+        p = (uint8_t *)phys((pages[pg] & ~0xfffU) + off);
+        n = MIN(len, (int)(0x1000 - off));
+        if (to_mem) {
+            memcpy(p, pkt, n);
+        } else {
+            memcpy(pkt, p, n);
+        }
+        pkt += n;
+        len -= n;
+        off = 0;
+        pg++;
+    }
+    return 0;
+}
+
+static int to_sim_pid(uint32_t tok)
+{
+    switch (tok & (0x3 * BIT(8))) {
+    case TDTOK_PID_IN:
+        return PID_IN;
+    case TDTOK_PID_SETUP:
+        return PID_SETUP;
+    default:
+        return PID_OUT;
+    }
+}
+
+/* Write the overlay token back to the qTD and retire it */
+static void qtd_retire(struct ehci_model *m, volatile struct QH *qh,
+                       uint32_t tok, int short_pkt)
+{
+    volatile struct TD *ov = &qh->td_overlay;
+    volatile struct TD *td = phys(qh->td_cur);
+
+    ov->token = tok;
+    td->token = tok;
+    m->stats.qtds++;
+
+    /* A short packet continues at the alternate qTD if there is one */
+    if (short_pkt && !(ov->alt & TDLP_INVALID)) {
+        ov->next = ov->alt;
+    }
+
+    if (tok & TDTOK_SHALTED) {
+        irq_defer(m, EHCISTS_USBERRINT);
+    }
+    if ((tok & TDTOK_IOC) || short_pkt) {
+        irq_defer(m, EHCISTS_USBINT);
+    }
+}
+
+/* No handshake from the device, retry until the error counter runs out */
+static void qtd_xact_error(struct ehci_model *m, volatile struct QH *qh,
+                           uint32_t tok)
+{
+    int cerr = (tok & TDTOK_C_ERR_MASK) >> 10;
+
+    if (cerr == 0) {
+        /* Retries forever */
+        return;
+    }
+    if (cerr > 1) {
+        qh->td_overlay.token = tok - TDTOK_C_ERR(1);
+        return;
+    }
+    tok &= ~(TDTOK_SACTIVE | TDTOK_C_ERR_MASK);
+    qtd_retire(m, qh, tok | TDTOK_SHALTED | TDTOK_SXACTERR, 0);
+}
+
+/* Move one packet of the qTD in the overlay, returns 1 if data moved */
+static int qtd_packet(struct ehci_model *m, volatile struct QH *qh)
+{
+    volatile struct TD *ov = &qh->td_overlay;
+    uint32_t epc0 = qh->epc[0];
+    uint32_t tok = ov->token;
+    int max_pkt = QHEPC0_GET_MAXPKT(epc0);
+    int total = TDTOK_GET_BYTES(tok);
+    int len = MIN(total, max_pkt);
+    int pg = (tok & TDTOK_C_PAGE_MASK) >> 12;
+    uint32_t off = ov->buf[0] & TDBUF0_CUROFFSET_MASK;
+    int pid = to_sim_pid(tok);
+    uint8_t pkt[MAX_PACKET];
+    struct sim_dev *d;
+    int ret, done, short_pkt;
+
+    if (len > MAX_PACKET) {
+        tok &= ~TDTOK_SACTIVE;
+        qtd_retire(m, qh, tok | TDTOK_SHALTED | TDTOK_SBABDET, 0);
+        return 0;
+    }
+
+    d = model_route(m, QHEPC0_GET_ADDR(epc0));
+    if (!d) {
+        qtd_xact_error(m, qh, tok);
+        return 0;
+    }
+
+    if (pid != PID_IN && page_copy(ov->buf, 5, pg, off, pkt, len, 0)) {
+        tok &= ~TDTOK_SACTIVE;
+        qtd_retire(m, qh, tok | TDTOK_SHALTED | TDTOK_SBUFERR, 0);
+        return 0;
+    }
+
+    ret = sim_dev_packet(d, pid, (epc0 >> 8) & 0xf, pkt, len);
+    if (ret == SIM_NAK) {
+        m->stats.naks++;
+        return 0;
+    }
+    if (ret == SIM_STALL) {
+        qtd_retire(m, qh, (tok & ~TDTOK_SACTIVE) | TDTOK_SHALTED, 0);
+        return 0;
+    }
+    if (ret > len) {
+        qtd_retire(m, qh, (tok & ~TDTOK_SACTIVE) | TDTOK_SHALTED |
+                   TDTOK_SBABDET, 0);
+        return 0;
+    }
+    if (pid == PID_IN && page_copy(ov->buf, 5, pg, off, pkt, ret, 1)) {
+        qtd_retire(m, qh, (tok & ~TDTOK_SACTIVE) | TDTOK_SHALTED |
+                   TDTOK_SBUFERR, 0);
+        return 0;
+    }
+    m->stats.packets++;
+    m->stats.bytes += ret;
+
+    /* Advance the buffer and flip the data toggle */
+    total -= ret;
+    off += ret;
+    pg += off >> 12;
+    off &= 0xfff;
+    tok &= ~(TDTOK_BYTES_MASK | TDTOK_C_PAGE_MASK);
+    tok |= TDTOK_BYTES(total) | TDTOK_C_PAGE(pg);
+    tok ^= TDTOK_DT;
+    ov->buf[0] = (ov->buf[0] & ~TDBUF0_CUROFFSET_MASK) | off;
+
+    short_pkt = pid == PID_IN && total && ret < max_pkt;
+    done = total == 0 || ret < max_pkt || pid == PID_SETUP;
+    if (done) {
+        qtd_retire(m, qh, tok & ~TDTOK_SACTIVE, short_pkt);
+    } else {
+        ov->token = tok;
+    }
+    return 1;
+}
+
+/* Load the next qTD into the overlay, returns -1 if there is none */
+static int qh_advance(volatile struct QH *qh)
+{
+    volatile struct TD *ov = &qh->td_overlay;
+    volatile struct TD *td;
+    uint32_t next = ov->next;
+    uint32_t tok;
+    int i;
+
+    if (next & TDLP_INVALID) {
+        return -1;
+    }
+    td = phys(LINK_ADDR(next));
+    tok = td->token;
+    if (!(tok & TDTOK_SACTIVE)) {
+        return -1;
+    }
+
+    qh->td_cur = LINK_ADDR(next);
+    ov->next = td->next;
+    ov->alt = td->alt;
+    for (i = 0; i < 5; i++) {
+        ov->buf[i] = td->buf[i];
+    }
+    /* Without DTC the queue head keeps the data toggle */
+    if (!(qh->epc[0] & QHEPC0_DTC)) {
+        tok = (tok & ~TDTOK_DT) | (ov->token & TDTOK_DT);
+    }
+    ov->token = tok;
+    return 0;
+}
+
+/* Run the queue head for up to budget packets, returns the packets moved */
+static int qh_run(struct ehci_model *m, volatile struct QH *qh, int budget)
+{
+    uint32_t tok;
+    int moved = 0;
+
+    while (moved < budget) {
+        tok = qh->td_overlay.token;
+        if (tok & TDTOK_SHALTED) {
+            break;
+        }
+        if (!(tok & TDTOK_SACTIVE)) {
+            if (qh_advance(qh)) {
+                break;
+            }
+            continue;
+        }
+        if (!qtd_packet(m, qh)) {
+            break;
+        }
+        moved++;
+    }
+    return moved;
+}
+
+/* One micro frame of a high speed isochronous endpoint */
+static void itd_run(struct ehci_model *m, volatile struct ITD *itd, int uf)
+{
+    uint32_t tx = itd->transaction[uf];
+    uint32_t b0 = itd->buf[0];
+    uint32_t b1 = itd->buf[1];
+    int in = !!(b1 & ITDBUF1_DIR_IN);
+    int max_pkt = b1 & 0x7ff;
+    int mult = MAX((int)(itd->buf[2] & 0x3), 1);
+    int len = ITDTX_GET_LEN(tx);
+    int pg = (tx >> 12) & 0x7;
+    uint32_t off = tx & 0xfff;
+    uint8_t pkt[MAX_PACKET];
+    struct sim_dev *d;
+    int moved = 0;
+    int i, n, ret;
+
+    if (!(tx & ITDTX_ACTIVE)) {
+        return;
+    }
+
+    d = model_route(m, b0 & 0x7f);
+    len = MIN(len, MIN(max_pkt * mult, MAX_PACKET));
+    if (!d) {
+        tx |= ITDTX_XACTERR;
+    } else {
+        if (!in && page_copy(itd->buf, 7, pg, off, pkt, len, 0)) {
+            tx |= ITDTX_DBERR;
+        }
+        /* Up to mult packets in the micro frame */
+        for (i = 0; i < mult && moved < len && !(tx & ITDTX_ERROR); i++) {
+            n = MIN(max_pkt, len - moved);
+            ret = sim_dev_packet(d, in ? PID_IN : PID_OUT, (b0 >> 8) & 0xf,
+                                 pkt + moved, n);
+            if (ret == SIM_STALL) {
+                tx |= ITDTX_XACTERR;
+                break;
+            }
+            if (ret == SIM_NAK) {
+                break;
+            }
+            moved += ret;
+            m->stats.packets++;
+            m->stats.bytes += ret;
+            if (ret < n) {
+                break;
+            }
+        }
+        if (in && !(tx & ITDTX_ERROR)) {
+            if (page_copy(itd->buf, 7, pg, off, pkt, moved, 1)) {
+                tx |= ITDTX_DBERR;
+            }
+            tx = (tx & ~ITDTX_LEN(0xfff)) | ITDTX_LEN(moved);
+        }
+    }
+
+    tx &= ~ITDTX_ACTIVE;
+    itd->transaction[uf] = tx;
+    if (tx & ITDTX_IOC) {
+        irq_defer(m, EHCISTS_USBINT);
+    }
+    if (tx & ITDTX_ERROR) {
+        irq_defer(m, EHCISTS_USBERRINT);
+    }
+}
+
+/*
+ * A full speed isochronous packet through the TT. The whole split
+ * transaction is done in the first start split micro frame.
+ */
+static void sitd_run(struct ehci_model *m, volatile struct SITD *sitd, int uf)
+{
+    uint32_t st = sitd->state;
+    uint32_t epc = sitd->epc;
+    uint32_t smask = sitd->uframe & 0xff;
+    int in = !!(epc & SITDEPC_DIR_IN);
+    int len = SITDST_GET_BYTES(st);
+    int pg = !!(st & SITDST_PAGE);
+    uint8_t pkt[MAX_PACKET];
+    struct sim_dev *d;
+    int ret;
+
+    if (!(st & SITDST_ACTIVE) || !smask || uf != __builtin_ctz(smask)) {
+        return;
+    }
+
+    d = model_route(m, epc & 0x7f);
+    if (!d) {
+        st |= SITDST_XACTERR;
+    } else if (!in && page_copy(sitd->buf, 2, pg, sitd->buf[0] & 0xfff,
+                                pkt, len, 0)) {
+        st |= SITDST_DBERR;
+    } else {
+        ret = sim_dev_packet(d, in ? PID_IN : PID_OUT, (epc >> 8) & 0xf,
+                             pkt, len);
+        if (ret == SIM_STALL) {
+            st |= SITDST_ERR;
+        } else {
+            ret = MAX(ret, 0);
+            if (in && page_copy(sitd->buf, 2, pg, sitd->buf[0] & 0xfff,
+                                pkt, ret, 1)) {
+                st |= SITDST_DBERR;
+            }
+            m->stats.packets++;
+            m->stats.bytes += ret;
+            st = (st & ~SITDST_BYTES(0x3ff)) |
+                 SITDST_BYTES(in ? len - ret : 0);
+        }
+    }
+
+    st &= ~SITDST_ACTIVE;
+    sitd->state = st;
+    if (st & SITDST_IOC) {
+        irq_defer(m, EHCISTS_USBINT);
+    }
+    if (st & SITDST_ERROR) {
+        irq_defer(m, EHCISTS_USBERRINT);
+    }
+}
+
+static int flist_size(uint32_t cmd)
+{
+    switch (cmd & EHCICMD_LIST_SMASK) {
+    case EHCICMD_LIST_S512:
+        return 512;
+    case EHCICMD_LIST_S256:
+        return 256;
+    default:
+        return 1024;
+    }
+}
+
+static void periodic_uframe(struct ehci_model *m, uint32_t cmd)
+{
+    int frame = (m->uframe >> 3) & (flist_size(cmd) - 1);
+    int uf = m->uframe & 7;
+    volatile uint32_t *flist;
+    volatile struct QH *qh;
+    uint32_t link;
+    int n;
+
+    if (!(cmd & EHCICMD_PERI_EN) || !m->op->periodiclistbase) {
+        return;
+    }
+
+    flist = phys(m->op->periodiclistbase);
+    link = flist[frame];
+    for (n = 0; !(link & QHLP_INVALID) && n < MAX_WALK; n++) {
+        switch (LINK_TYPE(link)) {
+        case QHLP_TYPE_ITD:
+            itd_run(m, phys(LINK_ADDR(link)), uf);
+            link = ((volatile struct ITD *)phys(LINK_ADDR(link)))->next;
+            break;
+        case QHLP_TYPE_SITD:
+            sitd_run(m, phys(LINK_ADDR(link)), uf);
+            link = ((volatile struct SITD *)phys(LINK_ADDR(link)))->next;
+            break;
+        case QHLP_TYPE_QH:
+            qh = phys(LINK_ADDR(link));
+            /* One packet in each start micro frame */
+            if (qh->epc[1] & QHEPC1_UFRAME_SMASK(BIT(uf))) {
+                qh_run(m, qh, 1);
+            }
+            link = qh->qhlptr;
+            break;
+        default:
+            /* FSTNs are not used by the driver, follow the link */
+            link = *(volatile uint32_t *)phys(LINK_ADDR(link));
+            break;
+        }
+    }
+}
+
+static int async_pass(struct ehci_model *m, uint32_t cmd)
+{
+    volatile struct QH *qh, *first;
+    uint32_t link;
+    int moved = 0;
+    int heads = 0;
+    int n;
+
+    if ((cmd & EHCICMD_ASYNC_EN) && m->op->asynclistaddr) {
+        first = qh = phys(m->op->asynclistaddr);
+        for (n = 0; n < MAX_WALK; n++) {
+            moved += qh_run(m, qh, ASYNC_BUDGET);
+            /* The head of reclamation flag ends a pass too */
+            if ((qh->epc[0] & QHEPC0_H) && heads++) {
+                break;
+            }
+            link = qh->qhlptr;
+            if (link & QHLP_INVALID) {
+                break;
+            }
+            /* The register holds the next queue head to execute */
+            m->op->asynclistaddr = LINK_ADDR(link);
+            qh = phys(LINK_ADDR(link));
+            if (qh == first) {
+                break;
+            }
+        }
+    }
+
+    /*
+     * Nothing read in this pass can have been unlinked before the doorbell
+     * rang, so the driver may now free it.
+     */
+    if (cmd & EHCICMD_ASYNC_DB) {
+        model_lock(m);
+        m->op->usbcmd &= ~EHCICMD_ASYNC_DB;
+        irq_raise_locked(m, EHCISTS_ASYNC_ADV);
+        model_unlock(m);
+    }
+    return moved;
+}
+
+static void uframe_tick(struct ehci_model *m, uint32_t cmd)
+{
+    int thres = (cmd & EHCICMD_IRQTHRES_MASK) >> 16;
+
+    periodic_uframe(m, cmd);
+    m->uframe++;
+    m->stats.uframes++;
+    m->op->frindex = m->uframe & 0x3fff;
+
+    if (m->irq_deferred && m->uframe % MAX(thres, 1) == 0) {
+        irq_raise(m, m->irq_deferred);
+        m->irq_deferred = 0;
+    }
+    if ((m->uframe & (flist_size(cmd) * 8 - 1)) == 0) {
+        irq_raise(m, EHCISTS_FLIST_ROLL);
+    }
+}
+
+static void nap(void)
+{
+    struct timespec ts = { 0, 10000 };
+
+    nanosleep(&ts, NULL);
+}
+
+static void *model_thread(void *arg)
+{
+    struct ehci_model *m = arg;
+    int was_running = 0;
+    uint64_t now, target;
+    uint32_t cmd;
+
+    prctl(PR_SET_TIMERSLACK, 1UL);
+    while (m->running) {
+        cmd = m->op->usbcmd;
+        if (!(cmd & EHCICMD_RUNSTOP)) {
+            was_running = 0;
+            nap();
+            continue;
+        }
+
+        now = sim_now_ns();
+        if (!was_running) {
+            m->uframe = m->op->frindex;
+            m->t0 = now - m->uframe * UFRAME_NS;
+            was_running = 1;
+        }
+        target = (now - m->t0) / UFRAME_NS;
+        if (target > m->uframe + MAX_CATCHUP) {
+            m->uframe = target - MAX_CATCHUP;
+        }
+        while (m->uframe < target) {
+            uframe_tick(m, cmd);
+        }
+
+        if (!async_pass(m, cmd)) {
+            nap();
+        }
+    }
+    return NULL;
+}
+
+/****************
+ *** Exported ***
+ ****************/
+
+struct ehci_model *ehci_model_create(int nports)
+{
+    struct ehci_model *m;
+    struct sigaction sa;
+
+    if (the_model) {
+        fprintf(stderr, "ehci_model: one controller per process\n");
+        return NULL;
+    }
+    if (nports < 1 || nports > EHCI_MODEL_MAX_PORTS) {
+        fprintf(stderr, "ehci_model: 1 to %d ports\n", EHCI_MODEL_MAX_PORTS);
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(*m));
+    if (!m) {
+        return NULL;
+    }
+    m->nports = nports;
+    atomic_flag_clear(&m->lock);
+
+    m->fd = memfd_create("ehci_model", 0);
+    if (m->fd < 0 || ftruncate(m->fd, REG_SIZE)) {
+        perror("ehci_model: memfd");
+        free(m);
+        return NULL;
+    }
+    m->rw = mmap(NULL, REG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    m->ro = mmap(NULL, REG_SIZE, PROT_READ, MAP_SHARED, m->fd, 0);
+    if (m->rw == MAP_FAILED || m->ro == MAP_FAILED) {
+        perror("ehci_model: mmap");
+        close(m->fd);
+        free(m);
+        return NULL;
+    }
+    m->cap = (volatile struct ehci_host_cap *)m->rw;
+    m->op = (volatile struct ehci_host_op *)(m->rw + CAP_LENGTH);
+
+    m->cap->caplength = CAP_LENGTH;
+    m->cap->hciversion = 0x100;
+    /* No port power control */
+    m->cap->hcsparams = nports;
+    /* Programmable frame list, isochronous threshold of one micro frame */
+    m->cap->hccparams = EHCI_HCC_PFRAMELIST | BIT(4);
+    hc_reset(m);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = model_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL)) {
+        perror("ehci_model: sigaction");
+        return NULL;
+    }
+    the_model = m;
+    return m;
+}
+
+int ehci_model_start(struct ehci_model *m)
+{
+    m->running = 1;
+    if (pthread_create(&m->thread, NULL, model_thread, m)) {
+        m->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void ehci_model_stop(struct ehci_model *m)
+{
+    if (m->running) {
+        m->running = 0;
+        pthread_join(m->thread, NULL);
+    }
+}
+
+uintptr_t ehci_model_regs(struct ehci_model *m)
+{
+    return (uintptr_t)m->ro;
+}
+
+int ehci_model_attach(struct ehci_model *m, int port, struct sim_dev *dev)
+{
+    volatile uint32_t *sc;
+
+    if (port < 1 || port > m->nports || m->port[port - 1]) {
+        return -1;
+    }
+    if (dev->speed != USBSPEED_HIGH) {
+        /* It would be handed over to a companion controller */
+        fprintf(stderr, "ehci_model: %s: root ports take high speed devices, "
+                "use a hub\n", dev->name);
+        return -1;
+    }
+
+    model_lock(m);
+    dev->parent = NULL;
+    dev->port = port;
+    dev->t_attach = sim_now_ns();
+    m->port[port - 1] = dev;
+    sc = &m->op->portsc[port - 1];
+    *sc = (*sc & ~(EHCI_PORT_ENABLE | EHCI_PORT_SPEED_MASK)) |
+          EHCI_PORT_CONNECT | EHCI_PORT_CONNECT_C | port_line_state(dev);
+    irq_raise_locked(m, EHCISTS_PORTC_DET);
+    model_unlock(m);
+    return 0;
+}
+
+void ehci_model_detach(struct ehci_model *m, int port)
+{
+    volatile uint32_t *sc;
+
+    if (port < 1 || port > m->nports || !m->port[port - 1]) {
+        return;
+    }
+
+    model_lock(m);
+    m->port[port - 1] = NULL;
+    sc = &m->op->portsc[port - 1];
+    *sc = (*sc & ~(EHCI_PORT_CONNECT | EHCI_PORT_ENABLE |
+                   EHCI_PORT_SPEED_MASK)) | EHCI_PORT_CONNECT_C;
+    irq_raise_locked(m, EHCISTS_PORTC_DET);
+    model_unlock(m);
+}
+
+struct sim_dev *ehci_model_port_dev(struct ehci_model *m, int port)
+{
+    if (port < 1 || port > m->nports) {
+        return NULL;
+    }
+    return m->port[port - 1];
+}
+
+uint32_t ehci_model_irq_pending(struct ehci_model *m)
+{
+    return m->op->usbsts & m->op->usbintr & EHCISTS_MASK;
+}
+
+void ehci_model_get_stats(struct ehci_model *m, struct ehci_model_stats *st)
+{
+    model_lock(m);
+    *st = m->stats;
+    model_unlock(m);
+}
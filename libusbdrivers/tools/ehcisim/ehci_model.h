@@ -0,0 +1,66 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Software model of an EHCI host controller.
+ *
+ * The model owns a register block that the unmodified driver maps as if it
+ * was MMIO. The driver's view is read only: every store traps and is decoded
+ * and applied with the register's real semantics (write-1-to-clear status
+ * bits, self clearing reset and so on). A model thread walks the periodic
+ * and asynchronous schedules in ordinary memory, moving data between qTDs,
+ * iTDs and siTDs and the simulated devices attached to the root ports.
+ *
+ * DMA memory must be identity mapped below 4GiB, see sim_plat.c.
+ * Register write decoding is specific to x86-64 Linux.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "sim_dev.h"
+
+#define EHCI_MODEL_MAX_PORTS   15
+
+struct ehci_model;
+
+struct ehci_model_stats {
+    uint64_t uframes;
+    uint64_t qtds;          /* qTDs retired */
+    uint64_t packets;       /* Data packets moved */
+    uint64_t bytes;
+    uint64_t naks;
+    uint64_t irqs;          /* Interrupts raised */
+    uint64_t reg_writes;    /* Trapped register stores */
+};
+
+/** Create a controller with nports root ports, not yet running */
+struct ehci_model *ehci_model_create(int nports);
+
+/** Start the schedule walker thread */
+int ehci_model_start(struct ehci_model *m);
+
+/** Stop the walker thread */
+void ehci_model_stop(struct ehci_model *m);
+
+/** Base address of the capability registers, as seen by the driver */
+uintptr_t ehci_model_regs(struct ehci_model *m);
+
+/** Plug a device into a root port, 1 based */
+int ehci_model_attach(struct ehci_model *m, int port, struct sim_dev *dev);
+
+/** Unplug the device from a root port */
+void ehci_model_detach(struct ehci_model *m, int port);
+
+/** Device on a root port, or NULL */
+struct sim_dev *ehci_model_port_dev(struct ehci_model *m, int port);
+
+/**
+ * Interrupt status bits that are both pending and enabled. The interrupt
+ * line is level triggered, the driver's handler clears the status bits.
+ */
+uint32_t ehci_model_irq_pending(struct ehci_model *m);
+
+void ehci_model_get_stats(struct ehci_model *m, struct ehci_model_stats *st);
@@ -0,0 +1,854 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Runs the unmodified USB stack against the EHCI model and a simulated
+ * device tree, then reports enumeration latency, transfer throughput and
+ * allocator traffic.
+ *
+ * usage: ehcisim [-p ports] [-s MiB] [topology]
+ *
+ * A topology is a list of devices for consecutive root ports, a hub takes
+ * a list for its own ports in brackets:
+ *
+ *     hub:4(msc:16M,hid:text,zero),zero
+ *
+ * Devices: hub[:ports], msc[:size], hid[:text], zero[:fs], dead[:fs].
+ */
+#include <ctype.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platsupport/delay.h>
+#include <usb/usb.h>
+
+#include "../../src/drivers/storage.h"
+#include "ehci_model.h"
+#include "sim_dev.h"
+#include "sim_plat.h"
+
+#define DEFAULT_TOPOLOGY    "hub:4(msc,hid,zero,dead),zero"
+#define MAX_DEVS            64
+#define MAX_ROOT            EHCI_MODEL_MAX_PORTS
+#define SETTLE_TIMEOUT_MS   10000
+#define STREAM_DEPTH        8
+#define STREAM_XFER         (16 * 1024)
+#define SYNC_XFERS          64
+#define STALL_XFERS         3
+#define MSC_XFER_BLOCKS     8
+#define MSC_BLOCK           512
+
+struct node {
+    struct sim_dev *dev;
+    const char *kind;
+    char args[64];
+};
+
+struct kind {
+    const char *name;
+    struct sim_dev *(*create)(const char *args);
+};
+
+static const struct kind kinds[] = {
+    { "hub",  sim_hub_new },
+    { "msc",  sim_msc_new },
+    { "hid",  sim_hid_new },
+    { "zero", sim_zero_new },
+    { "dead", sim_dead_new },
+};
+
+static struct node nodes[MAX_DEVS];
+static int nnodes;
+static struct sim_dev *roots[MAX_ROOT];
+static int nroots;
+
+static usb_t usb;
+
+static double ms_since(uint64_t t0, uint64_t t)
+{
+    return t ? (double)(t - t0) / 1e6 : -1.0;
+}
+
+static void sleep_ms(int ms)
+{
+    ps_udelay(ms * 1000UL);
+}
+
+/****************
+ *** Topology ***
+ ****************/
+
+static int parse_list(const char **s, struct sim_dev *hub);
+
+static struct sim_dev *parse_dev(const char **s)
+{
+    struct node *n;
+    char name[16];
+    int len = 0;
+    size_t i;
+
+    if (nnodes == MAX_DEVS) {
+        fprintf(stderr, "too many devices\n");
+        return NULL;
+    }
+    n = &nodes[nnodes];
+
+    while (isalnum((unsigned char)**s) && len < (int)sizeof(name) - 1) {
+        name[len++] = *(*s)++;
+    }
+    name[len] = '\0';
+
+    len = 0;
+    if (**s == ':') {
+        (*s)++;
+        while (**s && !strchr(",()", **s) && len < (int)sizeof(n->args) - 1) {
+            n->args[len++] = *(*s)++;
+        }
+    }
+    n->args[len] = '\0';
+
+    for (i = 0; i < ARRAY_SIZE(kinds); i++) {
+        if (!strcmp(name, kinds[i].name)) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(kinds)) {
+        fprintf(stderr, "unknown device '%s'\n", name);
+        return NULL;
+    }
+    n->kind = kinds[i].name;
+    n->dev = kinds[i].create(n->args);
+    if (!n->dev) {
+        return NULL;
+    }
+    nnodes++;
+
+    if (**s == '(') {
+        if (strcmp(n->kind, "hub")) {
+            fprintf(stderr, "only hubs have ports\n");
+            return NULL;
+        }
+        (*s)++;
+        if (parse_list(s, n->dev)) {
+            return NULL;
+        }
+        if (**s != ')') {
+            fprintf(stderr, "missing ')'\n");
+            return NULL;
+        }
+        (*s)++;
+    }
+    return n->dev;
+}
+
+/* Devices for consecutive ports of a hub, or the root ports */
+static int parse_list(const char **s, struct sim_dev *hub)
+{
+    struct sim_dev *d;
+    int port = 1;
+
+    for (;;) {
+        d = parse_dev(s);
+        if (!d) {
+            return -1;
+        }
+        if (hub) {
+            if (sim_hub_attach(hub, port, d)) {
+                fprintf(stderr, "hub has no port %d\n", port);
+                return -1;
+            }
+        } else {
+            if (nroots == MAX_ROOT) {
+                fprintf(stderr, "too many root devices\n");
+                return -1;
+            }
+            roots[nroots] = d;
+            nroots++;
+        }
+        port++;
+        if (**s != ',') {
+            return 0;
+        }
+        (*s)++;
+    }
+}
+
+static void dev_path(struct sim_dev *d, char *buf, size_t len)
+{
+    size_t n;
+
+    if (d->parent) {
+        dev_path(d->parent, buf, len);
+        n = strlen(buf);
+        snprintf(buf + n, len - n, ".%d", d->port);
+    } else {
+        snprintf(buf, len, "%d", d->port);
+    }
+}
+
+static int all_settled(void)
+{
+    int i;
+
+    for (i = 0; i < nroots; i++) {
+        if (!sim_dev_settled(roots[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* A device that failed to enumerate must not keep its address */
+static int check_dead(struct node *n)
+{
+    usb_dev_t *udev = NULL;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        sim_plat_lock();
+        udev = usb_get_device(&usb, n->dev->addr);
+        sim_plat_unlock();
+        if (!udev) {
+            break;
+        }
+        sleep_ms(1);
+    }
+
+    printf("  %-6s failed enumeration, address %d %s\n", n->kind,
+           n->dev->addr, udev ? "still in use" : "released");
+    return udev ? -1 : 0;
+}
+
+/***************
+ *** Helpers ***
+ ***************/
+
+/* A control request without a data stage */
+static int ctrl_nodata(usb_dev_t *udev, uint8_t type, uint8_t request,
+                       uint16_t value, uint16_t index)
+{
+    struct usbreq *req;
+    struct xact xact;
+    int err;
+
+    xact.type = PID_SETUP;
+    xact.len = sizeof(*req);
+    if (usb_alloc_xact(udev->dman, &xact, 1)) {
+        return -1;
+    }
+    req = xact_get_vaddr(&xact);
+    req->bmRequestType = type;
+    req->bRequest = request;
+    req->wValue = value;
+    req->wIndex = index;
+    req->wLength = 0;
+
+    err = usbdev_schedule_xact(udev, udev->ep_ctrl, &xact, 1, NULL, NULL);
+    usb_destroy_xact(udev->dman, &xact, 1);
+    return err < 0 ? -1 : 0;
+}
+
+static int set_configuration(usb_dev_t *udev, int cfg)
+{
+    return ctrl_nodata(udev, USB_DIR_OUT | USB_TYPE_STD | USB_RCPT_DEVICE,
+                       SET_CONFIGURATION, cfg, 0);
+}
+
+static struct endpoint *find_ep(usb_dev_t *udev, enum usb_endpoint_type type,
+                                enum usb_endpoint_dir dir)
+{
+    int i;
+
+    for (i = 0; i < USB_MAX_EPS && udev->ep[i]; i++) {
+        if (udev->ep[i]->type == type && udev->ep[i]->dir == dir) {
+            return udev->ep[i];
+        }
+    }
+    return NULL;
+}
+
+/* Populate the endpoints and select the configuration */
+static int configure(usb_dev_t *udev)
+{
+    if (usbdev_parse_config(udev, NULL, NULL)) {
+        return -1;
+    }
+    return set_configuration(udev, 1);
+}
+
+/*****************
+ *** Streaming ***
+ *****************/
+
+struct stream;
+
+struct stream_slot {
+    struct stream *s;
+    struct xact xact;
+};
+
+struct stream {
+    usb_dev_t *udev;
+    struct endpoint *ep;
+    struct stream_slot slot[STREAM_DEPTH];
+    uint64_t target;
+    uint64_t queued;
+    uint64_t bytes;
+    int inflight;
+    int errors;
+    int bad_data;
+};
+
+/* Every packet from the zero device is a single repeated byte */
+static int zero_packets_ok(const uint8_t *buf, int len, int max_pkt)
+{
+    int i;
+
+    for (i = 1; i < len; i++) {
+        if (i % max_pkt && buf[i] != buf[i - 1]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Runs from the interrupt handler */
+static int stream_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+    struct stream_slot *sl = token;
+    struct stream *s = sl->s;
+    int len = sl->xact.len - rbytes;
+
+    if (stat != XACTSTAT_SUCCESS) {
+        s->errors++;
+        s->inflight--;
+        return 0;
+    }
+    if (sl->xact.type == PID_IN &&
+        !zero_packets_ok(xact_get_vaddr(&sl->xact), len, s->ep->max_pkt)) {
+        s->bad_data++;
+    }
+    s->bytes += len;
+
+    if (s->queued < s->target) {
+        s->queued += sl->xact.len;
+        if (usbdev_schedule_xact(s->udev, s->ep, &sl->xact, 1, stream_cb,
+                                 sl) < 0) {
+            s->errors++;
+            s->inflight--;
+        }
+    } else {
+        s->inflight--;
+    }
+    return 0;
+}
+
+static double run_stream(usb_dev_t *udev, struct endpoint *ep,
+                         enum usb_xact_type type, uint64_t target,
+                         struct stream *s)
+{
+    uint64_t t0, t1;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->udev = udev;
+    s->ep = ep;
+    s->target = target;
+    for (i = 0; i < STREAM_DEPTH; i++) {
+        s->slot[i].s = s;
+        s->slot[i].xact.type = type;
+        s->slot[i].xact.len = STREAM_XFER;
+        if (usb_alloc_xact(udev->dman, &s->slot[i].xact, 1)) {
+            return -1;
+        }
+    }
+
+    t0 = sim_now_ns();
+    sim_plat_lock();
+    for (i = 0; i < STREAM_DEPTH && s->queued < target; i++) {
+        s->queued += STREAM_XFER;
+        s->inflight++;
+        if (usbdev_schedule_xact(udev, ep, &s->slot[i].xact, 1, stream_cb,
+                                 &s->slot[i]) < 0) {
+            s->inflight--;
+            s->errors++;
+        }
+    }
+    sim_plat_unlock();
+
+    while (*(volatile int *)&s->inflight) {
+        sleep_ms(1);
+    }
+    t1 = sim_now_ns();
+
+    for (i = 0; i < STREAM_DEPTH; i++) {
+        usb_destroy_xact(udev->dman, &s->slot[i].xact, 1);
+    }
+    return (double)s->bytes / ((double)(t1 - t0) / 1e9) / (1 << 20);
+}
+
+static double run_sync(usb_dev_t *udev, struct endpoint *ep,
+                       enum usb_xact_type type, int *errors)
+{
+    struct xact xact;
+    uint64_t t0, t1, bytes = 0;
+    int i, ret;
+
+    xact.type = type;
+    xact.len = STREAM_XFER;
+    if (usb_alloc_xact(udev->dman, &xact, 1)) {
+        return -1;
+    }
+
+    t0 = sim_now_ns();
+    for (i = 0; i < SYNC_XFERS; i++) {
+        sim_plat_lock();
+        ret = usbdev_schedule_xact(udev, ep, &xact, 1, NULL, NULL);
+        sim_plat_unlock();
+        if (ret < 0) {
+            (*errors)++;
+        } else {
+            bytes += xact.len - ret;
+        }
+    }
+    t1 = sim_now_ns();
+
+    usb_destroy_xact(udev->dman, &xact, 1);
+    return (double)bytes / ((double)(t1 - t0) / 1e9) / (1 << 20);
+}
+
+/* Runs from the interrupt handler */
+static int stall_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+    int *status = token;
+
+    *status = stat;
+    return 0;
+}
+
+/*
+ * Queue transfers on a halted bulk IN endpoint. Each must come back with an
+ * error, and the endpoint must work again once the halt is cleared.
+ */
+static int check_stall(usb_dev_t *udev, struct endpoint *in, struct node *n)
+{
+    struct xact xact[STALL_XFERS];
+    volatile int status[STALL_XFERS];
+    int i, ret;
+    int errors = 0;
+    int failed = 0;
+
+    for (i = 0; i < STALL_XFERS; i++) {
+        xact[i].type = PID_IN;
+        xact[i].len = STREAM_XFER;
+        if (usb_alloc_xact(udev->dman, &xact[i], 1)) {
+            return -1;
+        }
+        status[i] = XACTSTAT_PENDING;
+    }
+
+    sim_plat_lock();
+    errors += ctrl_nodata(udev, USB_DIR_OUT | USB_TYPE_VEN | USB_RCPT_DEVICE,
+                          ZERO_REQ_HALT, 0, 0x81) != 0;
+    for (i = 0; i < STALL_XFERS; i++) {
+        errors += usbdev_schedule_xact(udev, in, &xact[i], 1, stall_cb,
+                                       (void *)&status[i]) < 0;
+    }
+    sim_plat_unlock();
+
+    for (i = 0; i < STALL_XFERS; i++) {
+        while (status[i] == XACTSTAT_PENDING) {
+            sleep_ms(1);
+        }
+        failed += status[i] == XACTSTAT_ERROR;
+    }
+
+    sim_plat_lock();
+    errors += ctrl_nodata(udev, USB_DIR_OUT | USB_TYPE_STD | USB_RCPT_ENDPOINT,
+                          CLR_FEATURE, 0, 0x81) != 0;
+    ret = usbdev_schedule_xact(udev, in, &xact[0], 1, NULL, NULL);
+    sim_plat_unlock();
+    if (ret < 0 || !zero_packets_ok(xact_get_vaddr(&xact[0]),
+                                    xact[0].len - ret, in->max_pkt)) {
+        errors++;
+    }
+
+    printf("  %-6s stalled bulk IN      %d of %d failed, %s\n", n->kind,
+           failed, STALL_XFERS, errors ? "not recovered" : "recovered");
+
+    for (i = 0; i < STALL_XFERS; i++) {
+        usb_destroy_xact(udev->dman, &xact[i], 1);
+    }
+    return errors || failed != STALL_XFERS ? -1 : 0;
+}
+
+static int bench_zero(usb_dev_t *udev, struct node *n, uint64_t target)
+{
+    struct endpoint *in, *out;
+    struct stream s;
+    double rate;
+    int errors = 0;
+
+    sim_plat_lock();
+    errors = configure(udev);
+    sim_plat_unlock();
+    in = find_ep(udev, EP_BULK, EP_DIR_IN);
+    out = find_ep(udev, EP_BULK, EP_DIR_OUT);
+    if (errors || !in || !out) {
+        printf("  %-6s configuration failed\n", n->kind);
+        return -1;
+    }
+
+    rate = run_stream(udev, in, PID_IN, target, &s);
+    printf("  %-6s bulk IN  queued x%d  %8.1f MiB/s\n", n->kind,
+           STREAM_DEPTH, rate);
+    errors += s.errors + s.bad_data;
+
+    rate = run_stream(udev, out, PID_OUT, target, &s);
+    printf("  %-6s bulk OUT queued x%d  %8.1f MiB/s\n", n->kind,
+           STREAM_DEPTH, rate);
+    errors += s.errors;
+
+    rate = run_sync(udev, in, PID_IN, &errors);
+    printf("  %-6s bulk IN  sync         %8.1f MiB/s\n", n->kind, rate);
+    rate = run_sync(udev, out, PID_OUT, &errors);
+    printf("  %-6s bulk OUT sync         %8.1f MiB/s\n", n->kind, rate);
+
+    errors += check_stall(udev, in, n) != 0;
+
+    if (errors) {
+        printf("  %-6s %d transfer errors\n", n->kind, errors);
+    }
+    return errors ? -1 : 0;
+}
+
+/***************
+ *** Storage ***
+ ***************/
+
+static int msc_rw(usb_dev_t *udev, uint32_t lba, struct xact *data, int write)
+{
+    uint8_t cdb[10] = { write ? 0x2a : 0x28 };
+
+    cdb[2] = lba >> 24;
+    cdb[3] = lba >> 16;
+    cdb[4] = lba >> 8;
+    cdb[5] = lba;
+    cdb[8] = MSC_XFER_BLOCKS;
+    return usb_storage_xfer(udev, cdb, sizeof(cdb), data, 1, !write);
+}
+
+static int bench_msc(usb_dev_t *udev, struct node *n)
+{
+    struct xact data;
+    uint8_t *disk, *buf;
+    uint32_t nblocks, lba;
+    uint64_t t0, t1;
+    int errors = 0;
+    int nread = 0;
+    int i, err;
+
+    nblocks = sim_msc_blocks(n->dev, &disk);
+
+    sim_plat_lock();
+    err = usb_storage_bind(udev);
+    sim_plat_unlock();
+    if (err) {
+        printf("  %-6s bind failed\n", n->kind);
+        return -1;
+    }
+
+    data.len = MSC_XFER_BLOCKS * MSC_BLOCK;
+    if (usb_alloc_xact(udev->dman, &data, 1)) {
+        return -1;
+    }
+    buf = xact_get_vaddr(&data);
+
+    /* Write a block run, then read it and a few others back */
+    data.type = PID_OUT;
+    for (i = 0; i < data.len; i++) {
+        buf[i] = i ^ 0x5a;
+    }
+    lba = nblocks / 2;
+    sim_plat_lock();
+    err = msc_rw(udev, lba, &data, 1);
+    sim_plat_unlock();
+    if (err || memcmp(disk + (size_t)lba * MSC_BLOCK, buf, data.len)) {
+        errors++;
+    }
+
+    data.type = PID_IN;
+    t0 = sim_now_ns();
+    for (i = 0; i < 4; i++) {
+        lba = i == 0 ? nblocks / 2 : (nblocks / 4) * (i - 1);
+        memset(buf, 0, data.len);
+        sim_plat_lock();
+        err = msc_rw(udev, lba, &data, 0);
+        sim_plat_unlock();
+        if (err || memcmp(disk + (size_t)lba * MSC_BLOCK, buf, data.len)) {
+            errors++;
+        }
+        nread++;
+    }
+    t1 = sim_now_ns();
+
+    usb_destroy_xact(udev->dman, &data, 1);
+    printf("  %-6s %d x READ(10) of %d blocks, %.1f ms each, %s\n", n->kind,
+           nread, MSC_XFER_BLOCKS, ms_since(t0, t1) / nread,
+           errors ? "MISMATCH" : "data ok");
+    return errors ? -1 : 0;
+}
+
+/***********
+ *** HID ***
+ ***********/
+
+struct hid_rx {
+    usb_dev_t *udev;
+    struct endpoint *ep;
+    struct xact xact;
+    char text[64];
+    int len;
+    int reports;
+    int expected;
+    volatile int done;
+};
+
+static char hid_char(const uint8_t *r)
+{
+    char c;
+
+    if (r[2] >= 4 && r[2] <= 29) {
+        c = 'a' + r[2] - 4;
+        return (r[0] & 0x22) ? toupper(c) : c;
+    }
+    if (r[2] >= 30 && r[2] <= 38) {
+        return '1' + r[2] - 30;
+    }
+    switch (r[2]) {
+    case 39:
+        return '0';
+    case 40:
+        return '\n';
+    case 44:
+        return ' ';
+    default:
+        return '/';
+    }
+}
+
+/* Runs from the interrupt handler */
+static int hid_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+    struct hid_rx *h = token;
+    const uint8_t *r = xact_get_vaddr(&h->xact);
+
+    if (stat != XACTSTAT_SUCCESS) {
+        h->done = 1;
+        return 0;
+    }
+    h->reports++;
+    if (r[2] && h->len < (int)sizeof(h->text) - 1) {
+        h->text[h->len++] = hid_char(r);
+    }
+    if (h->reports >= h->expected) {
+        h->done = 1;
+        return 0;
+    }
+    usbdev_schedule_xact(h->udev, h->ep, &h->xact, 1, hid_cb, h);
+    return 0;
+}
+
+static int bench_hid(usb_dev_t *udev, struct node *n)
+{
+    const char *script = n->args[0] ? n->args : "hello";
+    char expect[64];
+    struct hid_rx h;
+    uint64_t t0, t1;
+    int i, err;
+
+    for (i = 0; script[i] && i < (int)sizeof(expect) - 1; i++) {
+        expect[i] = isalnum((unsigned char)script[i]) || script[i] == ' ' ||
+                    script[i] == '\n' ? script[i] : '/';
+    }
+    expect[i] = '\0';
+
+    memset(&h, 0, sizeof(h));
+    h.udev = udev;
+    h.expected = 2 * strlen(expect);
+
+    sim_plat_lock();
+    err = configure(udev);
+    sim_plat_unlock();
+    h.ep = find_ep(udev, EP_INTERRUPT, EP_DIR_IN);
+    if (err || !h.ep) {
+        printf("  %-6s configuration failed\n", n->kind);
+        return -1;
+    }
+
+    h.xact.type = PID_IN;
+    h.xact.len = h.ep->max_pkt;
+    if (usb_alloc_xact(udev->dman, &h.xact, 1)) {
+        return -1;
+    }
+
+    t0 = sim_now_ns();
+    sim_plat_lock();
+    err = usbdev_schedule_xact(udev, h.ep, &h.xact, 1, hid_cb, &h);
+    sim_plat_unlock();
+    for (i = 0; !err && !h.done && i < 5000; i++) {
+        sleep_ms(1);
+    }
+    t1 = sim_now_ns();
+
+    printf("  %-6s %d reports in %.1f ms, %.2f ms apart, typed \"%s\"\n",
+           n->kind, h.reports, ms_since(t0, t1),
+           h.reports ? ms_since(t0, t1) / h.reports : 0.0, h.text);
+    /* The endpoint stays scheduled, so the buffer is not freed */
+    return err || strcmp(h.text, expect) ? -1 : 0;
+}
+
+/************
+ *** Main ***
+ ************/
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p ports] [-s MiB] [topology]\n"
+            "  default topology: %s\n", prog, DEFAULT_TOPOLOGY);
+}
+
+int main(int argc, char **argv)
+{
+    const char *topology = DEFAULT_TOPOLOGY;
+    const char *s;
+    struct ehci_model *m;
+    struct ehci_model_stats ms;
+    struct sim_plat_stats ps;
+    ps_io_ops_t io_ops;
+    ps_mutex_ops_t sync;
+    uint64_t t_start, t_settled, target = 16ULL << 20;
+    usb_dev_t *udev;
+    char path[32];
+    int nports = 4;
+    int failed = 0;
+    int opt, i, err;
+
+    while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            nports = atoi(optarg);
+            break;
+        case 's':
+            target = strtoull(optarg, NULL, 0) << 20;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc) {
+        topology = argv[optind];
+    }
+
+    s = topology;
+    if (parse_list(&s, NULL) || *s) {
+        fprintf(stderr, "bad topology at '%s'\n", s);
+        return 2;
+    }
+    nports = MAX(nports, nroots);
+
+    m = ehci_model_create(nports);
+    if (!m || sim_plat_init(m, &io_ops, &sync) || ehci_model_start(m)) {
+        return 1;
+    }
+
+    /* Enumeration */
+    t_start = sim_now_ns();
+    for (i = 0; i < nroots; i++) {
+        if (ehci_model_attach(m, i + 1, roots[i])) {
+            return 1;
+        }
+    }
+    sim_plat_start_irq(&usb);
+    sim_plat_lock();
+    err = usb_init(USB_HOST_DEFAULT, &io_ops, &sync, &usb);
+    sim_plat_unlock();
+    if (err) {
+        fprintf(stderr, "usb_init failed\n");
+        return 1;
+    }
+    for (i = 0; !all_settled() && i < SETTLE_TIMEOUT_MS; i++) {
+        sleep_ms(1);
+    }
+    t_settled = sim_now_ns();
+
+    printf("Topology %s\n", topology);
+    printf("Enumeration %s after %.1f ms\n",
+           all_settled() ? "complete" : "TIMED OUT",
+           ms_since(t_start, t_settled));
+    printf("  %-8s %-6s %4s %10s %10s %10s\n", "port", "device", "addr",
+           "attach", "address", "ready");
+    for (i = 0; i < nnodes; i++) {
+        struct sim_dev *d = nodes[i].dev;
+
+        dev_path(d, path, sizeof(path));
+        printf("  %-8s %-6s %4d %8.1fms %8.1fms %8.1fms\n", path,
+               nodes[i].kind, d->addr, ms_since(t_start, d->t_attach),
+               ms_since(t_start, d->t_addressed),
+               ms_since(t_start, d->t_enumerated));
+    }
+    if (!all_settled()) {
+        failed = 1;
+    }
+    for (i = 0; i < nnodes && !failed; i++) {
+        if (!strcmp(nodes[i].kind, "dead")) {
+            failed |= check_dead(&nodes[i]) != 0;
+        }
+    }
+
+    /* Transfers */
+    printf("Transfers\n");
+    for (i = 0; i < nnodes && !failed; i++) {
+        udev = usb_get_device(&usb, nodes[i].dev->addr);
+        if (!udev) {
+            continue;
+        }
+        if (!strcmp(nodes[i].kind, "zero")) {
+            failed |= bench_zero(udev, &nodes[i], target) != 0;
+        } else if (!strcmp(nodes[i].kind, "msc")) {
+            failed |= bench_msc(udev, &nodes[i]) != 0;
+        } else if (!strcmp(nodes[i].kind, "hid")) {
+            failed |= bench_hid(udev, &nodes[i]) != 0;
+        }
+    }
+
+    sim_plat_stop_irq();
+    ehci_model_stop(m);
+
+    ehci_model_get_stats(m, &ms);
+    sim_plat_get_stats(&ps);
+    printf("Controller\n");
+    printf("  %llu micro frames, %llu qTDs, %llu packets, %llu bytes, "
+           "%llu NAKs\n", (unsigned long long)ms.uframes,
+           (unsigned long long)ms.qtds, (unsigned long long)ms.packets,
+           (unsigned long long)ms.bytes, (unsigned long long)ms.naks);
+    printf("  %llu interrupts, %llu register writes\n",
+           (unsigned long long)ms.irqs, (unsigned long long)ms.reg_writes);
+    printf("Allocations\n");
+    printf("  malloc %llu, free %llu\n", (unsigned long long)ps.mallocs,
+           (unsigned long long)ps.frees);
+    printf("  DMA %llu allocs, %llu frees, %llu bytes in use, %llu peak\n",
+           (unsigned long long)ps.dma_allocs,
+           (unsigned long long)ps.dma_frees,
+           (unsigned long long)ps.dma_bytes,
+           (unsigned long long)ps.dma_peak);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed;
+}
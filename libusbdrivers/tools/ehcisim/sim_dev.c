@@ -0,0 +1,340 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Common part of the simulated devices: descriptors, addressing and the
+ * default control pipe.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim_dev.h"
+
+#define LANGID_EN_US  0x0409
+
+uint64_t sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sim_dev_init(struct sim_dev *d, const char *name, enum usb_speed speed,
+                  uint16_t vid, uint16_t pid, uint8_t cls)
+{
+    struct config_desc *cfg = (struct config_desc *)d->config;
+
+    memset(d, 0, sizeof(*d));
+    d->name = name;
+    d->speed = speed;
+
+    d->desc.bLength = sizeof(d->desc);
+    d->desc.bDescriptorType = DEVICE;
+    d->desc.bcdUSB = speed == USBSPEED_HIGH ? 0x200 : 0x110;
+    d->desc.bDeviceClass = cls;
+    d->desc.bMaxPacketSize0 = speed == USBSPEED_LOW ? 8 : 64;
+    d->desc.idVendor = vid;
+    d->desc.idProduct = pid;
+    d->desc.bcdDevice = 0x100;
+    d->desc.iManufacturer = 1;
+    d->desc.iProduct = 2;
+    d->desc.bNumConfigurations = 1;
+    d->strings[0] = "seL4 ehcisim";
+    d->strings[1] = name;
+
+    cfg->bLength = sizeof(*cfg);
+    cfg->bDescriptorType = CONFIGURATION;
+    cfg->bConfigurationValue = 1;
+    cfg->bmAttributes = BIT(7);
+    cfg->bMaxPower = 50;
+    d->config_len = sizeof(*cfg);
+    cfg->wTotalLength = d->config_len;
+}
+
+void sim_dev_add_desc(struct sim_dev *d, const void *desc, int len)
+{
+    struct config_desc *cfg = (struct config_desc *)d->config;
+
+    if (d->config_len + len > (int)sizeof(d->config)) {
+        fprintf(stderr, "%s: configuration descriptor overflow\n", d->name);
+        return;
+    }
+    memcpy(d->config + d->config_len, desc, len);
+    d->config_len += len;
+    cfg->wTotalLength = d->config_len;
+}
+
+void sim_dev_add_iface(struct sim_dev *d, uint8_t cls, uint8_t subcls,
+                       uint8_t proto, int neps)
+{
+    struct config_desc *cfg = (struct config_desc *)d->config;
+    struct iface_desc idesc = {
+        .bLength = sizeof(idesc),
+        .bDescriptorType = INTERFACE,
+        .bInterfaceNumber = cfg->bNumInterfaces,
+        .bNumEndpoints = neps,
+        .bInterfaceClass = cls,
+        .bInterfaceSubClass = subcls,
+        .bInterfaceProtocol = proto,
+    };
+
+    sim_dev_add_desc(d, &idesc, sizeof(idesc));
+    cfg->bNumInterfaces++;
+}
+
+void sim_dev_add_ep(struct sim_dev *d, uint8_t addr, uint8_t type,
+                    uint16_t max_pkt, uint8_t interval)
+{
+    struct endpoint_desc edesc = {
+        .bLength = sizeof(edesc),
+        .bDescriptorType = ENDPOINT,
+        .bEndpointAddress = addr,
+        .bmAttributes = type,
+        .wMaxPacketSize = max_pkt,
+        .bInterval = interval,
+    };
+
+    sim_dev_add_desc(d, &edesc, sizeof(edesc));
+}
+
+uint16_t sim_bulk_max_pkt(struct sim_dev *d)
+{
+    return d->speed == USBSPEED_HIGH ? 512 : 64;
+}
+
+struct sim_dev *sim_dev_route(struct sim_dev *d, uint8_t addr)
+{
+    if (d->addr == addr) {
+        return d;
+    }
+    if (d->route) {
+        return d->route(d, addr);
+    }
+    return NULL;
+}
+
+void sim_dev_reset(struct sim_dev *d)
+{
+    d->addr = 0;
+    d->new_addr = 0;
+    d->cfg_value = 0;
+    d->ctrl_len = 0;
+    d->ctrl_pos = 0;
+    d->ctrl_stall = 0;
+    d->t_addressed = 0;
+    d->t_enumerated = 0;
+    if (d->reset) {
+        d->reset(d);
+    }
+}
+
+int sim_dev_settled(struct sim_dev *d)
+{
+    if (!d->t_enumerated) {
+        return 0;
+    }
+    return d->settled ? d->settled(d) : 1;
+}
+
+/*******************************
+ *** Default control pipe ***
+ *******************************/
+
+static int string_desc(struct sim_dev *d, int idx, uint8_t *buf)
+{
+    const char *s;
+    int i;
+
+    buf[1] = STRING;
+    if (idx == 0) {
+        buf[0] = 4;
+        buf[2] = LANGID_EN_US & 0xff;
+        buf[3] = LANGID_EN_US >> 8;
+        return 4;
+    }
+    if (idx > SIM_MAX_STR || !d->strings[idx - 1]) {
+        return SIM_STALL;
+    }
+
+    s = d->strings[idx - 1];
+    for (i = 0; s[i] && 2 + 2 * i < SIM_CTRL_BUF - 2 && i < 126; i++) {
+        buf[2 + 2 * i] = s[i];
+        buf[3 + 2 * i] = 0;
+    }
+    buf[0] = 2 + 2 * i;
+
+    /* The product string is the last thing the host reads */
+    if (idx == d->desc.iProduct && !d->t_enumerated) {
+        d->t_enumerated = sim_now_ns();
+    }
+    return buf[0];
+}
+
+/* Standard requests, IN data goes to buf */
+static int std_request(struct sim_dev *d, struct usbreq *req, uint8_t *buf)
+{
+    int type = req->wValue >> 8;
+
+    switch (req->bRequest) {
+    case GET_DESCRIPTOR:
+        if ((req->bmRequestType & 0x1f) != USB_RCPT_DEVICE) {
+            break;
+        }
+        switch (type) {
+        case DEVICE:
+            /* The first 8 bytes are read before the address is set */
+            if (d->bad_desc && req->wLength > 8) {
+                d->t_enumerated = sim_now_ns();
+                return SIM_STALL;
+            }
+            memcpy(buf, &d->desc, sizeof(d->desc));
+            return sizeof(d->desc);
+        case CONFIGURATION:
+            memcpy(buf, d->config, d->config_len);
+            return d->config_len;
+        case STRING:
+            return string_desc(d, req->wValue & 0xff, buf);
+        default:
+            break;
+        }
+        break;
+    case SET_ADDRESS:
+        /* Takes effect after the status stage */
+        d->new_addr = req->wValue & 0x7f;
+        return 0;
+    case SET_CONFIGURATION:
+        d->cfg_value = req->wValue & 0xff;
+        return 0;
+    case GET_CONFIGURATION:
+        buf[0] = d->cfg_value;
+        return 1;
+    case GET_STATUS:
+        if ((req->bmRequestType & 0x60) != USB_TYPE_STD) {
+            break;
+        }
+        buf[0] = 0;
+        buf[1] = 0;
+        return 2;
+    case CLR_FEATURE:
+        if ((req->bmRequestType & 0x60) != USB_TYPE_STD) {
+            break;
+        }
+        /* ENDPOINT_HALT, the device may have stalled it */
+        if ((req->bmRequestType & 0x1f) == USB_RCPT_ENDPOINT && d->request) {
+            d->request(d, req, buf);
+        }
+        return 0;
+    case SET_INTERFACE:
+    case SET_FEATURE:
+        if ((req->bmRequestType & 0x60) != USB_TYPE_STD) {
+            break;
+        }
+        return 0;
+    default:
+        break;
+    }
+
+    /* Class, vendor or unknown */
+    return d->request ? d->request(d, req, buf) : SIM_STALL;
+}
+
+static int ctrl_setup(struct sim_dev *d, uint8_t *buf, int len)
+{
+    int ret;
+
+    if (len != sizeof(d->setup)) {
+        return SIM_STALL;
+    }
+    memcpy(&d->setup, buf, sizeof(d->setup));
+    d->ctrl_pos = 0;
+    d->ctrl_len = 0;
+    d->ctrl_stall = 0;
+
+    /* OUT data is handled once it has all arrived */
+    if (!(d->setup.bmRequestType & USB_DIR_IN) && d->setup.wLength) {
+        return len;
+    }
+
+    ret = std_request(d, &d->setup, d->ctrl_buf);
+    if (ret < 0) {
+        d->ctrl_stall = 1;
+    } else {
+        d->ctrl_len = MIN(ret, d->setup.wLength);
+    }
+    return len;
+}
+
+static int ctrl_in(struct sim_dev *d, uint8_t *buf, int len)
+{
+    int n;
+
+    if (d->ctrl_stall) {
+        return SIM_STALL;
+    }
+
+    /* Data stage */
+    if (d->setup.bmRequestType & USB_DIR_IN) {
+        n = MIN(len, d->ctrl_len - d->ctrl_pos);
+        memcpy(buf, d->ctrl_buf + d->ctrl_pos, n);
+        d->ctrl_pos += n;
+        return n;
+    }
+
+    /* Status stage of an OUT request */
+    if (d->setup.wLength) {
+        if (std_request(d, &d->setup, d->ctrl_buf) < 0) {
+            d->ctrl_stall = 1;
+            return SIM_STALL;
+        }
+    }
+    if (d->setup.bRequest == SET_ADDRESS &&
+        (d->setup.bmRequestType & 0x60) == USB_TYPE_STD) {
+        d->addr = d->new_addr;
+        d->t_addressed = sim_now_ns();
+    }
+    return 0;
+}
+
+static int ctrl_out(struct sim_dev *d, uint8_t *buf, int len)
+{
+    int n;
+
+    if (d->ctrl_stall) {
+        return SIM_STALL;
+    }
+
+    /* Status stage of an IN request */
+    if (d->setup.bmRequestType & USB_DIR_IN) {
+        return 0;
+    }
+
+    n = MIN(len, (int)sizeof(d->ctrl_buf) - d->ctrl_len);
+    memcpy(d->ctrl_buf + d->ctrl_len, buf, n);
+    d->ctrl_len += n;
+    return n;
+}
+
+int sim_dev_packet(struct sim_dev *d, int pid, int ep, uint8_t *buf, int len)
+{
+    if (ep == 0) {
+        switch (pid) {
+        case PID_SETUP:
+            return ctrl_setup(d, buf, len);
+        case PID_IN:
+            return ctrl_in(d, buf, len);
+        default:
+            return ctrl_out(d, buf, len);
+        }
+    }
+
+    /* Data endpoints only exist once configured */
+    if (!d->cfg_value || !d->packet || pid == PID_SETUP) {
+        return SIM_STALL;
+    }
+    return d->packet(d, pid == PID_IN ? ep | 0x80 : ep, buf, len);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Simulated USB devices. The core handles the default control pipe and the
+ * standard requests from a device's descriptors; a device only implements
+ * its class requests and data endpoints.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <usb/usb.h>
+
+/* Packet handler results, otherwise the number of bytes moved */
+#define SIM_NAK      (-1)
+#define SIM_STALL    (-2)
+
+#define SIM_CTRL_BUF 1024
+#define SIM_MAX_STR  4
+
+struct sim_dev {
+    const char *name;
+    enum usb_speed speed;
+
+    /* Descriptors, filled in by the device constructor */
+    struct device_desc desc;
+    uint8_t config[256];
+    int config_len;
+    const char *strings[SIM_MAX_STR];   /* String indices 1.. */
+
+    /* Device state */
+    uint8_t addr;
+    uint8_t cfg_value;
+    uint8_t new_addr;
+    /* Stall reads of the full device descriptor, enumeration fails */
+    int bad_desc;
+
+    /* Default control pipe */
+    struct usbreq setup;
+    uint8_t ctrl_buf[SIM_CTRL_BUF];
+    int ctrl_len;
+    int ctrl_pos;
+    int ctrl_stall;
+
+    /* Enumeration progress, for benchmarking */
+    uint64_t t_attach;
+    uint64_t t_addressed;
+    uint64_t t_enumerated;
+
+    /* Hub topology */
+    struct sim_dev *parent;
+    int port;
+
+    /**
+     * Class or vendor request. For IN requests fill buf and return the
+     * length, for OUT requests buf holds the data stage. Also sees the
+     * standard CLEAR_FEATURE of an endpoint, whose result is ignored.
+     * @return length, 0 or SIM_STALL.
+     */
+    int (*request)(struct sim_dev *d, struct usbreq *req, uint8_t *buf);
+    /**
+     * Move one packet on a data endpoint.
+     * @param ep  Endpoint number, bit 7 set for IN.
+     * @return    bytes moved, SIM_NAK or SIM_STALL.
+     */
+    int (*packet)(struct sim_dev *d, int ep, uint8_t *buf, int len);
+    /** Bus reset */
+    void (*reset)(struct sim_dev *d);
+    /** Find a downstream device by address, hubs only */
+    struct sim_dev *(*route)(struct sim_dev *d, uint8_t addr);
+    /** Enumerated, including downstream devices */
+    int (*settled)(struct sim_dev *d);
+
+    void *priv;
+};
+
+/** Initialise the common part of a device */
+void sim_dev_init(struct sim_dev *d, const char *name, enum usb_speed speed,
+                  uint16_t vid, uint16_t pid, uint8_t cls);
+
+/** Append a descriptor to the configuration */
+void sim_dev_add_desc(struct sim_dev *d, const void *desc, int len);
+void sim_dev_add_iface(struct sim_dev *d, uint8_t cls, uint8_t subcls,
+                       uint8_t proto, int neps);
+void sim_dev_add_ep(struct sim_dev *d, uint8_t addr, uint8_t type,
+                    uint16_t max_pkt, uint8_t interval);
+
+/** Find the device with address addr at or below d */
+struct sim_dev *sim_dev_route(struct sim_dev *d, uint8_t addr);
+
+/** Bus reset of d */
+void sim_dev_reset(struct sim_dev *d);
+
+/**
+ * Move one packet to or from a device.
+ * @param pid  PID_SETUP, PID_IN or PID_OUT.
+ * @param ep   Endpoint number without direction.
+ * @return     bytes moved, SIM_NAK or SIM_STALL.
+ */
+int sim_dev_packet(struct sim_dev *d, int pid, int ep, uint8_t *buf, int len);
+
+/** Enumerated, including downstream devices */
+int sim_dev_settled(struct sim_dev *d);
+
+/** Max packet size for a bulk endpoint at the device's speed */
+uint16_t sim_bulk_max_pkt(struct sim_dev *d);
+
+/* Device constructors, args come from the topology description */
+struct sim_dev *sim_hub_new(const char *args);
+int sim_hub_attach(struct sim_dev *hub, int port, struct sim_dev *child);
+int sim_hub_port_enabled(struct sim_dev *hub, int port);
+struct sim_dev *sim_msc_new(const char *args);
+struct sim_dev *sim_hid_new(const char *args);
+struct sim_dev *sim_zero_new(const char *args);
+struct sim_dev *sim_dead_new(const char *args);
+
+/* Vendor request to the zero device: halt the endpoint in wIndex */
+#define ZERO_REQ_HALT 0x01
+
+/* Device specific inspection, for checks */
+int sim_msc_blocks(struct sim_dev *d, uint8_t **disk);
+int sim_hid_reports(struct sim_dev *d);
+
+/** Monotonic time in nanoseconds */
+uint64_t sim_now_ns(void);
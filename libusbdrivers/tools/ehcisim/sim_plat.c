@@ -0,0 +1,362 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include <platsupport/delay.h>
+#include <usb/usb_host.h>
+
+#include "../../src/ehci/ehci.h"
+#include "sim_plat.h"
+
+/*
+ * DMA memory comes from an arena below 4GiB where the virtual address is
+ * the physical address. Blocks are powers of two aligned to their size,
+ * small ones are carved out of a page of their own size class so the
+ * class of any block can be found from its page.
+ */
+#define ARENA_SIZE      (128UL << 20)
+#define ARENA_PAGES     (ARENA_SIZE >> 12)
+#define MIN_CLASS       5
+#define MAX_CLASS       24
+#define PAGE_CLASS      12
+
+struct dma_arena {
+    uint8_t *base;
+    uintptr_t top;                          /* Bump pointer */
+    void *free[MAX_CLASS + 1];              /* Free lists */
+    uint8_t page_class[ARENA_PAGES];
+    pthread_mutex_t lock;
+};
+
+static struct dma_arena arena;
+static struct ehci_model *sim_ehci;
+static pthread_mutex_t driver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    atomic_ullong mallocs;
+    atomic_ullong frees;
+    atomic_ullong dma_allocs;
+    atomic_ullong dma_frees;
+    atomic_ullong dma_bytes;
+    atomic_ullong dma_peak;
+} counters;
+
+static struct {
+    pthread_t thread;
+    volatile int running;
+    usb_t *host;
+} irq;
+
+/**************
+ *** Malloc ***
+ **************/
+
+static int sim_malloc(void *cookie, size_t size, void **ptr)
+{
+    *ptr = malloc(size);
+    if (!*ptr) {
+        return -1;
+    }
+    counters.mallocs++;
+    return 0;
+}
+
+static int sim_calloc(void *cookie, size_t nmemb, size_t size, void **ptr)
+{
+    *ptr = calloc(nmemb, size);
+    if (!*ptr) {
+        return -1;
+    }
+    counters.mallocs++;
+    return 0;
+}
+
+static int sim_free(void *cookie, size_t size, void *ptr)
+{
+    /* The stack does not know the size, only count the call */
+    if (ptr) {
+        counters.frees++;
+    }
+    free(ptr);
+    return 0;
+}
+
+/***********
+ *** DMA ***
+ ***********/
+
+static int size_class(size_t size)
+{
+    int c = MIN_CLASS;
+
+    while (c <= MAX_CLASS && (1UL << c) < size) {
+        c++;
+    }
+    return c;
+}
+
+/* Allocate a naturally aligned block of 2^c bytes from the bump pointer */
+static void *arena_carve(int c)
+{
+    uintptr_t sz = 1UL << MAX(c, PAGE_CLASS);
+    uintptr_t p = ALIGN_UP(arena.top, sz);
+    void *blk;
+    uintptr_t off;
+
+    if (p + sz > (uintptr_t)arena.base + ARENA_SIZE) {
+        return NULL;
+    }
+    arena.top = p + sz;
+    arena.page_class[(p - (uintptr_t)arena.base) >> 12] = c;
+
+    /* Split a fresh page into blocks of a small class */
+    if (c < PAGE_CLASS) {
+        for (off = sz - (1UL << c); off > 0; off -= 1UL << c) {
+            blk = (void *)(p + off);
+            *(void **)blk = arena.free[c];
+            arena.free[c] = blk;
+        }
+    }
+    return (void *)p;
+}
+
+static void *sim_dma_alloc(void *cookie, size_t size, int align, int cached,
+                           ps_mem_flags_t flags)
+{
+    int c = size_class(MAX(size, (size_t)align));
+    void *p;
+
+    if (c > MAX_CLASS) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&arena.lock);
+    p = arena.free[c];
+    if (p) {
+        arena.free[c] = *(void **)p;
+    } else {
+        p = arena_carve(c);
+    }
+    pthread_mutex_unlock(&arena.lock);
+
+    if (p) {
+        counters.dma_allocs++;
+        counters.dma_bytes += 1UL << c;
+        if (counters.dma_bytes > counters.dma_peak) {
+            counters.dma_peak = counters.dma_bytes;
+        }
+    }
+    return p;
+}
+
+static void sim_dma_free(void *cookie, void *addr, size_t size)
+{
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)arena.base;
+    int c;
+
+    if (!addr || off >= ARENA_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&arena.lock);
+    c = arena.page_class[off >> 12];
+    *(void **)addr = arena.free[c];
+    arena.free[c] = addr;
+    pthread_mutex_unlock(&arena.lock);
+
+    counters.dma_frees++;
+    counters.dma_bytes -= 1UL << c;
+}
+
+static uintptr_t sim_dma_pin(void *cookie, void *addr, size_t size)
+{
+    return (uintptr_t)addr;
+}
+
+static void sim_dma_unpin(void *cookie, void *addr, size_t size)
+{
+}
+
+static void sim_dma_cache_op(void *cookie, void *addr, size_t size,
+                             dma_cache_op_t op)
+{
+    /* Coherent */
+}
+
+/***************
+ *** Mutexes ***
+ ***************/
+
+static void *sim_mutex_new(void *cookie)
+{
+    pthread_mutex_t *mtx = malloc(sizeof(*mtx));
+
+    if (mtx) {
+        pthread_mutex_init(mtx, NULL);
+    }
+    return mtx;
+}
+
+static int sim_mutex_lock(void *cookie, void *mtx)
+{
+    return pthread_mutex_lock(mtx);
+}
+
+static int sim_mutex_unlock(void *cookie, void *mtx)
+{
+    return pthread_mutex_unlock(mtx);
+}
+
+static int sim_mutex_destroy(void *cookie, void *mtx)
+{
+    pthread_mutex_destroy(mtx);
+    free(mtx);
+    return 0;
+}
+
+/*******************
+ *** Timer, IRQs ***
+ *******************/
+
+void ps_udelay(unsigned long us)
+{
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+    nanosleep(&ts, NULL);
+}
+
+static void *irq_thread(void *arg)
+{
+    struct timespec ts = { 0, 10000 };
+
+    prctl(PR_SET_TIMERSLACK, 1UL);
+    while (irq.running) {
+        if (!ehci_model_irq_pending(sim_ehci)) {
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        sim_plat_lock();
+        usb_handle_irq(irq.host);
+        sim_plat_unlock();
+    }
+    return NULL;
+}
+
+/*****************************
+ *** Platform entry points ***
+ *****************************/
+
+int usb_host_init(enum usb_host_id id, ps_io_ops_t *io_ops,
+                  ps_mutex_ops_t *sync, usb_host_t *hdev)
+{
+    if (!sim_ehci || !io_ops || !hdev) {
+        return -1;
+    }
+
+    hdev->id = id;
+    hdev->dman = &io_ops->dma_manager;
+    hdev->sync = sync;
+
+    return ehci_host_init(hdev, ehci_model_regs(sim_ehci), NULL);
+}
+
+const int *usb_host_irqs(usb_host_t *host, int *nirqs)
+{
+    static int irq_line;
+
+    if (nirqs) {
+        *nirqs = 1;
+    }
+    host->irqs = &irq_line;
+    return host->irqs;
+}
+
+/****************
+ *** Exported ***
+ ****************/
+
+int sim_plat_init(struct ehci_model *m, ps_io_ops_t *io_ops,
+                  ps_mutex_ops_t *sync)
+{
+    void *base;
+
+    base = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE,
+                -1, 0);
+    if (base == MAP_FAILED) {
+        perror("sim_plat: DMA arena");
+        return -1;
+    }
+    arena.base = base;
+    arena.top = (uintptr_t)base;
+    pthread_mutex_init(&arena.lock, NULL);
+
+    memset(io_ops, 0, sizeof(*io_ops));
+    io_ops->malloc_ops.malloc = sim_malloc;
+    io_ops->malloc_ops.calloc = sim_calloc;
+    io_ops->malloc_ops.free = sim_free;
+    io_ops->dma_manager.dma_alloc_fn = sim_dma_alloc;
+    io_ops->dma_manager.dma_free_fn = sim_dma_free;
+    io_ops->dma_manager.dma_pin_fn = sim_dma_pin;
+    io_ops->dma_manager.dma_unpin_fn = sim_dma_unpin;
+    io_ops->dma_manager.dma_cache_op_fn = sim_dma_cache_op;
+
+    memset(sync, 0, sizeof(*sync));
+    sync->mutex_new = sim_mutex_new;
+    sync->mutex_lock = sim_mutex_lock;
+    sync->mutex_unlock = sim_mutex_unlock;
+    sync->mutex_destroy = sim_mutex_destroy;
+
+    sim_ehci = m;
+    return 0;
+}
+
+int sim_plat_start_irq(usb_t *host)
+{
+    irq.host = host;
+    irq.running = 1;
+    if (pthread_create(&irq.thread, NULL, irq_thread, NULL)) {
+        irq.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void sim_plat_stop_irq(void)
+{
+    if (irq.running) {
+        irq.running = 0;
+        pthread_join(irq.thread, NULL);
+    }
+}
+
+void sim_plat_lock(void)
+{
+    pthread_mutex_lock(&driver_lock);
+}
+
+void sim_plat_unlock(void)
+{
+    pthread_mutex_unlock(&driver_lock);
+}
+
+void sim_plat_get_stats(struct sim_plat_stats *st)
+{
+    st->mallocs = counters.mallocs;
+    st->frees = counters.frees;
+    st->dma_allocs = counters.dma_allocs;
+    st->dma_frees = counters.dma_frees;
+    st->dma_bytes = counters.dma_bytes;
+    st->dma_peak = counters.dma_peak;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Host platform for the USB stack: the usb_host_init glue for the EHCI model,
+ * counting malloc and DMA allocators, pthread mutexes and an interrupt
+ * thread.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <usb/usb.h>
+#include "ehci_model.h"
+
+struct sim_plat_stats {
+    uint64_t mallocs;
+    uint64_t frees;
+    uint64_t dma_allocs;
+    uint64_t dma_frees;
+    uint64_t dma_bytes;     /* Currently allocated, rounded to size classes */
+    uint64_t dma_peak;
+};
+
+/**
+ * Fill in the I/O and mutex operations and select the controller that
+ * usb_host_init will bind to.
+ */
+int sim_plat_init(struct ehci_model *m, ps_io_ops_t *io_ops,
+                  ps_mutex_ops_t *sync);
+
+/** Deliver controller interrupts to usb_handle_irq from a thread */
+int sim_plat_start_irq(usb_t *host);
+void sim_plat_stop_irq(void);
+
+/**
+ * The driver is not reentrant. The interrupt thread holds this lock while
+ * it runs the handler, callers take it around calls into the stack.
+ */
+void sim_plat_lock(void);
+void sim_plat_unlock(void);
+
+void sim_plat_get_stats(struct sim_plat_stats *st);
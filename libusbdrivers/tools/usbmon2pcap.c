@@ -0,0 +1,198 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Convert a raw dump of a usbmon capture ring into a pcap file that
+ * Wireshark and tcpdump read as Linux usbmon traffic.
+ *
+ * Build on the development host with:
+ *     cc -I include -o usbmon2pcap tools/usbmon2pcap.c
+ * Usage:
+ *     usbmon2pcap <ring dump> <output.pcap>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <usb/usbmon_ring.h>
+
+#define PCAP_MAGIC                  0xa1b2c3d4
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+
+struct pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+};
+
+struct pcap_rec {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+/* The 64 byte header of the Linux usbmon binary interface */
+struct usbmon_packet {
+    uint64_t id;
+    uint8_t  type;
+    uint8_t  xfer_type;
+    uint8_t  epnum;
+    uint8_t  devnum;
+    uint16_t busnum;
+    char     flag_setup;
+    char     flag_data;
+    int64_t  ts_sec;
+    int32_t  ts_usec;
+    int32_t  status;
+    uint32_t length;
+    uint32_t len_cap;
+    uint8_t  setup[8];
+    int32_t  interval;
+    int32_t  start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+};
+
+static void *read_file(const char *path, size_t *size)
+{
+    FILE *f;
+    void *buf;
+    long len;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len <= 0) {
+        fprintf(stderr, "%s: empty file\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    buf = malloc(len);
+    if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "%s: read error\n", path);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    *size = len;
+    return buf;
+}
+
+static void write_record(FILE *out, const struct usbmon_record *rec)
+{
+    struct usbmon_packet pkt;
+    struct pcap_rec hdr;
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.id = rec->id;
+    pkt.type = rec->event;
+    pkt.xfer_type = rec->xfer_type;
+    pkt.epnum = rec->epnum;
+    pkt.devnum = rec->devnum;
+    pkt.busnum = rec->busnum;
+    pkt.flag_setup = rec->flag_setup;
+    pkt.flag_data = rec->flag_data;
+    pkt.ts_sec = rec->ts_ns / 1000000000ULL;
+    pkt.ts_usec = (rec->ts_ns / 1000) % 1000000;
+    pkt.status = rec->status;
+    pkt.length = rec->length;
+    pkt.len_cap = rec->len_cap;
+    memcpy(pkt.setup, rec->setup, sizeof(pkt.setup));
+
+    hdr.ts_sec = pkt.ts_sec;
+    hdr.ts_usec = pkt.ts_usec;
+    hdr.incl_len = sizeof(pkt) + rec->len_cap;
+    hdr.orig_len = sizeof(pkt) + (rec->flag_data == 0 ? rec->length : 0);
+    if (hdr.orig_len < hdr.incl_len) {
+        hdr.orig_len = hdr.incl_len;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(&pkt, sizeof(pkt), 1, out);
+    fwrite(rec->data, 1, rec->len_cap, out);
+}
+
+int main(int argc, char **argv)
+{
+    const struct usbmon_ring *ring;
+    struct pcap_hdr hdr;
+    size_t size;
+    uint32_t first, i;
+    int skipped = 0;
+    int cnt = 0;
+    FILE *out;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <ring dump> <output.pcap>\n", argv[0]);
+        return 1;
+    }
+
+    ring = read_file(argv[1], &size);
+    if (!ring) {
+        return 1;
+    }
+    if (size < sizeof(*ring) || ring->magic != USBMON_MAGIC) {
+        fprintf(stderr, "%s: not a usbmon ring\n", argv[1]);
+        return 1;
+    }
+    if (ring->version != USBMON_VERSION ||
+        ring->record_size != sizeof(struct usbmon_record)) {
+        fprintf(stderr, "%s: unsupported ring version %u\n", argv[1],
+                ring->version);
+        return 1;
+    }
+    if (ring->nrecords == 0 || (ring->nrecords & (ring->nrecords - 1)) ||
+        size < sizeof(*ring) + ring->nrecords * sizeof(struct usbmon_record)) {
+        fprintf(stderr, "%s: truncated ring\n", argv[1]);
+        return 1;
+    }
+
+    out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.snaplen = sizeof(struct usbmon_packet) + USBMON_DATA_LEN;
+    hdr.network = LINKTYPE_USB_LINUX_MMAPPED;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* Oldest surviving record first */
+    first = ring->head > ring->nrecords ? ring->head - ring->nrecords : 0;
+    for (i = first; i != ring->head; i++) {
+        const struct usbmon_record *rec;
+        rec = &ring->rec[i & (ring->nrecords - 1)];
+        /* Torn or overwritten while the dump was taken */
+        if (rec->seq != i + 1) {
+            skipped++;
+            continue;
+        }
+        write_record(out, rec);
+        cnt++;
+    }
+
+    fclose(out);
+    fprintf(stderr, "%d records written, %d skipped\n", cnt, skipped);
+    return 0;
+}